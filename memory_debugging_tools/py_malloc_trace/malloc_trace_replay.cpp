@@ -0,0 +1,1193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <malloc.h>
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "trace_codec.h"
+#include "pool_allocator.h"
+
+// Replays a py_malloc_trace log against an allocator backend.
+//
+// The alloc/free/realloc sequence of each original thread is executed by its own replay thread.
+// Pointers in the trace are mapped to slot ids at load time. A free of a block allocated by another
+// thread waits until the allocating thread has filled the slot, so the cross-thread ordering of the
+// original run is preserved without a global lock.
+
+//-----
+
+enum ReplayOperation
+{
+    ReplayOperation_Alloc = 1,
+    ReplayOperation_Free = 2,
+    ReplayOperation_Realloc = 3,
+};
+
+struct ReplayOp
+{
+    uint8_t op;
+    size_t slot;        // slot to fill (alloc, realloc) or to release (free)
+    size_t old_slot;    // realloc only
+    size_t size;
+};
+
+static const size_t NO_SLOT = SIZE_MAX;
+
+struct Slot
+{
+    std::atomic<void*> p;
+    size_t size;
+};
+
+// Placeholder of allocations which failed during the replay, so waiting threads don't block forever
+static char failed_alloc;
+
+// Growable array in anonymous mmap memory. Replay data is kept out of the allocator under test,
+// so it doesn't affect the fragmentation and arena statistics of the backend.
+template< typename T >
+struct MmapArray
+{
+    MmapArray()
+        :
+        data(NULL),
+        size(0),
+        capacity(0)
+    {
+    }
+
+    void push_back( const T & value )
+    {
+        append() = value;
+    }
+
+    // Returns new zero filled element
+    T & append()
+    {
+        if( size==capacity )
+        {
+            reserve( capacity ? capacity * 2 : 4096 );
+        }
+        return data[size++];
+    }
+
+    void reserve( size_t new_capacity )
+    {
+        void * p;
+        if( data )
+        {
+            p = mremap( data, capacity * sizeof(T), new_capacity * sizeof(T), MREMAP_MAYMOVE );
+        }
+        else
+        {
+            p = mmap( NULL, new_capacity * sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        }
+
+        if( p==MAP_FAILED )
+        {
+            fprintf( stderr, "Failed to allocate replay data (%zd bytes)\n", new_capacity * sizeof(T) );
+            exit(1);
+        }
+
+        data = (T*)p;
+        capacity = new_capacity;
+    }
+
+    T & operator[]( size_t i ) { return data[i]; }
+    const T & operator[]( size_t i ) const { return data[i]; }
+
+    T * data;
+    size_t size;
+    size_t capacity;
+};
+
+// Event decoded from a trace file
+struct TraceEvent
+{
+    int op;
+    pid_t tid;
+    uint64_t p;
+    size_t size;
+    uint64_t return_addr;
+};
+
+//-----
+
+struct Options
+{
+    Options()
+        :
+        backend("glibc"),
+        arena_max(0),
+        trim_threshold(0),
+        mmap_threshold(0),
+        pool_size(4ULL << 30),
+        touch(true),
+        single_thread(false),
+        sample_interval_us(5000)
+    {
+    }
+
+    const char * backend;
+    size_t arena_max;
+    size_t trim_threshold;
+    size_t mmap_threshold;
+    size_t pool_size;
+    bool touch;
+    bool single_thread;
+    size_t sample_interval_us;
+    std::vector<const char*> filenames;
+};
+
+// Allocator under test
+struct AllocatorBackend
+{
+    const char * name;
+    const char * description;
+    bool (*init)( const Options & options );
+    void * (*allocate)( size_t size );
+    void (*release)( void * p );
+    void * (*reallocate)( void * p, size_t size );
+    void (*print_stats)();
+};
+
+// Per replay thread state
+struct ReplayThread
+{
+    ReplayThread()
+        :
+        tid(0),
+        num_cross_thread_frees(0),
+        num_waits(0),
+        num_failed(0)
+    {
+        live_bytes.store( 0, std::memory_order_relaxed );
+    }
+
+    pid_t tid;
+    MmapArray<ReplayOp> ops;
+
+    // Updated by the owner thread only, read by the sampler thread
+    alignas(64) std::atomic<int64_t> live_bytes;
+    size_t num_cross_thread_frees;
+    size_t num_waits;
+    size_t num_failed;
+};
+
+struct Globals
+{
+    Globals()
+        :
+        backend(NULL),
+        num_alloc(0),
+        num_free(0),
+        num_realloc(0),
+        num_unmatched_free(0),
+        num_events(0),
+        filtered(false),
+        peak_live_bytes(0),
+        replay_done(false),
+        peak_rss(0),
+        peak_sampled_live_bytes(0),
+        rss_at_peak_live(0)
+    {
+        start_flag.store( 0, std::memory_order_relaxed );
+        num_ready.store( 0, std::memory_order_relaxed );
+    }
+
+    Options options;
+    const AllocatorBackend * backend;
+    PoolAllocator pool;
+
+    MmapArray<Slot> slots;
+    std::vector<ReplayThread*> threads;
+
+    // Load statistics
+    size_t num_alloc;
+    size_t num_free;
+    size_t num_realloc;
+    size_t num_unmatched_free; // freed blocks allocated before the trace started
+    size_t num_events;
+    bool filtered;
+    size_t peak_live_bytes; // of the original run
+
+    // Replay synchronization
+    std::atomic<int> start_flag;
+    std::atomic<size_t> num_ready;
+    std::atomic<bool> replay_done;
+
+    // Sampler results
+    size_t peak_rss;
+    size_t peak_sampled_live_bytes;
+    size_t rss_at_peak_live;
+};
+
+static Globals g;
+
+//-----
+
+static inline uint64_t get_timestamp()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Parse size argument. Accepts K/M/G suffixes.
+static size_t parse_size( const char * s )
+{
+    char * end;
+    size_t value = strtoull( s, &end, 10 );
+    switch(*end)
+    {
+    case 'k': case 'K': value <<= 10; break;
+    case 'm': case 'M': value <<= 20; break;
+    case 'g': case 'G': value <<= 30; break;
+    }
+
+    return value;
+}
+
+static size_t get_rss()
+{
+    int fd = open( "/proc/self/statm", O_RDONLY | O_CLOEXEC );
+    if( fd<0 )
+    {
+        return 0;
+    }
+
+    char buf[256];
+    ssize_t len = read( fd, buf, sizeof(buf)-1 );
+    close(fd);
+    if( len<=0 )
+    {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    unsigned long long size, resident;
+    if( sscanf( buf, "%llu %llu", &size, &resident )!=2 )
+    {
+        return 0;
+    }
+
+    return (size_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+static size_t get_live_bytes()
+{
+    int64_t total = 0;
+    for( ReplayThread * thread : g.threads )
+    {
+        total += thread->live_bytes.load(std::memory_order_relaxed);
+    }
+    return total > 0 ? (size_t)total : 0;
+}
+
+// ---
+
+// glibc backend. mallopt() options are applied before the replay starts.
+
+static bool glibc_init( const Options & options )
+{
+    if( options.arena_max>0 && mallopt( M_ARENA_MAX, (int)options.arena_max )!=1 )
+    {
+        fprintf( stderr, "mallopt(M_ARENA_MAX) failed\n" );
+        return false;
+    }
+
+    if( options.trim_threshold>0 && mallopt( M_TRIM_THRESHOLD, (int)options.trim_threshold )!=1 )
+    {
+        fprintf( stderr, "mallopt(M_TRIM_THRESHOLD) failed\n" );
+        return false;
+    }
+
+    if( options.mmap_threshold>0 && mallopt( M_MMAP_THRESHOLD, (int)options.mmap_threshold )!=1 )
+    {
+        fprintf( stderr, "mallopt(M_MMAP_THRESHOLD) failed\n" );
+        return false;
+    }
+
+    return true;
+}
+
+static void * glibc_allocate( size_t size )
+{
+    return malloc(size);
+}
+
+static void glibc_release( void * p )
+{
+    free(p);
+}
+
+static void * glibc_reallocate( void * p, size_t size )
+{
+    return realloc( p, size );
+}
+
+// glibc 2.33 deprecated mallinfo(), which overflows at 4GB
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2,33)
+typedef struct mallinfo2 MallocInfo;
+#define get_malloc_info mallinfo2
+#else
+typedef struct mallinfo MallocInfo;
+#define get_malloc_info mallinfo
+#endif
+
+static void glibc_print_stats()
+{
+    MallocInfo info = get_malloc_info();
+
+    size_t num_arenas = 0;
+    char * xml = NULL;
+    size_t xml_size = 0;
+    FILE * fp = open_memstream( &xml, &xml_size );
+    if( fp )
+    {
+        malloc_info( 0, fp );
+        fclose(fp);
+
+        for( const char * p = xml ; ( p = strstr( p, "<heap nr=" ) ) ; ++p )
+        {
+            num_arenas ++;
+        }
+        free(xml);
+    }
+
+    printf( "  Arenas              : %zd\n", num_arenas );
+    printf( "  Arena (sbrk) bytes  : %zd\n", (size_t)info.arena );
+    printf( "  mmap chunks         : %zd (%zd bytes)\n", (size_t)info.hblks, (size_t)info.hblkhd );
+    printf( "  In use bytes        : %zd\n", (size_t)info.uordblks );
+    printf( "  Free bytes          : %zd (%zd free chunks)\n", (size_t)info.fordblks, (size_t)info.ordblks );
+    printf( "  Releasable top      : %zd\n", (size_t)info.keepcost );
+}
+
+// ---
+
+// Pool allocator backend, same as PY_MALLOC_TRACE_ALLOCATOR=pool. Large allocations fall back to glibc.
+
+static bool pool_init( const Options & options )
+{
+    if( !glibc_init(options) )
+    {
+        return false;
+    }
+
+    if( !g.pool.init( options.pool_size ) )
+    {
+        fprintf( stderr, "Failed to reserve %zd bytes for pool allocator\n", options.pool_size );
+        return false;
+    }
+
+    return true;
+}
+
+static void * pool_allocate( size_t size )
+{
+    void * p = g.pool.allocate(size);
+    return p ? p : malloc(size);
+}
+
+static void pool_release( void * p )
+{
+    if( g.pool.owns(p) )
+    {
+        g.pool.release(p);
+    }
+    else
+    {
+        free(p);
+    }
+}
+
+static void * pool_reallocate( void * old_p, size_t size )
+{
+    if( !g.pool.owns(old_p) )
+    {
+        return old_p ? realloc( old_p, size ) : pool_allocate(size);
+    }
+
+    // Keep the block when the new size still fits in its size class reasonably
+    size_t old_size = g.pool.usable_size(old_p);
+    if( size<=old_size && size>old_size/2 )
+    {
+        return old_p;
+    }
+
+    void * new_p = pool_allocate(size);
+    if( new_p )
+    {
+        memcpy( new_p, old_p, size<old_size ? size : old_size );
+        g.pool.release(old_p);
+    }
+    return new_p;
+}
+
+static void pool_print_stats()
+{
+    printf( "  Pool committed      : %zd\n", g.pool.committed_bytes() );
+    printf( "  Pool free (shared)  : %zd\n", g.pool.transfer_free_bytes() );
+    printf( "  Pool slabs by class :" );
+    for( size_t i=0 ; i<POOL_NUM_CLASSES ; ++i )
+    {
+        size_t num_slabs = g.pool.transfer_caches[i].num_slabs.load(std::memory_order_relaxed);
+        if( num_slabs>0 )
+        {
+            printf( " %d:%zd", pool_class_sizes[i], num_slabs );
+        }
+    }
+    printf( "\n" );
+
+    printf( "  glibc (allocations over %zd bytes):\n", POOL_MAX_SIZE );
+    glibc_print_stats();
+}
+
+static const AllocatorBackend backends[] = {
+    { "glibc", "glibc malloc, tunable with --arena-max, --trim-threshold, --mmap-threshold",
+        glibc_init, glibc_allocate, glibc_release, glibc_reallocate, glibc_print_stats },
+    { "pool", "size-class pool allocator with thread caches (PY_MALLOC_TRACE_ALLOCATOR=pool), glibc for larger blocks",
+        pool_init, pool_allocate, pool_release, pool_reallocate, pool_print_stats },
+};
+
+static const AllocatorBackend * find_backend( const char * name )
+{
+    for( const AllocatorBackend & backend : backends )
+    {
+        if( strcmp( backend.name, name )==0 )
+        {
+            return &backend;
+        }
+    }
+    return NULL;
+}
+
+//-----
+
+// Converts trace events into per-thread replay operations
+
+struct ReplayBuilder
+{
+    struct ThreadContext
+    {
+        ThreadContext()
+            :
+            thread(NULL),
+            last_free_index(NO_SLOT),
+            last_free_return_addr(0)
+        {
+        }
+
+        ReplayThread * thread;
+
+        // realloc() is recorded as a free followed by an alloc with the same return address.
+        // Remember the last free to merge them back.
+        size_t last_free_index;
+        uint64_t last_free_return_addr;
+    };
+
+    ReplayBuilder()
+        :
+        live_bytes(0)
+    {
+    }
+
+    ThreadContext & get_context( pid_t tid )
+    {
+        if( g.options.single_thread )
+        {
+            tid = 0;
+        }
+
+        auto it = contexts.find(tid);
+        if( it!=contexts.end() )
+        {
+            return it->second;
+        }
+
+        ThreadContext & context = contexts[tid];
+        context.thread = new ReplayThread();
+        context.thread->tid = tid;
+        g.threads.push_back(context.thread);
+        return context;
+    }
+
+    size_t new_slot( uint64_t p, size_t size, ReplayThread * thread )
+    {
+        auto it = live.find(p);
+        if( it!=live.end() )
+        {
+            // Free of the previous block was not recorded (e.g. filtered). Leave it allocated.
+            live_bytes -= g.slots[it->second.slot].size;
+        }
+
+        Slot & slot = g.slots.append();
+        slot.size = size;
+
+        size_t slot_index = g.slots.size - 1;
+        live[p] = LiveBlock{ slot_index, thread };
+
+        live_bytes += size;
+        g.peak_live_bytes = std::max( g.peak_live_bytes, live_bytes );
+
+        return slot_index;
+    }
+
+    void add_event( const TraceEvent & event )
+    {
+        g.num_events ++;
+
+        ThreadContext & context = get_context(event.tid);
+        ReplayThread * thread = context.thread;
+
+        if( event.op==1 )
+        {
+            if( event.p==0 )
+            {
+                context.last_free_index = NO_SLOT;
+                return;
+            }
+
+            size_t slot = new_slot( event.p, event.size, thread );
+
+            if( context.last_free_index!=NO_SLOT && context.last_free_return_addr==event.return_addr )
+            {
+                ReplayOp & op = thread->ops[context.last_free_index];
+                op.op = ReplayOperation_Realloc;
+                op.old_slot = op.slot;
+                op.slot = slot;
+                op.size = event.size;
+
+                g.num_free --;
+                g.num_realloc ++;
+            }
+            else
+            {
+                ReplayOp op;
+                op.op = ReplayOperation_Alloc;
+                op.slot = slot;
+                op.old_slot = NO_SLOT;
+                op.size = event.size;
+                thread->ops.push_back(op);
+
+                g.num_alloc ++;
+            }
+
+            context.last_free_index = NO_SLOT;
+        }
+        else if( event.op==2 )
+        {
+            context.last_free_index = NO_SLOT;
+
+            if( event.p==0 )
+            {
+                return;
+            }
+
+            auto it = live.find(event.p);
+            if( it==live.end() )
+            {
+                g.num_unmatched_free ++;
+                return;
+            }
+
+            size_t slot = it->second.slot;
+            if( it->second.thread!=thread )
+            {
+                thread->num_cross_thread_frees ++;
+            }
+            live_bytes -= g.slots[slot].size;
+            live.erase(it);
+
+            ReplayOp op;
+            op.op = ReplayOperation_Free;
+            op.slot = slot;
+            op.old_slot = NO_SLOT;
+            op.size = 0;
+            thread->ops.push_back(op);
+
+            context.last_free_index = thread->ops.size - 1;
+            context.last_free_return_addr = event.return_addr;
+
+            g.num_free ++;
+        }
+    }
+
+    struct LiveBlock
+    {
+        size_t slot;
+        ReplayThread * thread;
+    };
+
+    std::unordered_map< pid_t, ThreadContext > contexts;
+    std::unordered_map< uint64_t, LiveBlock > live;
+    size_t live_bytes;
+};
+
+// ---
+
+// Returns pointer to the value of "key":, or NULL
+static const char * find_json_value( const char * line, const char * key )
+{
+    char pattern[64];
+    snprintf( pattern, sizeof(pattern), "\"%s\":", key );
+
+    const char * p = strstr( line, pattern );
+    return p ? p + strlen(pattern) : NULL;
+}
+
+// Header record tells the event encoding, and whether the trace is complete
+static void handle_meta_line( const char * line, size_t & num_return_addr_levels, int & version )
+{
+    if( strncmp( line, "{\"type\":\"header\"", 16 )!=0 )
+    {
+        return;
+    }
+
+    const char * value;
+    if( ( value = find_json_value( line, "num_return_addr_levels" ) ) )
+    {
+        num_return_addr_levels = strtoul( value, NULL, 10 );
+    }
+    if( ( value = find_json_value( line, "version" ) ) )
+    {
+        version = (int)strtol( value, NULL, 10 );
+    }
+    if( ( value = find_json_value( line, "filtered" ) ) && strncmp( value, "true", 4 )==0 )
+    {
+        g.filtered = true;
+    }
+    if( ( value = find_json_value( line, "mode" ) ) && strncmp( value, "\"flight\"", 8 )==0 )
+    {
+        g.filtered = true;
+    }
+}
+
+static bool load_json_trace( FILE * fp, const char * filename, ReplayBuilder & builder )
+{
+    char * line = NULL;
+    size_t line_capacity = 0;
+    size_t num_return_addr_levels = 1;
+    int version = 1;
+
+    while( getline( &line, &line_capacity, fp ) > 0 )
+    {
+        if( strncmp( line, "{\"type\"", 7 )==0 )
+        {
+            handle_meta_line( line, num_return_addr_levels, version );
+            continue;
+        }
+
+        const char * op = find_json_value( line, "op" );
+        const char * p = find_json_value( line, "p" );
+        const char * size = find_json_value( line, "size" );
+        const char * tid = find_json_value( line, "tid" );
+        const char * return_addr = find_json_value( line, "return_addr" );
+        if( !op || !p || !size )
+        {
+            fprintf( stderr, "%s: malformed line skipped\n", filename );
+            continue;
+        }
+
+        TraceEvent event;
+        event.op = atoi(op);
+        event.p = ( p[0]=='"' && p[1]!='(' ) ? strtoull( p+1, NULL, 16 ) : 0;
+        event.size = strtoull( size, NULL, 10 );
+        event.tid = tid ? atoi(tid) : 0;
+        event.return_addr = ( return_addr && return_addr[1]=='"' ) ? strtoull( return_addr+2, NULL, 16 ) : 0;
+
+        builder.add_event(event);
+    }
+
+    free(line);
+    return true;
+}
+
+static bool load_binary_trace( FILE * fp, const char * filename, ReplayBuilder & builder )
+{
+    size_t num_return_addr_levels = 1;
+    int version = 1;
+
+    std::vector<uint8_t> payload;
+    std::vector<uint8_t> raw;
+
+    while( true )
+    {
+        TraceBlockHeader header;
+        if( fread( &header, sizeof(header), 1, fp )!=1 )
+        {
+            break;
+        }
+
+        if( memcmp( header.magic, TRACE_BLOCK_MAGIC, sizeof(header.magic) )!=0 )
+        {
+            fprintf( stderr, "%s: malformed block\n", filename );
+            return false;
+        }
+
+        payload.resize( header.compressed_size );
+        if( header.compressed_size>0 && fread( payload.data(), header.compressed_size, 1, fp )!=1 )
+        {
+            fprintf( stderr, "%s: truncated block\n", filename );
+            break;
+        }
+
+        const uint8_t * data = payload.data();
+        size_t data_size = payload.size();
+        if( header.codec==TraceBlockCodec_LZ )
+        {
+            raw.resize( header.raw_size );
+            long len = lz_decompress( payload.data(), payload.size(), raw.data(), raw.size() );
+            if( len!=(long)header.raw_size )
+            {
+                fprintf( stderr, "%s: failed to decompress block\n", filename );
+                return false;
+            }
+            data = raw.data();
+            data_size = raw.size();
+        }
+
+        if( header.type==TraceBlockType_Meta )
+        {
+            std::string text( (const char*)data, data_size );
+            size_t pos = 0;
+            while( pos < text.size() )
+            {
+                size_t end = text.find( '\n', pos );
+                if( end==std::string::npos )
+                {
+                    end = text.size();
+                }
+                handle_meta_line( text.substr( pos, end-pos ).c_str(), num_return_addr_levels, version );
+                pos = end + 1;
+            }
+            continue;
+        }
+
+        // Decode delta encoded events. See append_event() in py_malloc_trace.cpp
+        const uint8_t * p = data;
+        const uint8_t * end = data + data_size;
+        int64_t tid = 0;
+        uint64_t prev_p = 0;
+        uint64_t prev_t = 0;
+        std::vector<uint64_t> prev_return_addr( num_return_addr_levels, 0 );
+
+        for( uint32_t i=0 ; i<header.num_events ; ++i )
+        {
+            uint64_t value;
+            TraceEvent event;
+
+            if( p>=end )
+            {
+                fprintf( stderr, "%s: truncated event block\n", filename );
+                return false;
+            }
+            event.op = *p++;
+
+            if( version>=2 )
+            {
+                if( !get_varint( p, end, value ) ) return false;
+                tid += zigzag_decode(value);
+            }
+            event.tid = (pid_t)tid;
+
+            if( !get_varint( p, end, value ) ) return false;
+            prev_p += zigzag_decode(value);
+            event.p = prev_p;
+
+            if( !get_varint( p, end, value ) ) return false;
+            event.size = value;
+
+            if( !get_varint( p, end, value ) ) return false;
+            prev_t += zigzag_decode(value);
+
+            for( size_t level=0 ; level<num_return_addr_levels ; ++level )
+            {
+                if( !get_varint( p, end, value ) ) return false;
+                prev_return_addr[level] += zigzag_decode(value);
+            }
+            event.return_addr = num_return_addr_levels>0 ? prev_return_addr[0] : 0;
+
+            builder.add_event(event);
+        }
+    }
+
+    return true;
+}
+
+static bool load_trace( const char * filename, ReplayBuilder & builder )
+{
+    FILE * fp = fopen( filename, "rb" );
+    if( !fp )
+    {
+        fprintf( stderr, "Failed to open %s : %s\n", filename, strerror(errno) );
+        return false;
+    }
+
+    char magic[4] = {0};
+    size_t len = fread( magic, 1, sizeof(magic), fp );
+    fseek( fp, 0, SEEK_SET );
+
+    bool result;
+    if( len==sizeof(magic) && memcmp( magic, TRACE_BLOCK_MAGIC, sizeof(magic) )==0 )
+    {
+        result = load_binary_trace( fp, filename, builder );
+    }
+    else
+    {
+        result = load_json_trace( fp, filename, builder );
+    }
+
+    fclose(fp);
+    return result;
+}
+
+//-----
+
+static inline void touch_memory( void * p, size_t size )
+{
+    // Write a byte per page, as the original program would have used the memory
+    volatile char * c = (volatile char*)p;
+    for( size_t offset=0 ; offset<size ; offset+=4096 )
+    {
+        c[offset] = 0;
+    }
+}
+
+// Wait until the allocating thread fills the slot
+static inline void * wait_slot( ReplayThread * thread, Slot & slot )
+{
+    void * p = slot.p.load(std::memory_order_acquire);
+    if( p )
+    {
+        return p;
+    }
+
+    thread->num_waits ++;
+    while( ( p = slot.p.load(std::memory_order_acquire) )==NULL )
+    {
+        sched_yield();
+    }
+    return p;
+}
+
+static void replay_thread_main( ReplayThread * thread )
+{
+    const AllocatorBackend * backend = g.backend;
+    const bool touch = g.options.touch;
+    int64_t live_bytes = 0;
+
+    g.num_ready.fetch_add( 1, std::memory_order_release );
+    while( g.start_flag.load(std::memory_order_acquire)==0 )
+    {
+        sched_yield();
+    }
+
+    for( size_t i=0 ; i<thread->ops.size ; ++i )
+    {
+        const ReplayOp & op = thread->ops[i];
+
+        switch( op.op )
+        {
+        case ReplayOperation_Alloc:
+            {
+                void * p = backend->allocate( op.size );
+                if( p==NULL )
+                {
+                    thread->num_failed ++;
+                    p = &failed_alloc;
+                }
+                else if( touch )
+                {
+                    touch_memory( p, op.size );
+                }
+                g.slots[op.slot].p.store( p, std::memory_order_release );
+                live_bytes += op.size;
+            }
+            break;
+
+        case ReplayOperation_Free:
+            {
+                Slot & slot = g.slots[op.slot];
+                void * p = wait_slot( thread, slot );
+                if( p!=&failed_alloc )
+                {
+                    backend->release(p);
+                }
+                live_bytes -= slot.size;
+            }
+            break;
+
+        case ReplayOperation_Realloc:
+            {
+                Slot & old_slot = g.slots[op.old_slot];
+                void * old_p = wait_slot( thread, old_slot );
+                void * p = backend->reallocate( old_p!=&failed_alloc ? old_p : NULL, op.size );
+                if( p==NULL )
+                {
+                    thread->num_failed ++;
+                    p = &failed_alloc;
+                }
+                else if( touch )
+                {
+                    touch_memory( p, op.size );
+                }
+                g.slots[op.slot].p.store( p, std::memory_order_release );
+                live_bytes += (int64_t)op.size - (int64_t)old_slot.size;
+            }
+            break;
+        }
+
+        // Publish for the sampler thread occasionally
+        if( (i & 255)==0 )
+        {
+            thread->live_bytes.store( live_bytes, std::memory_order_relaxed );
+        }
+    }
+
+    thread->live_bytes.store( live_bytes, std::memory_order_relaxed );
+}
+
+// Track peak RSS during the replay
+static void sampler_thread_main()
+{
+    while( !g.replay_done.load(std::memory_order_acquire) )
+    {
+        size_t rss = get_rss();
+        size_t live_bytes = get_live_bytes();
+
+        g.peak_rss = std::max( g.peak_rss, rss );
+        if( live_bytes > g.peak_sampled_live_bytes )
+        {
+            g.peak_sampled_live_bytes = live_bytes;
+            g.rss_at_peak_live = rss;
+        }
+
+        usleep( g.options.sample_interval_us );
+    }
+}
+
+//-----
+
+static void print_usage( const char * argv0 )
+{
+    fprintf( stderr, "Usage: %s [options] trace_file [trace_file ...]\n", argv0 );
+    fprintf( stderr, "\n" );
+    fprintf( stderr, "Options:\n" );
+    fprintf( stderr, "  --backend NAME          Allocator backend (default: glibc)\n" );
+    fprintf( stderr, "  --arena-max N           mallopt(M_ARENA_MAX)\n" );
+    fprintf( stderr, "  --trim-threshold SIZE   mallopt(M_TRIM_THRESHOLD)\n" );
+    fprintf( stderr, "  --mmap-threshold SIZE   mallopt(M_MMAP_THRESHOLD)\n" );
+    fprintf( stderr, "  --pool-size SIZE        Address range reserved for pool backend (default: 4G)\n" );
+    fprintf( stderr, "  --no-touch              Don't write to allocated memory\n" );
+    fprintf( stderr, "  --single-thread         Replay all threads on one thread\n" );
+    fprintf( stderr, "  --sample-interval US    RSS sampling interval in microseconds (default: 5000)\n" );
+    fprintf( stderr, "\n" );
+    fprintf( stderr, "Backends:\n" );
+    for( const AllocatorBackend & backend : backends )
+    {
+        fprintf( stderr, "  %-8s %s\n", backend.name, backend.description );
+    }
+}
+
+static bool parse_args( int argc, const char * argv[], Options & options )
+{
+    for( int i=1 ; i<argc ; ++i )
+    {
+        const char * arg = argv[i];
+        bool has_value = i+1 < argc;
+
+        if( strcmp( arg, "--backend" )==0 && has_value )
+        {
+            options.backend = argv[++i];
+        }
+        else if( strcmp( arg, "--arena-max" )==0 && has_value )
+        {
+            options.arena_max = parse_size( argv[++i] );
+        }
+        else if( strcmp( arg, "--trim-threshold" )==0 && has_value )
+        {
+            options.trim_threshold = parse_size( argv[++i] );
+        }
+        else if( strcmp( arg, "--mmap-threshold" )==0 && has_value )
+        {
+            options.mmap_threshold = parse_size( argv[++i] );
+        }
+        else if( strcmp( arg, "--pool-size" )==0 && has_value )
+        {
+            options.pool_size = parse_size( argv[++i] );
+        }
+        else if( strcmp( arg, "--no-touch" )==0 )
+        {
+            options.touch = false;
+        }
+        else if( strcmp( arg, "--single-thread" )==0 )
+        {
+            options.single_thread = true;
+        }
+        else if( strcmp( arg, "--sample-interval" )==0 && has_value )
+        {
+            options.sample_interval_us = parse_size( argv[++i] );
+        }
+        else if( arg[0]=='-' )
+        {
+            return false;
+        }
+        else
+        {
+            options.filenames.push_back(arg);
+        }
+    }
+
+    return !options.filenames.empty();
+}
+
+static void print_bytes( const char * label, size_t bytes )
+{
+    printf( "  %-20s: %zd (%.1f MB)\n", label, bytes, bytes / (1024.0 * 1024.0) );
+}
+
+int main( int argc, const char * argv[] )
+{
+    if( !parse_args( argc, argv, g.options ) )
+    {
+        print_usage( argv[0] );
+        return 1;
+    }
+
+    g.backend = find_backend( g.options.backend );
+    if( !g.backend )
+    {
+        fprintf( stderr, "Unknown backend: %s\n", g.options.backend );
+        print_usage( argv[0] );
+        return 1;
+    }
+
+    // Load trace files
+    {
+        uint64_t t0 = get_timestamp();
+
+        ReplayBuilder builder;
+        for( const char * filename : g.options.filenames )
+        {
+            if( !load_trace( filename, builder ) )
+            {
+                return 1;
+            }
+        }
+
+        printf( "Loaded %zd events in %.2f sec\n", g.num_events, ( get_timestamp() - t0 ) / 1e9 );
+
+        if( g.filtered )
+        {
+            printf( "Warning: the trace is filtered or in flight recorder mode. Replay won't be representative.\n" );
+        }
+    }
+
+    // Return memory used while loading, and take the baseline
+    malloc_trim(0);
+
+    if( !g.backend->init( g.options ) )
+    {
+        return 1;
+    }
+
+    std::vector<std::thread> threads;
+    for( ReplayThread * thread : g.threads )
+    {
+        threads.emplace_back( replay_thread_main, thread );
+    }
+
+    while( g.num_ready.load(std::memory_order_acquire) < g.threads.size() )
+    {
+        sched_yield();
+    }
+
+    size_t baseline_rss = get_rss();
+    g.peak_rss = baseline_rss;
+
+    std::thread sampler( sampler_thread_main );
+
+    uint64_t start_time = get_timestamp();
+    g.start_flag.store( 1, std::memory_order_release );
+
+    for( std::thread & thread : threads )
+    {
+        thread.join();
+    }
+
+    uint64_t elapsed = get_timestamp() - start_time;
+
+    g.replay_done.store( true, std::memory_order_release );
+    sampler.join();
+
+    size_t final_rss = get_rss();
+    size_t final_live_bytes = get_live_bytes();
+    g.peak_rss = std::max( g.peak_rss, final_rss );
+
+    // Report
+    size_t num_ops = g.num_alloc + g.num_free + g.num_realloc;
+    size_t num_cross_thread_frees = 0;
+    size_t num_waits = 0;
+    size_t num_failed = 0;
+    for( ReplayThread * thread : g.threads )
+    {
+        num_cross_thread_frees += thread->num_cross_thread_frees;
+        num_waits += thread->num_waits;
+        num_failed += thread->num_failed;
+    }
+
+    auto overhead = []( size_t rss, size_t live_bytes ) -> double
+    {
+        return live_bytes>0 ? (double)rss / live_bytes : 0.0;
+    };
+
+    size_t peak_rss_growth = g.peak_rss - baseline_rss;
+    size_t final_rss_growth = final_rss > baseline_rss ? final_rss - baseline_rss : 0;
+    size_t rss_growth_at_peak_live = g.rss_at_peak_live > baseline_rss ? g.rss_at_peak_live - baseline_rss : 0;
+
+    printf( "\n" );
+    printf( "Replay summary:\n" );
+    printf( "  Backend             : %s\n", g.backend->name );
+    printf( "  Threads             : %zd\n", g.threads.size() );
+    printf( "  Operations          : %zd (alloc %zd, free %zd, realloc %zd)\n", num_ops, g.num_alloc, g.num_free, g.num_realloc );
+    printf( "  Unmatched frees     : %zd (skipped)\n", g.num_unmatched_free );
+    printf( "  Cross-thread frees  : %zd (waited %zd)\n", num_cross_thread_frees, num_waits );
+    if( num_failed>0 )
+    {
+        printf( "  Failed allocations  : %zd\n", num_failed );
+    }
+    printf( "  Elapsed             : %.3f sec\n", elapsed / 1e9 );
+    printf( "  Throughput          : %.0f ops/sec (%.1f ns/op)\n",
+        elapsed>0 ? num_ops * 1e9 / elapsed : 0.0, num_ops>0 ? (double)elapsed / num_ops : 0.0 );
+
+    printf( "\n" );
+    printf( "Memory (RSS growth is relative to the baseline after loading the trace):\n" );
+    print_bytes( "Baseline RSS", baseline_rss );
+    print_bytes( "Peak live (trace)", g.peak_live_bytes );
+    print_bytes( "Peak live (sampled)", g.peak_sampled_live_bytes );
+    print_bytes( "Peak RSS growth", peak_rss_growth );
+    print_bytes( "RSS growth at peak", rss_growth_at_peak_live );
+    print_bytes( "Final live", final_live_bytes );
+    print_bytes( "Final RSS growth", final_rss_growth );
+    printf( "  Overhead at peak    : %.2f x live bytes\n", overhead( rss_growth_at_peak_live, g.peak_sampled_live_bytes ) );
+    printf( "  Overhead at end     : %.2f x live bytes\n", overhead( final_rss_growth, final_live_bytes ) );
+
+    printf( "\n" );
+    printf( "Allocator (%s):\n", g.backend->name );
+    g.backend->print_stats();
+
+    return 0;
+}
@@ -5,12 +5,30 @@ import json
 import re
 import subprocess
 import pprint
+import struct
+import collections
+import csv
+
+try:
+    import lz4.block as lz4_block
+except ImportError:
+    lz4_block = None
 
 # ---
 
 argparser = argparse.ArgumentParser( description='parse malloc/free trace log and detect issues' )
-argparser.add_argument('--mapfile', action='store', required=True, help='memory map filename (/proc/{pid}/maps format)')
-argparser.add_argument('--logfile', action='store', required=True, help='trace log filename')
+argparser.add_argument('--mapfile', action='store', default=None, help='memory map filename (/proc/{pid}/maps format). If not specified, module maps recorded in the trace log are used.')
+argparser.add_argument('--logfile', action='store', required=True, nargs='+', help='trace log filename(s). Pass rotated segments in order.')
+argparser.add_argument('--build-index', dest="build_index", action='store_true', help='replay the whole trace log and write a sidecar index of periodic checkpoints')
+argparser.add_argument('--index', action='store', default=None, help='trace index filename (default: {logfile}.index)')
+argparser.add_argument('--index-interval', dest="index_interval", action='store', type=int, default=1000000, help='number of events between checkpoints')
+argparser.add_argument('--index-without-live-set', dest="index_without_live_set", action='store_true', help="don't include live memory block snapshots in checkpoints")
+argparser.add_argument('--at-event', dest="at_event", action='store', type=int, default=None, help='report memory blocks live just before this event number')
+argparser.add_argument('--at-time', dest="at_time", action='store', type=float, default=None, help='report memory blocks live at this time (seconds from the first event)')
+argparser.add_argument('--churn-report', dest="churn_report", action='store_true', help='report allocation lifetime, size, rate and cross-thread frees per callsite')
+argparser.add_argument('--churn-top', dest="churn_top", action='store', type=int, default=20, help='number of callsites in the churn report')
+argparser.add_argument('--stats-csv', dest="stats_csv", action='store', default=None, help='write heap stats records (PY_MALLOC_TRACE_HEAP_STATS) to a CSV file, to plot heap usage, RSS and fragmentation over time')
+argparser.add_argument('--process-tree', dest="process_tree", action='store_true', help='group log files by process, and replay forked child processes on top of the memory blocks inherited from the parent process')
 args = argparser.parse_args()
 
 # ---
@@ -45,9 +63,21 @@ class SymbolResolver:
 
     def __init__(self):
         self.maps = []
+        self.known_maps = set()
+        self.maps_sorted = True
         self.cache = {}
         self.unresolved = []
 
+    def add_module( self, addr_range, offset, filename ):
+
+        key = ( addr_range, offset, filename )
+        if key in self.known_maps:
+            return
+        self.known_maps.add(key)
+
+        self.maps.append( MemoryMap(addr_range, offset, filename) )
+        self.maps_sorted = False
+
     def load_mapfile( self, mapfile ):
 
         """
@@ -68,14 +98,10 @@ class SymbolResolver:
                     filename = re_result.group(5)
 
                     if 'x' in mode:
-                    
-                        if offset != 0:
-                            print(line)
-                        assert offset==0
-
-                        self.maps.append( MemoryMap(addr_range, offset, filename) )
+                        self.add_module( addr_range, offset, filename )
 
         self.maps.sort()
+        self.maps_sorted = True
 
         pprint.pprint(self.maps)
 
@@ -84,11 +110,17 @@ class SymbolResolver:
         if addr in self.cache:
             return self.cache[addr]
 
+        if not self.maps_sorted:
+            self.maps.sort()
+            self.maps_sorted = True
+
         for memory_map in self.maps:
 
             if memory_map.addr_range[0] <= addr < memory_map.addr_range[1]:
                 
-                addr_offset_in_module = addr - memory_map.addr_range[0]
+                # Code segments don't always start at the beginning of the file.
+                # Assuming virtual address and file offset are same in the ELF file.
+                addr_offset_in_module = addr - memory_map.addr_range[0] + memory_map.offset
 
                 if memory_map.symbols is None:
                     memory_map.symbols = self.load_symbol_table( memory_map.filename )
@@ -152,9 +184,12 @@ class SymbolResolver:
         return symbols
 
     def load_symbol_table_all(self):
+        symbol_tables = {}
         for memory_map in self.maps:
             if memory_map.symbols is None:
-                memory_map.symbols = self.load_symbol_table( memory_map.filename )
+                if memory_map.filename not in symbol_tables:
+                    symbol_tables[memory_map.filename] = self.load_symbol_table( memory_map.filename )
+                memory_map.symbols = symbol_tables[memory_map.filename]
     
     def print_unresolved(self):
 
@@ -165,71 +200,789 @@ class SymbolResolver:
                 print( hex(addr) )
 
 
+# tid is None for traces written before format version 2
+Event = collections.namedtuple( "Event", [ "op", "p", "size", "t", "return_addr", "tid" ], defaults=[None] )
+
+
+def lz_decompress( src, raw_size ):
+
+    """
+    Decompress LZ4 block format data written by py_malloc_trace.
+    Uses lz4 package if available, otherwise falls back to pure Python implementation.
+    """
+
+    if lz4_block:
+        return lz4_block.decompress( src, uncompressed_size=raw_size )
+
+    dst = bytearray()
+    pos = 0
+    src_size = len(src)
+
+    while pos < src_size:
+
+        token = src[pos]
+        pos += 1
+
+        literal_len = token >> 4
+        if literal_len==15:
+            while True:
+                b = src[pos]
+                pos += 1
+                literal_len += b
+                if b!=255:
+                    break
+
+        dst += src[ pos : pos + literal_len ]
+        pos += literal_len
+
+        if pos >= src_size:
+            break
+
+        offset = src[pos] | ( src[pos+1] << 8 )
+        pos += 2
+
+        match_len = token & 15
+        if match_len==15:
+            while True:
+                b = src[pos]
+                pos += 1
+                match_len += b
+                if b!=255:
+                    break
+        match_len += 4
+
+        start = len(dst) - offset
+        if offset >= match_len:
+            dst += dst[ start : start + match_len ]
+        else:
+            # overlapping match
+            for i in range(match_len):
+                dst.append( dst[start+i] )
+
+    return bytes(dst)
+
+
+class TraceLogReader:
+
+    """
+    Reads trace log in either JSON lines format or binary block format (PY_MALLOC_TRACE_FORMAT=lz).
+
+    records() yields ( offset, skip, record ) tuples. record is a dict for meta records (header, module, etc),
+    and Event for alloc/free events. Reading can be resumed from a record by passing its offset and skip.
+    """
+
+    BLOCK_HEADER = struct.Struct( "<4sBBHIIIIQ" )
+    BLOCK_MAGIC = b"PMTB"
+    BLOCK_TYPE_META = 1
+    BLOCK_TYPE_EVENTS = 2
+    BLOCK_CODEC_LZ = 1
+
+    def __init__( self, filename ):
+        self.filename = filename
+        self.num_return_addr_levels = 1
+        self.version = 1
+
+        with open( filename, "rb" ) as fd:
+            self.is_binary = ( fd.read(4) == self.BLOCK_MAGIC )
+
+    def records( self, offset=0, skip=0 ):
+        if self.is_binary:
+            yield from self._binary_records( offset, skip )
+        else:
+            yield from self._json_records( offset )
+
+    def meta_records( self ):
+
+        # Module map records are written at the beginning and the end of each segment.
+        # Read them without replaying the events, for the case replaying starts from a checkpoint.
+
+        if self.is_binary:
+            for _, header, payload in self._blocks( 0, event_blocks=False ):
+                yield from self._decode_meta_block( header, payload )
+            return
+
+        tail_size = 4 * 1024 * 1024
+
+        with open( self.filename, "rb" ) as fd:
+
+            for line in fd:
+                if not line.startswith(b'{"type"'):
+                    break
+                yield json.loads(line)
+
+            file_size = os.fstat( fd.fileno() ).st_size
+            if file_size > tail_size:
+                fd.seek( file_size - tail_size )
+                fd.readline() # skip partial line
+
+            for line in fd:
+                if line.startswith(b'{"type":"module"'):
+                    yield json.loads(line)
+
+    def _json_records( self, offset ):
+
+        with open( self.filename, "rb" ) as fd:
+
+            fd.seek(offset)
+
+            for line in fd:
+
+                line_offset = offset
+                offset += len(line)
+
+                line = line.strip()
+                try:
+                    d = json.loads(line)
+                except json.decoder.JSONDecodeError:
+                    print( "Malformed JSON :", [line] )
+                    continue
+
+                if "type" in d:
+                    yield line_offset, 0, d
+                    continue
+
+                p = int( d["p"], 16 ) if d["p"]!="(nil)" else 0
+                return_addr = tuple( int(return_addr,16) for return_addr in d["return_addr"] )
+
+                yield line_offset, 0, Event( d["op"], p, d["size"], d.get("t"), return_addr, d.get("tid") )
+
+    def _blocks( self, offset, event_blocks=True ):
+
+        with open( self.filename, "rb" ) as fd:
+
+            fd.seek(offset)
+
+            while True:
+
+                block_offset = fd.tell()
+
+                data = fd.read( self.BLOCK_HEADER.size )
+                if len(data) < self.BLOCK_HEADER.size:
+                    break
+
+                header = self.BLOCK_HEADER.unpack(data)
+                magic, block_type, codec, _, raw_size, compressed_size, num_events, _, first_event = header
+
+                if magic != self.BLOCK_MAGIC:
+                    print( f"Malformed block at offset {block_offset}" )
+                    break
+
+                if block_type==self.BLOCK_TYPE_EVENTS and not event_blocks:
+                    fd.seek( compressed_size, os.SEEK_CUR )
+                    continue
+
+                payload = fd.read(compressed_size)
+                if len(payload) < compressed_size:
+                    print( f"Truncated block at offset {block_offset}" )
+                    break
+
+                if codec==self.BLOCK_CODEC_LZ:
+                    payload = lz_decompress( payload, raw_size )
+
+                yield block_offset, header, payload
+
+    def _decode_meta_block( self, header, payload ):
+
+        for line in payload.decode("utf-8").splitlines():
+            d = json.loads(line)
+            if d["type"]=="header":
+                self.num_return_addr_levels = d.get( "num_return_addr_levels", 1 )
+                self.version = d.get( "version", 1 )
+            yield d
+
+    def _binary_records( self, offset, skip ):
+
+        def get_varint():
+            nonlocal pos
+            value = 0
+            shift = 0
+            while True:
+                b = payload[pos]
+                pos += 1
+                value |= ( b & 0x7f ) << shift
+                if b < 0x80:
+                    return value
+                shift += 7
+
+        def get_zigzag():
+            value = get_varint()
+            return ( value >> 1 ) ^ -( value & 1 )
+
+        mask = ( 1 << 64 ) - 1
+
+        for block_offset, header, payload in self._blocks(offset):
+
+            block_type = header[1]
+            num_events = header[6]
+
+            if block_type==self.BLOCK_TYPE_META:
+                for d in self._decode_meta_block( header, payload ):
+                    yield block_offset, 0, d
+                continue
+
+            num_levels = self.num_return_addr_levels
+            has_tid = self.version >= 2
+            pos = 0
+            prev_p = 0
+            prev_t = 0
+            tid = None if not has_tid else 0
+            prev_return_addr = [0] * num_levels
+
+            for i in range(num_events):
+
+                op = payload[pos]
+                pos += 1
+                if has_tid:
+                    tid += get_zigzag()
+                p = ( prev_p + get_zigzag() ) & mask
+                size = get_varint()
+                t = ( prev_t + get_zigzag() ) & mask
+                for level in range(num_levels):
+                    prev_return_addr[level] = ( prev_return_addr[level] + get_zigzag() ) & mask
+
+                prev_p = p
+                prev_t = t
+
+                if i < skip:
+                    continue
+
+                yield block_offset, i, Event( op, p, size, t, tuple(prev_return_addr), tid )
+
+            skip = 0
+
+
+class TraceIndex:
+
+    """
+    Sidecar index of periodic checkpoints in a trace log.
+
+    Each checkpoint records the byte offset of a record, its event number, its timestamp and
+    (optionally) the compacted set of memory blocks which were live just before the record.
+    Any point of the trace can be reconstructed by loading the nearest checkpoint and replaying only the tail.
+    """
+
+    def __init__( self, logfile, interval, with_live_set ):
+        self.logfile = logfile
+        self.interval = interval
+        self.with_live_set = with_live_set
+        self.checkpoints = []
+
+    @staticmethod
+    def default_filename( logfile ):
+        return logfile + ".index"
+
+    def add_checkpoint( self, event, offset, skip, t, allocated_memories ):
+
+        # offset and skip : position to resume reading (see TraceLogReader.records())
+        checkpoint = { "event" : event, "offset" : offset, "skip" : skip, "t" : t }
+
+        if self.with_live_set:
+            # compact form : [ p, size, return_addr0, return_addr1, ... ]
+            checkpoint["live"] = [ [ p, size, *return_addr ] for p, (size, return_addr) in allocated_memories.items() ]
+
+        self.checkpoints.append(checkpoint)
+
+    def save( self, filename ):
+
+        print( "Writing trace index :", filename )
+
+        with open( filename, "w" ) as fd:
+            header = { "logfile" : os.path.basename(self.logfile), "interval" : self.interval, "live_set" : self.with_live_set }
+            fd.write( json.dumps(header) + "\n" )
+            for checkpoint in self.checkpoints:
+                fd.write( json.dumps(checkpoint) + "\n" )
+
+        print( f"Wrote {len(self.checkpoints)} checkpoints" )
+
+    @staticmethod
+    def load( filename, logfile ):
+
+        print( "Loading trace index :", filename )
+
+        with open( filename, "r" ) as fd:
+            header = json.loads( fd.readline() )
+            index = TraceIndex( logfile, header["interval"], header["live_set"] )
+            for line in fd:
+                index.checkpoints.append( json.loads(line) )
+
+        return index
+
+    def find_checkpoint( self, t0, at_event, at_time ):
+
+        # Returns the last checkpoint located before the requested point
+        found = None
+        for checkpoint in self.checkpoints:
+            if at_event is not None and checkpoint["event"] > at_event:
+                break
+            if at_time is not None and ( checkpoint["t"] is None or checkpoint["t"] - t0 > at_time ):
+                break
+            found = checkpoint
+        return found
+
+
+class ChurnProfiler:
+
+    """
+    Per-callsite allocation lifetime and churn statistics, to find where object pools or arenas would pay off.
+
+    Allocations are matched with their frees while replaying. Short-lived alloc/free pairs cancelled by the tracer
+    (PY_MALLOC_TRACE_MIN_AGE_US) are merged from churn records.
+    """
+
+    # Same buckets as the tracer's churn records
+    LIFETIME_BUCKETS = [ "<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", "<10s", ">=10s" ]
+    NUM_SIZE_BUCKETS = 33
+
+    class Callsite:
+        def __init__(self):
+            self.count = 0
+            self.bytes = 0
+            self.cross_thread = 0
+            self.num_freed = 0
+            self.lifetime_hist = [0] * len(ChurnProfiler.LIFETIME_BUCKETS)
+            self.size_hist = [0] * ChurnProfiler.NUM_SIZE_BUCKETS
+
+    def __init__(self):
+        self.callsites = {}
+        self.live = {}
+
+    def callsite( self, return_addr ):
+        if return_addr not in self.callsites:
+            self.callsites[return_addr] = ChurnProfiler.Callsite()
+        return self.callsites[return_addr]
+
+    @staticmethod
+    def size_bucket( size ):
+        return min( ( size - 1 ).bit_length() if size > 1 else 0, ChurnProfiler.NUM_SIZE_BUCKETS - 1 )
+
+    @staticmethod
+    def lifetime_bucket( lifetime ):
+        bucket = 0
+        limit = 10000
+        while lifetime >= limit and bucket < len(ChurnProfiler.LIFETIME_BUCKETS) - 1:
+            bucket += 1
+            limit *= 10
+        return bucket
+
+    def on_alloc( self, d ):
+        callsite = self.callsite( d.return_addr )
+        callsite.count += 1
+        callsite.bytes += d.size
+        callsite.size_hist[ self.size_bucket(d.size) ] += 1
+        self.live[d.p] = ( d.t, d.tid, d.return_addr )
+
+    def on_free( self, d ):
+        if d.p not in self.live:
+            return
+        t, tid, return_addr = self.live.pop(d.p)
+        callsite = self.callsite(return_addr)
+        callsite.num_freed += 1
+        if t is not None and d.t is not None:
+            callsite.lifetime_hist[ self.lifetime_bucket( d.t - t ) ] += 1
+        if tid is not None and d.tid is not None and tid != d.tid:
+            callsite.cross_thread += 1
+
+    def on_churn_record( self, d ):
+        return_addr = tuple( int(return_addr,16) for return_addr in d["return_addr"] )
+        callsite = self.callsite(return_addr)
+        callsite.count += d["count"]
+        callsite.bytes += d["bytes"]
+        callsite.num_freed += d["count"]
+        callsite.cross_thread += d.get( "cross_thread", 0 )
+        for i, n in enumerate( d.get( "lifetime_hist", [] ) ):
+            callsite.lifetime_hist[i] += n
+        for i, n in enumerate( d.get( "size_hist", [] ) ):
+            callsite.size_hist[i] += n
+
+    def print_report( self, symbol_resolver, duration, top ):
+
+        # Merge callsites resolving to the same symbols
+        stats = {}
+        for return_addr, callsite in self.callsites.items():
+            caller = tuple( symbol_resolver.resolve_symbol(addr) for addr in return_addr )
+            if caller not in stats:
+                stats[caller] = ChurnProfiler.Callsite()
+            merged = stats[caller]
+            merged.count += callsite.count
+            merged.bytes += callsite.bytes
+            merged.cross_thread += callsite.cross_thread
+            merged.num_freed += callsite.num_freed
+            merged.lifetime_hist = [ a+b for a, b in zip( merged.lifetime_hist, callsite.lifetime_hist ) ]
+            merged.size_hist = [ a+b for a, b in zip( merged.size_hist, callsite.size_hist ) ]
+
+        def format_hist( labels, hist, total ):
+            return " | ".join( f"{label}: {n*100/total:.1f}%" for label, n in zip(labels,hist) if n>0 )
+
+        size_labels = [ f"<={1<<i}" for i in range(ChurnProfiler.NUM_SIZE_BUCKETS-1) ] + [ f">{1<<(ChurnProfiler.NUM_SIZE_BUCKETS-2)}" ]
+
+        print("")
+        print(f"Allocation churn by callsite (top {top} by number of allocations):")
+
+        for caller, callsite in sorted( stats.items(), key=lambda item: item[1].count, reverse=True )[:top]:
+
+            rate = f"{callsite.count / duration:.1f}" if duration > 0 else "-"
+            short_lived = sum( callsite.lifetime_hist[:3] ) # <1ms
+            num_freed = max( callsite.num_freed, 1 )
+
+            print( caller, f": allocs: {callsite.count} : allocs/sec: {rate} : bytes: {callsite.bytes}"
+                f" : freed < 1ms: {short_lived*100/num_freed:.1f}%"
+                f" : cross-thread frees: {callsite.cross_thread*100/num_freed:.1f}%"
+                f" : live: {callsite.count - callsite.num_freed}" )
+            if callsite.num_freed > 0:
+                print( "    lifetime :", format_hist( ChurnProfiler.LIFETIME_BUCKETS, callsite.lifetime_hist, num_freed ) )
+            print( "    size     :", format_hist( size_labels, callsite.size_hist, max( callsite.count, 1 ) ) )
+
+
 class MallocTraceLogParser:
 
     def __init__( self, symbol_resolver ):
         self.symbol_resolver = symbol_resolver
         self.allocated_memories = {}
         self.stats = {}
+        self.num_events = 0
+        self.t0 = None
+        self.last_t = None
+        self.use_module_records = True
+        self.churn = {}
+        self.filtered = False
+        self.num_unknown_frees = 0
+        self.fork_points = [] # ( fork time, child pid ), sorted by time
+        self.fork_snapshots = {} # child pid -> live memory blocks at the fork time
+        self.inherited = {}
+        self.first_thread_stats = None
+        self.last_thread_stats = None
+        self.first_tag_stats = None
+        self.last_tag_stats = None
+        self.churn_profiler = None
+        self.heap_stats = []
+
+    def parse( self, filename, index=None, checkpoint=None, at_event=None, at_time=None ):
 
-    def parse( self, filename ):
+        """
+        Replay alloc/free events in the trace log and build the set of live memory blocks.
 
-        def resolve_return_addr_list(return_addr_list):
-            result = []
-            for return_addr in return_addr_list:
-                name = self.symbol_resolver.resolve_symbol( int(return_addr,16) )
-                result.append(name)
-            return tuple(result)
+        index      : TraceIndex to fill with checkpoints while replaying
+        checkpoint : checkpoint to start replaying from instead of the beginning of the log
+        at_event   : stop replaying before this event number
+        at_time    : stop replaying before this time (seconds from the first event)
+        """
 
         print("")
         print( "Parsing trace log :", filename )
-        
-        with open( filename, "r" ) as fd:
 
-            for lineno, line in enumerate(fd):
+        reader = TraceLogReader(filename)
 
-                if lineno % 100000==0:
-                    print(".", end="", flush=True)
-                
-                line = line.strip()
-                try:
-                    d = json.loads(line)
-                except json.decoder.JSONDecodeError:
-                    print( "Malformed JSON :", [line] )
-                    continue
+        offset = 0
+        skip = 0
+
+        if checkpoint:
+            print( f"Starting from checkpoint : event {checkpoint['event']}, offset {checkpoint['offset']}" )
+            offset = checkpoint["offset"]
+            skip = checkpoint.get( "skip", 0 )
+            self.num_events = checkpoint["event"]
+            for p, size, *return_addr in checkpoint["live"]:
+                self.allocated_memories[p] = ( size, tuple(return_addr) )
+            if reader.is_binary:
+                # Binary event blocks need the segment header to decode
+                for d in reader.meta_records():
+                    pass
 
-                #print(d)
+        for record_offset, record_skip, d in reader.records( offset, skip ):
 
-                op = d["op"]
-                p = d["p"]
+            if self.num_events % 100000==0:
+                print(".", end="", flush=True)
 
-                if op==1: # alloc
-                    
-                    if p in self.allocated_memories:
-                        print("Warning : [alloc] already allocated :", p, self.allocated_memories[p], (d["size"], d["return_addr"]) )
-                    
-                    self.allocated_memories[p] = ( d["size"], resolve_return_addr_list(d["return_addr"]) )
+            #print(d)
 
-                elif op==2: # free
+            if isinstance( d, dict ):
+                self.handle_meta_record(d)
+                continue
 
-                    if p=="(nil)":
-                        continue
-                    
-                    if p not in self.allocated_memories:
-                        print(f"Warning : [free] freeing unknown memory {p}")
-                        continue
+            t = d.t
+            if self.t0 is None:
+                self.t0 = t
 
-                    del self.allocated_memories[p]
+            if self.fork_points and t is not None:
+                self.take_fork_snapshots(t)
+
+            if at_event is not None and self.num_events >= at_event:
+                break
+            if at_time is not None and t is not None and t - self.t0 > at_time:
+                break
+
+            if index and self.num_events % index.interval==0:
+                index.add_checkpoint( self.num_events, record_offset, record_skip, t, self.allocated_memories )
+
+            self.num_events += 1
+            self.last_t = t
+
+            op = d.op
+            p = d.p
+
+            if op==1: # alloc
                 
-                else:
-                    assert f"Unknown operation : {op}"
+                if p in self.allocated_memories:
+                    print("Warning : [alloc] already allocated :", hex(p), self.allocated_memories[p], (d.size, d.return_addr) )
+                
+                self.allocated_memories[p] = ( d.size, d.return_addr )
+
+                if self.churn_profiler:
+                    self.churn_profiler.on_alloc(d)
+
+            elif op==2: # free
+
+                if p==0:
+                    continue
+
+                if self.churn_profiler:
+                    self.churn_profiler.on_free(d)
+                
+                if p not in self.allocated_memories:
+                    # With record-time filters or flight recorder dumps, frees of unrecorded allocations are expected
+                    if not self.filtered:
+                        print(f"Warning : [free] freeing unknown memory {hex(p)}")
+                    self.num_unknown_frees += 1
+                    continue
+
+                del self.allocated_memories[p]
+            
+            else:
+                assert f"Unknown operation : {op}"
 
         print("\n")
+        print( f"Replayed {self.num_events} events" )
+        if self.t0 is not None and self.last_t is not None:
+            print( f"Replayed time range : {(self.last_t - self.t0) / 1e9:.3f} sec" )
+
+    def take_fork_snapshots( self, t=None ):
+
+        # Snapshot live memory blocks for child processes forked before time t (all remaining ones if t is None)
+        while self.fork_points and ( t is None or self.fork_points[0][0] <= t ):
+            fork_t, child_pid = self.fork_points.pop(0)
+            self.fork_snapshots[child_pid] = dict(self.allocated_memories)
+
+    def inherit( self, allocated_memories ):
+
+        # Memory blocks allocated by the parent process before fork() are live in the child process too
+        self.allocated_memories.update(allocated_memories)
+        self.inherited = allocated_memories
+
+    def load_module_records( self, filename ):
+        for d in TraceLogReader(filename).meta_records():
+            self.handle_meta_record(d)
+
+    def handle_meta_record( self, d ):
+
+        if d["type"]=="header":
+            print( f"\nSegment header : pid {d['pid']}, segment {d['segment']}" )
+            self.filtered = self.filtered or d.get( "filtered", False )
+            if d.get( "mode" )=="flight":
+                # Flight recorder dumps only contain the most recent events. Blocks allocated before the window are unknown.
+                print( "Flight recorder dump : remaining blocks are the ones allocated within the recorded window" )
+                self.filtered = True
+
+        elif d["type"]=="module":
+            if self.use_module_records:
+                addr_range = int( d["start"], 16 ), int( d["end"], 16 )
+                self.symbol_resolver.add_module( addr_range, int( d["offset"], 16 ), d["path"] )
+
+        elif d["type"]=="churn":
+            # Short-lived alloc/free pairs cancelled by the tracer (PY_MALLOC_TRACE_MIN_AGE_US)
+            return_addr = tuple( int(return_addr,16) for return_addr in d["return_addr"] )
+            if return_addr not in self.churn:
+                self.churn[return_addr] = [ 0, 0 ]
+            self.churn[return_addr][0] += d["count"]
+            self.churn[return_addr][1] += d["bytes"]
+            if self.churn_profiler:
+                self.churn_profiler.on_churn_record(d)
+
+        elif d["type"]=="thread_stats":
+            # Per-thread heap accounting snapshots (PY_MALLOC_TRACE_THREAD_STATS)
+            if self.first_thread_stats is None:
+                self.first_thread_stats = d
+            self.last_thread_stats = d
+
+        elif d["type"]=="heap_stats":
+            # Allocator state samples (PY_MALLOC_TRACE_HEAP_STATS)
+            self.heap_stats.append(d)
+
+        elif d["type"]=="tag_stats":
+            # Per-tag heap accounting snapshots (py_malloc_trace.tag)
+            if self.first_tag_stats is None:
+                self.first_tag_stats = d
+            self.last_tag_stats = d
+
+    def print_churn( self, top=20 ):
+
+        if self.churn_profiler:
+            duration = ( self.last_t - self.t0 ) / 1e9 if self.t0 is not None and self.last_t is not None else 0
+            self.churn_profiler.print_report( self.symbol_resolver, duration, top )
+            return
+
+        if not self.churn:
+            return
+
+        stats = {}
+        for return_addr, (count, size) in self.churn.items():
+            caller = tuple( self.symbol_resolver.resolve_symbol(addr) for addr in return_addr )
+            if caller not in stats:
+                stats[caller] = [ 0, 0 ]
+            stats[caller][0] += count
+            stats[caller][1] += size
+
+        print("")
+        print("Short-lived allocations cancelled by the tracer (num allocations and total size):")
+        for caller, (count, size) in sorted( stats.items(), key=lambda item: item[1][0], reverse=True ):
+            print( caller, ": num allocations:", count, ": total size:", size )
+
+    def print_thread_stats( self ):
+
+        if self.last_thread_stats is None:
+            return
+
+        def thread_label(thread):
+            return thread["py_name"] or thread["name"] or "(unknown)"
+
+        first = { thread["tid"] : thread for thread in self.first_thread_stats["threads"] }
+        duration = ( self.last_thread_stats["t"] - self.first_thread_stats["t"] ) / 1e9
+
+        print("")
+        print("Per-thread heap usage (last snapshot):")
+
+        by_label = {}
+        for thread in self.last_thread_stats["threads"]:
+
+            live_count = thread["alloc_count"] - thread["free_count"]
+            live_bytes = thread["alloc_bytes"] - thread["free_bytes"]
+
+            # Allocation rate between the first and the last snapshots
+            rate = ""
+            if duration>0:
+                prev = first.get( thread["tid"], { "alloc_count" : 0, "alloc_bytes" : 0 } )
+                rate = f" : allocs/sec: {( thread['alloc_count'] - prev['alloc_count'] ) / duration:.1f} : bytes/sec: {( thread['alloc_bytes'] - prev['alloc_bytes'] ) / duration:.1f}"
+
+            label = thread_label(thread)
+            print( f"{label} (tid {thread['tid']}{'' if thread['alive'] else ', exited'}) : live blocks: {live_count} : live size: {live_bytes}{rate}" )
+
+            if label not in by_label:
+                by_label[label] = [ 0, 0, 0 ]
+            by_label[label][0] += 1
+            by_label[label][1] += live_count
+            by_label[label][2] += live_bytes
+
+        print("")
+        print("Per-thread-name heap usage (num threads, live blocks and live size):")
+        for label, (num_threads, live_count, live_bytes) in sorted( by_label.items(), key=lambda item: item[1][2], reverse=True ):
+            print( label, ": num threads:", num_threads, ": live blocks:", live_count, ": live size:", live_bytes )
+
+    def print_tag_stats( self ):
+
+        if self.last_tag_stats is None:
+            return
+
+        first = { tag["name"] : tag for tag in self.first_tag_stats["tags"] }
+        duration = ( self.last_tag_stats["t"] - self.first_tag_stats["t"] ) / 1e9
+
+        print("")
+        print("Per-tag heap usage (last snapshot):")
+        for tag in sorted( self.last_tag_stats["tags"], key=lambda tag: tag["alloc_bytes"] - tag["free_bytes"], reverse=True ):
+
+            rate = ""
+            if duration>0:
+                prev = first.get( tag["name"], { "alloc_count" : 0, "alloc_bytes" : 0 } )
+                rate = f" : allocs/sec: {( tag['alloc_count'] - prev['alloc_count'] ) / duration:.1f} : bytes/sec: {( tag['alloc_bytes'] - prev['alloc_bytes'] ) / duration:.1f}"
+
+            print( f"{tag['name'] or '(untagged)'} : live blocks: {tag['alloc_count'] - tag['free_count']} : live size: {tag['alloc_bytes'] - tag['free_bytes']}{rate}" )
+
+    @staticmethod
+    def heap_stats_row( d ):
+
+        # Memory obtained by malloc from the system, memory in use by the application, and free memory kept in arenas
+        heap_mapped = d["arena"] + d["hblkhd"]
+        heap_in_use = d["uordblks"] + d["hblkhd"]
+        row = {
+            "rss" : d["rss"],
+            "heap_mapped" : heap_mapped,
+            "heap_in_use" : heap_in_use,
+            "heap_free" : d["fordblks"],
+            "fragmentation" : d["fordblks"] / d["arena"] if d["arena"] else 0,
+            "num_free_chunks" : d["ordblks"],
+            "num_arenas" : d["num_arenas"],
+            "keepcost" : d["keepcost"],
+        }
+        if "live_bytes_hist" in d:
+            row["accounted_live_bytes"] = sum( d["live_bytes_hist"] )
+        if "pool_committed" in d:
+            row["pool_committed"] = d["pool_committed"]
+            row["pool_free"] = d["pool_free"]
+        return row
+
+    def write_stats_csv( self, filename ):
+
+        if not self.heap_stats:
+            print( "No heap stats records found. Set PY_MALLOC_TRACE_HEAP_STATS to record them." )
+            return
+
+        print( "Writing heap stats :", filename )
+
+        t0 = self.heap_stats[0]["t"]
+        rows = []
+        for d in self.heap_stats:
+            row = { "t" : f"{( d['t'] - t0 ) / 1e9:.3f}" }
+            row.update( self.heap_stats_row(d) )
+            rows.append(row)
+
+        fieldnames = []
+        for row in rows:
+            fieldnames += [ key for key in row if key not in fieldnames ]
+
+        with open( filename, "w", newline="" ) as fd:
+            writer = csv.DictWriter( fd, fieldnames=fieldnames )
+            writer.writeheader()
+            writer.writerows(rows)
+
+    def print_heap_stats( self ):
+
+        if not self.heap_stats:
+            return
+
+        first = self.heap_stats_row( self.heap_stats[0] )
+        last = self.heap_stats_row( self.heap_stats[-1] )
+        peak_rss = max( d["rss"] for d in self.heap_stats )
+
+        print("")
+        print( f"Heap stats ({len(self.heap_stats)} samples, first -> last):" )
+        for key in [ "rss", "heap_mapped", "heap_in_use", "heap_free", "num_free_chunks", "num_arenas", "pool_committed", "pool_free" ]:
+            if key in last:
+                print( f"{key} : {first.get(key,0)} -> {last[key]}" )
+        print( f"fragmentation : {first['fragmentation']*100:.1f}% -> {last['fragmentation']*100:.1f}%" )
+        print( f"peak rss : {peak_rss}" )
+
+        last_record = self.heap_stats[-1]
+        if "live_count_hist" in last_record:
+            print("")
+            print("Live blocks by size class (last sample):")
+            for i, ( count, size ) in enumerate( zip( last_record["live_count_hist"], last_record["live_bytes_hist"] ) ):
+                if count:
+                    print( f"<={1<<i} : num blocks: {count} : total size: {size}" )
+
+    def print_remaining( self ):
+
+        def resolve_return_addr_list(return_addr_list):
+            result = []
+            for return_addr in return_addr_list:
+                name = self.symbol_resolver.resolve_symbol( return_addr )
+                result.append(name)
+            return tuple(result)
+
+        print("")
         print("Num remaining memory blocks and total size:")
         for p, (size,return_addr) in self.allocated_memories.items():
             
             #print( p, size,return_addr )
 
+            return_addr = resolve_return_addr_list(return_addr)
+
             if return_addr not in self.stats:
                 self.stats[return_addr] = [ 0, 0 ]
             
@@ -244,13 +997,186 @@ class MallocTraceLogParser:
 
         print("")
         print("Total remaining size:", total_size)
+
+        if self.inherited:
+            print("Remaining size inherited from the parent process:", self.inherited_remaining_size())
+
+    def remaining_size( self ):
+        return sum( size for size, _ in self.allocated_memories.values() )
+
+    def inherited_remaining_size( self ):
+        # Blocks which were never freed nor reallocated after fork()
+        return sum( entry[0] for p, entry in self.inherited.items() if self.allocated_memories.get(p) is entry )
+
+
+class ProcessTree:
+
+    """
+    Merges trace logs of a process and its forked child processes (one log file or segment set per pid).
+
+    Each child process is replayed on top of the memory blocks which were live in the parent process
+    at the fork time ("fork_t" in the child's segment header).
+    """
+
+    def __init__( self, symbol_resolver, use_module_records, churn_report=False, churn_top=20 ):
+        self.symbol_resolver = symbol_resolver
+        self.use_module_records = use_module_records
+        self.churn_report = churn_report
+        self.churn_top = churn_top
+        self.processes = {}
+        self.parsers = {}
+
+    def add_logfile( self, logfile ):
+
+        header = None
+        for d in TraceLogReader(logfile).meta_records():
+            if d["type"]=="header":
+                header = d
+                break
+
+        if header is None:
+            print( "Warning : segment header not found :", logfile )
+            return
+
+        pid = header["pid"]
+        if pid not in self.processes:
+            self.processes[pid] = { "ppid" : header.get("ppid"), "fork_t" : header.get("fork_t"), "logfiles" : [] }
+        self.processes[pid]["logfiles"].append( ( header["segment"], logfile ) )
+
+    def children( self, pid ):
+        return sorted( [ child_pid for child_pid, process in self.processes.items() if process["ppid"]==pid ],
+            key = lambda child_pid: self.processes[child_pid]["fork_t"] or 0 )
+
+    def roots( self ):
+        return sorted( [ pid for pid, process in self.processes.items() if process["ppid"] not in self.processes ] )
+
+    def replay( self ):
+
+        # Parents first, so that their live memory blocks at fork time are ready for children
+        queue = self.roots()
+        while queue:
+            pid = queue.pop(0)
+            process = self.processes[pid]
+
+            parser = MallocTraceLogParser( self.symbol_resolver )
+            parser.use_module_records = self.use_module_records
+            if self.churn_report:
+                parser.churn_profiler = ChurnProfiler()
+
+            children = self.children(pid)
+            parser.fork_points = [ ( self.processes[child_pid]["fork_t"], child_pid ) for child_pid in children if self.processes[child_pid]["fork_t"] is not None ]
+
+            parent_parser = self.parsers.get( process["ppid"] )
+            if parent_parser and pid in parent_parser.fork_snapshots:
+                parser.inherit( parent_parser.fork_snapshots.pop(pid) )
+
+            for _, logfile in sorted( process["logfiles"] ):
+                parser.parse( logfile )
+            parser.take_fork_snapshots()
+
+            self.parsers[pid] = parser
+            queue += children
+
+    def print_report( self ):
+
+        for pid in self.parsers:
+            print("")
+            print( f"==== Process {pid} ====" )
+            self.parsers[pid].print_churn( self.churn_top )
+            self.parsers[pid].print_thread_stats()
+            self.parsers[pid].print_tag_stats()
+            self.parsers[pid].print_heap_stats()
+            self.parsers[pid].print_remaining()
+
+        def print_process( pid, depth ):
+            parser = self.parsers[pid]
+            process = self.processes[pid]
+            description = f"pid {pid} : events: {parser.num_events} : remaining size: {parser.remaining_size()}"
+            if parser.inherited:
+                description += f" : inherited: {parser.inherited_remaining_size()}"
+            elif depth>0 and process["fork_t"] is None:
+                description += " : (exec)"
+            print( "    " * depth + description )
+            for child_pid in self.children(pid):
+                print_process( child_pid, depth+1 )
+
+        print("")
+        print("Process tree:")
+        for pid in self.roots():
+            print_process( pid, 0 )
         
 
 symbol_resolver = SymbolResolver()
-symbol_resolver.load_mapfile( args.mapfile )
-symbol_resolver.load_symbol_table_all()
 
 parser = MallocTraceLogParser(symbol_resolver)
-parser.parse( args.logfile )
+
+if args.churn_report:
+    parser.churn_profiler = ChurnProfiler()
+
+if args.mapfile:
+    symbol_resolver.load_mapfile( args.mapfile )
+    parser.use_module_records = False
+
+use_index = args.build_index or args.at_event is not None or args.at_time is not None
+if use_index and len(args.logfile) > 1:
+    argparser.error("--build-index, --at-event and --at-time accept only one log file")
+
+if args.process_tree:
+
+    if use_index:
+        argparser.error("--process-tree can't be used with --build-index, --at-event and --at-time")
+
+    process_tree = ProcessTree( symbol_resolver, parser.use_module_records, args.churn_report, args.churn_top )
+    for logfile in args.logfile:
+        process_tree.add_logfile( logfile )
+    process_tree.replay()
+
+    symbol_resolver.load_symbol_table_all()
+    process_tree.print_report()
+    symbol_resolver.print_unresolved()
+    sys.exit(0)
+
+logfile = args.logfile[0]
+index_filename = args.index or TraceIndex.default_filename( logfile )
+
+if args.build_index:
+
+    index = TraceIndex( logfile, args.index_interval, not args.index_without_live_set )
+    parser.parse( logfile, index=index )
+    index.save( index_filename )
+
+elif args.at_event is not None or args.at_time is not None:
+
+    at_time = args.at_time * 1e9 if args.at_time is not None else None
+
+    checkpoint = None
+    if os.path.exists(index_filename):
+        index = TraceIndex.load( index_filename, logfile )
+        if index.with_live_set and index.checkpoints:
+            t0 = index.checkpoints[0]["t"]
+            checkpoint = index.find_checkpoint( t0, args.at_event, at_time )
+            parser.t0 = t0
+        else:
+            print( "Trace index doesn't contain live set snapshots. Replaying from the beginning." )
+
+    if checkpoint and parser.use_module_records:
+        parser.load_module_records( logfile )
+
+    parser.parse( logfile, checkpoint=checkpoint, at_event=args.at_event, at_time=at_time )
+
+else:
+    for logfile in args.logfile:
+        parser.parse( logfile )
+
+if args.stats_csv:
+    parser.write_stats_csv( args.stats_csv )
+
+symbol_resolver.load_symbol_table_all()
+
+parser.print_churn( args.churn_top )
+parser.print_thread_stats()
+parser.print_tag_stats()
+parser.print_heap_stats()
+parser.print_remaining()
 
 symbol_resolver.print_unresolved()
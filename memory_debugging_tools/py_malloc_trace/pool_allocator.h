@@ -0,0 +1,383 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <atomic>
+
+// Size-class pool allocator
+//
+// Small allocations are served from slabs carved from a single reserved virtual address range, so
+// the ownership of a pointer is a range check, and its size class is a table lookup by slab index.
+//
+//   Thread cache   : per-thread free list per size class. No locking.
+//   Transfer cache : per size class free list shared by threads. Objects move between thread caches
+//                    and the transfer cache in batches, under a spinlock.
+//   Slabs          : POOL_SLAB_SIZE chunks of the reserved range, dedicated to a size class.
+//
+// Objects freed by another thread go to the freeing thread's cache, and flow back through the
+// transfer cache. Slabs are never returned to the OS. Only one PoolAllocator can exist in a process,
+// as the thread cache is a thread local variable.
+
+static const size_t POOL_SLAB_SIZE = 64 * 1024;
+static const size_t POOL_MAX_SIZE = 4096;
+static const size_t POOL_NUM_CLASSES = 28;
+static const size_t POOL_MAX_BATCH = 64;
+
+// 16 bytes steps up to 128, then 4 classes per power of 2
+static const uint32_t pool_class_sizes[POOL_NUM_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+};
+
+struct PoolAllocator;
+
+struct PoolFreeList
+{
+    void * head;
+    uint32_t count;
+};
+
+struct PoolThreadCache
+{
+    PoolFreeList lists[POOL_NUM_CLASSES];
+    PoolAllocator * owner; // set when registered for the thread exit destructor
+    bool exited;
+};
+
+static __thread PoolThreadCache t_pool_cache;
+
+struct PoolAllocator
+{
+    struct alignas(64) TransferCache
+    {
+        TransferCache()
+            :
+            locked(false),
+            head(NULL),
+            count(0),
+            num_slabs(0)
+        {
+        }
+
+        void lock()
+        {
+            while( locked.exchange( true, std::memory_order_acquire ) )
+            {
+                sched_yield();
+            }
+        }
+
+        void unlock()
+        {
+            locked.store( false, std::memory_order_release );
+        }
+
+        std::atomic<bool> locked;
+        void * head;
+        size_t count;
+        std::atomic<size_t> num_slabs;
+    };
+
+    static inline void * & next_of( void * p )
+    {
+        return *(void**)p;
+    }
+
+    PoolAllocator()
+        :
+        base(0),
+        region_size(0),
+        num_slabs(0),
+        slab_classes(NULL)
+    {
+        enabled.store( false, std::memory_order_relaxed );
+        next_slab.store( 0, std::memory_order_relaxed );
+    }
+
+    // Reserve the address range. Physical memory is used only when touched.
+    bool init( size_t size )
+    {
+        num_slabs = size / POOL_SLAB_SIZE;
+        region_size = num_slabs * POOL_SLAB_SIZE;
+        if( num_slabs==0 )
+        {
+            return false;
+        }
+
+        // Extra slab for alignment
+        void * p = mmap( NULL, region_size + POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+        if( p==MAP_FAILED )
+        {
+            return false;
+        }
+        base = ( (uintptr_t)p + POOL_SLAB_SIZE - 1 ) & ~(uintptr_t)( POOL_SLAB_SIZE - 1 );
+
+        void * table = mmap( NULL, num_slabs, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+        if( table==MAP_FAILED )
+        {
+            munmap( p, region_size + POOL_SLAB_SIZE );
+            return false;
+        }
+        slab_classes = (uint8_t*)table;
+
+        for( size_t i=0 ; i<=POOL_MAX_SIZE/16 ; ++i )
+        {
+            size_t size_class = 0;
+            while( pool_class_sizes[size_class] < i*16 )
+            {
+                size_class ++;
+            }
+            class_lookup[i] = (uint8_t)size_class;
+        }
+
+        for( size_t i=0 ; i<POOL_NUM_CLASSES ; ++i )
+        {
+            size_t batch = 8192 / pool_class_sizes[i];
+            batch_sizes[i] = batch < 2 ? 2 : batch > POOL_MAX_BATCH ? POOL_MAX_BATCH : batch;
+        }
+
+        pthread_key_create( &thread_exit_key, on_thread_exit );
+
+        enabled.store( true, std::memory_order_release );
+        return true;
+    }
+
+    inline bool is_enabled() const
+    {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    inline bool owns( const void * p ) const
+    {
+        return (uintptr_t)p - base < region_size;
+    }
+
+    inline size_t usable_size( const void * p ) const
+    {
+        return pool_class_sizes[ slab_classes[ ( (uintptr_t)p - base ) / POOL_SLAB_SIZE ] ];
+    }
+
+    // Returns NULL when the size is not served by the pool, or the pool is exhausted
+    inline void * allocate( size_t size )
+    {
+        if( size > POOL_MAX_SIZE || !is_enabled() )
+        {
+            return NULL;
+        }
+
+        size_t size_class = class_lookup[ (size+15) / 16 ];
+        PoolFreeList & list = t_pool_cache.lists[size_class];
+
+        if( !list.head && !refill( size_class ) )
+        {
+            return NULL;
+        }
+
+        void * p = list.head;
+        list.head = next_of(p);
+        list.count --;
+        return p;
+    }
+
+    // p must be owned by the pool
+    inline void release( void * p )
+    {
+        size_t size_class = slab_classes[ ( (uintptr_t)p - base ) / POOL_SLAB_SIZE ];
+
+        if( t_pool_cache.exited )
+        {
+            // Called from a thread local destructor after the thread cache was flushed
+            next_of(p) = NULL;
+            push_transfer( size_class, p, p, 1 );
+            return;
+        }
+
+        PoolFreeList & list = t_pool_cache.lists[size_class];
+        next_of(p) = list.head;
+        list.head = p;
+        list.count ++;
+
+        if( list.count > batch_sizes[size_class] * 2 )
+        {
+            release_batch( size_class, batch_sizes[size_class] );
+        }
+    }
+
+    // Number of bytes of slabs carved from the reserved range
+    size_t committed_bytes() const
+    {
+        size_t n = next_slab.load(std::memory_order_relaxed);
+        return ( n < num_slabs ? n : num_slabs ) * POOL_SLAB_SIZE;
+    }
+
+    // Bytes of free objects in transfer caches. Objects in thread caches are not included.
+    size_t transfer_free_bytes()
+    {
+        size_t total = 0;
+        for( size_t i=0 ; i<POOL_NUM_CLASSES ; ++i )
+        {
+            transfer_caches[i].lock();
+            total += transfer_caches[i].count * pool_class_sizes[i];
+            transfer_caches[i].unlock();
+        }
+        return total;
+    }
+
+    // Hold all locks across fork(), so that the child process doesn't inherit a held lock
+    void lock_all()
+    {
+        for( size_t i=0 ; i<POOL_NUM_CLASSES ; ++i )
+        {
+            transfer_caches[i].lock();
+        }
+    }
+
+    void unlock_all()
+    {
+        for( size_t i=POOL_NUM_CLASSES ; i>0 ; --i )
+        {
+            transfer_caches[i-1].unlock();
+        }
+    }
+
+    std::atomic<bool> enabled;
+    uintptr_t base;
+    size_t region_size;
+    size_t num_slabs;
+    std::atomic<size_t> next_slab;
+    uint8_t * slab_classes; // size class of each slab
+    uint8_t class_lookup[POOL_MAX_SIZE/16 + 1]; // (size+15)/16 -> size class
+    uint32_t batch_sizes[POOL_NUM_CLASSES];
+    TransferCache transfer_caches[POOL_NUM_CLASSES];
+    pthread_key_t thread_exit_key;
+
+    // Fill the thread cache from the transfer cache, carving a new slab when it is empty
+    bool refill( size_t size_class )
+    {
+        if( !t_pool_cache.owner )
+        {
+            // The destructor returns cached objects to the transfer cache at thread exit
+            t_pool_cache.owner = this;
+            pthread_setspecific( thread_exit_key, &t_pool_cache );
+        }
+
+        TransferCache & transfer = transfer_caches[size_class];
+        PoolFreeList & list = t_pool_cache.lists[size_class];
+
+        while( true )
+        {
+            transfer.lock();
+
+            void * head = transfer.head;
+            void * tail = NULL;
+            size_t count = 0;
+            for( void * p=head ; p && count<batch_sizes[size_class] ; p=next_of(p) )
+            {
+                tail = p;
+                count ++;
+            }
+
+            if( count>0 )
+            {
+                transfer.head = next_of(tail);
+                transfer.count -= count;
+                next_of(tail) = list.head;
+                list.head = head;
+                list.count += count;
+            }
+
+            transfer.unlock();
+
+            if( count>0 )
+            {
+                return true;
+            }
+
+            if( !carve_slab( size_class ) )
+            {
+                return false;
+            }
+        }
+    }
+
+    bool carve_slab( size_t size_class )
+    {
+        size_t slab_index = next_slab.fetch_add( 1, std::memory_order_relaxed );
+        if( slab_index >= num_slabs )
+        {
+            return false;
+        }
+
+        slab_classes[slab_index] = (uint8_t)size_class;
+        transfer_caches[size_class].num_slabs.fetch_add( 1, std::memory_order_relaxed );
+
+        // Link objects in address order
+        size_t object_size = pool_class_sizes[size_class];
+        size_t num_objects = POOL_SLAB_SIZE / object_size;
+        char * slab = (char*)( base + slab_index * POOL_SLAB_SIZE );
+        for( size_t i=0 ; i+1<num_objects ; ++i )
+        {
+            next_of( slab + i * object_size ) = slab + (i+1) * object_size;
+        }
+        void * tail = slab + (num_objects-1) * object_size;
+        next_of(tail) = NULL;
+
+        push_transfer( size_class, slab, tail, num_objects );
+        return true;
+    }
+
+    void push_transfer( size_t size_class, void * head, void * tail, size_t count )
+    {
+        TransferCache & transfer = transfer_caches[size_class];
+
+        transfer.lock();
+        next_of(tail) = transfer.head;
+        transfer.head = head;
+        transfer.count += count;
+        transfer.unlock();
+    }
+
+    // Move count objects from the head of the thread cache to the transfer cache
+    void release_batch( size_t size_class, size_t count )
+    {
+        PoolFreeList & list = t_pool_cache.lists[size_class];
+        if( count > list.count )
+        {
+            count = list.count;
+        }
+        if( count==0 )
+        {
+            return;
+        }
+
+        void * head = list.head;
+        void * tail = head;
+        for( size_t i=1 ; i<count ; ++i )
+        {
+            tail = next_of(tail);
+        }
+
+        list.head = next_of(tail);
+        list.count -= count;
+
+        push_transfer( size_class, head, tail, count );
+    }
+
+    static void on_thread_exit( void * arg )
+    {
+        PoolThreadCache * cache = (PoolThreadCache*)arg;
+        for( size_t i=0 ; i<POOL_NUM_CLASSES ; ++i )
+        {
+            cache->owner->release_batch( i, cache->lists[i].count );
+        }
+        cache->exited = true;
+    }
+};
@@ -2,13 +2,32 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <malloc.h>
+#include <execinfo.h>
 
 #include <cstdlib>
+#include <string>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
 
 #include "Python.h"
 
+#include "trace_codec.h"
+#include "pool_allocator.h"
+
 //-----
 
 #define REPLACE_MALLOC_FUNCTIONS
@@ -38,6 +57,22 @@ static void malloc_trace_printf( const char * fmt, ... )
     (void)result;
 }
 
+// Same as malloc_trace_printf, but writes to stderr
+static void malloc_trace_error_printf( const char * fmt, ... )
+{
+    char buf[1024];
+
+    va_list args;
+    va_start(args, fmt);
+
+    int len = vsnprintf( buf, sizeof(buf)-1, fmt, args );
+
+    va_end(args);
+
+    ssize_t result = write( STDERR_FILENO, buf, len );
+    (void)result;
+}
+
 //-----
 
 enum MallocOperation
@@ -49,137 +84,3658 @@ enum MallocOperation
 struct MallocCallHistory
 {
     MallocOperation op;
+    pid_t tid;
     void * p;
     size_t size;
+    uint64_t timestamp; // nanoseconds, CLOCK_MONOTONIC
     void * return_addr[NUM_RETURN_ADDR_LEVELS];
 };
 
-struct Globals
+// Bounded multi-producer / single-consumer queue of history entries.
+// Allocating threads only reserve a slot and copy the entry. All formatting and file I/O
+// happens in the background flusher thread.
+struct TraceRing
+{
+    static const uint64_t NUM_ENTRIES = 1 << 17; // must be power of 2
+
+    struct Slot
+    {
+        std::atomic<uint64_t> seq; // index+1 when the entry is ready to be consumed
+        MallocCallHistory entry;
+    };
+
+    TraceRing()
+        :
+        slots(NULL),
+        head(0),
+        tail(0)
+    {
+    }
+
+    bool init()
+    {
+        void * p = mmap( NULL, sizeof(Slot) * NUM_ENTRIES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( p==MAP_FAILED )
+        {
+            return false;
+        }
+
+        // mmap-ed memory is zero filled, which is the initial state of the slots
+        slots = (Slot*)p;
+        return true;
+    }
+
+    // Discard all entries. Used in forked child processes, where entries inherited from the parent
+    // process may be partially written by threads which don't exist anymore.
+    bool reset()
+    {
+        head = 0;
+        tail = 0;
+
+        // Replace with fresh zero filled pages, instead of touching (and copying) all inherited pages
+        void * p = mmap( slots, sizeof(Slot) * NUM_ENTRIES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0 );
+        return p!=MAP_FAILED;
+    }
+
+    bool push( const MallocCallHistory & entry, const std::atomic<bool> & consumer_running )
+    {
+        uint64_t index = head.fetch_add( 1, std::memory_order_relaxed );
+
+        // Wait for the flusher when the ring is full
+        while( index - tail.load(std::memory_order_acquire) >= NUM_ENTRIES )
+        {
+            if( !consumer_running.load(std::memory_order_relaxed) )
+            {
+                return false;
+            }
+            sched_yield();
+        }
+
+        Slot & slot = slots[ index & (NUM_ENTRIES-1) ];
+        slot.entry = entry;
+        slot.seq.store( index+1, std::memory_order_release );
+
+        return true;
+    }
+
+    // Called only from the flusher thread
+    template<typename F>
+    size_t consume( F func, size_t max_count )
+    {
+        uint64_t index = tail.load(std::memory_order_relaxed);
+        size_t count = 0;
+
+        while( count < max_count )
+        {
+            Slot & slot = slots[ index & (NUM_ENTRIES-1) ];
+            if( slot.seq.load(std::memory_order_acquire) != index+1 )
+            {
+                break;
+            }
+
+            func( slot.entry );
+            ++index;
+            ++count;
+
+            // Release slots in batches to reduce cache line ping-pong with producers
+            if( count % 1024 == 0 )
+            {
+                tail.store( index, std::memory_order_release );
+            }
+        }
+
+        tail.store( index, std::memory_order_release );
+
+        return count;
+    }
+
+    Slot * slots;
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+};
+
+enum TraceMode
+{
+    TraceMode_Continuous,     // write all events to trace files
+    TraceMode_FlightRecorder, // keep recent events in per-thread memory, and write them only when triggered
+};
+
+enum TraceFormat
+{
+    TraceFormat_Json,
+    TraceFormat_LZ,
+};
+
+enum TraceAllocator
+{
+    TraceAllocator_Glibc,
+    TraceAllocator_Pool,
+};
+
+struct Config
+{
+    Config()
+        :
+        mode(TraceMode_Continuous),
+        format(TraceFormat_Json),
+        max_segment_size(0),
+        max_segments(0),
+        min_age(0),
+        min_size(0),
+        callsite_rate_limit(0),
+        flight_events(0),
+        flight_seconds(0),
+        flight_signal(0),
+        flight_trigger_bytes(0),
+        thread_stats_interval(0),
+        heap_stats_interval(0),
+        allocator(TraceAllocator_Glibc),
+        pool_size(0),
+        guard_sample_rate(0),
+        guard_slots(0)
+    {
+    }
+
+    TraceMode mode;          // PY_MALLOC_TRACE_MODE : "continuous" (default) or "flight"
+    TraceFormat format;      // PY_MALLOC_TRACE_FORMAT : "json" (default) or "lz" (compressed binary blocks)
+    size_t max_segment_size; // PY_MALLOC_TRACE_MAX_SEGMENT_SIZE : rotate trace file when it reaches this size (0 : unlimited)
+    size_t max_segments;     // PY_MALLOC_TRACE_MAX_SEGMENTS : keep only latest N segment files (0 : unlimited)
+    uint64_t min_age;        // PY_MALLOC_TRACE_MIN_AGE_US : cancel alloc/free pairs shorter than this, in nanoseconds (0 : disabled)
+
+    // Record-time filters for allocations
+    std::string include_modules; // PY_MALLOC_TRACE_INCLUDE_MODULES : comma separated module names. Record allocations only from these modules.
+    std::string exclude_modules; // PY_MALLOC_TRACE_EXCLUDE_MODULES : comma separated module names. Don't record allocations from these modules.
+    size_t min_size;             // PY_MALLOC_TRACE_MIN_SIZE : don't record allocations smaller than this
+    size_t callsite_rate_limit;  // PY_MALLOC_TRACE_CALLSITE_RATE_LIMIT : max allocations per second recorded per callsite (0 : unlimited)
+
+    bool has_record_filter() const
+    {
+        return !include_modules.empty() || !exclude_modules.empty() || min_size>0 || callsite_rate_limit>0;
+    }
+
+    // Flight recorder mode
+    size_t flight_events;        // PY_MALLOC_TRACE_FLIGHT_EVENTS : per-thread circular buffer size in number of events (rounded up to power of 2)
+    uint64_t flight_seconds;     // PY_MALLOC_TRACE_FLIGHT_SECONDS : dump only events in last N seconds, in nanoseconds (0 : whole buffer)
+    int flight_signal;           // PY_MALLOC_TRACE_FLIGHT_SIGNAL : signal number to trigger a dump (0 : disabled)
+    size_t flight_trigger_bytes; // PY_MALLOC_TRACE_FLIGHT_TRIGGER_BYTES : dump when heap in-use bytes cross this (0 : disabled)
+
+    // Per-thread heap accounting
+    uint64_t thread_stats_interval; // PY_MALLOC_TRACE_THREAD_STATS : interval of thread stats records, in nanoseconds (0 : accounting disabled)
+
+    // Allocator state sampling
+    uint64_t heap_stats_interval; // PY_MALLOC_TRACE_HEAP_STATS : interval of heap stats records, in nanoseconds (0 : disabled)
+
+    // Underlying allocator
+    TraceAllocator allocator; // PY_MALLOC_TRACE_ALLOCATOR : "glibc" (default) or "pool"
+    size_t pool_size;         // PY_MALLOC_TRACE_POOL_SIZE : address range reserved for the pool allocator
+
+    // Sampled guard page allocations
+    size_t guard_sample_rate; // PY_MALLOC_TRACE_GUARD_SAMPLE_RATE : place 1 in N allocations on average in guarded pages (0 : disabled)
+    size_t guard_slots;       // PY_MALLOC_TRACE_GUARD_SLOTS : max number of guarded blocks, live or recently freed
+};
+
+// Size classes for histograms : <=1, <=2, <=4, ... <=2^(NUM_SIZE_CLASSES-2), larger
+static const size_t NUM_SIZE_CLASSES = 33;
+
+static inline size_t get_size_class( size_t size )
+{
+    size_t size_class = size<=1 ? 0 : 64 - __builtin_clzll( size-1 );
+    return std::min( size_class, NUM_SIZE_CLASSES-1 );
+}
+
+// Counters written only by a single thread. Relaxed load and store instead of read-modify-write,
+// so that updating them is as cheap as plain variables, while other threads can still read them.
+struct ThreadCounter
+{
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> bytes;
+
+    inline void add( uint64_t size )
+    {
+        count.store( count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed );
+        bytes.store( bytes.load(std::memory_order_relaxed) + size, std::memory_order_relaxed );
+    }
+};
+
+// Allocations and frees of a thread, in the order of the thread. Single producer (the thread) and single consumer
+// (the flusher thread), so that adding an event is a plain store and a release store of the head.
+struct BlockLog
+{
+    static const uint64_t NUM_ENTRIES = 1 << 14; // must be power of 2
+
+    struct Entry
+    {
+        uintptr_t p;
+        uint64_t size;
+        uint64_t timestamp; // orders events of the same block across threads
+        uint32_t tag;
+        uint32_t op; // MallocOperation
+    };
+
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    Entry entries[NUM_ENTRIES];
+};
+
+// Per-thread heap accounting counters. Written only by the owner thread.
+// Frees are not counted here, as the freeing thread doesn't know which thread allocated the block without
+// a shared table. They go to the block log, and the flusher thread attributes them (see FreeAccounting).
+struct ThreadAccounting
+{
+    static const size_t MAX_THREADS = 1024;
+    static const size_t MAX_TAGS = 256;
+
+    ThreadCounter tag_allocated[MAX_TAGS];
+    ThreadCounter size_class_allocated[NUM_SIZE_CLASSES];
+    BlockLog block_log;
+};
+
+// Frees attributed to the thread and tag which allocated the block. Written only by the flusher thread.
+struct FreeAccounting
+{
+    ThreadCounter freed_for[ThreadAccounting::MAX_THREADS];
+    ThreadCounter tag_freed[ThreadAccounting::MAX_TAGS];
+    ThreadCounter size_class_freed[NUM_SIZE_CLASSES];
+};
+
+// Block log event waiting to be applied to the block table
+struct PendingBlockEvent
+{
+    BlockLog::Entry entry;
+    uint32_t owner; // ThreadState::slot
+};
+
+// Per-thread state. Allocated on the first traced event in the thread, and never freed,
+// so that other threads can read it at any time.
+struct ThreadState
+{
+    static const size_t MAX_THREADS = ThreadAccounting::MAX_THREADS;
+
+    pid_t tid;
+    uint32_t slot; // index in ThreadRegistry::threads
+    std::atomic<bool> alive;
+
+    // Flight recorder circular buffer. Written only by the owner thread.
+    MallocCallHistory * flight_entries;
+    std::atomic<uint64_t> flight_pos;
+
+    // Heap accounting. Written only by the owner thread.
+    ThreadCounter allocated;
+    ThreadAccounting * accounting;
+
+    // Thread names. "name" is updated by the flusher thread, "py_name" by py_malloc_trace.thread_stats().
+    char name[16];
+    char py_name[64];
+};
+
+struct ThreadRegistry
+{
+    static const size_t MAX_THREADS = ThreadState::MAX_THREADS;
+
+    std::mutex mutex;
+    pthread_key_t key;
+    ThreadState * threads[MAX_THREADS];
+    std::atomic<size_t> num_threads;
+};
+
+// Memory tags set from Python code (py_malloc_trace.tag). Names are interned once when tag objects are created,
+// and allocations refer to them by index. Tag 0 means "untagged".
+struct TagRegistry
+{
+    static const size_t MAX_TAGS = ThreadAccounting::MAX_TAGS;
+    static const size_t MAX_NAME_LEN = 64;
+
+    TagRegistry()
+        :
+        num_tags(1)
+    {
+    }
+
+    // Returns tag index, or 0 when the registry is full
+    uint32_t intern( const char * name )
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        size_t n = num_tags.load(std::memory_order_relaxed);
+        for( size_t i=1 ; i<n ; ++i )
+        {
+            if( strcmp( names[i], name )==0 )
+            {
+                return i;
+            }
+        }
+
+        if( n>=MAX_TAGS )
+        {
+            return 0;
+        }
+
+        snprintf( names[n], MAX_NAME_LEN, "%s", name );
+        num_tags.store( n+1, std::memory_order_release );
+        return n;
+    }
+
+    std::mutex mutex;
+    char names[MAX_TAGS][MAX_NAME_LEN];
+    std::atomic<size_t> num_tags;
+};
+
+// Sharded open addressing hash table keyed by pointer, used by the tables which are updated from inside malloc/free.
+// Entry must have a uintptr_t member p, and ShardData is extra state of each shard, protected by the shard lock.
+// Entries are stored in mmap-ed memory, so that the table doesn't call malloc itself.
+// Has no constructor, so that it is usable before static constructors run (all zero is the initial state).
+struct NoShardData
+{
+};
+
+template< typename Entry, typename ShardData = NoShardData >
+struct ShardedPointerMap
+{
+    static const size_t NUM_SHARDS = 64; // must be power of 2
+    static const size_t INITIAL_CAPACITY = 4096; // per shard, must be power of 2
+
+    static const uintptr_t EMPTY = 0;
+    static const uintptr_t DELETED = 1;
+
+    // Methods other than lock() are called with the shard locked
+    struct alignas(64) Shard : ShardData
+    {
+        void lock()
+        {
+            while( locked.exchange( true, std::memory_order_acquire ) )
+            {
+                sched_yield();
+            }
+        }
+
+        void unlock()
+        {
+            locked.store( false, std::memory_order_release );
+        }
+
+        // Returns the entry of p, or NULL
+        Entry * find( uint64_t h, uintptr_t p )
+        {
+            if( capacity==0 )
+            {
+                return NULL;
+            }
+
+            size_t index = h & (capacity-1);
+            while( entries[index].p != EMPTY )
+            {
+                if( entries[index].p == p )
+                {
+                    return &entries[index];
+                }
+                index = (index+1) & (capacity-1);
+            }
+            return NULL;
+        }
+
+        // Returns a slot for a new live entry, or NULL if the table couldn't grow. The caller fills it, including p.
+        // Doesn't look for an existing entry of the same pointer.
+        Entry * add( uint64_t h )
+        {
+            if( ( num_used + 1 ) * 2 > capacity && !grow() )
+            {
+                return NULL;
+            }
+
+            size_t index = h & (capacity-1);
+            while( entries[index].p > DELETED )
+            {
+                index = (index+1) & (capacity-1);
+            }
+
+            if( entries[index].p==EMPTY )
+            {
+                ++num_used;
+            }
+            ++num_live;
+            return &entries[index];
+        }
+
+        void remove( Entry * entry )
+        {
+            entry->p = DELETED;
+            --num_live;
+        }
+
+        // Rehash to a new array, dropping deleted entries
+        bool grow()
+        {
+            size_t new_capacity = INITIAL_CAPACITY;
+            while( new_capacity < num_live * 4 )
+            {
+                new_capacity <<= 1;
+            }
+
+            void * mem = mmap( NULL, sizeof(Entry) * new_capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if( mem==MAP_FAILED )
+            {
+                return false;
+            }
+
+            Entry * new_entries = (Entry*)mem;
+            for( size_t i=0 ; i<capacity ; ++i )
+            {
+                const Entry & entry = entries[i];
+                if( entry.p > DELETED )
+                {
+                    size_t index = hash(entry.p) & (new_capacity-1);
+                    while( new_entries[index].p != EMPTY )
+                    {
+                        index = (index+1) & (new_capacity-1);
+                    }
+                    new_entries[index] = entry;
+                }
+            }
+
+            if( entries )
+            {
+                munmap( entries, sizeof(Entry) * capacity );
+            }
+
+            entries = new_entries;
+            capacity = new_capacity;
+            num_used = num_live;
+            return true;
+        }
+
+        std::atomic<bool> locked;
+        Entry * entries;
+        size_t capacity;
+        size_t num_used; // entries other than EMPTY
+        size_t num_live; // entries other than EMPTY and DELETED
+    };
+
+    static inline uint64_t hash( uintptr_t p )
+    {
+        return ( p >> 4 ) * 0x9E3779B97F4A7C15ULL;
+    }
+
+    inline Shard & get_shard( uint64_t h )
+    {
+        return shards[ h >> 58 & (NUM_SHARDS-1) ];
+    }
+
+    void lock_all()
+    {
+        for( size_t i=0 ; i<NUM_SHARDS ; ++i )
+        {
+            shards[i].lock();
+        }
+    }
+
+    void unlock_all()
+    {
+        for( size_t i=0 ; i<NUM_SHARDS ; ++i )
+        {
+            shards[i].unlock();
+        }
+    }
+
+    Shard shards[NUM_SHARDS];
+};
+
+// Live memory blocks : pointer -> ( allocating thread, tag, size ).
+// Updated only by the flusher thread, from the block logs of all threads.
+struct BlockTable
+{
+    struct Entry
+    {
+        uintptr_t p;
+        uint64_t size;
+        uint32_t owner; // ThreadState::slot
+        uint32_t tag;
+    };
+
+    typedef ShardedPointerMap<Entry> Map;
+
+    void insert( void * p, uint64_t size, uint32_t owner, uint32_t tag )
+    {
+        uint64_t h = Map::hash( (uintptr_t)p );
+        Map::Shard & shard = map.get_shard(h);
+
+        shard.lock();
+
+        // The same pointer can't be live twice, so no need to look for an existing entry
+        Entry * entry = shard.add(h);
+        if( entry )
+        {
+            entry->p = (uintptr_t)p;
+            entry->size = size;
+            entry->owner = owner;
+            entry->tag = tag;
+        }
+
+        shard.unlock();
+    }
+
+    bool remove( void * p, Entry & removed )
+    {
+        uint64_t h = Map::hash( (uintptr_t)p );
+        Map::Shard & shard = map.get_shard(h);
+
+        shard.lock();
+
+        Entry * entry = shard.find( h, (uintptr_t)p );
+        if( entry )
+        {
+            removed = *entry;
+            shard.remove(entry);
+        }
+
+        shard.unlock();
+
+        return entry!=NULL;
+    }
+
+    Map map;
+};
+
+// Live and recently freed blocks for PY_MALLOC_TRACE_CHECK. Each shard of the map has its own quarantine ring
+// of freed blocks, so that a free takes a single shard lock.
+// Has no constructor, so that it is usable before static constructors run (all zero is the initial state).
+struct HeapChecker
+{
+    static const size_t QUARANTINE_CAPACITY = 4096; // blocks per shard
+
+    static const uint8_t POISON = 0xdf;
+    static const size_t MAX_EVICTIONS = 8;
+
+    struct Entry
+    {
+        uintptr_t p;
+        uint64_t size;
+        void * alloc_return_addr;
+        void * free_return_addr;
+        pid_t alloc_tid;
+        pid_t free_tid; // 0 : live, otherwise in quarantine
+    };
+
+    // FIFO of quarantined pointers. Quarantined blocks stay in the map until evicted.
+    struct Quarantine
+    {
+        uintptr_t * quarantine;
+        size_t quarantine_head;
+        size_t quarantine_count;
+        size_t quarantine_bytes;
+    };
+
+    typedef ShardedPointerMap<Entry,Quarantine> Map;
+
+    static const size_t NUM_SHARDS = Map::NUM_SHARDS;
+
+    // Register a new block. Returns false with the existing entry, if the block is already known,
+    // which means the allocator returned a live or quarantined block.
+    bool insert( const Entry & new_entry, Entry & existing )
+    {
+        uint64_t h = Map::hash(new_entry.p);
+        Map::Shard & shard = map.get_shard(h);
+
+        shard.lock();
+
+        Entry * entry = shard.find( h, new_entry.p );
+        if( entry )
+        {
+            existing = *entry;
+            shard.unlock();
+            return false;
+        }
+
+        if( !shard.quarantine )
+        {
+            void * mem = mmap( NULL, sizeof(uintptr_t) * QUARANTINE_CAPACITY, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if( mem==MAP_FAILED )
+            {
+                shard.unlock();
+                return true;
+            }
+            shard.quarantine = (uintptr_t*)mem;
+        }
+
+        entry = shard.add(h);
+        if( entry )
+        {
+            *entry = new_entry;
+        }
+
+        shard.unlock();
+        return true;
+    }
+
+    enum FreeResult
+    {
+        FreeResult_Quarantined,
+        FreeResult_Release,     // too large for the quarantine, free it now
+        FreeResult_DoubleFree,
+        FreeResult_Unknown,
+    };
+
+    bool lookup( uintptr_t p, Entry & entry_out )
+    {
+        uint64_t h = Map::hash(p);
+        Map::Shard & shard = map.get_shard(h);
+
+        shard.lock();
+        Entry * entry = shard.find( h, p );
+        if(entry)
+        {
+            entry_out = *entry;
+        }
+        shard.unlock();
+
+        return entry!=NULL;
+    }
+
+    // Move a live block to the quarantine, and poison it. entry_out receives the entry of the block.
+    // Blocks evicted from the quarantine are returned in evicted, to be verified and freed by the caller.
+    FreeResult quarantine( uintptr_t p, void * return_addr, pid_t tid, Entry & entry_out, Entry * evicted, size_t & num_evicted )
+    {
+        uint64_t h = Map::hash(p);
+        Map::Shard & shard = map.get_shard(h);
+        num_evicted = 0;
+
+        shard.lock();
+
+        Entry * entry = shard.find( h, p );
+        if( !entry )
+        {
+            shard.unlock();
+            return FreeResult_Unknown;
+        }
+
+        if( entry->free_tid!=0 )
+        {
+            entry_out = *entry;
+            shard.unlock();
+            return FreeResult_DoubleFree;
+        }
+
+        entry->free_return_addr = return_addr;
+        entry->free_tid = tid;
+        entry_out = *entry;
+
+        if( entry->size > quarantine_bytes_per_shard )
+        {
+            shard.remove(entry);
+            shard.unlock();
+            return FreeResult_Release;
+        }
+
+        // Poison while the block can't be reused
+        memset( (void*)p, POISON, entry->size );
+
+        shard.quarantine[ ( shard.quarantine_head + shard.quarantine_count ) % QUARANTINE_CAPACITY ] = p;
+        shard.quarantine_count ++;
+        shard.quarantine_bytes += entry->size;
+
+        while( num_evicted < MAX_EVICTIONS
+            && ( shard.quarantine_count==QUARANTINE_CAPACITY || shard.quarantine_bytes > quarantine_bytes_per_shard ) )
+        {
+            uintptr_t oldest = shard.quarantine[shard.quarantine_head];
+            shard.quarantine_head = ( shard.quarantine_head + 1 ) % QUARANTINE_CAPACITY;
+            shard.quarantine_count --;
+
+            Entry * oldest_entry = shard.find( Map::hash(oldest), oldest );
+            evicted[num_evicted++] = *oldest_entry;
+            shard.quarantine_bytes -= oldest_entry->size;
+            shard.remove(oldest_entry);
+        }
+
+        shard.unlock();
+        return FreeResult_Quarantined;
+    }
+
+    // Call func for each block in the quarantine, with the shard locked
+    template< typename F >
+    void for_each_quarantined( F func )
+    {
+        for( size_t i=0 ; i<NUM_SHARDS ; ++i )
+        {
+            Map::Shard & shard = map.shards[i];
+            shard.lock();
+            for( size_t j=0 ; j<shard.quarantine_count ; ++j )
+            {
+                uintptr_t p = shard.quarantine[ ( shard.quarantine_head + j ) % QUARANTINE_CAPACITY ];
+                func( *shard.find( Map::hash(p), p ) );
+            }
+            shard.unlock();
+        }
+    }
+
+    bool enabled;
+    bool abort_on_error;
+    size_t quarantine_bytes_per_shard;
+    uintptr_t untracked_heap_start; // blocks allocated before checking started are in this range
+    uintptr_t untracked_heap_end;
+    size_t page_size; // to validate mmap-ed chunks allocated before checking started
+    std::atomic<size_t> num_errors;
+    Map map;
+};
+
+// Pages for sampled guarded allocations (PY_MALLOC_TRACE_GUARD_SAMPLE_RATE). Each block gets a page of its own,
+// placed against the inaccessible page before or after it, and the page becomes inaccessible when the block is freed.
+// Out of bounds accesses and accesses after free then fault immediately, and the fault handler looks up the block here.
+//
+// Slot i is page 2i+1 of the reserved range. Even pages are guard pages, and are never accessible.
+struct GuardedAllocator
+{
+    static const size_t MAX_FRAMES = 16;
+
+    struct Slot
+    {
+        uintptr_t p; // 0 : never used
+        size_t size;
+        pid_t alloc_tid;
+        pid_t free_tid; // 0 : live
+        int num_alloc_frames;
+        int num_free_frames;
+        void * alloc_frames[MAX_FRAMES];
+        void * free_frames[MAX_FRAMES];
+    };
+
+    GuardedAllocator()
+        :
+        base(0),
+        region_size(0),
+        page_size(0),
+        num_slots(0),
+        sample_rate(0),
+        slots(NULL),
+        free_slots(NULL),
+        free_head(0),
+        free_count(0),
+        locked(false),
+        num_sampled(0)
+    {
+    }
+
+    bool init( size_t rate, size_t max_slots )
+    {
+        if( rate==0 || max_slots==0 )
+        {
+            return false;
+        }
+
+        page_size = sysconf(_SC_PAGESIZE);
+        num_slots = max_slots;
+        size_t size = ( 2 * num_slots + 1 ) * page_size;
+
+        void * p = mmap( NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+        if( p==MAP_FAILED )
+        {
+            return false;
+        }
+
+        size_t table_size = num_slots * ( sizeof(Slot) + sizeof(uint32_t) );
+        void * table = mmap( NULL, table_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( table==MAP_FAILED )
+        {
+            munmap( p, size );
+            return false;
+        }
+
+        slots = (Slot*)table;
+        free_slots = (uint32_t*)( slots + num_slots );
+        for( size_t i=0 ; i<num_slots ; ++i )
+        {
+            free_slots[i] = (uint32_t)i;
+        }
+        free_count = num_slots;
+
+        // Ownership checks start to succeed from here
+        base = (uintptr_t)p;
+        region_size = size;
+        sample_rate = rate;
+        return true;
+    }
+
+    inline bool is_enabled() const
+    {
+        return sample_rate!=0;
+    }
+
+    inline bool owns( const void * p ) const
+    {
+        return (uintptr_t)p - base < region_size;
+    }
+
+    // Returns NULL for guard pages (even page indices, including the last page), which never contain a block
+    inline Slot * slot_of( const void * p )
+    {
+        size_t page_index = ( (uintptr_t)p - base ) / page_size;
+        if( page_index % 2 == 0 )
+        {
+            return NULL;
+        }
+        return &slots[ page_index / 2 ];
+    }
+
+    inline uintptr_t slot_page( size_t index ) const
+    {
+        return base + ( 2 * index + 1 ) * page_size;
+    }
+
+    // Returns NULL when the size doesn't fit in a page, or all slots are in use.
+    // The block is placed at the start of the page when place_left, otherwise at the end (rounded to 16 bytes alignment).
+    // Zero sized blocks are padded like 1 byte blocks, so that the pointer is in the slot page, not in the guard page.
+    void * allocate( size_t size, bool place_left, pid_t tid, void * const * frames, int num_frames )
+    {
+        if( size > page_size )
+        {
+            return NULL;
+        }
+
+        lock();
+        if( free_count==0 )
+        {
+            unlock();
+            return NULL;
+        }
+        uint32_t index = free_slots[free_head];
+        free_head = ( free_head + 1 ) % num_slots;
+        free_count --;
+        unlock();
+
+        uintptr_t page = slot_page(index);
+        if( mprotect( (void*)page, page_size, PROT_READ | PROT_WRITE )!=0 )
+        {
+            push_free_slot(index);
+            return NULL;
+        }
+
+        Slot & slot = slots[index];
+        size_t padded_size = ( ( size ? size : 1 ) + 15 ) & ~(size_t)15;
+        slot.p = place_left ? page : page + page_size - padded_size;
+        slot.size = size;
+        slot.alloc_tid = tid;
+        slot.free_tid = 0;
+        slot.num_alloc_frames = num_frames;
+        slot.num_free_frames = 0;
+        memcpy( slot.alloc_frames, frames, num_frames * sizeof(void*) );
+        num_sampled.fetch_add( 1, std::memory_order_relaxed );
+        return (void*)slot.p;
+    }
+
+    // Returns false if p is not a live block
+    bool release( void * p, pid_t tid, void * const * frames, int num_frames )
+    {
+        Slot * slot_ptr = slot_of(p);
+        if( slot_ptr==NULL )
+        {
+            return false;
+        }
+        Slot & slot = *slot_ptr;
+
+        lock();
+        if( slot.p!=(uintptr_t)p || slot.free_tid!=0 )
+        {
+            unlock();
+            return false;
+        }
+        slot.free_tid = tid;
+        slot.num_free_frames = num_frames;
+        memcpy( slot.free_frames, frames, num_frames * sizeof(void*) );
+        unlock();
+
+        // The page content is discarded, and reads as zero when the slot is used again
+        uintptr_t page = slot.p & ~(uintptr_t)( page_size - 1 );
+        mprotect( (void*)page, page_size, PROT_NONE );
+        madvise( (void*)page, page_size, MADV_DONTNEED );
+
+        // Freed slots are reused in FIFO order, so that accesses after free are detected as long as possible
+        push_free_slot( &slot - slots );
+        return true;
+    }
+
+    void push_free_slot( size_t index )
+    {
+        lock();
+        free_slots[ ( free_head + free_count ) % num_slots ] = (uint32_t)index;
+        free_count ++;
+        unlock();
+    }
+
+    void lock()
+    {
+        while( locked.exchange( true, std::memory_order_acquire ) )
+        {
+            sched_yield();
+        }
+    }
+
+    void unlock()
+    {
+        locked.store( false, std::memory_order_release );
+    }
+
+    uintptr_t base;
+    size_t region_size;
+    size_t page_size;
+    size_t num_slots;
+    size_t sample_rate;
+    Slot * slots;
+    uint32_t * free_slots; // FIFO of free slot indices
+    size_t free_head;
+    size_t free_count;
+    std::atomic<bool> locked;
+    std::atomic<size_t> num_sampled;
+    struct sigaction prev_segv_action; // chained from the fault handler
+};
+
+// Key to aggregate statistics per callsite
+struct CallsiteKey
+{
+    CallsiteKey( const MallocCallHistory & entry )
+    {
+        memcpy( return_addr, entry.return_addr, sizeof(return_addr) );
+    }
+
+    bool operator==( const CallsiteKey & other ) const
+    {
+        return memcmp( return_addr, other.return_addr, sizeof(return_addr) )==0;
+    }
+
+    struct Hash
+    {
+        size_t operator()( const CallsiteKey & key ) const
+        {
+            size_t h = 0;
+            for( size_t level=0 ; level<NUM_RETURN_ADDR_LEVELS ; ++level )
+            {
+                h = h * 31 + std::hash<void*>()( key.return_addr[level] );
+            }
+            return h;
+        }
+    };
+
+    void * return_addr[NUM_RETURN_ADDR_LEVELS];
+};
+
+// Holds allocations until they get older than Config::min_age. When they are freed before that,
+// both alloc and free are dropped, and only counted in per-callsite churn counters.
+struct ShortLivedFilter
+{
+    // Lifetime buckets : <10us, <100us, <1ms, <10ms, <100ms, <1s, <10s, >=10s
+    static const size_t NUM_LIFETIME_BUCKETS = 8;
+
+    struct ChurnCounter
+    {
+        ChurnCounter()
+            :
+            count(0),
+            bytes(0),
+            cross_thread(0)
+        {
+            memset( lifetime_hist, 0, sizeof(lifetime_hist) );
+            memset( size_hist, 0, sizeof(size_hist) );
+        }
+
+        void add( const MallocCallHistory & alloc, const MallocCallHistory & free )
+        {
+            count ++;
+            bytes += alloc.size;
+
+            if( alloc.tid!=free.tid )
+            {
+                cross_thread ++;
+            }
+
+            size_t lifetime_bucket = 0;
+            for( uint64_t limit = 10000 ; free.timestamp - alloc.timestamp >= limit && lifetime_bucket<NUM_LIFETIME_BUCKETS-1 ; limit *= 10 )
+            {
+                lifetime_bucket ++;
+            }
+            lifetime_hist[lifetime_bucket] ++;
+
+            size_hist[ get_size_class(alloc.size) ] ++;
+        }
+
+        uint64_t count;
+        uint64_t bytes;
+        uint64_t cross_thread; // freed by a different thread
+        uint64_t lifetime_hist[NUM_LIFETIME_BUCKETS];
+        uint64_t size_hist[NUM_SIZE_CLASSES];
+    };
+
+    std::unordered_map< void*, MallocCallHistory > pending;
+    std::deque< std::pair< void*, uint64_t > > pending_order; // (pointer, timestamp) in allocation order
+    std::unordered_map< CallsiteKey, ChurnCounter, CallsiteKey::Hash > churn;
+    uint64_t last_churn_flush_time;
+};
+
+// Delta encoding state of the event block being built (binary format only)
+struct EventBlock
+{
+    EventBlock()
+        :
+        num_events(0),
+        first_event(0),
+        start_time(0)
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        raw.clear();
+        num_events = 0;
+        prev_p = 0;
+        prev_tid = 0;
+        prev_timestamp = 0;
+        memset( prev_return_addr, 0, sizeof(prev_return_addr) );
+    }
+
+    std::string raw;
+    uint32_t num_events;
+    uint64_t first_event;
+    uint64_t start_time;
+
+    uint64_t prev_p;
+    pid_t prev_tid;
+    uint64_t prev_timestamp;
+    uint64_t prev_return_addr[NUM_RETURN_ADDR_LEVELS];
+};
+
+// Compact lookup structure of record-time filters. Built by the flusher thread from the module map,
+// and published with an atomic pointer. Tables are immutable once published, and never freed.
+struct RecordFilter
+{
+    static const size_t MAX_RANGES = 64;
+
+    struct Range
+    {
+        uintptr_t start;
+        uintptr_t end;
+        bool include;
+    };
+
+    // Returns true if the allocation should be recorded
+    inline bool accept( size_t size, void * return_addr ) const
+    {
+        if( size < min_size )
+        {
+            return false;
+        }
+
+        uintptr_t addr = (uintptr_t)return_addr;
+        for( size_t i=0 ; i<num_ranges ; ++i )
+        {
+            if( ranges[i].start <= addr && addr < ranges[i].end )
+            {
+                return ranges[i].include;
+            }
+        }
+
+        return default_accept;
+    }
+
+    bool operator==( const RecordFilter & other ) const
+    {
+        return min_size==other.min_size
+            && default_accept==other.default_accept
+            && num_ranges==other.num_ranges
+            && memcmp( ranges, other.ranges, sizeof(Range) * num_ranges )==0;
+    }
+
+    size_t min_size;
+    bool default_accept;
+    size_t num_ranges;
+    Range ranges[MAX_RANGES];
+};
+
+// Per-callsite rate limiter. Callsites are hashed into fixed number of slots without locking,
+// so callsites colliding in a slot share the budget.
+struct CallsiteRateLimiter
+{
+    static const size_t NUM_SLOTS = 4096;
+
+    struct Slot
+    {
+        std::atomic<uint32_t> window;
+        std::atomic<uint32_t> count;
+    };
+
+    inline bool accept( void * return_addr, uint64_t timestamp, size_t limit )
+    {
+        Slot & slot = slots[ ( ( (uintptr_t)return_addr >> 2 ) * 2654435761U ) & (NUM_SLOTS-1) ];
+
+        uint32_t window = (uint32_t)( timestamp >> 30 ); // ~1 second
+        if( slot.window.load(std::memory_order_relaxed) != window )
+        {
+            slot.window.store( window, std::memory_order_relaxed );
+            slot.count.store( 0, std::memory_order_relaxed );
+        }
+
+        return slot.count.fetch_add( 1, std::memory_order_relaxed ) < limit;
+    }
+
+    Slot slots[NUM_SLOTS];
+};
+
+struct Globals
+{
+    Globals()
+        :
+        enabled(false),
+        record_filter(NULL),
+        flight_dump_requested(false),
+        num_flight_dumps(0),
+        pid(0),
+        parent_pid(0),
+        fork_time(0),
+        restart_after_fork(false),
+        flusher_running(false),
+        flusher_stop_requested(false),
+        fd(-1),
+        segment_index(0),
+        segment_size(0),
+        segment_header_size(0),
+        num_events(0)
+    {
+    }
+
+    bool enabled;
+    Config config;
+    TraceRing ring;
+    std::atomic<const RecordFilter*> record_filter;
+    CallsiteRateLimiter rate_limiter;
+    ThreadRegistry thread_registry;
+    TagRegistry tag_registry;
+    BlockTable block_table;
+    FreeAccounting freed;
+    PoolAllocator pool;
+    GuardedAllocator guard;
+
+    // Flight recorder dump requests and completions
+    std::atomic<bool> flight_dump_requested;
+    std::atomic<size_t> num_flight_dumps;
+    char last_flight_dump_filename[512];
+
+    // Process which owns the flusher thread. Forked child processes start their own flusher lazily.
+    pid_t pid;
+    pid_t parent_pid;
+    uint64_t fork_time;
+    std::atomic<bool> restart_after_fork;
+
+    pthread_t flusher;
+    std::atomic<bool> flusher_running;
+    std::atomic<bool> flusher_stop_requested;
+
+    // Held by the flusher thread while it updates following members, so that fork() doesn't copy them half-updated
+    std::mutex flusher_mutex;
+
+    // Following members are accessed only by the flusher thread
+    std::string output_base; // output_prefix without pid
+    std::string output_prefix;
+    int fd;
+    size_t segment_index;
+    size_t segment_size;
+    size_t segment_header_size;
+    std::string write_buf;
+    uint64_t num_events;
+    EventBlock event_block;
+    std::string compress_buf;
+    ShortLivedFilter short_lived;
+    std::vector<PendingBlockEvent> block_events; // sorted by timestamp
+};
+
+static Globals g;
+
+// Outside of Globals, as checking starts before static constructors
+static HeapChecker checker;
+
+// Set for the flusher thread, so that its own allocations are not traced
+static __thread bool t_in_tracer = false;
+
+static __thread ThreadState * t_state = NULL;
+
+// Cached thread id. Reset in forked child processes.
+static __thread pid_t t_tid = 0;
+
+// Memory tag stack of the thread, pushed and popped by py_malloc_trace.tag objects
+static const size_t MAX_TAG_DEPTH = 32;
+static __thread uint32_t t_current_tag = 0;
+static __thread uint32_t t_tag_stack[MAX_TAG_DEPTH];
+static __thread size_t t_tag_depth = 0;
+
+// ---
+
+static inline uint64_t get_timestamp()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Read size from environment variable. Accepts K/M/G suffixes.
+static size_t get_env_size( const char * name, size_t default_value )
+{
+    const char * s = getenv(name);
+    if( s==NULL || s[0]=='\0' )
+    {
+        return default_value;
+    }
+
+    char * end;
+    size_t value = strtoull( s, &end, 10 );
+    switch(*end)
+    {
+    case 'k': case 'K': value <<= 10; break;
+    case 'm': case 'M': value <<= 20; break;
+    case 'g': case 'G': value <<= 30; break;
+    }
+
+    return value;
+}
+
+static inline int format_malloc_call_history( char * buf, int bufsize, const MallocCallHistory & entry )
+{
+    char * p = buf;
+    bufsize -= 1;
+    int len;
+
+    len = snprintf( p, bufsize, "{\"op\":%d,\"p\":\"%p\",\"size\":%zd,\"t\":%llu,\"tid\":%d,\"return_addr\":[", 
+        entry.op,
+        entry.p,
+        entry.size,
+        (unsigned long long)entry.timestamp,
+        entry.tid );
+    p += len;
+    bufsize -= len;
+
+    for( size_t level=0 ; level<NUM_RETURN_ADDR_LEVELS ; ++level )
+    {
+        const char * format;
+        if( level<NUM_RETURN_ADDR_LEVELS-1 )
+        {
+            format = "\"%p\",";
+        }
+        else
+        {
+            format = "\"%p\"";
+        }
+        len = snprintf( p, bufsize, format, entry.return_addr[level] );
+        p += len;
+        bufsize -= len;
+    }
+
+    len = snprintf( p, bufsize, "]}\n" );
+    p += len;
+    bufsize -= len;
+
+    return (p - buf);
+}
+
+static void on_thread_exit( void * arg )
+{
+    ThreadState * state = (ThreadState*)arg;
+
+    // Keep the name for reports after the thread exits
+    pthread_getname_np( pthread_self(), state->name, sizeof(state->name) );
+
+    state->alive = false;
+}
+
+static ThreadState * register_thread()
+{
+    // Allocations inside this function must not be traced
+    bool in_tracer = t_in_tracer;
+    t_in_tracer = true;
+
+    ThreadRegistry & registry = g.thread_registry;
+    ThreadState * state = NULL;
+
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        size_t num_threads = registry.num_threads.load(std::memory_order_relaxed);
+        if( num_threads < ThreadRegistry::MAX_THREADS )
+        {
+            state = (ThreadState*)mmap( NULL, sizeof(ThreadState), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if( state==MAP_FAILED )
+            {
+                state = NULL;
+            }
+            else
+            {
+                if( g.config.mode==TraceMode_FlightRecorder )
+                {
+                    void * p = mmap( NULL, sizeof(MallocCallHistory) * g.config.flight_events, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+                    state->flight_entries = ( p==MAP_FAILED ) ? NULL : (MallocCallHistory*)p;
+                }
+
+                if( g.config.thread_stats_interval>0 )
+                {
+                    void * p = mmap( NULL, sizeof(ThreadAccounting), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+                    state->accounting = ( p==MAP_FAILED ) ? NULL : (ThreadAccounting*)p;
+                }
+
+                state->slot = num_threads;
+                registry.threads[num_threads] = state;
+                registry.num_threads.store( num_threads+1, std::memory_order_release );
+            }
+        }
+        else
+        {
+            // Too many threads. Reuse a state of exited thread.
+            // Heap accounting counters are not reset, as other threads may still free blocks allocated by the exited thread.
+            for( size_t i=0 ; i<num_threads ; ++i )
+            {
+                if( !registry.threads[i]->alive )
+                {
+                    state = registry.threads[i];
+                    state->flight_pos = 0;
+                    break;
+                }
+            }
+        }
+
+        if( state )
+        {
+            state->tid = syscall(SYS_gettid);
+            state->alive = true;
+            state->py_name[0] = '\0';
+        }
+    }
+
+    t_state = state;
+    if( state )
+    {
+        pthread_setspecific( registry.key, state );
+    }
+
+    t_in_tracer = in_tracer;
+
+    return state;
+}
+
+static inline ThreadState * get_thread_state()
+{
+    if( t_state )
+    {
+        return t_state;
+    }
+
+    return register_thread();
+}
+
+static inline void record_flight_event( const MallocCallHistory & entry )
+{
+    ThreadState * state = get_thread_state();
+    if( !state || !state->flight_entries )
+    {
+        return;
+    }
+
+    uint64_t pos = state->flight_pos.load(std::memory_order_relaxed);
+    state->flight_entries[ pos & (g.config.flight_events-1) ] = entry;
+    state->flight_pos.store( pos+1, std::memory_order_release );
+}
+
+// Count allocations for the current thread and tag, and log allocations and frees for the flusher thread,
+// which attributes frees to the thread and tag which allocated the block
+static inline void account_malloc_call( MallocOperation op, void * p, size_t size, uint64_t timestamp )
+{
+    if( p==NULL )
+    {
+        return;
+    }
+
+    ThreadState * state = get_thread_state();
+    if( !state || !state->accounting )
+    {
+        return;
+    }
+
+    if( op==MallocOperation_Alloc )
+    {
+        state->allocated.add(size);
+        state->accounting->tag_allocated[t_current_tag].add(size);
+        state->accounting->size_class_allocated[ get_size_class(size) ].add(size);
+    }
+
+    BlockLog & log = state->accounting->block_log;
+    uint64_t head = log.head.load(std::memory_order_relaxed);
+
+    // Wait for the flusher thread when the log is full, as a lost event would break the attribution
+    while( head - log.tail.load(std::memory_order_acquire) >= BlockLog::NUM_ENTRIES )
+    {
+        if( !g.flusher_running.load(std::memory_order_relaxed) )
+        {
+            return;
+        }
+        sched_yield();
+    }
+
+    BlockLog::Entry & entry = log.entries[ head & (BlockLog::NUM_ENTRIES-1) ];
+    entry.p = (uintptr_t)p;
+    entry.size = size;
+    entry.timestamp = timestamp;
+    entry.tag = t_current_tag;
+    entry.op = op;
+    log.head.store( head+1, std::memory_order_release );
+}
+
+static void malloc_trace_restart_after_fork();
+
+static inline void write_malloc_call_history( MallocOperation op, void * p, size_t size, void * return_addr )
+{
+    if(!g.enabled)
+    {
+        // First traced event in a forked child process
+        if( !g.restart_after_fork || t_in_tracer )
+        {
+            return;
+        }
+
+        malloc_trace_restart_after_fork();
+
+        if(!g.enabled)
+        {
+            return;
+        }
+    }
+
+    if(t_in_tracer)
+    {
+        return;
+    }
+
+    // Allocation events are timestamped after the allocation, and free events before the free, so that
+    // timestamps order the events of a block, even when it is freed and allocated again by other threads
+    uint64_t timestamp = 0;
+    if( g.config.thread_stats_interval>0 )
+    {
+        timestamp = get_timestamp();
+        account_malloc_call( op, p, size, timestamp );
+    }
+
+    const RecordFilter * filter = g.record_filter.load(std::memory_order_acquire);
+    if( filter && op==MallocOperation_Alloc && !filter->accept( size, return_addr ) )
+    {
+        return;
+    }
+
+    MallocCallHistory new_entry;
+
+    if( t_tid==0 )
+    {
+        t_tid = syscall(SYS_gettid);
+    }
+
+    new_entry.op = op;
+    new_entry.tid = t_tid;
+    new_entry.p = p;
+    new_entry.size = size;
+    new_entry.timestamp = timestamp ? timestamp : get_timestamp();
+
+    if( g.config.callsite_rate_limit>0 && op==MallocOperation_Alloc
+        && !g.rate_limiter.accept( return_addr, new_entry.timestamp, g.config.callsite_rate_limit ) )
+    {
+        return;
+    }
+
+    #if defined(USE_BUILTIN_RETURN_ADDR)
+    new_entry.return_addr[0] = return_addr;
+    #else //defined(USE_BUILTIN_RETURN_ADDR)
+    if(NUM_RETURN_ADDR_LEVELS>0)
+    {
+        void * bt[NUM_RETURN_ADDR_LEVELS+1] = {0};
+        backtrace( bt, sizeof(bt)/sizeof(bt[0]) );
+        for( size_t level=0 ; level<NUM_RETURN_ADDR_LEVELS ; ++level )
+        {
+            new_entry.return_addr[level] = bt[level+1];
+        }
+    }
+    #endif //defined(USE_BUILTIN_RETURN_ADDR)
+
+    if( g.config.mode==TraceMode_FlightRecorder )
+    {
+        record_flight_event( new_entry );
+    }
+    else
+    {
+        g.ring.push( new_entry, g.flusher_running );
+    }
+}
+
+#if defined(USE_MALLOC_HISTORY)
+#define ADD_MALLOC_CALL_HISTORY(op,p,size) write_malloc_call_history(op,p,size,__builtin_return_address(0))
+#else //defined(USE_MALLOC_HISTORY)
+#define ADD_MALLOC_CALL_HISTORY(op,p,size) (void)0
+#endif //defined(USE_MALLOC_HISTORY)
+
+// ---
+
+// Following functions run in the flusher thread
+
+static void write_fully( int fd, const char * buf, size_t len )
+{
+    while( len>0 )
+    {
+        ssize_t result = write( fd, buf, len );
+        if( result<=0 )
+        {
+            if( result<0 && errno==EINTR )
+            {
+                continue;
+            }
+            return;
+        }
+        buf += result;
+        len -= result;
+    }
+}
+
+static std::string get_segment_filename( size_t segment_index )
+{
+    char filename[512];
+    const char * extension = g.config.format==TraceFormat_LZ ? "lz" : "log";
+
+    if( g.config.max_segment_size==0 )
+    {
+        snprintf( filename, sizeof(filename), "%s.%s", g.output_prefix.c_str(), extension );
+    }
+    else
+    {
+        snprintf( filename, sizeof(filename), "%s.%04zd.%s", g.output_prefix.c_str(), segment_index, extension );
+    }
+
+    return filename;
+}
+
+// Call func( start, end, offset, path ) for each executable mapping of /proc/self/maps
+template<typename F>
+static void for_each_executable_mapping( F func )
+{
+    FILE * fp = fopen( "/proc/self/maps", "r" );
+    if(!fp)
+    {
+        return;
+    }
+
+    char line[1024];
+    while( fgets( line, sizeof(line), fp ) )
+    {
+        unsigned long long start, end, offset;
+        char mode[8];
+        int path_pos = 0;
+
+        if( sscanf( line, "%llx-%llx %7s %llx %*s %*s %n", &start, &end, mode, &offset, &path_pos ) < 4 || path_pos==0 )
+        {
+            continue;
+        }
+
+        char * path = line + path_pos;
+        path[strcspn(path,"\n")] = '\0';
+
+        if( strchr(mode,'x')==NULL || path[0]!='/' )
+        {
+            continue;
+        }
+
+        func( start, end, offset, path );
+    }
+
+    fclose(fp);
+}
+
+// Append executable mappings of /proc/self/maps, so that each segment can be symbolized by itself
+static void format_module_map( std::string & out )
+{
+    for_each_executable_mapping( [&]( unsigned long long start, unsigned long long end, unsigned long long offset, const char * path )
+    {
+        char buf[1024+128];
+        snprintf( buf, sizeof(buf), "{\"type\":\"module\",\"start\":\"0x%llx\",\"end\":\"0x%llx\",\"offset\":\"0x%llx\",\"path\":\"%s\"}\n",
+            start, end, offset, path );
+        out += buf;
+    });
+}
+
+// Check if path contains any of comma separated names
+static bool match_module_names( const char * path, const std::string & names )
+{
+    size_t pos = 0;
+    while( pos < names.size() )
+    {
+        size_t end = names.find( ',', pos );
+        if( end==std::string::npos )
+        {
+            end = names.size();
+        }
+
+        std::string name = names.substr( pos, end-pos );
+        if( !name.empty() && strstr( path, name.c_str() ) )
+        {
+            return true;
+        }
+
+        pos = end + 1;
+    }
+
+    return false;
+}
+
+// Build the record filter from the current module map, and publish it if it changed.
+// Modules can be loaded after tracing started, so this is called periodically.
+static void update_record_filter()
+{
+    if( !g.config.has_record_filter() )
+    {
+        return;
+    }
+
+    RecordFilter * filter = new RecordFilter();
+    filter->min_size = g.config.min_size;
+    filter->default_accept = g.config.include_modules.empty();
+    filter->num_ranges = 0;
+
+    for_each_executable_mapping( [&]( unsigned long long start, unsigned long long end, unsigned long long offset, const char * path )
+    {
+        bool include;
+        if( match_module_names( path, g.config.exclude_modules ) )
+        {
+            include = false;
+        }
+        else if( match_module_names( path, g.config.include_modules ) )
+        {
+            include = true;
+        }
+        else
+        {
+            return;
+        }
+
+        if( filter->num_ranges < RecordFilter::MAX_RANGES )
+        {
+            RecordFilter::Range & range = filter->ranges[filter->num_ranges++];
+            range.start = start;
+            range.end = end;
+            range.include = include;
+        }
+    });
+
+    const RecordFilter * current = g.record_filter.load(std::memory_order_relaxed);
+    if( current && *current==*filter )
+    {
+        delete filter;
+        return;
+    }
+
+    // The previous table is leaked intentionally, as allocating threads may still be reading it
+    g.record_filter.store( filter, std::memory_order_release );
+}
+
+static void append_block( std::string & out, TraceBlockType type, const std::string & raw, uint32_t num_events, uint64_t first_event )
+{
+    TraceBlockHeader header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, TRACE_BLOCK_MAGIC, sizeof(header.magic) );
+    header.type = type;
+    header.raw_size = raw.size();
+    header.num_events = num_events;
+    header.first_event = first_event;
+
+    g.compress_buf.resize( raw.size() );
+    size_t compressed_size = lz_compress( (const uint8_t*)raw.data(), raw.size(), (uint8_t*)&g.compress_buf[0], g.compress_buf.size() );
+
+    if( compressed_size>0 )
+    {
+        header.codec = TraceBlockCodec_LZ;
+        header.compressed_size = compressed_size;
+        out.append( (const char*)&header, sizeof(header) );
+        out.append( g.compress_buf.data(), compressed_size );
+    }
+    else
+    {
+        header.codec = TraceBlockCodec_Stored;
+        header.compressed_size = raw.size();
+        out.append( (const char*)&header, sizeof(header) );
+        out.append( raw );
+    }
+}
+
+static void end_write_record( size_t record_start );
+
+// Append JSON lines of meta records, wrapping them in a meta block for the binary format
+static void append_meta( std::string & out, const std::string & text )
+{
+    if( g.config.format==TraceFormat_LZ )
+    {
+        append_block( out, TraceBlockType_Meta, text, 0, 0 );
+    }
+    else
+    {
+        out += text;
+    }
+}
+
+// Append meta records to the write buffer, as a record of their own
+static void append_meta_record( const std::string & text )
+{
+    size_t record_start = g.write_buf.size();
+    append_meta( g.write_buf, text );
+    end_write_record(record_start);
+}
+
+static void append_event( const MallocCallHistory & entry )
+{
+    if( g.config.format==TraceFormat_LZ )
+    {
+        EventBlock & block = g.event_block;
+
+        if( block.num_events==0 )
+        {
+            block.first_event = g.num_events;
+            block.start_time = get_timestamp();
+        }
+
+        uint64_t p = (uint64_t)entry.p;
+
+        block.raw.push_back( (char)entry.op );
+        put_varint( block.raw, zigzag_encode( (int64_t)entry.tid - (int64_t)block.prev_tid ) );
+        put_varint( block.raw, zigzag_encode( (int64_t)( p - block.prev_p ) ) );
+        put_varint( block.raw, entry.size );
+        put_varint( block.raw, zigzag_encode( (int64_t)( entry.timestamp - block.prev_timestamp ) ) );
+        for( size_t level=0 ; level<NUM_RETURN_ADDR_LEVELS ; ++level )
+        {
+            uint64_t return_addr = (uint64_t)entry.return_addr[level];
+            put_varint( block.raw, zigzag_encode( (int64_t)( return_addr - block.prev_return_addr[level] ) ) );
+            block.prev_return_addr[level] = return_addr;
+        }
+
+        block.prev_p = p;
+        block.prev_tid = entry.tid;
+        block.prev_timestamp = entry.timestamp;
+        block.num_events ++;
+    }
+    else
+    {
+        char buf[1024];
+        int len = format_malloc_call_history( buf, sizeof(buf), entry );
+        size_t record_start = g.write_buf.size();
+        g.write_buf.append( buf, len );
+        end_write_record(record_start);
+    }
+
+    g.num_events ++;
+}
+
+// Compress the event block being built, and move it to the write buffer
+static void finish_event_block()
+{
+    EventBlock & block = g.event_block;
+
+    if( block.num_events==0 )
+    {
+        return;
+    }
+
+    size_t record_start = g.write_buf.size();
+    append_block( g.write_buf, TraceBlockType_Events, block.raw, block.num_events, block.first_event );
+    end_write_record(record_start);
+    block.reset();
+}
+
+static void process_event( const MallocCallHistory & entry )
+{
+    if( g.config.min_age==0 )
+    {
+        append_event(entry);
+        return;
+    }
+
+    ShortLivedFilter & filter = g.short_lived;
+
+    if( entry.op==MallocOperation_Alloc )
+    {
+        if( entry.p==NULL )
+        {
+            return;
+        }
+
+        auto it = filter.pending.find(entry.p);
+        if( it!=filter.pending.end() )
+        {
+            // Missed free. Don't lose the history.
+            append_event(it->second);
+        }
+
+        filter.pending[entry.p] = entry;
+        filter.pending_order.push_back( std::make_pair( entry.p, entry.timestamp ) );
+    }
+    else
+    {
+        if( entry.p==NULL )
+        {
+            return;
+        }
+
+        auto it = filter.pending.find(entry.p);
+        if( it!=filter.pending.end() )
+        {
+            // The allocation may still be pending after min_age, when the flusher thread is behind.
+            // Only blocks freed within min_age are cancelled.
+            if( entry.timestamp < it->second.timestamp + g.config.min_age )
+            {
+                filter.churn[ CallsiteKey(it->second) ].add( it->second, entry );
+            }
+            else
+            {
+                append_event(it->second);
+                append_event(entry);
+            }
+
+            filter.pending.erase(it);
+            return;
+        }
+
+        append_event(entry);
+    }
+}
+
+// Write allocations which survived longer than min_age (or all of them, when now is UINT64_MAX)
+static void release_pending_allocs( uint64_t now )
+{
+    ShortLivedFilter & filter = g.short_lived;
+
+    while( !filter.pending_order.empty() )
+    {
+        const std::pair< void*, uint64_t > & front = filter.pending_order.front();
+        if( now!=UINT64_MAX && front.second + g.config.min_age > now )
+        {
+            break;
+        }
+
+        // Skip stale order entries (freed, or re-allocated at the same address)
+        auto it = filter.pending.find(front.first);
+        if( it!=filter.pending.end() && it->second.timestamp==front.second )
+        {
+            append_event(it->second);
+            filter.pending.erase(it);
+        }
+
+        filter.pending_order.pop_front();
+    }
+}
+
+// Write churn counters accumulated since the last call, as meta records
+static void flush_churn_counters()
+{
+    ShortLivedFilter & filter = g.short_lived;
+
+    if( filter.churn.empty() )
+    {
+        return;
+    }
+
+    std::string text;
+
+    for( auto & item : filter.churn )
+    {
+        const ShortLivedFilter::ChurnCounter & counter = item.second;
+
+        char buf[2048];
+        char * p = buf;
+        char * end = buf + sizeof(buf);
+
+        p += snprintf( p, end-p, "{\"type\":\"churn\",\"t\":%llu,\"count\":%llu,\"bytes\":%llu,\"cross_thread\":%llu,\"return_addr\":[",
+            (unsigned long long)get_timestamp(), (unsigned long long)counter.count, (unsigned long long)counter.bytes,
+            (unsigned long long)counter.cross_thread );
+        for( size_t level=0 ; level<NUM_RETURN_ADDR_LEVELS ; ++level )
+        {
+            p += snprintf( p, end-p, level<NUM_RETURN_ADDR_LEVELS-1 ? "\"%p\"," : "\"%p\"", item.first.return_addr[level] );
+        }
+
+        p += snprintf( p, end-p, "],\"lifetime_hist\":[" );
+        for( size_t i=0 ; i<ShortLivedFilter::NUM_LIFETIME_BUCKETS ; ++i )
+        {
+            p += snprintf( p, end-p, i>0 ? ",%llu" : "%llu", (unsigned long long)counter.lifetime_hist[i] );
+        }
+
+        // Trailing empty buckets are omitted
+        size_t num_size_buckets = NUM_SIZE_CLASSES;
+        while( num_size_buckets>0 && counter.size_hist[num_size_buckets-1]==0 )
+        {
+            num_size_buckets --;
+        }
+
+        p += snprintf( p, end-p, "],\"size_hist\":[" );
+        for( size_t i=0 ; i<num_size_buckets ; ++i )
+        {
+            p += snprintf( p, end-p, i>0 ? ",%llu" : "%llu", (unsigned long long)counter.size_hist[i] );
+        }
+        p += snprintf( p, end-p, "]}\n" );
+
+        text.append( buf, p-buf );
+    }
+
+    filter.churn.clear();
+
+    append_meta_record(text);
+}
+
+// Apply block log events of all threads to the block table, and count frees for the thread and tag which allocated
+// the block. Events are applied in timestamp order, as a block allocated by a thread can be freed by another thread,
+// and then allocated again by a third thread. Events newer than BLOCK_LOG_DELAY are kept for the next call, as
+// events of other threads with older timestamps may not be in their logs yet.
+static void update_block_table( bool all )
+{
+    static const uint64_t BLOCK_LOG_DELAY = 100000000ULL; // nanoseconds
+
+    uint64_t now = get_timestamp();
+
+    std::vector<PendingBlockEvent> & events = g.block_events;
+    size_t num_old_events = events.size();
+
+    ThreadRegistry & registry = g.thread_registry;
+    size_t num_threads = registry.num_threads.load(std::memory_order_acquire);
+    for( size_t i=0 ; i<num_threads ; ++i )
+    {
+        ThreadAccounting * accounting = registry.threads[i]->accounting;
+        if( !accounting )
+        {
+            continue;
+        }
+
+        BlockLog & log = accounting->block_log;
+        uint64_t tail = log.tail.load(std::memory_order_relaxed);
+        uint64_t head = log.head.load(std::memory_order_acquire);
+        for( ; tail<head ; ++tail )
+        {
+            PendingBlockEvent event;
+            event.entry = log.entries[ tail & (BlockLog::NUM_ENTRIES-1) ];
+            event.owner = i;
+            events.push_back(event);
+        }
+        log.tail.store( tail, std::memory_order_release );
+    }
+
+    // Events kept from the last call are already sorted
+    auto compare = []( const PendingBlockEvent & a, const PendingBlockEvent & b )
+    {
+        return a.entry.timestamp < b.entry.timestamp;
+    };
+    std::stable_sort( events.begin() + num_old_events, events.end(), compare );
+    std::inplace_merge( events.begin(), events.begin() + num_old_events, events.end(), compare );
+
+    size_t num_applied = 0;
+    for( ; num_applied<events.size() ; ++num_applied )
+    {
+        const PendingBlockEvent & event = events[num_applied];
+        if( !all && event.entry.timestamp + BLOCK_LOG_DELAY > now )
+        {
+            break;
+        }
+
+        if( event.entry.op==MallocOperation_Alloc )
+        {
+            g.block_table.insert( (void*)event.entry.p, event.entry.size, event.owner, event.entry.tag );
+            continue;
+        }
+
+        BlockTable::Entry removed;
+        if( g.block_table.remove( (void*)event.entry.p, removed ) )
+        {
+            g.freed.freed_for[removed.owner].add( removed.size );
+            g.freed.tag_freed[removed.tag].add( removed.size );
+            g.freed.size_class_freed[ get_size_class(removed.size) ].add( removed.size );
+        }
+    }
+    events.erase( events.begin(), events.begin() + num_applied );
+}
+
+struct ThreadStats
+{
+    pid_t tid;
+    bool alive;
+    std::string name;
+    std::string py_name;
+    uint64_t alloc_count;
+    uint64_t alloc_bytes;
+    uint64_t free_count;
+    uint64_t free_bytes;
+};
+
+// Sum up per-thread heap accounting counters. Frees of the blocks allocated by a thread are counted
+// by the flusher thread in FreeAccounting.
+static void collect_thread_stats( std::vector<ThreadStats> & stats )
+{
+    ThreadRegistry & registry = g.thread_registry;
+    size_t num_threads = registry.num_threads.load(std::memory_order_acquire);
+
+    stats.resize(num_threads);
+
+    for( size_t i=0 ; i<num_threads ; ++i )
+    {
+        ThreadState * state = registry.threads[i];
+        ThreadStats & thread_stats = stats[i];
+
+        thread_stats.tid = state->tid;
+        thread_stats.alive = state->alive;
+        thread_stats.name = state->name;
+        thread_stats.py_name = state->py_name;
+        thread_stats.alloc_count = state->allocated.count.load(std::memory_order_relaxed);
+        thread_stats.alloc_bytes = state->allocated.bytes.load(std::memory_order_relaxed);
+        thread_stats.free_count = g.freed.freed_for[i].count.load(std::memory_order_relaxed);
+        thread_stats.free_bytes = g.freed.freed_for[i].bytes.load(std::memory_order_relaxed);
+    }
+}
+
+struct TagStats
+{
+    std::string name;
+    uint64_t alloc_count;
+    uint64_t alloc_bytes;
+    uint64_t free_count;
+    uint64_t free_bytes;
+};
+
+// Sum up per-tag heap accounting counters of all threads
+static void collect_tag_stats( std::vector<TagStats> & stats )
+{
+    size_t num_tags = g.tag_registry.num_tags.load(std::memory_order_acquire);
+
+    stats.resize(num_tags);
+    for( size_t tag=0 ; tag<num_tags ; ++tag )
+    {
+        stats[tag].name = g.tag_registry.names[tag];
+        stats[tag].alloc_count = 0;
+        stats[tag].alloc_bytes = 0;
+        stats[tag].free_count = g.freed.tag_freed[tag].count.load(std::memory_order_relaxed);
+        stats[tag].free_bytes = g.freed.tag_freed[tag].bytes.load(std::memory_order_relaxed);
+    }
+
+    ThreadRegistry & registry = g.thread_registry;
+    size_t num_threads = registry.num_threads.load(std::memory_order_acquire);
+
+    for( size_t i=0 ; i<num_threads ; ++i )
+    {
+        ThreadAccounting * accounting = registry.threads[i]->accounting;
+        if( !accounting )
+        {
+            continue;
+        }
+
+        for( size_t tag=0 ; tag<num_tags ; ++tag )
+        {
+            stats[tag].alloc_count += accounting->tag_allocated[tag].count.load(std::memory_order_relaxed);
+            stats[tag].alloc_bytes += accounting->tag_allocated[tag].bytes.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// Read OS thread names of live threads. Same as pthread_getname_np(), but by thread id,
+// as pthread_t of other threads may be invalid once they exit.
+static void update_thread_names()
+{
+    ThreadRegistry & registry = g.thread_registry;
+    size_t num_threads = registry.num_threads.load(std::memory_order_acquire);
+
+    for( size_t i=0 ; i<num_threads ; ++i )
+    {
+        ThreadState * state = registry.threads[i];
+        if( !state->alive )
+        {
+            continue;
+        }
+
+        char path[64];
+        snprintf( path, sizeof(path), "/proc/self/task/%d/comm", state->tid );
+        int fd = open( path, O_RDONLY | O_CLOEXEC );
+        if( fd<0 )
+        {
+            continue;
+        }
+
+        char name[sizeof(state->name)];
+        ssize_t len = read( fd, name, sizeof(name)-1 );
+        close(fd);
+
+        if( len>0 )
+        {
+            if( name[len-1]=='\n' )
+            {
+                --len;
+            }
+            name[len] = '\0';
+            memcpy( state->name, name, len+1 );
+        }
+    }
+}
+
+static void append_json_string( std::string & out, const std::string & s )
+{
+    out += '"';
+    for( char c : s )
+    {
+        if( c=='"' || c=='\\' || (unsigned char)c < 0x20 )
+        {
+            c = '_';
+        }
+        out += c;
+    }
+    out += '"';
+}
+
+static void write_thread_stats()
+{
+    update_thread_names();
+
+    std::vector<ThreadStats> stats;
+    collect_thread_stats(stats);
+
+    char buf[256];
+    std::string text;
+
+    snprintf( buf, sizeof(buf), "{\"type\":\"thread_stats\",\"t\":%llu,\"threads\":[", (unsigned long long)get_timestamp() );
+    text += buf;
+
+    for( size_t i=0 ; i<stats.size() ; ++i )
+    {
+        const ThreadStats & thread_stats = stats[i];
+
+        snprintf( buf, sizeof(buf), "%s{\"tid\":%d,\"alive\":%s,\"name\":", i>0 ? "," : "",
+            thread_stats.tid, thread_stats.alive ? "true" : "false" );
+        text += buf;
+        append_json_string( text, thread_stats.name );
+        text += ",\"py_name\":";
+        append_json_string( text, thread_stats.py_name );
+        snprintf( buf, sizeof(buf), ",\"alloc_count\":%llu,\"alloc_bytes\":%llu,\"free_count\":%llu,\"free_bytes\":%llu}",
+            (unsigned long long)thread_stats.alloc_count, (unsigned long long)thread_stats.alloc_bytes,
+            (unsigned long long)thread_stats.free_count, (unsigned long long)thread_stats.free_bytes );
+        text += buf;
+    }
+
+    text += "]}\n";
+
+    // Tags are written only when they are used
+    std::vector<TagStats> tag_stats;
+    collect_tag_stats(tag_stats);
+
+    if( tag_stats.size()>1 )
+    {
+        snprintf( buf, sizeof(buf), "{\"type\":\"tag_stats\",\"t\":%llu,\"tags\":[", (unsigned long long)get_timestamp() );
+        text += buf;
+
+        for( size_t i=0 ; i<tag_stats.size() ; ++i )
+        {
+            text += i>0 ? ",{\"name\":" : "{\"name\":";
+            append_json_string( text, tag_stats[i].name );
+            snprintf( buf, sizeof(buf), ",\"alloc_count\":%llu,\"alloc_bytes\":%llu,\"free_count\":%llu,\"free_bytes\":%llu}",
+                (unsigned long long)tag_stats[i].alloc_count, (unsigned long long)tag_stats[i].alloc_bytes,
+                (unsigned long long)tag_stats[i].free_count, (unsigned long long)tag_stats[i].free_bytes );
+            text += buf;
+        }
+
+        text += "]}\n";
+    }
+
+    append_meta_record(text);
+}
+
+// Open a trace file, and write the header and the module map
+static void open_trace_file( const char * filename, size_t segment_index )
+{
+    // Don't leak the trace file to programs executed by child processes
+    g.fd = open( filename, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0644 );
+    g.segment_size = 0;
+
+    std::string text;
+    char buf[512];
+    int len = snprintf( buf, sizeof(buf), "{\"type\":\"header\",\"version\":2,\"pid\":%d,\"ppid\":%d,\"segment\":%zd,\"t\":%llu,\"format\":\"%s\",\"num_return_addr_levels\":%zd,\"min_age_us\":%llu,\"filtered\":%s,\"mode\":\"%s\"",
+        getpid(), getppid(), segment_index, (unsigned long long)get_timestamp(),
+        g.config.format==TraceFormat_LZ ? "lz" : "json", NUM_RETURN_ADDR_LEVELS,
+        (unsigned long long)( g.config.min_age / 1000 ),
+        g.config.has_record_filter() ? "true" : "false",
+        g.config.mode==TraceMode_FlightRecorder ? "flight" : "continuous" );
+    if( g.parent_pid!=0 )
+    {
+        // Forked child process. Memory blocks allocated by the parent before this time are inherited.
+        snprintf( buf+len, sizeof(buf)-len, ",\"fork_t\":%llu", (unsigned long long)g.fork_time );
+    }
+    text += buf;
+    text += "}\n";
+    format_module_map(text);
+
+    std::string header;
+    append_meta( header, text );
+
+    write_fully( g.fd, header.data(), header.size() );
+    g.segment_size += header.size();
+    g.segment_header_size = header.size();
+}
+
+// Write the module map again and close the trace file.
+// Modules may have been loaded after the header was written.
+static void close_trace_file()
+{
+    std::string text;
+    format_module_map(text);
+    append_meta_record(text);
+    write_fully( g.fd, g.write_buf.data(), g.write_buf.size() );
+    g.write_buf.clear();
+
+    close(g.fd);
+    g.fd = -1;
+}
+
+static void open_next_segment()
+{
+    if( g.fd>=0 )
+    {
+        close(g.fd);
+        g.fd = -1;
+        g.segment_index ++;
+    }
+
+    if( g.config.max_segments>0 && g.segment_index>=g.config.max_segments )
+    {
+        std::string old_filename = get_segment_filename( g.segment_index - g.config.max_segments );
+        unlink( old_filename.c_str() );
+    }
+
+    open_trace_file( get_segment_filename( g.segment_index ).c_str(), g.segment_index );
+}
+
+// Called after appending a record (JSON line, or block of the binary format) to the write buffer.
+// When the record doesn't fit in the current segment, the records before it are written to the current segment,
+// and the record goes to the next one. A record larger than the maximum segment size gets a segment of its own.
+static void end_write_record( size_t record_start )
+{
+    if( g.config.mode!=TraceMode_Continuous || g.config.max_segment_size==0 || g.fd<0 )
+    {
+        return;
+    }
+
+    if( g.segment_size + g.write_buf.size() <= g.config.max_segment_size )
+    {
+        return;
+    }
+
+    if( record_start==0 && g.segment_size==g.segment_header_size )
+    {
+        return;
+    }
+
+    write_fully( g.fd, g.write_buf.data(), record_start );
+    g.write_buf.erase( 0, record_start );
+    open_next_segment();
+}
+
+static void flush_write_buffer()
+{
+    if( g.write_buf.empty() )
+    {
+        return;
+    }
+
+    write_fully( g.fd, g.write_buf.data(), g.write_buf.size() );
+    g.segment_size += g.write_buf.size();
+    g.write_buf.clear();
+}
+
+static const size_t WRITE_BUFFER_SIZE = 256 * 1024;
+static const size_t EVENT_BLOCK_SIZE = 64 * 1024;
+
+// Finish the event block and flush the write buffer when they get large enough
+static inline void flush_if_full()
+{
+    if( g.event_block.raw.size() >= EVENT_BLOCK_SIZE )
+    {
+        finish_event_block();
+    }
+
+    if( g.write_buf.size() >= WRITE_BUFFER_SIZE )
+    {
+        flush_write_buffer();
+    }
+}
+
+static std::string get_flight_dump_filename( size_t dump_index )
+{
+    char filename[512];
+    snprintf( filename, sizeof(filename), "%s.flight%04zd.%s", g.output_prefix.c_str(), dump_index,
+        g.config.format==TraceFormat_LZ ? "lz" : "log" );
+    return filename;
+}
+
+// glibc 2.33 deprecated mallinfo(), which overflows at 4GB
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2,33)
+typedef struct mallinfo2 MallocInfo;
+#define get_malloc_info mallinfo2
+#else
+typedef struct mallinfo MallocInfo;
+#define get_malloc_info mallinfo
+#endif
+
+static size_t get_heap_in_use()
+{
+    MallocInfo info = get_malloc_info();
+    size_t heap_in_use = (size_t)info.uordblks + (size_t)info.hblkhd;
+
+    // Small allocations are served by the pool and not visible to mallinfo().
+    // Free objects in thread caches are counted as in use.
+    if( g.pool.is_enabled() )
+    {
+        heap_in_use += g.pool.committed_bytes() - g.pool.transfer_free_bytes();
+    }
+
+    return heap_in_use;
+}
+
+static size_t get_rss()
+{
+    int fd = open( "/proc/self/statm", O_RDONLY | O_CLOEXEC );
+    if( fd<0 )
+    {
+        return 0;
+    }
+
+    char buf[256];
+    ssize_t len = read( fd, buf, sizeof(buf)-1 );
+    close(fd);
+    if( len<=0 )
+    {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    unsigned long long size, resident;
+    if( sscanf( buf, "%llu %llu", &size, &resident )!=2 )
+    {
+        return 0;
+    }
+
+    return (size_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+// Number of arenas and total memory mapped by the allocator, from malloc_info() XML output
+static void get_arena_info( size_t & num_arenas, size_t & system_current )
+{
+    num_arenas = 0;
+    system_current = 0;
+
+    char * xml = NULL;
+    size_t xml_size = 0;
+    FILE * fp = open_memstream( &xml, &xml_size );
+    if( !fp )
+    {
+        return;
+    }
+
+    malloc_info( 0, fp );
+    fclose(fp);
+
+    for( const char * p = xml ; ( p = strstr( p, "<heap nr=" ) ) ; ++p )
+    {
+        num_arenas ++;
+    }
+
+    // The last one is the total of all arenas
+    const char * total = NULL;
+    for( const char * p = xml ; ( p = strstr( p, "<system type=\"current\" size=\"" ) ) ; ++p )
+    {
+        total = p;
+    }
+    if( total )
+    {
+        system_current = strtoull( total + strlen("<system type=\"current\" size=\""), NULL, 10 );
+    }
+
+    free(xml);
+}
+
+// Sample allocator state, and write it as a heap_stats record
+static void write_heap_stats()
+{
+    MallocInfo info = get_malloc_info();
+
+    size_t num_arenas, system_current;
+    get_arena_info( num_arenas, system_current );
+
+    char buf[512];
+    std::string text;
+
+    snprintf( buf, sizeof(buf), "{\"type\":\"heap_stats\",\"t\":%llu,\"rss\":%zd,\"arena\":%zd,\"ordblks\":%zd,\"hblks\":%zd,\"hblkhd\":%zd,\"uordblks\":%zd,\"fordblks\":%zd,\"keepcost\":%zd,\"num_arenas\":%zd,\"system_current\":%zd",
+        (unsigned long long)get_timestamp(), get_rss(),
+        (size_t)info.arena, (size_t)info.ordblks, (size_t)info.hblks, (size_t)info.hblkhd,
+        (size_t)info.uordblks, (size_t)info.fordblks, (size_t)info.keepcost,
+        num_arenas, system_current );
+    text += buf;
+
+    if( g.pool.is_enabled() )
+    {
+        snprintf( buf, sizeof(buf), ",\"pool_committed\":%zd,\"pool_free\":%zd", g.pool.committed_bytes(), g.pool.transfer_free_bytes() );
+        text += buf;
+    }
+
+    // Size-class histogram of live blocks, from per-thread heap accounting
+    if( g.config.thread_stats_interval>0 )
+    {
+        uint64_t live_count[NUM_SIZE_CLASSES] = {0};
+        uint64_t live_bytes[NUM_SIZE_CLASSES] = {0};
+
+        for( size_t size_class=0 ; size_class<NUM_SIZE_CLASSES ; ++size_class )
+        {
+            live_count[size_class] -= g.freed.size_class_freed[size_class].count.load(std::memory_order_relaxed);
+            live_bytes[size_class] -= g.freed.size_class_freed[size_class].bytes.load(std::memory_order_relaxed);
+        }
+
+        ThreadRegistry & registry = g.thread_registry;
+        size_t num_threads = registry.num_threads.load(std::memory_order_acquire);
+        for( size_t i=0 ; i<num_threads ; ++i )
+        {
+            ThreadAccounting * accounting = registry.threads[i]->accounting;
+            if( !accounting )
+            {
+                continue;
+            }
+
+            for( size_t size_class=0 ; size_class<NUM_SIZE_CLASSES ; ++size_class )
+            {
+                live_count[size_class] += accounting->size_class_allocated[size_class].count.load(std::memory_order_relaxed);
+                live_bytes[size_class] += accounting->size_class_allocated[size_class].bytes.load(std::memory_order_relaxed);
+            }
+        }
+
+        // Trailing empty classes are omitted
+        size_t num_size_classes = NUM_SIZE_CLASSES;
+        while( num_size_classes>0 && live_count[num_size_classes-1]==0 )
+        {
+            num_size_classes --;
+        }
+
+        text += ",\"live_count_hist\":[";
+        for( size_t i=0 ; i<num_size_classes ; ++i )
+        {
+            snprintf( buf, sizeof(buf), i>0 ? ",%lld" : "%lld", (long long)live_count[i] );
+            text += buf;
+        }
+        text += "],\"live_bytes_hist\":[";
+        for( size_t i=0 ; i<num_size_classes ; ++i )
+        {
+            snprintf( buf, sizeof(buf), i>0 ? ",%lld" : "%lld", (long long)live_bytes[i] );
+            text += buf;
+        }
+        text += "]";
+    }
+
+    text += "}\n";
+
+    append_meta_record(text);
+}
+
+// Collect events from per-thread circular buffers, and write them to a new file in time order
+static void flight_recorder_dump( const char * reason )
+{
+    std::vector<MallocCallHistory> entries;
+
+    ThreadRegistry & registry = g.thread_registry;
+    size_t num_threads = registry.num_threads.load(std::memory_order_acquire);
+    const uint64_t capacity = g.config.flight_events;
+
+    for( size_t i=0 ; i<num_threads ; ++i )
+    {
+        ThreadState * state = registry.threads[i];
+        if( !state->flight_entries )
+        {
+            continue;
+        }
+
+        uint64_t end = state->flight_pos.load(std::memory_order_acquire);
+        uint64_t begin = end > capacity ? end - capacity : 0;
+
+        size_t first = entries.size();
+        for( uint64_t pos=begin ; pos<end ; ++pos )
+        {
+            entries.push_back( state->flight_entries[ pos & (capacity-1) ] );
+        }
+
+        // The owner thread keeps writing while copying. Discard entries which may have been overwritten.
+        // The fence keeps the copy before the second read of the position. The owner thread writes the entry of
+        // position end_after before publishing end_after+1, so the entry of end_after-capacity may be torn too.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t end_after = state->flight_pos.load(std::memory_order_relaxed);
+        if( end_after + 1 > capacity && end_after + 1 - capacity > begin )
+        {
+            size_t num_overwritten = std::min( end_after + 1 - capacity - begin, end - begin );
+            entries.erase( entries.begin() + first, entries.begin() + first + num_overwritten );
+        }
+    }
+
+    std::stable_sort( entries.begin(), entries.end(), []( const MallocCallHistory & a, const MallocCallHistory & b )
+    {
+        return a.timestamp < b.timestamp;
+    });
+
+    uint64_t min_timestamp = 0;
+    if( g.config.flight_seconds>0 )
+    {
+        uint64_t now = get_timestamp();
+        min_timestamp = now > g.config.flight_seconds ? now - g.config.flight_seconds : 0;
+    }
+
+    size_t dump_index = g.num_flight_dumps.load(std::memory_order_relaxed);
+    std::string filename = get_flight_dump_filename(dump_index);
+
+    malloc_trace_printf( "Flight recorder dump (%s) : %s\n", reason, filename.c_str() );
+
+    open_trace_file( filename.c_str(), dump_index );
+
+    for( const MallocCallHistory & entry : entries )
+    {
+        if( entry.timestamp >= min_timestamp )
+        {
+            append_event(entry);
+            flush_if_full();
+        }
+    }
+
+    finish_event_block();
+
+    if( g.config.thread_stats_interval>0 )
+    {
+        write_thread_stats();
+    }
+
+    if( g.config.heap_stats_interval>0 )
+    {
+        write_heap_stats();
+    }
+
+    flush_write_buffer();
+    close_trace_file();
+
+    snprintf( g.last_flight_dump_filename, sizeof(g.last_flight_dump_filename), "%s", filename.c_str() );
+    g.num_flight_dumps.store( dump_index+1, std::memory_order_release );
+}
+
+static void flight_recorder_signal_handler( int sig )
+{
+    g.flight_dump_requested = true;
+}
+
+static void * flusher_main( void * )
+{
+    t_in_tracer = true;
+
+    static const uint64_t EVENT_BLOCK_MAX_AGE = 1000000000ULL; // nanoseconds
+    static const uint64_t CHURN_FLUSH_INTERVAL = 10000000000ULL; // nanoseconds
+    static const uint64_t RECORD_FILTER_UPDATE_INTERVAL = 1000000000ULL; // nanoseconds
+    static const uint64_t HEAP_CHECK_INTERVAL = 100000000ULL; // nanoseconds
+
+    g.write_buf.reserve( WRITE_BUFFER_SIZE + EVENT_BLOCK_SIZE + 1024 );
+    g.event_block.raw.reserve( EVENT_BLOCK_SIZE + 1024 );
+
+    if( g.config.mode==TraceMode_Continuous )
+    {
+        open_next_segment();
+    }
+
+    g.short_lived.last_churn_flush_time = get_timestamp();
+    uint64_t last_record_filter_update_time = get_timestamp();
+    uint64_t last_heap_check_time = get_timestamp();
+    uint64_t last_thread_stats_time = get_timestamp();
+    uint64_t last_heap_stats_time = 0; // sample at start
+    bool heap_trigger_armed = true;
+
+    for(;;)
+    {
+        bool stop_requested = g.flusher_stop_requested.load(std::memory_order_acquire);
+
+        std::unique_lock<std::mutex> lock(g.flusher_mutex);
+
+        if( g.config.thread_stats_interval>0 )
+        {
+            update_block_table( stop_requested );
+        }
+
+        if( g.config.mode==TraceMode_FlightRecorder )
+        {
+            if( g.flight_dump_requested.exchange(false) )
+            {
+                flight_recorder_dump("requested");
+            }
+
+            if( g.config.flight_trigger_bytes>0 && get_timestamp() - last_heap_check_time >= HEAP_CHECK_INTERVAL )
+            {
+                // Dump once when crossing the threshold upward. Re-arm when the heap goes below the threshold.
+                size_t heap_in_use = get_heap_in_use();
+                if( heap_trigger_armed && heap_in_use >= g.config.flight_trigger_bytes )
+                {
+                    flight_recorder_dump("heap threshold");
+                    heap_trigger_armed = false;
+                }
+                else if( heap_in_use < g.config.flight_trigger_bytes )
+                {
+                    heap_trigger_armed = true;
+                }
+                last_heap_check_time = get_timestamp();
+            }
+
+            if( get_timestamp() - last_record_filter_update_time >= RECORD_FILTER_UPDATE_INTERVAL )
+            {
+                update_record_filter();
+                last_record_filter_update_time = get_timestamp();
+            }
+
+            if( stop_requested )
+            {
+                break;
+            }
+
+            lock.unlock();
+            usleep(5000);
+            continue;
+        }
+
+        size_t count = g.ring.consume( [](const MallocCallHistory & entry)
+        {
+            process_event(entry);
+            flush_if_full();
+        }, TraceRing::NUM_ENTRIES );
+
+        if( g.config.min_age>0 )
+        {
+            uint64_t now = get_timestamp();
+
+            release_pending_allocs( stop_requested ? UINT64_MAX : now );
+
+            if( stop_requested || now - g.short_lived.last_churn_flush_time >= CHURN_FLUSH_INTERVAL )
+            {
+                flush_churn_counters();
+                g.short_lived.last_churn_flush_time = now;
+            }
+        }
+
+        if( get_timestamp() - last_record_filter_update_time >= RECORD_FILTER_UPDATE_INTERVAL )
+        {
+            update_record_filter();
+            last_record_filter_update_time = get_timestamp();
+        }
+
+        // Avoid writing small blocks which don't compress well, unless they are getting old
+        if( stop_requested || ( g.event_block.num_events>0 && get_timestamp() - g.event_block.start_time >= EVENT_BLOCK_MAX_AGE ) )
+        {
+            finish_event_block();
+        }
+
+        if( g.config.thread_stats_interval>0
+            && ( stop_requested || get_timestamp() - last_thread_stats_time >= g.config.thread_stats_interval ) )
+        {
+            finish_event_block();
+            write_thread_stats();
+            last_thread_stats_time = get_timestamp();
+        }
+
+        if( g.config.heap_stats_interval>0
+            && ( stop_requested || get_timestamp() - last_heap_stats_time >= g.config.heap_stats_interval ) )
+        {
+            finish_event_block();
+            write_heap_stats();
+            last_heap_stats_time = get_timestamp();
+        }
+
+        flush_write_buffer();
+
+        if( stop_requested )
+        {
+            break;
+        }
+
+        lock.unlock();
+
+        if( count==0 )
+        {
+            usleep(5000);
+        }
+    }
+
+    if( g.config.mode==TraceMode_Continuous )
+    {
+        close_trace_file();
+    }
+
+    return NULL;
+}
+
+// ---
+
+static void update_output_prefix()
+{
+    char prefix[512];
+    snprintf( prefix, sizeof(prefix), "%s.%d", g.output_base.c_str(), getpid() );
+    g.output_prefix = prefix;
+    g.pid = getpid();
+}
+
+static bool start_flusher()
+{
+    g.flusher_running = true;
+    if( pthread_create( &g.flusher, NULL, flusher_main, NULL )!=0 )
+    {
+        malloc_trace_printf( "Error : failed to start trace flusher thread\n" );
+        g.flusher_running = false;
+        return false;
+    }
+
+    return true;
+}
+
+// Fork handlers. Hold the locks while forking, so that the child process doesn't inherit them in locked state,
+// or flusher state in the middle of update.
+// Registered at load time (see register_fork_handlers()), so that the prepare handler runs after the handlers of
+// other libraries, which may call malloc(). The locks are not recursive.
+static void atfork_prepare()
+{
+    g.flusher_mutex.lock();
+    g.thread_registry.mutex.lock();
+    checker.map.lock_all();
+    g.pool.lock_all();
+    g.guard.lock();
+}
+
+static void atfork_parent()
+{
+    g.guard.unlock();
+    g.pool.unlock_all();
+    checker.map.unlock_all();
+    g.thread_registry.mutex.unlock();
+    g.flusher_mutex.unlock();
+}
+
+static void atfork_child()
+{
+    g.guard.unlock();
+    g.pool.unlock_all();
+    checker.map.unlock_all();
+    g.thread_registry.mutex.unlock();
+    g.flusher_mutex.unlock();
+
+    if( !g.enabled && !g.restart_after_fork )
+    {
+        return;
+    }
+
+    // The flusher thread doesn't exist in the child process. Start tracing again at the first traced event,
+    // so that fork() immediately followed by exec() doesn't create empty trace files.
+    g.enabled = false;
+    g.flusher_running = false;
+    g.parent_pid = getppid();
+    g.fork_time = get_timestamp();
+
+    // Only the forking thread exists in the child process
+    ThreadRegistry & registry = g.thread_registry;
+    size_t num_threads = registry.num_threads.load(std::memory_order_relaxed);
+    for( size_t i=0 ; i<num_threads ; ++i )
+    {
+        ThreadState * state = registry.threads[i];
+        state->flight_pos = 0;
+        if( state!=t_state )
+        {
+            state->alive = false;
+        }
+    }
+    t_tid = syscall(SYS_gettid);
+    if( t_state )
+    {
+        t_state->tid = t_tid;
+    }
+
+    g.restart_after_fork = true;
+}
+
+// Fork handlers run in the reverse order of registration for prepare, and in the order of registration for
+// parent and child. Registering them before other static constructors makes the prepare handler the last one
+// before fork(), and the child handler the first one after fork().
+__attribute__((constructor(101))) static void register_fork_handlers()
+{
+    pthread_atfork( atfork_prepare, atfork_parent, atfork_child );
+}
+
+// Called at the first traced event in a forked child process
+static void malloc_trace_restart_after_fork()
+{
+    if( !g.restart_after_fork.exchange(false) )
+    {
+        return;
+    }
+
+    t_in_tracer = true;
+
+    // Discard flusher state inherited from the parent process
+    if( g.fd>=0 )
+    {
+        close(g.fd);
+        g.fd = -1;
+    }
+    g.write_buf.clear();
+    g.event_block.reset();
+    g.event_block.first_event = 0;
+    g.short_lived.pending.clear();
+    g.short_lived.pending_order.clear();
+    g.short_lived.churn.clear();
+    g.segment_index = 0;
+    g.segment_size = 0;
+    g.segment_header_size = 0;
+    g.num_events = 0;
+    g.flight_dump_requested = false;
+    g.num_flight_dumps = 0;
+    g.flusher_stop_requested = false;
+
+    update_output_prefix();
+
+    bool ready = true;
+    if( g.config.mode==TraceMode_FlightRecorder )
+    {
+        malloc_trace_printf( "Starting malloc tracing in forked process in flight recorder mode : %s\n", get_flight_dump_filename(0).c_str() );
+    }
+    else
+    {
+        ready = g.ring.reset();
+        if( ready )
+        {
+            malloc_trace_printf( "Starting malloc tracing in forked process : %s\n", get_segment_filename(0).c_str() );
+        }
+        else
+        {
+            malloc_trace_printf( "Error : failed to reset trace ring buffer\n" );
+        }
+    }
+
+    if( ready && start_flusher() )
+    {
+        g.enabled = true;
+    }
+
+    t_in_tracer = false;
+}
+
+static void start_guarded_allocator();
+static void malloc_trace_stop();
+
+static void malloc_trace_start( const char * output_base )
+{
+    const char * mode = getenv("PY_MALLOC_TRACE_MODE");
+    if( mode && strcmp(mode,"flight")==0 )
+    {
+        g.config.mode = TraceMode_FlightRecorder;
+    }
+
+    g.config.max_segment_size = get_env_size( "PY_MALLOC_TRACE_MAX_SEGMENT_SIZE", 0 );
+    g.config.max_segments = get_env_size( "PY_MALLOC_TRACE_MAX_SEGMENTS", 0 );
+
+    const char * format = getenv("PY_MALLOC_TRACE_FORMAT");
+    if( format && strcmp(format,"lz")==0 )
+    {
+        g.config.format = TraceFormat_LZ;
+    }
+
+    g.config.min_age = get_env_size( "PY_MALLOC_TRACE_MIN_AGE_US", 0 ) * 1000;
+
+    const char * include_modules = getenv("PY_MALLOC_TRACE_INCLUDE_MODULES");
+    const char * exclude_modules = getenv("PY_MALLOC_TRACE_EXCLUDE_MODULES");
+    g.config.include_modules = include_modules ? include_modules : "";
+    g.config.exclude_modules = exclude_modules ? exclude_modules : "";
+    g.config.min_size = get_env_size( "PY_MALLOC_TRACE_MIN_SIZE", 0 );
+    g.config.callsite_rate_limit = get_env_size( "PY_MALLOC_TRACE_CALLSITE_RATE_LIMIT", 0 );
+
+    update_record_filter();
+
+    // Round up to power of 2
+    size_t flight_events = 1;
+    size_t requested_flight_events = get_env_size( "PY_MALLOC_TRACE_FLIGHT_EVENTS", 65536 );
+    while( flight_events < requested_flight_events )
+    {
+        flight_events <<= 1;
+    }
+    g.config.flight_events = flight_events;
+    g.config.flight_seconds = get_env_size( "PY_MALLOC_TRACE_FLIGHT_SECONDS", 0 ) * 1000000000ULL;
+    g.config.flight_signal = get_env_size( "PY_MALLOC_TRACE_FLIGHT_SIGNAL", SIGUSR2 );
+    g.config.flight_trigger_bytes = get_env_size( "PY_MALLOC_TRACE_FLIGHT_TRIGGER_BYTES", 0 );
+    g.config.thread_stats_interval = get_env_size( "PY_MALLOC_TRACE_THREAD_STATS", 0 ) * 1000000000ULL;
+    g.config.heap_stats_interval = get_env_size( "PY_MALLOC_TRACE_HEAP_STATS", 0 ) * 1000000000ULL;
+
+    const char * allocator = getenv("PY_MALLOC_TRACE_ALLOCATOR");
+    if( allocator && strcmp(allocator,"pool")==0 )
+    {
+        g.config.allocator = TraceAllocator_Pool;
+    }
+    g.config.pool_size = get_env_size( "PY_MALLOC_TRACE_POOL_SIZE", 4ULL << 30 );
+
+    // Blocks allocated by glibc so far are still freed by glibc, as the owner is decided by address
+    if( g.config.allocator==TraceAllocator_Pool )
+    {
+        if( g.pool.init( g.config.pool_size ) )
+        {
+            malloc_trace_printf( "Using pool allocator for allocations up to %zd bytes\n", POOL_MAX_SIZE );
+        }
+        else
+        {
+            malloc_trace_printf( "Error : failed to reserve %zd bytes for pool allocator. Using glibc.\n", g.config.pool_size );
+        }
+    }
+
+    g.config.guard_sample_rate = get_env_size( "PY_MALLOC_TRACE_GUARD_SAMPLE_RATE", 0 );
+    g.config.guard_slots = get_env_size( "PY_MALLOC_TRACE_GUARD_SLOTS", 1024 );
+    start_guarded_allocator();
+
+    if( pthread_key_create( &g.thread_registry.key, on_thread_exit )!=0 )
+    {
+        malloc_trace_printf( "Error : failed to create thread key\n" );
+        return;
+    }
+
+    g.output_base = output_base;
+    update_output_prefix();
+
+    if( g.config.mode==TraceMode_FlightRecorder )
+    {
+        if( g.config.flight_signal>0 )
+        {
+            struct sigaction action;
+            memset( &action, 0, sizeof(action) );
+            action.sa_handler = flight_recorder_signal_handler;
+            action.sa_flags = SA_RESTART;
+            sigaction( g.config.flight_signal, &action, NULL );
+        }
+
+        malloc_trace_printf( "Starting malloc tracing in flight recorder mode : %s\n", get_flight_dump_filename(0).c_str() );
+    }
+    else
+    {
+        if( !g.ring.init() )
+        {
+            malloc_trace_printf( "Error : failed to allocate trace ring buffer\n" );
+            return;
+        }
+
+        malloc_trace_printf( "Starting malloc tracing : %s\n", get_segment_filename(0).c_str() );
+    }
+
+    // Processes which call exit() without returning from main() (e.g. forked child processes)
+    atexit( malloc_trace_stop );
+
+    if( !start_flusher() )
+    {
+        return;
+    }
+
+    g.enabled = true;
+}
+
+static void stop_heap_checker();
+
+static void malloc_trace_stop()
+{
+    // Called from main() and from the atexit() handler
+    static pid_t stopped_pid = 0;
+    if( stopped_pid==getpid() )
+    {
+        return;
+    }
+    stopped_pid = getpid();
+
+    if( checker.enabled && getpid()==g.pid )
+    {
+        stop_heap_checker();
+    }
+
+    if( g.guard.is_enabled() && getpid()==g.pid )
+    {
+        malloc_trace_printf( "Guarded allocations : %zd sampled\n", g.guard.num_sampled.load() );
+    }
+
+    // Child processes created with vfork() share the memory, but don't own the flusher thread
+    if( !g.flusher_running || getpid()!=g.pid )
+    {
+        return;
+    }
+
+    g.enabled = false;
+
+    g.flusher_stop_requested = true;
+    pthread_join( g.flusher, NULL );
+    g.flusher_running = false;
+}
+
+// ---
+
+#if defined(REPLACE_MALLOC_FUNCTIONS)
+
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_memalign(size_t, size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+extern "C" void __libc_free(void*);
+
+// Internal API used by faulthandler. Doesn't allocate memory.
+extern "C" void _Py_DumpTraceback( int fd, PyThreadState * tstate );
+
+static inline pid_t get_current_tid()
+{
+    if( t_tid==0 )
+    {
+        t_tid = syscall(SYS_gettid);
+    }
+    return t_tid;
+}
+
+// ---
+
+// Sampled guard page allocations (PY_MALLOC_TRACE_GUARD_SAMPLE_RATE). Each thread counts down allocations to the next
+// sample, so that the cost for other allocations is a decrement and a branch.
+
+static const uint32_t GUARD_RECHECK_INTERVAL = 65536; // allocations between checks while sampling is disabled
+
+static __thread uint32_t t_guard_countdown = 1;
+static __thread uint64_t t_guard_random = 0;
+
+static void print_guard_frames( const char * label, pid_t tid, void * const * frames, int num_frames )
+{
+    malloc_trace_error_printf( "  %s by thread %d at:\n", label, tid );
+    backtrace_symbols_fd( frames, num_frames, STDERR_FILENO );
+}
+
+static void print_guard_block_history( const GuardedAllocator::Slot & slot )
+{
+    print_guard_frames( "allocated", slot.alloc_tid, slot.alloc_frames, slot.num_alloc_frames );
+    if( slot.free_tid!=0 )
+    {
+        print_guard_frames( "freed", slot.free_tid, slot.free_frames, slot.num_free_frames );
+    }
+}
+
+static void print_guard_current_stacks()
+{
+    void * bt[32];
+    int num_frames = backtrace( bt, sizeof(bt)/sizeof(bt[0]) );
+    malloc_trace_error_printf( "  thread %d stack:\n", get_current_tid() );
+    backtrace_symbols_fd( bt+1, num_frames-1, STDERR_FILENO );
+
+    PyThreadState * tstate = PyGILState_GetThisThreadState();
+    if( tstate )
+    {
+        malloc_trace_error_printf( "  Python stack:\n" );
+        _Py_DumpTraceback( STDERR_FILENO, tstate );
+    }
+}
+
+static __attribute__((noinline)) void * guarded_allocate( size_t size )
+{
+    GuardedAllocator & guard = g.guard;
+
+    if( !guard.is_enabled() )
+    {
+        t_guard_countdown = GUARD_RECHECK_INTERVAL;
+        return NULL;
+    }
+
+    // xorshift64, seeded per thread
+    if( t_guard_random==0 )
+    {
+        t_guard_random = ( (uint64_t)get_current_tid() << 32 ) ^ get_timestamp() ^ 0x9e3779b97f4a7c15ULL;
+    }
+    t_guard_random ^= t_guard_random << 13;
+    t_guard_random ^= t_guard_random >> 7;
+    t_guard_random ^= t_guard_random << 17;
+
+    // Uniform in [1, 2*rate], so that 1 in rate allocations is sampled on average, without a fixed pattern.
+    // Reset before calling backtrace(), which can allocate memory.
+    t_guard_countdown = 1 + (uint32_t)( ( t_guard_random >> 1 ) % ( 2 * guard.sample_rate ) );
+
+    if( size > guard.page_size )
+    {
+        return NULL;
+    }
+
+    // Skip this function
+    void * frames[GuardedAllocator::MAX_FRAMES+1];
+    int num_frames = backtrace( frames, GuardedAllocator::MAX_FRAMES+1 );
+
+    return guard.allocate( size, t_guard_random & 1, get_current_tid(), frames+1, num_frames-1 );
+}
+
+static inline void * sample_guarded( size_t size )
+{
+    if( __builtin_expect( --t_guard_countdown==0, 0 ) )
+    {
+        return guarded_allocate(size);
+    }
+    return NULL;
+}
+
+static __attribute__((noinline)) void guarded_free( void * p )
+{
+    void * frames[GuardedAllocator::MAX_FRAMES+1];
+    int num_frames = backtrace( frames, GuardedAllocator::MAX_FRAMES+1 );
+
+    if( !g.guard.release( p, get_current_tid(), frames+1, num_frames-1 ) )
+    {
+        const GuardedAllocator::Slot * slot = g.guard.slot_of(p);
+        if( slot==NULL )
+        {
+            malloc_trace_error_printf( "\npy_malloc_trace: invalid free of guard page : %p\n", p );
+            print_guard_current_stacks();
+            return;
+        }
+
+        malloc_trace_error_printf( "\npy_malloc_trace: %s of guarded block : %p\n", slot->p==(uintptr_t)p ? "double free" : "invalid free", p );
+        print_guard_current_stacks();
+        if( slot->p!=0 )
+        {
+            malloc_trace_error_printf( "  block in the same page : %p (size %zd)\n", (void*)slot->p, slot->size );
+            print_guard_block_history(*slot);
+        }
+    }
+}
+
+// Called in the fault handler, for an address in the guarded range.
+// Accesses to a slot page are accesses after free, and accesses to a guard page are blamed on the nearest block.
+static void report_guard_fault( uintptr_t addr )
+{
+    GuardedAllocator & guard = g.guard;
+    size_t page_index = ( addr - guard.base ) / guard.page_size;
+
+    const GuardedAllocator::Slot * slot = NULL;
+    const char * error = "use after free";
+    if( page_index % 2 == 1 )
+    {
+        slot = &guard.slots[ page_index / 2 ];
+    }
+    else
+    {
+        const GuardedAllocator::Slot * before = page_index>0 ? &guard.slots[ page_index / 2 - 1 ] : NULL;
+        const GuardedAllocator::Slot * after = page_index / 2 < guard.num_slots ? &guard.slots[ page_index / 2 ] : NULL;
+        if( before && before->p==0 ) before = NULL;
+        if( after && after->p==0 ) after = NULL;
+
+        if( before && ( !after || addr - ( before->p + before->size ) <= after->p - addr ) )
+        {
+            slot = before;
+            error = "heap buffer overflow";
+        }
+        else
+        {
+            slot = after;
+            error = "heap buffer underflow";
+        }
+    }
+
+    if( slot==NULL || slot->p==0 )
+    {
+        malloc_trace_error_printf( "\npy_malloc_trace: access to unused guarded page : %p\n", (void*)addr );
+        print_guard_current_stacks();
+        return;
+    }
+
+    malloc_trace_error_printf( "\npy_malloc_trace: %s on guarded block : access at %p, block %p (size %zd)%s\n",
+        error, (void*)addr, (void*)slot->p, slot->size, slot->free_tid!=0 ? ", already freed" : "" );
+    if( addr >= slot->p + slot->size )
+    {
+        malloc_trace_error_printf( "  %zd bytes after the end of the block\n", addr - ( slot->p + slot->size ) );
+    }
+    else if( addr < slot->p )
+    {
+        malloc_trace_error_printf( "  %zd bytes before the start of the block\n", slot->p - addr );
+    }
+    else
+    {
+        malloc_trace_error_printf( "  at offset %zd\n", addr - slot->p );
+    }
+
+    print_guard_current_stacks();
+    print_guard_block_history(*slot);
+}
+
+static void guard_fault_handler( int sig, siginfo_t * info, void * context )
+{
+    struct sigaction & prev = g.guard.prev_segv_action;
+
+    if( g.guard.owns( info->si_addr ) )
+    {
+        report_guard_fault( (uintptr_t)info->si_addr );
+
+        // Return with the previous action restored. The access faults again, and terminates the process in the usual way.
+        sigaction( sig, &prev, NULL );
+        return;
+    }
+
+    if( prev.sa_flags & SA_SIGINFO )
+    {
+        prev.sa_sigaction( sig, info, context );
+    }
+    else if( prev.sa_handler==SIG_DFL || prev.sa_handler==SIG_IGN )
+    {
+        sigaction( sig, &prev, NULL );
+    }
+    else
+    {
+        prev.sa_handler(sig);
+    }
+}
+
+static void start_guarded_allocator()
+{
+    if( !g.guard.init( g.config.guard_sample_rate, g.config.guard_slots ) )
+    {
+        if( g.config.guard_sample_rate>0 )
+        {
+            malloc_trace_printf( "Error : failed to reserve pages for %zd guarded allocation slots\n", g.config.guard_slots );
+        }
+        return;
+    }
+
+    // backtrace() loads the unwinder at the first call. Don't do it in the fault handler.
+    void * bt[1];
+    backtrace( bt, 1 );
+
+    struct sigaction action;
+    memset( &action, 0, sizeof(action) );
+    action.sa_sigaction = guard_fault_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset( &action.sa_mask );
+    sigaction( SIGSEGV, &action, &g.guard.prev_segv_action );
+
+    // Other threads which existed before start sampling within GUARD_RECHECK_INTERVAL allocations
+    t_guard_countdown = 1;
+
+    malloc_trace_printf( "Guarded allocations enabled : 1 in %zd allocations, %zd slots\n", g.config.guard_sample_rate, g.config.guard_slots );
+}
+
+// ---
+
+// Underlying allocator. With PY_MALLOC_TRACE_ALLOCATOR=pool, small allocations are served by the pool allocator,
+// and others by glibc. Sampled allocations go to guarded pages before them. Blocks are returned to the allocator
+// which owns the address.
+
+static inline void * underlying_malloc( size_t size )
+{
+    void * p = sample_guarded(size);
+    if( !p )
+    {
+        p = g.pool.allocate(size);
+    }
+    return p ? p : __libc_malloc(size);
+}
+
+static inline void * underlying_memalign( size_t align, size_t size )
+{
+    // Pool objects and guarded blocks are 16 bytes aligned
+    if( align<=16 )
+    {
+        void * p = sample_guarded(size);
+        if( !p )
+        {
+            p = g.pool.allocate(size);
+        }
+        if(p)
+        {
+            return p;
+        }
+    }
+
+    return __libc_memalign( align, size );
+}
+
+static inline void * underlying_calloc( size_t n, size_t size )
+{
+    size_t total;
+    if( !__builtin_mul_overflow( n, size, &total ) )
+    {
+        void * p = sample_guarded(total);
+        if( !p )
+        {
+            p = g.pool.allocate(total);
+        }
+        if(p)
+        {
+            memset( p, 0, total );
+            return p;
+        }
+    }
+
+    return __libc_calloc( n, size );
+}
+
+static inline void * underlying_realloc( void * old_p, size_t size )
+{
+    // Guarded blocks always move, so that the new size is guarded too
+    if( g.guard.owns(old_p) )
+    {
+        const GuardedAllocator::Slot * slot = g.guard.slot_of(old_p);
+        if( slot==NULL || slot->p!=(uintptr_t)old_p )
+        {
+            // Reports the invalid pointer
+            guarded_free(old_p);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        size_t old_size = slot->size;
+        void * new_p = underlying_malloc(size);
+        if( new_p )
+        {
+            memcpy( new_p, old_p, size<old_size ? size : old_size );
+            guarded_free(old_p);
+        }
+        return new_p;
+    }
+
+    if( !g.pool.owns(old_p) )
+    {
+        return old_p ? __libc_realloc( old_p, size ) : underlying_malloc(size);
+    }
+
+    // Keep the block when the new size still fits in its size class reasonably
+    size_t old_size = g.pool.usable_size(old_p);
+    if( size<=old_size && size>old_size/2 )
+    {
+        return old_p;
+    }
+
+    void * new_p = underlying_malloc(size);
+    if( new_p )
+    {
+        memcpy( new_p, old_p, size<old_size ? size : old_size );
+        g.pool.release(old_p);
+    }
+    return new_p;
+}
+
+static inline void underlying_free( void * p )
+{
+    if( g.guard.owns(p) )
+    {
+        guarded_free(p);
+    }
+    else if( g.pool.owns(p) )
+    {
+        g.pool.release(p);
+    }
+    else
+    {
+        __libc_free(p);
+    }
+}
+
+// ---
+
+// Heap checking (PY_MALLOC_TRACE_CHECK). Frees are validated against the table of live blocks, and freed blocks
+// are kept poisoned in a bounded quarantine, to detect double frees, invalid frees and writes after free.
+
+extern "C" char _end; // end of the executable's data, where the initial heap starts
+
+static __thread bool t_in_check_report = false;
+
+static void print_check_return_addr( const char * label, void * return_addr, pid_t tid )
+{
+    malloc_trace_error_printf( "  %s by thread %d at:\n    ", label, tid );
+    backtrace_symbols_fd( &return_addr, 1, STDERR_FILENO );
+}
+
+// Report a heap error immediately, with the current native and Python stacks, and the history of the block
+static void check_report( const char * error, uintptr_t p, const HeapChecker::Entry * entry, size_t offset=SIZE_MAX )
+{
+    checker.num_errors ++;
+
+    if( t_in_check_report )
+    {
+        return;
+    }
+    t_in_check_report = true;
+
+    if( entry )
+    {
+        malloc_trace_error_printf( "\npy_malloc_trace: %s : %p (size %zd)\n", error, (void*)p, (size_t)entry->size );
+    }
+    else
+    {
+        malloc_trace_error_printf( "\npy_malloc_trace: %s : %p\n", error, (void*)p );
+    }
+    if( offset!=SIZE_MAX )
+    {
+        malloc_trace_error_printf( "  modified at offset %zd\n", offset );
+    }
+
+    void * bt[32];
+    int num_frames = backtrace( bt, sizeof(bt)/sizeof(bt[0]) );
+    malloc_trace_error_printf( "  thread %d stack:\n", get_current_tid() );
+    backtrace_symbols_fd( bt+1, num_frames-1, STDERR_FILENO );
+
+    if( entry )
+    {
+        print_check_return_addr( "allocated", entry->alloc_return_addr, entry->alloc_tid );
+        if( entry->free_tid!=0 )
+        {
+            print_check_return_addr( "freed", entry->free_return_addr, entry->free_tid );
+        }
+    }
+
+    // The thread may not hold the GIL (e.g. native code called through ctypes)
+    PyThreadState * tstate = PyGILState_GetThisThreadState();
+    if( tstate )
+    {
+        malloc_trace_error_printf( "  Python stack:\n" );
+        _Py_DumpTraceback( STDERR_FILENO, tstate );
+    }
+
+    t_in_check_report = false;
+
+    if( checker.abort_on_error )
+    {
+        abort();
+    }
+}
+
+// glibc serves large blocks with mmap, outside the initial heap. Such a chunk has IS_MMAPPED (bit 1) in the size
+// field of its header, and starts at a page boundary after an alignment gap recorded in prev_size. The page
+// alignment is checked as glibc does, so that a pointer into the middle of a block is not taken as a chunk.
+static inline bool is_untracked_mmapped_chunk( void * p )
+{
+    if( ( (uintptr_t)p & (2*sizeof(size_t)-1) ) != 0 || g.pool.owns(p) || g.guard.owns(p) )
+    {
+        return false;
+    }
+
+    const size_t * header = (const size_t*)p - 2;
+    size_t prev_size = header[0];
+    size_t size = header[1];
+    if( ( size & 2 )==0 )
+    {
+        return false;
+    }
+
+    uintptr_t block = (uintptr_t)header - prev_size;
+    size_t total_size = prev_size + ( size & ~(size_t)7 );
+    return ( ( block | total_size ) & ( checker.page_size-1 ) )==0;
+}
+
+static inline bool is_untracked_heap_block( void * p )
+{
+    return (uintptr_t)p - checker.untracked_heap_start < checker.untracked_heap_end - checker.untracked_heap_start
+        || is_untracked_mmapped_chunk(p);
+}
+
+static void check_alloc( void * p, size_t size, void * return_addr )
+{
+    if( p==NULL )
+    {
+        return;
+    }
+
+    HeapChecker::Entry entry = { (uintptr_t)p, size, return_addr, NULL, get_current_tid(), 0 };
+    HeapChecker::Entry existing;
+    if( !checker.insert( entry, existing ) )
+    {
+        check_report( "heap corruption, allocator returned a block in use", (uintptr_t)p, &existing );
+    }
+}
+
+// Verify the poison pattern of a block in the quarantine
+static void verify_poison( const HeapChecker::Entry & entry )
+{
+    const uint8_t * bytes = (const uint8_t*)entry.p;
+    const uint64_t pattern = 0x0101010101010101ULL * HeapChecker::POISON;
+
+    size_t offset = 0;
+    for( ; offset+8<=entry.size ; offset+=8 )
+    {
+        uint64_t word;
+        memcpy( &word, bytes+offset, 8 );
+        if( word!=pattern )
+        {
+            break;
+        }
+    }
+    for( ; offset<entry.size ; ++offset )
+    {
+        if( bytes[offset]!=HeapChecker::POISON )
+        {
+            check_report( "write after free", entry.p, &entry, offset );
+            break;
+        }
+    }
+}
+
+static void checked_free( void * p, void * return_addr )
 {
-    Globals()
-        :
-        enabled(false),
-        fd(-1)
+    if( p==NULL )
     {
+        return;
     }
 
-    bool enabled;
-    std::string output_filename;
-    int fd;
-};
-
-static Globals g;
+    HeapChecker::Entry entry;
+    HeapChecker::Entry evicted[HeapChecker::MAX_EVICTIONS];
+    size_t num_evicted;
 
-// ---
+    switch( checker.quarantine( (uintptr_t)p, return_addr, get_current_tid(), entry, evicted, num_evicted ) )
+    {
+    case HeapChecker::FreeResult_Quarantined:
+        for( size_t i=0 ; i<num_evicted ; ++i )
+        {
+            verify_poison( evicted[i] );
+            underlying_free( (void*)evicted[i].p );
+        }
+        break;
 
-static inline int format_malloc_call_history( char * buf, int bufsize, const MallocCallHistory & entry )
-{
-    char * p = buf;
-    bufsize -= 1;
-    int len;
+    case HeapChecker::FreeResult_Release:
+        underlying_free(p);
+        break;
 
-    len = snprintf( p, bufsize, "{\"op\":%d,\"p\":\"%p\",\"size\":%zd,\"return_addr\":[", 
-        entry.op,
-        entry.p,
-        entry.size );
-    p += len;
-    bufsize -= len;
+    case HeapChecker::FreeResult_DoubleFree:
+        check_report( "double free", (uintptr_t)p, &entry );
+        break;
 
-    for( size_t level=0 ; level<NUM_RETURN_ADDR_LEVELS ; ++level )
-    {
-        const char * format;
-        if( level<NUM_RETURN_ADDR_LEVELS-1 )
+    case HeapChecker::FreeResult_Unknown:
+        // Blocks allocated before checking started can't be validated
+        if( is_untracked_heap_block(p) )
         {
-            format = "\"%p\",";
+            underlying_free(p);
         }
         else
         {
-            format = "\"%p\"";
+            check_report( "invalid free (not allocated, or freed and evicted from quarantine)", (uintptr_t)p, NULL );
         }
-        len = snprintf( p, bufsize, format, entry.return_addr[level] );
-        p += len;
-        bufsize -= len;
+        break;
     }
-
-    len = snprintf( p, bufsize, "]}\n" );
-    p += len;
-    bufsize -= len;
-
-    return (p - buf);
 }
 
-static inline void write_malloc_call_history( MallocOperation op, void * p, size_t size, void * return_addr )
+// Always moves the block, so that the old block goes to the quarantine
+static void * checked_realloc( void * old_p, size_t size, void * return_addr )
 {
-    if(!g.enabled)
+    if( old_p==NULL )
     {
-        return;
+        void * p = underlying_malloc(size);
+        check_alloc( p, size, return_addr );
+        return p;
     }
 
-    MallocCallHistory new_entry;
-
-    new_entry.op = op;
-    new_entry.p = p;
-    new_entry.size = size;
-
-    #if defined(USE_BUILTIN_RETURN_ADDR)
-    new_entry.return_addr[0] = return_addr;
-    #else //defined(USE_BUILTIN_RETURN_ADDR)
-    if(NUM_RETURN_ADDR_LEVELS>0)
+    HeapChecker::Entry entry;
+    if( !checker.lookup( (uintptr_t)old_p, entry ) )
     {
-        void * bt[NUM_RETURN_ADDR_LEVELS+1] = {0};
-        backtrace( bt, sizeof(bt)/sizeof(bt[0]) );
-        for( size_t level=0 ; level<NUM_RETURN_ADDR_LEVELS ; ++level )
+        if( !is_untracked_heap_block(old_p) )
         {
-            new_entry.return_addr[level] = bt[level+1];
+            check_report( "realloc of invalid pointer", (uintptr_t)old_p, NULL );
+            errno = ENOMEM;
+            return NULL;
         }
+
+        void * p = underlying_realloc( old_p, size );
+        check_alloc( p, size, return_addr );
+        return p;
     }
-    #endif //defined(USE_BUILTIN_RETURN_ADDR)
 
+    if( entry.free_tid!=0 )
     {
-        char buf[1024];
-        int len = format_malloc_call_history( buf, sizeof(buf), new_entry );
-        ssize_t result = write( g.fd, buf, len );
-        (void)result;
+        check_report( "realloc after free", (uintptr_t)old_p, &entry );
+        errno = ENOMEM;
+        return NULL;
     }
-}
 
-#if defined(USE_MALLOC_HISTORY)
-#define ADD_MALLOC_CALL_HISTORY(op,p,size) write_malloc_call_history(op,p,size,__builtin_return_address(0))
-#else //defined(USE_MALLOC_HISTORY)
-#define ADD_MALLOC_CALL_HISTORY(op,p,size) (void)0
-#endif //defined(USE_MALLOC_HISTORY)
+    void * p = underlying_malloc(size);
+    if( p==NULL )
+    {
+        return NULL;
+    }
+
+    memcpy( p, old_p, size<entry.size ? size : entry.size );
+    check_alloc( p, size, return_addr );
+    checked_free( old_p, return_addr );
+    return p;
+}
 
-static void malloc_trace_start( const char * output_filename )
+// Blocks still in the quarantine at exit are verified here, as writes after free are detected when blocks leave the quarantine
+static void stop_heap_checker()
 {
-    g.output_filename = output_filename;
-    g.fd = open( g.output_filename.c_str(), O_CREAT | O_WRONLY | O_APPEND, 0644 );
+    checker.for_each_quarantined( verify_poison );
 
-    g.enabled = true;
+    malloc_trace_printf( "Heap checking : %zd errors\n", checker.num_errors.load() );
 }
 
-static void malloc_trace_stop()
+// Checking starts before other static constructors of the executable, so that most blocks are tracked.
+// Blocks allocated earlier by shared library constructors are in the initial heap or in mmap-ed chunks, and their
+// frees are not validated.
+__attribute__((constructor(101))) static void heap_checker_init()
 {
-    g.enabled = false;
+    const char * check = getenv("PY_MALLOC_TRACE_CHECK");
+    if( check==NULL || check[0]=='\0' || strcmp(check,"0")==0 )
+    {
+        return;
+    }
 
-    close(g.fd);
-    g.fd = -1;
-}
+    checker.abort_on_error = ( strcmp(check,"abort")==0 );
+    checker.quarantine_bytes_per_shard = get_env_size( "PY_MALLOC_TRACE_QUARANTINE_SIZE", 64 << 20 ) / HeapChecker::NUM_SHARDS;
 
-// ---
+    // backtrace() allocates memory to load the unwinder at the first call. Do it before taking the heap range.
+    void * bt[1];
+    backtrace( bt, 1 );
 
-#if defined(REPLACE_MALLOC_FUNCTIONS)
+    checker.untracked_heap_start = (uintptr_t)&_end;
+    checker.untracked_heap_end = (uintptr_t)sbrk(0);
+    checker.page_size = sysconf(_SC_PAGESIZE);
 
-extern "C" void* __libc_malloc(size_t);
-extern "C" void* __libc_memalign(size_t, size_t);
-extern "C" void* __libc_calloc(size_t, size_t);
-extern "C" void* __libc_realloc(void*, size_t);
-extern "C" void __libc_free(void*);
+    checker.enabled = true;
+
+    malloc_trace_printf( "Heap checking enabled : quarantine %zd bytes%s\n",
+        checker.quarantine_bytes_per_shard * HeapChecker::NUM_SHARDS, checker.abort_on_error ? ", abort on error" : "" );
+}
 
 extern "C" void * malloc( size_t size )
 {
     //malloc_trace_printf( "malloc called: size=%d\n", size );
 
-    void * p = __libc_malloc(size);
+    void * p = underlying_malloc(size);
+
+    if( checker.enabled )
+    {
+        check_alloc( p, size, __builtin_return_address(0) );
+    }
 
     ADD_MALLOC_CALL_HISTORY( MallocOperation_Alloc, p, size );
 
@@ -190,7 +3746,12 @@ extern "C" void * memalign( size_t align, size_t size )
 {
     //malloc_trace_printf( "memalign called: align=%d, size=%d\n", align, size );
 
-    void * p = __libc_memalign( align, size );
+    void * p = underlying_memalign( align, size );
+
+    if( checker.enabled )
+    {
+        check_alloc( p, size, __builtin_return_address(0) );
+    }
 
     ADD_MALLOC_CALL_HISTORY( MallocOperation_Alloc, p, size );
 
@@ -201,9 +3762,15 @@ extern "C" void * calloc( size_t n, size_t size )
 {
     //malloc_trace_printf( "calloc called: n=%d, size=%d\n", n, size );
 
-    void * p = __libc_calloc( n, size );
+    void * p = underlying_calloc( n, size );
 
-    ADD_MALLOC_CALL_HISTORY( MallocOperation_Alloc, p, size );
+    // n * size doesn't overflow when p is not NULL, as calloc() fails in that case
+    if( checker.enabled )
+    {
+        check_alloc( p, n * size, __builtin_return_address(0) );
+    }
+
+    ADD_MALLOC_CALL_HISTORY( MallocOperation_Alloc, p, n * size );
 
     return p;
 }
@@ -214,7 +3781,7 @@ extern "C" void * realloc( void * old_p, size_t size )
 
     ADD_MALLOC_CALL_HISTORY( MallocOperation_Free, old_p, 0 );
 
-    void * new_p = __libc_realloc( old_p, size );
+    void * new_p = checker.enabled ? checked_realloc( old_p, size, __builtin_return_address(0) ) : underlying_realloc( old_p, size );
 
     ADD_MALLOC_CALL_HISTORY( MallocOperation_Alloc, new_p, size );
 
@@ -238,7 +3805,12 @@ extern "C" int posix_memalign( void **memptr, size_t align, size_t size )
     }
 
     int result;
-    *memptr = __libc_memalign(align, size);
+    *memptr = underlying_memalign(align, size);
+
+    if( checker.enabled )
+    {
+        check_alloc( *memptr, size, __builtin_return_address(0) );
+    }
 
     if(*memptr)
     {
@@ -260,14 +3832,25 @@ extern "C" void free( void * p )
 
     ADD_MALLOC_CALL_HISTORY( MallocOperation_Free, p, 0 );
 
-    __libc_free(p);
+    if( checker.enabled )
+    {
+        checked_free( p, __builtin_return_address(0) );
+        return;
+    }
+
+    underlying_free(p);
 }
 
 extern "C" void * aligned_alloc( size_t align, size_t size )
 {
     //malloc_trace_printf( "aligned_alloc called: align=%d, size=%d\n", align, size );
 
-    void * p = __libc_memalign( align, size );
+    void * p = underlying_memalign( align, size );
+
+    if( checker.enabled )
+    {
+        check_alloc( p, size, __builtin_return_address(0) );
+    }
 
     ADD_MALLOC_CALL_HISTORY( MallocOperation_Alloc, p, size );
 
@@ -294,11 +3877,27 @@ extern "C" void * pvalloc( size_t size )
 
 extern "C" size_t malloc_usable_size(void *ptr)
 {
-    malloc_trace_printf( "malloc_usable_size called: p=%p\n", ptr );
+    if( ptr==NULL )
+    {
+        return 0;
+    }
 
-    abort();
+    if( g.guard.owns(ptr) )
+    {
+        const GuardedAllocator::Slot * slot = g.guard.slot_of(ptr);
+        return slot ? slot->size : 0;
+    }
 
-    return 0;
+    if( g.pool.owns(ptr) )
+    {
+        return g.pool.usable_size(ptr);
+    }
+
+    // glibc doesn't export its implementation under another name. Read the chunk header in the same way.
+    // Size field has flags in the lowest 3 bits. Chunks allocated by mmap (bit 1) don't share the next chunk's header.
+    size_t header = ((size_t*)ptr)[-1];
+    size_t chunk_size = header & ~(size_t)7;
+    return ( header & 2 ) ? chunk_size - 2*sizeof(size_t) : chunk_size - sizeof(size_t);
 }
 
 #endif //defined(REPLACE_MALLOC_FUNCTIONS)
@@ -378,16 +3977,327 @@ void test_malloc_functions_multi_threads()
     }
 }
 
+// ---
+
+// py_malloc_trace.dump() : Write the flight recorder buffers to a new file, and return the filename
+static PyObject * py_malloc_trace_dump( PyObject * self, PyObject * args )
+{
+    if( !g.enabled || g.config.mode!=TraceMode_FlightRecorder )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "Flight recorder mode is not enabled. Set PY_MALLOC_TRACE_MODE=flight." );
+        return NULL;
+    }
+
+    size_t num_dumps = g.num_flight_dumps.load(std::memory_order_acquire);
+    g.flight_dump_requested = true;
+
+    // Wait for the flusher thread without holding the GIL
+    bool done = false;
+    Py_BEGIN_ALLOW_THREADS
+    for( int i=0 ; i<2000 ; ++i )
+    {
+        if( g.num_flight_dumps.load(std::memory_order_acquire)!=num_dumps )
+        {
+            done = true;
+            break;
+        }
+        usleep(5000);
+    }
+    Py_END_ALLOW_THREADS
+
+    if( !done )
+    {
+        PyErr_SetString( PyExc_TimeoutError, "Flight recorder dump timed out" );
+        return NULL;
+    }
+
+    return PyUnicode_FromString( g.last_flight_dump_filename );
+}
+
+// Copy Python thread names (threading.Thread.name) to the thread states, matching by native thread id
+static void update_python_thread_names()
+{
+    PyObject * threading = PyImport_ImportModule("threading");
+    if( !threading )
+    {
+        PyErr_Clear();
+        return;
+    }
+
+    PyObject * threads = PyObject_CallMethod( threading, "enumerate", NULL );
+    Py_DECREF(threading);
+    if( !threads )
+    {
+        PyErr_Clear();
+        return;
+    }
+
+    ThreadRegistry & registry = g.thread_registry;
+    size_t num_threads = registry.num_threads.load(std::memory_order_acquire);
+
+    for( Py_ssize_t i=0 ; i<PyList_Size(threads) ; ++i )
+    {
+        PyObject * thread = PyList_GetItem( threads, i );
+        PyObject * native_id = PyObject_GetAttrString( thread, "native_id" );
+        PyObject * name = PyObject_GetAttrString( thread, "name" );
+
+        if( native_id && native_id!=Py_None && name && PyUnicode_Check(name) )
+        {
+            pid_t tid = (pid_t)PyLong_AsLong(native_id);
+            const char * name_utf8 = PyUnicode_AsUTF8(name);
+
+            for( size_t j=0 ; name_utf8 && j<num_threads ; ++j )
+            {
+                ThreadState * state = registry.threads[j];
+                if( state->alive && state->tid==tid )
+                {
+                    snprintf( state->py_name, sizeof(state->py_name), "%s", name_utf8 );
+                }
+            }
+        }
+
+        Py_XDECREF(native_id);
+        Py_XDECREF(name);
+        PyErr_Clear();
+    }
+
+    Py_DECREF(threads);
+}
+
+// py_malloc_trace.thread_stats() : Return per-thread heap accounting counters as a list of dicts
+static PyObject * py_malloc_trace_thread_stats( PyObject * self, PyObject * args )
+{
+    if( !g.enabled || g.config.thread_stats_interval==0 )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "Per-thread heap accounting is not enabled. Set PY_MALLOC_TRACE_THREAD_STATS." );
+        return NULL;
+    }
+
+    update_python_thread_names();
+    update_thread_names();
+
+    std::vector<ThreadStats> stats;
+    collect_thread_stats(stats);
+
+    PyObject * result = PyList_New(0);
+    for( const ThreadStats & thread_stats : stats )
+    {
+        PyObject * item = Py_BuildValue( "{s:i,s:O,s:s,s:s,s:K,s:K,s:K,s:K,s:L,s:L}",
+            "tid", (int)thread_stats.tid,
+            "alive", thread_stats.alive ? Py_True : Py_False,
+            "name", thread_stats.name.c_str(),
+            "py_name", thread_stats.py_name.c_str(),
+            "alloc_count", (unsigned long long)thread_stats.alloc_count,
+            "alloc_bytes", (unsigned long long)thread_stats.alloc_bytes,
+            "free_count", (unsigned long long)thread_stats.free_count,
+            "free_bytes", (unsigned long long)thread_stats.free_bytes,
+            "live_count", (long long)( thread_stats.alloc_count - thread_stats.free_count ),
+            "live_bytes", (long long)( thread_stats.alloc_bytes - thread_stats.free_bytes ) );
+        if( !item )
+        {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_Append( result, item );
+        Py_DECREF(item);
+    }
+
+    return result;
+}
+
+// py_malloc_trace.tag_stats() : Return per-tag heap accounting counters as a list of dicts
+static PyObject * py_malloc_trace_tag_stats( PyObject * self, PyObject * args )
+{
+    if( !g.enabled || g.config.thread_stats_interval==0 )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "Per-thread heap accounting is not enabled. Set PY_MALLOC_TRACE_THREAD_STATS." );
+        return NULL;
+    }
+
+    std::vector<TagStats> stats;
+    collect_tag_stats(stats);
+
+    PyObject * result = PyList_New(0);
+    for( const TagStats & tag_stats : stats )
+    {
+        PyObject * item = Py_BuildValue( "{s:s,s:K,s:K,s:K,s:K,s:L,s:L}",
+            "name", tag_stats.name.c_str(),
+            "alloc_count", (unsigned long long)tag_stats.alloc_count,
+            "alloc_bytes", (unsigned long long)tag_stats.alloc_bytes,
+            "free_count", (unsigned long long)tag_stats.free_count,
+            "free_bytes", (unsigned long long)tag_stats.free_bytes,
+            "live_count", (long long)( tag_stats.alloc_count - tag_stats.free_count ),
+            "live_bytes", (long long)( tag_stats.alloc_bytes - tag_stats.free_bytes ) );
+        if( !item )
+        {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_Append( result, item );
+        Py_DECREF(item);
+    }
+
+    return result;
+}
+
+// py_malloc_trace.tag(name) : Context manager to attribute allocations in the current thread to a tag.
+// Create tag objects once and reuse them, as the name is interned at creation.
+struct PyMallocTraceTag
+{
+    PyObject_HEAD
+    uint32_t tag;
+};
+
+static int py_malloc_trace_tag_init( PyMallocTraceTag * self, PyObject * args, PyObject * kwds )
+{
+    const char * name;
+    if( !PyArg_ParseTuple( args, "s", &name ) )
+    {
+        return -1;
+    }
+
+    self->tag = g.tag_registry.intern(name);
+    if( self->tag==0 )
+    {
+        PyErr_Format( PyExc_RuntimeError, "Too many tags (max %d)", (int)TagRegistry::MAX_TAGS-1 );
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject * py_malloc_trace_tag_enter( PyMallocTraceTag * self, PyObject * args )
+{
+    // Nested tags beyond the max depth are ignored
+    if( t_tag_depth < MAX_TAG_DEPTH )
+    {
+        t_tag_stack[t_tag_depth] = t_current_tag;
+        t_current_tag = self->tag;
+    }
+    ++t_tag_depth;
+
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject * py_malloc_trace_tag_exit( PyMallocTraceTag * self, PyObject * args )
+{
+    if( t_tag_depth>0 )
+    {
+        --t_tag_depth;
+        if( t_tag_depth < MAX_TAG_DEPTH )
+        {
+            t_current_tag = t_tag_stack[t_tag_depth];
+        }
+    }
+
+    Py_RETURN_FALSE;
+}
+
+static PyObject * py_malloc_trace_tag_get_name( PyMallocTraceTag * self, void * closure )
+{
+    return PyUnicode_FromString( g.tag_registry.names[self->tag] );
+}
+
+static PyMethodDef py_malloc_trace_tag_methods[] = {
+    { "__enter__", (PyCFunction)py_malloc_trace_tag_enter, METH_NOARGS, NULL },
+    { "__exit__", (PyCFunction)py_malloc_trace_tag_exit, METH_VARARGS, NULL },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef py_malloc_trace_tag_getset[] = {
+    { (char*)"name", (getter)py_malloc_trace_tag_get_name, NULL, NULL, NULL },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyTypeObject py_malloc_trace_tag_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "py_malloc_trace.tag",
+};
+
+static PyMethodDef py_malloc_trace_methods[] = {
+    { "dump", py_malloc_trace_dump, METH_NOARGS, "Dump flight recorder buffers to a file, and return the filename" },
+    { "thread_stats", py_malloc_trace_thread_stats, METH_NOARGS, "Return per-thread heap accounting counters" },
+    { "tag_stats", py_malloc_trace_tag_stats, METH_NOARGS, "Return per-tag heap accounting counters" },
+    { NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef py_malloc_trace_module = {
+    PyModuleDef_HEAD_INIT,
+    "py_malloc_trace",
+    NULL,
+    -1,
+    py_malloc_trace_methods
+};
+
+// os._exit() doesn't run atexit() handlers, and is how forked child processes usually exit (e.g. multiprocessing).
+// Wrap it, so that buffered events are written to the trace file. C code calling _exit() directly
+// (e.g. after a failed exec() in a forked child process) isn't affected, as _exit() must stay async-signal-safe.
+static PyObject * original_os_exit = NULL;
+
+static PyObject * py_malloc_trace_os_exit( PyObject * self, PyObject * args )
+{
+    malloc_trace_stop();
+
+    return PyObject_Call( original_os_exit, args, NULL );
+}
+
+static PyMethodDef py_malloc_trace_os_exit_def = { "_exit", py_malloc_trace_os_exit, METH_VARARGS, "Stop malloc tracing, and exit the process without cleanup" };
+
+static void hook_os_exit()
+{
+    PyObject * os = PyImport_ImportModule("os");
+    if( !os )
+    {
+        PyErr_Clear();
+        return;
+    }
+
+    original_os_exit = PyObject_GetAttrString( os, "_exit" );
+    PyObject * func = original_os_exit ? PyCFunction_New( &py_malloc_trace_os_exit_def, NULL ) : NULL;
+    if( !func || PyObject_SetAttrString( os, "_exit", func )!=0 )
+    {
+        PyErr_Clear();
+    }
+
+    Py_XDECREF(func);
+    Py_DECREF(os);
+}
+
+static PyObject * PyInit_py_malloc_trace()
+{
+    py_malloc_trace_tag_type.tp_basicsize = sizeof(PyMallocTraceTag);
+    py_malloc_trace_tag_type.tp_flags = Py_TPFLAGS_DEFAULT;
+    py_malloc_trace_tag_type.tp_doc = "Context manager to attribute allocations in the current thread to a tag";
+    py_malloc_trace_tag_type.tp_methods = py_malloc_trace_tag_methods;
+    py_malloc_trace_tag_type.tp_getset = py_malloc_trace_tag_getset;
+    py_malloc_trace_tag_type.tp_init = (initproc)py_malloc_trace_tag_init;
+    py_malloc_trace_tag_type.tp_new = PyType_GenericNew;
+
+    if( PyType_Ready(&py_malloc_trace_tag_type) < 0 )
+    {
+        return NULL;
+    }
+
+    PyObject * module = PyModule_Create(&py_malloc_trace_module);
+    if( !module )
+    {
+        return NULL;
+    }
+
+    Py_INCREF(&py_malloc_trace_tag_type);
+    PyModule_AddObject( module, "tag", (PyObject*)&py_malloc_trace_tag_type );
+
+    return module;
+}
+
 int main( int argc, const char * argv[] )
 {
     int result = 0;
 
     // Start tracing malloc/free calls
     {
-        char trace_log_filename[256];
-        snprintf( trace_log_filename, sizeof(trace_log_filename)-1, TRACE_LOG_DIRNAME "malloc_trace.%d.log", getpid() );
-        malloc_trace_printf( "Starting malloc tracing : %s\n", trace_log_filename );
-        malloc_trace_start(trace_log_filename);
+        malloc_trace_start( TRACE_LOG_DIRNAME "malloc_trace" );
     }
 
     if(false)
@@ -409,8 +4319,12 @@ int main( int argc, const char * argv[] )
             wargv[i] = Py_DecodeLocale( argv[i], NULL );
         }
 
+        PyImport_AppendInittab( "py_malloc_trace", PyInit_py_malloc_trace );
+
         Py_Initialize();
 
+        hook_os_exit();
+
         result = Py_Main(argc, wargv);
 
         Py_Finalize();
@@ -1,4 +1,9 @@
 import os
+import sys
+import re
+import json
+import glob
+import collections
 import time
 import random
 import subprocess
@@ -21,5 +26,212 @@ result = subprocess.run(cmd, capture_output=True)
 with open(f"./memory_map.{pid}.txt","wb") as fd:
     fd.write(result.stdout)
 
+# Run a script in a new traced process, and return the completed process and the trace file name
+def run_traced( script, **env ):
+    launcher = os.readlink("/proc/self/exe")
+    result = subprocess.run( [ launcher, "-c", script ], env=dict( os.environ, **env ), capture_output=True, text=True )
+    assert result.returncode==0, result.stderr
+    logfile = re.search( r"Starting malloc tracing.* : (\S+)", result.stdout ).group(1)
+    return result, logfile
+
+# Compressed trace is decoded to the same live blocks as JSON trace
+leak_script = """
+import os
+blocks = [ bytearray( 1000000 + i * 4096 ) for i in range(100) ]
+del blocks[::2]
+os._exit(0)
+"""
+leak_size = sum( 1000000 + i * 4096 + 1 for i in range(1,100,2) ) # bytearray allocates 1 more byte for the terminating NUL
+parser_script = os.path.join( os.path.dirname(os.path.abspath(__file__)), "parse_malloc_trace_log.py" )
+for trace_format in [ "json", "lz" ]:
+    _, logfile = run_traced( leak_script, PY_MALLOC_TRACE_FORMAT=trace_format, PY_MALLOC_TRACE_MIN_SIZE="1000000" )
+    result = subprocess.run( [ sys.executable, parser_script, "--logfile", logfile ], capture_output=True, text=True )
+    os.remove(logfile)
+    assert f"Total remaining size: {leak_size}\n" in result.stdout, ( trace_format, result.stdout[-1000:], result.stderr[-1000:] )
+
+# Rotated segments stay within the maximum size, and are decoded to the same live blocks together
+segment_script = """
+import os
+blocks = []
+for i in range(20000):
+    block = bytearray( 300000 + i )
+    if i % 100 == 0:
+        blocks.append(block)
+del block
+os._exit(0)
+"""
+segment_leak_size = sum( 300000 + i + 1 for i in range(0,20000,100) )
+for trace_format in [ "json", "lz" ]:
+    max_segment_size = 64 * 1024
+    _, logfile = run_traced( segment_script, PY_MALLOC_TRACE_FORMAT=trace_format, PY_MALLOC_TRACE_MIN_SIZE="300000",
+        PY_MALLOC_TRACE_MAX_SEGMENT_SIZE=str(max_segment_size) )
+    segments = sorted( glob.glob( logfile.replace( ".0000.", ".*." ) ) )
+    sizes = [ os.path.getsize(segment) for segment in segments ]
+    result = subprocess.run( [ sys.executable, parser_script, "--logfile" ] + segments, capture_output=True, text=True )
+    for segment in segments:
+        os.remove(segment)
+    assert len(segments) > 1 and max(sizes) <= max_segment_size, ( trace_format, sizes )
+    assert f"Total remaining size: {segment_leak_size}\n" in result.stdout, ( trace_format, result.stdout[-1000:], result.stderr[-1000:] )
+
+# With PY_MALLOC_TRACE_MIN_AGE_US, blocks freed within the age are cancelled, and longer lived blocks are written
+# with both events, even when the flusher thread sees the free before releasing the allocation
+min_age_script = """
+import time
+for i in range(200):
+    block = bytearray(2000000)
+    time.sleep(0.003)
+    del block
+    bytearray(3000000)
+"""
+_, logfile = run_traced( min_age_script, PY_MALLOC_TRACE_MIN_AGE_US="1000", PY_MALLOC_TRACE_MIN_SIZE="2000000" )
+num_allocs = collections.Counter()
+num_frees = 0
+with open(logfile) as fd:
+    allocated = {}
+    for line in fd:
+        d = json.loads(line)
+        if d.get("op")==1:
+            num_allocs[ d["size"] ] += 1
+            allocated[ d["p"] ] = d["size"]
+        elif d.get("op")==2 and allocated.pop( d["p"], None )==2000001:
+            num_frees += 1
+os.remove(logfile)
+assert num_allocs[2000001]==200 and num_frees==200, ( num_allocs, num_frees )
+assert num_allocs[3000001] < 100, num_allocs
+
+# Allocations are attributed to the tag of the allocating thread, and frees to the tag of the allocation
+tag_script = """
+import json, threading, time
+import py_malloc_trace
+TAG = py_malloc_trace.tag("test_tag")
+blocks = []
+def allocate():
+    with TAG:
+        for i in range(100):
+            blocks.append( bytearray(100000) )
+thread = threading.Thread( target=allocate )
+thread.start()
+thread.join()
+del blocks[:50] # freed outside the tag, by another thread
+time.sleep(0.5) # for the flusher thread to apply the frees
+print( json.dumps( py_malloc_trace.tag_stats() ) )
+"""
+result, logfile = run_traced( tag_script, PY_MALLOC_TRACE_THREAD_STATS="1" )
+os.remove(logfile)
+tag_stats = { stats["name"] : stats for stats in json.loads( result.stdout.splitlines()[-1] ) }
+stats = tag_stats["test_tag"]
+block_size = 100001
+assert stats["alloc_bytes"] >= 100 * block_size, stats
+assert stats["free_bytes"] >= 50 * block_size, stats
+assert 50 * block_size <= stats["live_bytes"] < 60 * block_size, stats
+
+# Guarded blocks, including zero sized ones, are usable up to their size, and can be reallocated and freed
+guard_script = """
+import ctypes
+libc = ctypes.CDLL(None)
+libc.malloc.restype = ctypes.c_void_p
+libc.realloc.restype = ctypes.c_void_p
+libc.realloc.argtypes = [ ctypes.c_void_p, ctypes.c_size_t ]
+libc.free.argtypes = [ ctypes.c_void_p ]
+for i in range(1000):
+    p = libc.malloc(0)
+    ctypes.memset( p, 0xff, 1 ) # within the alignment padding
+    libc.free(p)
+    p = libc.malloc(10)
+    ctypes.memset( p, 0x5a, 10 )
+    p = libc.realloc( p, 20 )
+    assert ctypes.string_at( p, 10 ) == b"\\x5a" * 10
+    ctypes.memset( p, 0x5a, 20 )
+    libc.free(p)
+"""
+result, logfile = run_traced( guard_script, PY_MALLOC_TRACE_GUARD_SAMPLE_RATE="1", PY_MALLOC_TRACE_GUARD_SLOTS="8192" )
+os.remove(logfile)
+assert "py_malloc_trace:" not in result.stderr, result.stderr[-2000:]
+num_sampled = int( re.search( r"Guarded allocations : (\d+) sampled", result.stdout ).group(1) )
+assert num_sampled > 1000, num_sampled
+
+# Flight recorder dumps taken while threads keep allocating contain no torn events.
+# Each thread allocates increasing sizes, so a torn event breaks the order of sizes in time.
+flight_script = """
+import threading
+import py_malloc_trace
+def allocate():
+    for i in range(50000):
+        bytearray( 50000 + i )
+threads = [ threading.Thread( target=allocate ) for i in range(4) ]
+for thread in threads:
+    thread.start()
+while any( thread.is_alive() for thread in threads ):
+    print( "dump :", py_malloc_trace.dump() )
+for thread in threads:
+    thread.join()
+"""
+result, _ = run_traced( flight_script, PY_MALLOC_TRACE_MODE="flight", PY_MALLOC_TRACE_FLIGHT_EVENTS="64" )
+dump_filenames = re.findall( r"dump : (\S+)", result.stdout )
+assert len(dump_filenames) > 0, result.stdout
+num_events = 0
+for dump_filename in dump_filenames:
+    last_sizes = {}
+    with open(dump_filename) as fd:
+        for line in fd:
+            d = json.loads(line)
+            if d.get("op")==1 and 50000 < d["size"] <= 100000:
+                assert d["size"] > last_sizes.get( d["tid"], 0 ), ( dump_filename, line )
+                last_sizes[ d["tid"] ] = d["size"]
+                num_events += 1
+    os.remove(dump_filename)
+assert num_events > 0, dump_filenames
+
+# Pool allocator serves small blocks by size class. Blocks freed by another thread, and cached by exited threads,
+# flow back through the transfer caches, so repeating the same work with new threads reuses the same slabs.
+pool_script = """
+import ctypes, threading, queue
+libc = ctypes.CDLL(None)
+libc.malloc.restype = ctypes.c_void_p
+libc.realloc.restype = ctypes.c_void_p
+libc.realloc.argtypes = [ ctypes.c_void_p, ctypes.c_size_t ]
+libc.free.argtypes = [ ctypes.c_void_p ]
+libc.malloc_usable_size.argtypes = [ ctypes.c_void_p ]
+sizes = { 1:16, 16:16, 17:32, 100:112, 129:160, 1000:1024, 2049:2560, 4096:4096 }
+def produce( q, pattern ):
+    for i in range(20):
+        blocks = []
+        for size in sizes:
+            for j in range(50):
+                p = libc.malloc(size)
+                assert libc.malloc_usable_size(p)==sizes[size], ( size, libc.malloc_usable_size(p) )
+                ctypes.memset( p, pattern, size )
+                blocks.append( ( p, size ) )
+        q.put(blocks)
+    q.put(None)
+def consume( q, pattern ):
+    while True:
+        blocks = q.get()
+        if blocks is None:
+            break
+        for p, size in blocks:
+            p = libc.realloc( p, size * 2 ) # moves to another size class, or to glibc above 4096
+            assert ctypes.string_at( p, size )==bytes([pattern]) * size, size
+            libc.free(p)
+for round in range(%d):
+    threads = []
+    for pattern in range(1,5):
+        q = queue.Queue(1)
+        threads += [ threading.Thread( target=produce, args=(q,pattern) ), threading.Thread( target=consume, args=(q,pattern) ) ]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+"""
+pool_committed = {}
+for num_rounds in [ 1, 10 ]:
+    _, logfile = run_traced( pool_script % num_rounds, PY_MALLOC_TRACE_ALLOCATOR="pool",
+        PY_MALLOC_TRACE_HEAP_STATS="1", PY_MALLOC_TRACE_MIN_SIZE="1000000" )
+    with open(logfile) as fd:
+        heap_stats = [ d for d in map( json.loads, fd ) if d.get("type")=="heap_stats" ]
+    os.remove(logfile)
+    pool_committed[num_rounds] = heap_stats[-1]["pool_committed"]
+assert 0 < pool_committed[10] <= pool_committed[1] * 1.5, pool_committed
+
 print("Done")
 
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+// Binary trace format
+//
+// A trace file is a sequence of independent blocks. Each block starts with TraceBlockHeader,
+// followed by the (optionally compressed) payload. Delta encoding state is reset at every block,
+// so a decoder can start from any block boundary.
+//
+//   Meta block  : JSON lines text (header, module map, etc)
+//   Event block : sequence of delta encoded MallocCallHistory entries
+//
+// Compressed payloads use the LZ4 block format, so they can also be decoded by standard LZ4 libraries.
+
+static const char TRACE_BLOCK_MAGIC[4] = { 'P', 'M', 'T', 'B' };
+
+enum TraceBlockType
+{
+    TraceBlockType_Meta = 1,
+    TraceBlockType_Events = 2,
+};
+
+enum TraceBlockCodec
+{
+    TraceBlockCodec_Stored = 0,
+    TraceBlockCodec_LZ = 1,
+};
+
+struct TraceBlockHeader
+{
+    char magic[4];
+    uint8_t type;
+    uint8_t codec;
+    uint16_t reserved0;
+    uint32_t raw_size;
+    uint32_t compressed_size;
+    uint32_t num_events;
+    uint32_t reserved1;
+    uint64_t first_event; // event number of the first entry in this block
+};
+
+static_assert( sizeof(TraceBlockHeader)==32, "unexpected TraceBlockHeader size" );
+
+// ---
+
+static inline void put_varint( std::string & out, uint64_t value )
+{
+    while( value >= 0x80 )
+    {
+        out.push_back( (char)( (value & 0x7f) | 0x80 ) );
+        value >>= 7;
+    }
+    out.push_back( (char)value );
+}
+
+static inline bool get_varint( const uint8_t *& p, const uint8_t * end, uint64_t & value )
+{
+    value = 0;
+    for( int shift=0 ; shift<64 && p<end ; shift+=7 )
+    {
+        uint8_t b = *p++;
+        value |= (uint64_t)(b & 0x7f) << shift;
+        if( (b & 0x80)==0 )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline uint64_t zigzag_encode( int64_t value )
+{
+    return ( (uint64_t)value << 1 ) ^ (uint64_t)( value >> 63 );
+}
+
+static inline int64_t zigzag_decode( uint64_t value )
+{
+    return (int64_t)( value >> 1 ) ^ -(int64_t)( value & 1 );
+}
+
+// ---
+
+// LZ4 block format compressor. Single hash table, greedy matching.
+// Returns compressed size, or 0 if the data didn't shrink.
+static inline size_t lz_compress( const uint8_t * src, size_t src_size, uint8_t * dst, size_t dst_capacity )
+{
+    static const int HASH_BITS = 14;
+    static const size_t MIN_MATCH = 4;
+    static const size_t LAST_LITERALS = 5;
+    static const size_t MF_LIMIT = 12;
+
+    uint32_t hash_table[1<<HASH_BITS];
+    memset( hash_table, 0, sizeof(hash_table) );
+
+    const uint8_t * ip = src;
+    const uint8_t * anchor = src;
+    const uint8_t * const src_end = src + src_size;
+    const uint8_t * const match_limit = src_size > MF_LIMIT ? src_end - MF_LIMIT : src;
+    uint8_t * op = dst;
+    uint8_t * const dst_end = dst + dst_capacity;
+
+    auto hash = []( const uint8_t * p ) -> uint32_t
+    {
+        uint32_t v;
+        memcpy( &v, p, 4 );
+        return ( v * 2654435761U ) >> (32-HASH_BITS);
+    };
+
+    auto put_length = [&]( size_t len ) -> bool
+    {
+        while( len >= 255 )
+        {
+            if( op>=dst_end ) return false;
+            *op++ = 255;
+            len -= 255;
+        }
+        if( op>=dst_end ) return false;
+        *op++ = (uint8_t)len;
+        return true;
+    };
+
+    auto put_sequence = [&]( const uint8_t * literal, size_t literal_len, size_t offset, size_t match_len ) -> bool
+    {
+        if( op>=dst_end ) return false;
+        uint8_t * token = op++;
+
+        *token = (uint8_t)( ( literal_len>=15 ? 15 : literal_len ) << 4 );
+        if( literal_len>=15 && !put_length( literal_len-15 ) ) return false;
+
+        if( (size_t)(dst_end-op) < literal_len ) return false;
+        memcpy( op, literal, literal_len );
+        op += literal_len;
+
+        if( match_len==0 ) // last sequence has literals only
+        {
+            return true;
+        }
+
+        if( dst_end-op < 2 ) return false;
+        *op++ = (uint8_t)( offset & 0xff );
+        *op++ = (uint8_t)( offset >> 8 );
+
+        size_t ml = match_len - MIN_MATCH;
+        *token |= (uint8_t)( ml>=15 ? 15 : ml );
+        if( ml>=15 && !put_length( ml-15 ) ) return false;
+
+        return true;
+    };
+
+    if( src_size > MF_LIMIT )
+    {
+        while( ip < match_limit )
+        {
+            uint32_t h = hash(ip);
+            const uint8_t * ref = src + hash_table[h];
+            hash_table[h] = (uint32_t)( ip - src );
+
+            if( ref>=ip || ip-ref > 0xffff || memcmp( ref, ip, MIN_MATCH )!=0 )
+            {
+                ++ip;
+                continue;
+            }
+
+            // Extend the match, leaving last literals
+            const uint8_t * match_end = ip + MIN_MATCH;
+            const uint8_t * r = ref + MIN_MATCH;
+            while( match_end < src_end - LAST_LITERALS && *match_end==*r )
+            {
+                ++match_end;
+                ++r;
+            }
+
+            if( !put_sequence( anchor, ip-anchor, ip-ref, match_end-ip ) )
+            {
+                return 0;
+            }
+
+            ip = match_end;
+            anchor = ip;
+        }
+    }
+
+    if( !put_sequence( anchor, src_end-anchor, 0, 0 ) )
+    {
+        return 0;
+    }
+
+    size_t compressed_size = op - dst;
+    return compressed_size < src_size ? compressed_size : 0;
+}
+
+// Returns decompressed size, or -1 if the input is malformed
+static inline long lz_decompress( const uint8_t * src, size_t src_size, uint8_t * dst, size_t dst_capacity )
+{
+    const uint8_t * ip = src;
+    const uint8_t * const src_end = src + src_size;
+    uint8_t * op = dst;
+    uint8_t * const dst_end = dst + dst_capacity;
+
+    auto get_length = [&]( size_t & len ) -> bool
+    {
+        uint8_t b;
+        do
+        {
+            if( ip>=src_end ) return false;
+            b = *ip++;
+            len += b;
+        } while( b==255 );
+        return true;
+    };
+
+    while( ip < src_end )
+    {
+        uint8_t token = *ip++;
+
+        size_t literal_len = token >> 4;
+        if( literal_len==15 && !get_length(literal_len) ) return -1;
+        if( (size_t)(src_end-ip) < literal_len || (size_t)(dst_end-op) < literal_len ) return -1;
+        memcpy( op, ip, literal_len );
+        ip += literal_len;
+        op += literal_len;
+
+        if( ip>=src_end )
+        {
+            break;
+        }
+
+        if( src_end-ip < 2 ) return -1;
+        size_t offset = ip[0] | ( ip[1] << 8 );
+        ip += 2;
+        if( offset==0 || offset > (size_t)(op-dst) ) return -1;
+
+        size_t match_len = token & 15;
+        if( match_len==15 && !get_length(match_len) ) return -1;
+        match_len += 4;
+        if( (size_t)(dst_end-op) < match_len ) return -1;
+
+        // Byte by byte, as the match can overlap with the output
+        const uint8_t * ref = op - offset;
+        for( size_t i=0 ; i<match_len ; ++i )
+        {
+            op[i] = ref[i];
+        }
+        op += match_len;
+    }
+
+    return op - dst;
+}
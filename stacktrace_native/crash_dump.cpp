@@ -0,0 +1,554 @@
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <elf.h>
+#include <link.h>
+
+#include "stacktrace_native.h"
+#include "signal_safe.h"
+
+// Crash dump file
+//
+// Binary file written by the crash handler, to be symbolized offline by symbolize_crash_dump.py.
+// All values are in native byte order. The file starts with CrashDumpHeader, followed by records.
+// Each record starts with CrashDumpRecord, and its payload is padded to 8 bytes.
+//
+//   Signal : CrashDumpSignal
+//   Thread : CrashDumpThread, regs[num_regs], frames[num_frames], stack memory[stack_size]
+//   Module : CrashDumpModule, build_id[build_id_size], path[path_size]
+//   PythonStack : CrashDumpPythonStack, then for each frame (innermost first) CrashDumpPythonFrame, filename[filename_size], name[name_size]
+//   End    : no payload
+
+static const char CRASH_DUMP_MAGIC[8] = { 'S', 'T', 'N', 'D', 'U', 'M', 'P', '\0' };
+static const uint32_t CRASH_DUMP_VERSION = 1;
+
+enum CrashDumpRecordType
+{
+    CrashDumpRecordType_Signal = 1,
+    CrashDumpRecordType_Thread = 2,
+    CrashDumpRecordType_Module = 3,
+    CrashDumpRecordType_PythonStack = 4,
+    CrashDumpRecordType_End = 0xffffffff,
+};
+
+struct CrashDumpHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t arch; // CaptureArch
+    uint64_t timestamp; // CLOCK_REALTIME in nanoseconds
+    int32_t pid;
+    int32_t crashed_tid;
+};
+
+struct CrashDumpRecord
+{
+    uint32_t type;
+    uint32_t size; // payload size, including padding
+};
+
+struct CrashDumpSignal
+{
+    int32_t signo;
+    int32_t code;
+    uint64_t addr;
+    int32_t sender_pid;
+    int32_t reserved;
+};
+
+struct CrashDumpThread
+{
+    int32_t tid;
+    uint32_t flags; // CaptureFlags
+    char name[16];
+    uint32_t num_regs;
+    uint32_t num_frames;
+    uint64_t stack_start;
+    uint64_t stack_size;
+};
+
+struct CrashDumpModule
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t load_bias; // addresses in the module minus load_bias are addresses in the ELF file
+    uint32_t build_id_size;
+    uint32_t path_size;
+};
+
+struct CrashDumpPythonStack
+{
+    int32_t tid;
+    uint32_t num_frames;
+};
+
+struct CrashDumpPythonFrame
+{
+    uint32_t native_index; // index of the native frame running this frame in the thread record, or 0xffffffff
+    int32_t line;
+    uint32_t filename_size;
+    uint32_t name_size;
+};
+
+static_assert( sizeof(CrashDumpHeader)==32, "unexpected CrashDumpHeader size" );
+static_assert( sizeof(CrashDumpThread)==48, "unexpected CrashDumpThread size" );
+
+//-----
+
+static const size_t MAX_BUILD_ID_SIZE = 64;
+
+static int crash_dump_dir_fd = -1;
+static PythonFrameInfo python_frame_infos[CAPTURE_MAX_PYTHON_FRAMES];
+static uint32_t python_native_indices[CAPTURE_MAX_PYTHON_FRAMES];
+static char crash_dump_dir[PATH_MAX];
+static char crash_dump_filename[PATH_MAX];
+
+bool is_crash_dump_enabled()
+{
+    return crash_dump_dir_fd >= 0;
+}
+
+static inline size_t padded_size( size_t size )
+{
+    return ( size + 7 ) & ~(size_t)7;
+}
+
+static void write_record_header( SignalSafeWriter & out, CrashDumpRecordType type, size_t payload_size )
+{
+    CrashDumpRecord record;
+    record.type = type;
+    record.size = (uint32_t)padded_size(payload_size);
+    out.data( &record, sizeof(record) );
+}
+
+static void write_padding( SignalSafeWriter & out, size_t payload_size )
+{
+    static const char zeros[8] = {};
+    out.data( zeros, padded_size(payload_size) - payload_size );
+}
+
+//-----
+
+// Build-id and load bias of an ELF image mapped at start, read with safe_read()
+static void read_elf_info( uintptr_t start, uint8_t * build_id, uint32_t & build_id_size, uintptr_t & load_bias )
+{
+    build_id_size = 0;
+    load_bias = start;
+
+    ElfW(Ehdr) ehdr;
+    if( safe_read( &ehdr, (const void*)start, sizeof(ehdr) )!=sizeof(ehdr) || memcmp( ehdr.e_ident, ELFMAG, SELFMAG )!=0 )
+    {
+        return;
+    }
+
+    ElfW(Phdr) phdrs[32];
+    size_t num_phdrs = ehdr.e_phnum < 32 ? ehdr.e_phnum : 32;
+    size_t phdrs_size = num_phdrs * sizeof(ElfW(Phdr));
+    if( safe_read( phdrs, (const void*)( start + ehdr.e_phoff ), phdrs_size )!=phdrs_size )
+    {
+        return;
+    }
+
+    // The mapping at file offset 0 is the first PT_LOAD segment
+    for( size_t i=0 ; i<num_phdrs ; ++i )
+    {
+        if( phdrs[i].p_type==PT_LOAD )
+        {
+            load_bias = start - ( phdrs[i].p_vaddr & ~(uintptr_t)( phdrs[i].p_align > 1 ? phdrs[i].p_align - 1 : 0 ) );
+            break;
+        }
+    }
+
+    for( size_t i=0 ; i<num_phdrs && build_id_size==0 ; ++i )
+    {
+        if( phdrs[i].p_type!=PT_NOTE )
+        {
+            continue;
+        }
+
+        uint8_t notes[1024];
+        size_t notes_size = phdrs[i].p_filesz < sizeof(notes) ? phdrs[i].p_filesz : sizeof(notes);
+        notes_size = safe_read( notes, (const void*)( load_bias + phdrs[i].p_vaddr ), notes_size );
+
+        for( size_t pos=0 ; pos + sizeof(ElfW(Nhdr)) <= notes_size ; )
+        {
+            const ElfW(Nhdr) * note = (const ElfW(Nhdr)*)( notes + pos );
+            size_t name_pos = pos + sizeof(ElfW(Nhdr));
+            size_t desc_pos = name_pos + ( ( note->n_namesz + 3 ) & ~3 );
+            size_t next_pos = desc_pos + ( ( note->n_descsz + 3 ) & ~3 );
+            if( next_pos > notes_size )
+            {
+                break;
+            }
+
+            if( note->n_type==NT_GNU_BUILD_ID && note->n_namesz==4 && memcmp( notes + name_pos, "GNU", 4 )==0
+                && note->n_descsz <= MAX_BUILD_ID_SIZE )
+            {
+                memcpy( build_id, notes + desc_pos, note->n_descsz );
+                build_id_size = note->n_descsz;
+                break;
+            }
+
+            pos = next_pos;
+        }
+    }
+}
+
+struct ModuleInfo
+{
+    uintptr_t start;
+    uintptr_t end;
+    bool executable;
+    char path[PATH_MAX];
+};
+
+static void write_module( SignalSafeWriter & out, const ModuleInfo & module )
+{
+    if( !module.executable )
+    {
+        return;
+    }
+
+    CrashDumpModule record;
+    uint8_t build_id[MAX_BUILD_ID_SIZE];
+    uintptr_t load_bias;
+    read_elf_info( module.start, build_id, record.build_id_size, load_bias );
+
+    record.start = module.start;
+    record.end = module.end;
+    record.load_bias = load_bias;
+    record.path_size = (uint32_t)strlen(module.path);
+
+    size_t payload_size = sizeof(record) + record.build_id_size + record.path_size;
+    write_record_header( out, CrashDumpRecordType_Module, payload_size );
+    out.data( &record, sizeof(record) );
+    out.data( build_id, record.build_id_size );
+    out.data( module.path, record.path_size );
+    write_padding( out, payload_size );
+}
+
+static uintptr_t parse_hex( const char *& s )
+{
+    uintptr_t value = 0;
+    while( true )
+    {
+        char c = *s;
+        if( c>='0' && c<='9' ) value = value * 16 + ( c - '0' );
+        else if( c>='a' && c<='f' ) value = value * 16 + ( c - 'a' + 10 );
+        else break;
+        ++s;
+    }
+    return value;
+}
+
+// Handle a line of /proc/self/maps : "start-end perms offset dev inode path"
+static void handle_maps_line( SignalSafeWriter & out, const char * line, ModuleInfo & module )
+{
+    const char * s = line;
+    uintptr_t start = parse_hex(s);
+    if( *s++!='-' ) return;
+    uintptr_t end = parse_hex(s);
+    if( *s++!=' ' ) return;
+    char perms[4] = { s[0], s[1], s[2], s[3] };
+    s += 5;
+    uintptr_t offset = parse_hex(s);
+
+    // Skip dev and inode to the path
+    for( int field=0 ; field<2 ; ++field )
+    {
+        while( *s==' ' ) ++s;
+        while( *s && *s!=' ' ) ++s;
+    }
+    while( *s==' ' ) ++s;
+
+    if( *s!='/' )
+    {
+        return;
+    }
+
+    // Mappings of a file are contiguous, starting from the one at offset 0
+    if( offset==0 || strcmp( s, module.path )!=0 )
+    {
+        write_module( out, module );
+        module.start = start;
+        module.executable = false;
+        strncpy( module.path, s, sizeof(module.path)-1 );
+        module.path[sizeof(module.path)-1] = '\0';
+        if( offset!=0 )
+        {
+            module.path[0] = '\0'; // mapped without its ELF header
+        }
+    }
+
+    module.end = end;
+    if( perms[2]=='x' && module.path[0] )
+    {
+        module.executable = true;
+    }
+}
+
+// Read /proc/self/maps with a small buffer, without stdio
+static void write_modules( SignalSafeWriter & out )
+{
+    int fd = open( "/proc/self/maps", O_RDONLY );
+    if( fd < 0 )
+    {
+        return;
+    }
+
+    static ModuleInfo module; // too large for the alternate signal stack
+    memset( &module, 0, sizeof(module) );
+
+    char line[PATH_MAX + 128];
+    size_t line_len = 0;
+    char buf[4096];
+    ssize_t n;
+    while( ( n = read( fd, buf, sizeof(buf) ) ) > 0 )
+    {
+        for( ssize_t i=0 ; i<n ; ++i )
+        {
+            if( buf[i]=='\n' )
+            {
+                line[line_len] = '\0';
+                handle_maps_line( out, line, module );
+                line_len = 0;
+            }
+            else if( line_len < sizeof(line)-1 )
+            {
+                line[line_len++] = buf[i];
+            }
+        }
+    }
+
+    write_module( out, module );
+
+    close(fd);
+}
+
+//-----
+
+static void write_python_stack( SignalSafeWriter & out, const ThreadCapture & capture )
+{
+    match_python_frames( capture.frames, capture.num_frames, capture.num_python_frames, python_native_indices );
+
+    size_t payload_size = sizeof(CrashDumpPythonStack);
+    for( size_t i=0 ; i<capture.num_python_frames ; ++i )
+    {
+        read_python_frame_info( capture.python_frames[i], python_frame_infos[i] );
+        payload_size += sizeof(CrashDumpPythonFrame) + strlen(python_frame_infos[i].filename) + strlen(python_frame_infos[i].name);
+    }
+
+    CrashDumpPythonStack record;
+    record.tid = capture.tid;
+    record.num_frames = capture.num_python_frames;
+    write_record_header( out, CrashDumpRecordType_PythonStack, payload_size );
+    out.data( &record, sizeof(record) );
+
+    for( size_t i=0 ; i<capture.num_python_frames ; ++i )
+    {
+        const PythonFrameInfo & info = python_frame_infos[i];
+
+        CrashDumpPythonFrame frame;
+        frame.native_index = python_native_indices[i];
+        frame.line = info.line;
+        frame.filename_size = strlen(info.filename);
+        frame.name_size = strlen(info.name);
+        out.data( &frame, sizeof(frame) );
+        out.data( info.filename, frame.filename_size );
+        out.data( info.name, frame.name_size );
+    }
+
+    write_padding( out, payload_size );
+}
+
+static void write_threads( SignalSafeWriter & out, size_t num_threads )
+{
+    for( size_t i=0 ; i<num_threads ; ++i )
+    {
+        const ThreadCapture & capture = thread_capture.threads[i];
+        bool captured = capture.state.load(std::memory_order_acquire)==CaptureState_Done;
+
+        CrashDumpThread record;
+        memset( &record, 0, sizeof(record) );
+        record.tid = capture.tid;
+        record.flags = captured ? capture.flags : 0;
+        memcpy( record.name, capture.name, sizeof(record.name) );
+        if( captured )
+        {
+            record.num_regs = capture.num_regs;
+            record.num_frames = capture.num_frames;
+            record.stack_start = capture.stack_start;
+            record.stack_size = capture.stack_size;
+        }
+
+        size_t payload_size = sizeof(record) + record.num_regs * 8 + record.num_frames * 8 + record.stack_size;
+        write_record_header( out, CrashDumpRecordType_Thread, payload_size );
+        out.data( &record, sizeof(record) );
+        out.data( capture.regs, record.num_regs * 8 );
+        for( size_t j=0 ; j<record.num_frames ; ++j )
+        {
+            uint64_t frame = (uintptr_t)capture.frames[j];
+            out.data( &frame, 8 );
+        }
+        out.data( capture.stack, record.stack_size );
+        write_padding( out, payload_size );
+
+        if( captured && capture.num_python_frames > 0 )
+        {
+            write_python_stack( out, capture );
+        }
+    }
+}
+
+static char * append_str( char * p, const char * end, const char * s )
+{
+    while( *s && p < end )
+    {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+static char * append_udec( char * p, const char * end, uint64_t value )
+{
+    char digits[20];
+    int n = 0;
+    do
+    {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while( value );
+
+    while( n > 0 && p < end )
+    {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+const char * write_crash_dump( int sig, const siginfo_t * info, size_t num_threads )
+{
+    if( crash_dump_dir_fd < 0 )
+    {
+        return NULL;
+    }
+
+    struct timespec now;
+    clock_gettime( CLOCK_REALTIME, &now );
+
+    // "{dir}/stacktrace_native.{pid}.{seconds}.dmp"
+    char filename[64];
+    char * p = filename;
+    const char * end = filename + sizeof(filename) - 1;
+    p = append_str( p, end, MODULE_NAME "." );
+    p = append_udec( p, end, getpid() );
+    p = append_str( p, end, "." );
+    p = append_udec( p, end, now.tv_sec );
+    p = append_str( p, end, ".dmp" );
+    *p = '\0';
+
+    int fd = openat( crash_dump_dir_fd, filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if( fd < 0 )
+    {
+        return NULL;
+    }
+
+    {
+        SignalSafeWriter out(fd);
+
+        CrashDumpHeader header;
+        memset( &header, 0, sizeof(header) );
+        memcpy( header.magic, CRASH_DUMP_MAGIC, sizeof(header.magic) );
+        header.version = CRASH_DUMP_VERSION;
+        header.arch = get_capture_arch();
+        header.timestamp = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+        header.pid = getpid();
+        header.crashed_tid = get_tid();
+        out.data( &header, sizeof(header) );
+
+        CrashDumpSignal signal_record;
+        memset( &signal_record, 0, sizeof(signal_record) );
+        signal_record.signo = sig;
+        signal_record.code = info->si_code;
+        signal_record.addr = (uintptr_t)info->si_addr;
+        signal_record.sender_pid = info->si_code<=0 ? info->si_pid : 0;
+        write_record_header( out, CrashDumpRecordType_Signal, sizeof(signal_record) );
+        out.data( &signal_record, sizeof(signal_record) );
+
+        write_threads( out, num_threads );
+        write_modules( out );
+
+        write_record_header( out, CrashDumpRecordType_End, 0 );
+    }
+
+    close(fd);
+
+    p = crash_dump_filename;
+    end = crash_dump_filename + sizeof(crash_dump_filename) - 1;
+    p = append_str( p, end, crash_dump_dir );
+    p = append_str( p, end, "/" );
+    p = append_str( p, end, filename );
+    *p = '\0';
+    return crash_dump_filename;
+}
+
+//-----
+
+PyObject * _enable_crash_dump( PyObject * self, PyObject * args, PyObject * kwds )
+{
+    const char * directory;
+    int max_threads = 256;
+    int stack_size = 16 * 1024;
+
+    static const char * kwlist[] = {
+        "directory",
+        "max_threads",
+        "stack_size",
+        NULL
+    };
+
+    if( ! PyArg_ParseTupleAndKeywords( args, kwds, "s|ii", const_cast<char**>(kwlist), &directory, &max_threads, &stack_size ) )
+    {
+        return NULL;
+    }
+
+    if( max_threads<=0 || stack_size<0 )
+    {
+        PyErr_SetString( PyExc_ValueError, "max_threads and stack_size must be positive" );
+        return NULL;
+    }
+
+    if( strlen(directory) >= sizeof(crash_dump_dir) - 64 )
+    {
+        PyErr_SetString( PyExc_ValueError, "directory name is too long" );
+        return NULL;
+    }
+
+    // Open the directory now, as the path may not be resolvable in a crashing process (e.g. out of file descriptors)
+    int fd = open( directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if( fd < 0 )
+    {
+        PyErr_SetFromErrnoWithFilename( PyExc_OSError, directory );
+        return NULL;
+    }
+
+    if( !init_thread_capture( max_threads, stack_size ) )
+    {
+        close(fd);
+        PyErr_SetString( PyExc_OSError, "failed to allocate thread capture buffers" );
+        return NULL;
+    }
+
+    if( crash_dump_dir_fd >= 0 )
+    {
+        close(crash_dump_dir_fd);
+    }
+    strcpy( crash_dump_dir, directory );
+    crash_dump_dir_fd = fd;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
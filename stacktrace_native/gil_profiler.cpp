@@ -0,0 +1,696 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+
+#include "stacktrace_native.h"
+
+// GIL contention profiler
+//
+// Python 3.7 doesn't have hooks for GIL transitions, so the calls from the interpreter to pthread_cond_signal()
+// and pthread_cond_timedwait() are redirected to hook functions, by replacing their entries in the GOT of the
+// module which contains the interpreter (libpython, or the executable when it is statically linked).
+// Only calls on the condition variables of the GIL are recorded:
+//
+//   take_gil() : pthread_cond_timedwait( gil.cond ) while another thread holds the GIL -> wait starts
+//                pthread_cond_signal( gil.switch_cond ) after taking the GIL             -> wait ends, hold starts
+//   drop_gil() : pthread_cond_signal( gil.cond ) after releasing the GIL                 -> hold ends
+//
+// All of these are called with gil.mutex locked, so the hooks never run concurrently, and while the caller of
+// get_gil_profile() holds the GIL, no other thread can record a hold or an acquisition.
+
+//-----
+
+static const size_t GIL_MAX_THREADS = 256;
+static const size_t GIL_HISTOGRAM_BUCKETS = 32;
+static const size_t GIL_MAX_HOLD_EVENTS = 32;
+static const size_t GIL_HOLD_MAX_FRAMES = 32;
+static const size_t GIL_HOLD_MAX_PYTHON_FRAMES = 32;
+
+// Same layout as struct _gil_runtime_state of Python 3.7 (Include/internal/gil.h)
+struct GilRuntimeState
+{
+    unsigned long interval;
+    uintptr_t last_holder;
+    int locked;
+    unsigned long switch_number;
+    pthread_cond_t cond;
+    pthread_mutex_t mutex;
+    pthread_cond_t switch_cond;
+    pthread_mutex_t switch_mutex;
+};
+
+// Bucket 0 : less than 1us. Bucket i : [ 2^(i-1), 2^i ) us.
+struct GilHistogram
+{
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[GIL_HISTOGRAM_BUCKETS];
+};
+
+struct GilThread
+{
+    pid_t tid;
+    unsigned long ident; // pthread_self(), same as threading.get_ident()
+    uint64_t wait_start_ns;
+    uint64_t hold_start_ns;
+    GilHistogram wait;
+    GilHistogram hold;
+};
+
+// Long hold, with the stack when the GIL was released. Only the longest ones are kept.
+struct GilHoldEvent
+{
+    unsigned long ident;
+    pid_t tid;
+    uint64_t duration_ns;
+    uint32_t num_frames;
+    void * frames[GIL_HOLD_MAX_FRAMES];
+    uint32_t num_python_frames;
+    PythonFrameInfo python_frames[GIL_HOLD_MAX_PYTHON_FRAMES];
+};
+
+struct GotEntry
+{
+    const char * symbol;
+    void * hook;
+    void ** address;
+    void * previous; // value in the GOT before patching
+};
+
+struct GilProfilerState
+{
+    std::atomic<bool> active;
+    uint32_t session;
+    const GilRuntimeState * gil;
+    uint64_t long_hold_ns;
+
+    GilThread threads[GIL_MAX_THREADS];
+    std::atomic<size_t> num_threads;
+    uint64_t num_lost_threads;
+
+    GilHoldEvent hold_events[GIL_MAX_HOLD_EVENTS];
+    size_t num_hold_events;
+
+    int (*cond_signal)( pthread_cond_t * );
+    int (*cond_timedwait)( pthread_cond_t *, pthread_mutex_t *, const struct timespec * );
+};
+
+static GilProfilerState gil_profiler;
+
+// Slot of the calling thread, valid while gil_thread_session matches
+static __thread GilThread * gil_thread = NULL;
+static __thread uint32_t gil_thread_session = 0;
+
+//-----
+
+static inline uint64_t get_time_ns()
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void record( GilHistogram & histogram, uint64_t ns )
+{
+    uint64_t us = ns / 1000;
+    size_t bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if( bucket >= GIL_HISTOGRAM_BUCKETS )
+    {
+        bucket = GIL_HISTOGRAM_BUCKETS - 1;
+    }
+
+    histogram.count++;
+    histogram.total_ns += ns;
+    if( ns > histogram.max_ns )
+    {
+        histogram.max_ns = ns;
+    }
+    histogram.buckets[bucket]++;
+}
+
+// Called with gil.mutex locked
+static GilThread * get_gil_thread()
+{
+    if( gil_thread_session==gil_profiler.session )
+    {
+        return gil_thread;
+    }
+
+    GilThread * thread = NULL;
+    size_t index = gil_profiler.num_threads.load( std::memory_order_relaxed );
+    if( index < GIL_MAX_THREADS )
+    {
+        thread = &gil_profiler.threads[index];
+        memset( thread, 0, sizeof(GilThread) );
+        thread->tid = get_tid();
+        thread->ident = (unsigned long)pthread_self();
+        gil_profiler.num_threads.store( index + 1, std::memory_order_release );
+    }
+    else
+    {
+        gil_profiler.num_lost_threads++;
+    }
+
+    gil_thread = thread;
+    gil_thread_session = gil_profiler.session;
+    return thread;
+}
+
+// Not inlined, so that backtrace() has a fixed number of frames of this module before the interpreter
+__attribute__((noinline)) static void record_hold_event( GilThread & thread, uint64_t duration_ns )
+{
+    // When full, the shortest event is replaced
+    size_t index = gil_profiler.num_hold_events;
+    if( index >= GIL_MAX_HOLD_EVENTS )
+    {
+        index = 0;
+        for( size_t i=1 ; i<GIL_MAX_HOLD_EVENTS ; ++i )
+        {
+            if( gil_profiler.hold_events[i].duration_ns < gil_profiler.hold_events[index].duration_ns )
+            {
+                index = i;
+            }
+        }
+        if( gil_profiler.hold_events[index].duration_ns >= duration_ns )
+        {
+            return;
+        }
+    }
+    else
+    {
+        gil_profiler.num_hold_events++;
+    }
+
+    GilHoldEvent & event = gil_profiler.hold_events[index];
+    event.ident = thread.ident;
+    event.tid = thread.tid;
+    event.duration_ns = duration_ns;
+
+    // Without this function and the hook, starting from drop_gil()
+    const size_t skip = 2;
+    void * frames[GIL_HOLD_MAX_FRAMES + skip];
+    size_t num_frames = backtrace( frames, GIL_HOLD_MAX_FRAMES + skip );
+    event.num_frames = num_frames > skip ? num_frames - skip : 0;
+    memcpy( event.frames, frames + skip, event.num_frames * sizeof(void*) );
+
+    // Names are resolved now, as code objects can be freed after the frames return
+    PythonFrameCapture python_frames[GIL_HOLD_MAX_PYTHON_FRAMES];
+    event.num_python_frames = read_python_stack( python_frames, GIL_HOLD_MAX_PYTHON_FRAMES, false );
+    for( uint32_t i=0 ; i<event.num_python_frames ; ++i )
+    {
+        read_python_frame_info( python_frames[i], event.python_frames[i] );
+    }
+}
+
+static int hook_cond_signal( pthread_cond_t * cond )
+{
+    const GilRuntimeState * gil = gil_profiler.gil;
+    if( gil_profiler.active.load( std::memory_order_relaxed ) && ( cond==&gil->cond || cond==&gil->switch_cond ) )
+    {
+        GilThread * thread = get_gil_thread();
+        if( thread )
+        {
+            uint64_t now = get_time_ns();
+            if( cond==&gil->switch_cond )
+            {
+                // Taken the GIL. Without waiting, it was not held by other threads.
+                record( thread->wait, thread->wait_start_ns ? now - thread->wait_start_ns : 0 );
+                thread->wait_start_ns = 0;
+                thread->hold_start_ns = now;
+            }
+            else if( thread->hold_start_ns )
+            {
+                uint64_t duration_ns = now - thread->hold_start_ns;
+                record( thread->hold, duration_ns );
+                thread->hold_start_ns = 0;
+
+                if( gil_profiler.long_hold_ns && duration_ns >= gil_profiler.long_hold_ns )
+                {
+                    record_hold_event( *thread, duration_ns );
+                }
+            }
+        }
+    }
+
+    return gil_profiler.cond_signal( cond );
+}
+
+static int hook_cond_timedwait( pthread_cond_t * cond, pthread_mutex_t * mutex, const struct timespec * abstime )
+{
+    const GilRuntimeState * gil = gil_profiler.gil;
+    if( gil_profiler.active.load( std::memory_order_relaxed ) && cond==&gil->cond )
+    {
+        // take_gil() waits in a loop, with a timeout of the switch interval
+        GilThread * thread = get_gil_thread();
+        if( thread && !thread->wait_start_ns )
+        {
+            thread->wait_start_ns = get_time_ns();
+        }
+    }
+
+    return gil_profiler.cond_timedwait( cond, mutex, abstime );
+}
+
+static GotEntry got_entries[] =
+{
+    { "pthread_cond_signal", (void*)hook_cond_signal, NULL, NULL },
+    { "pthread_cond_timedwait", (void*)hook_cond_timedwait, NULL, NULL },
+};
+
+//-----
+
+// The GIL state is inside _PyRuntime, at an offset which depends on the build. It is located by its values
+// while the calling thread holds the GIL.
+static const GilRuntimeState * find_gil_state()
+{
+    const uint8_t * runtime = (const uint8_t*)dlsym( RTLD_DEFAULT, "_PyRuntime" );
+    if( !runtime )
+    {
+        return NULL;
+    }
+
+    const size_t scan_size = 16 * 1024;
+    uint8_t * copy = (uint8_t*)malloc( scan_size );
+    if( !copy )
+    {
+        return NULL;
+    }
+    size_t size = safe_read( copy, runtime, scan_size );
+
+    unsigned long interval = _PyEval_GetSwitchInterval();
+    uintptr_t tstate = (uintptr_t)PyThreadState_Get();
+
+    const GilRuntimeState * found = NULL;
+    for( size_t offset=0 ; offset + sizeof(GilRuntimeState) <= size ; offset += sizeof(long) )
+    {
+        GilRuntimeState gil;
+        memcpy( &gil, copy + offset, sizeof(gil) );
+        if( gil.interval==interval && gil.last_holder==tstate && gil.locked==1 )
+        {
+            found = (const GilRuntimeState*)( runtime + offset );
+            break;
+        }
+    }
+
+    free( copy );
+    return found;
+}
+
+struct GotSearch
+{
+    uintptr_t address; // inside the module
+    bool found;
+};
+
+static void patch_got_entry( const ElfW(Addr) base, const ElfW(Phdr) * phdrs, int num_phdrs, void ** address, void * value )
+{
+    // Full RELRO makes the GOT read-only after relocation
+    int prot = PROT_READ | PROT_WRITE;
+    for( int i=0 ; i<num_phdrs ; ++i )
+    {
+        uintptr_t start = base + phdrs[i].p_vaddr;
+        if( phdrs[i].p_type==PT_GNU_RELRO && (uintptr_t)address >= start && (uintptr_t)address < start + phdrs[i].p_memsz )
+        {
+            prot = PROT_READ;
+        }
+    }
+
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    void * page = (void*)( (uintptr_t)address & ~( page_size - 1 ) );
+    if( prot==PROT_READ && mprotect( page, page_size, PROT_READ | PROT_WRITE )!=0 )
+    {
+        return;
+    }
+    __atomic_store_n( address, value, __ATOMIC_SEQ_CST );
+    if( prot==PROT_READ )
+    {
+        mprotect( page, page_size, PROT_READ );
+    }
+}
+
+static void find_got_entries_in_relocations( ElfW(Addr) base, const ElfW(Rela) * relocations, size_t size, const ElfW(Sym) * symbols, const char * strings )
+{
+    for( size_t i=0 ; i<size/sizeof(ElfW(Rela)) ; ++i )
+    {
+        const ElfW(Rela) & rela = relocations[i];
+        unsigned long type = ELF64_R_TYPE(rela.r_info);
+#if defined(__aarch64__)
+        if( type!=R_AARCH64_JUMP_SLOT && type!=R_AARCH64_GLOB_DAT )
+#else
+        if( type!=R_X86_64_JUMP_SLOT && type!=R_X86_64_GLOB_DAT )
+#endif
+        {
+            continue;
+        }
+
+        const char * name = strings + symbols[ ELF64_R_SYM(rela.r_info) ].st_name;
+        for( GotEntry & entry : got_entries )
+        {
+            if( !entry.address && strcmp( name, entry.symbol )==0 )
+            {
+                entry.address = (void**)( base + rela.r_offset );
+            }
+        }
+    }
+}
+
+static int find_got_entries( struct dl_phdr_info * info, size_t, void * data )
+{
+    GotSearch * search = (GotSearch*)data;
+
+    const ElfW(Dyn) * dynamic = NULL;
+    bool contains = false;
+    for( int i=0 ; i<info->dlpi_phnum ; ++i )
+    {
+        const ElfW(Phdr) & phdr = info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+        if( phdr.p_type==PT_LOAD && search->address >= start && search->address < start + phdr.p_memsz )
+        {
+            contains = true;
+        }
+        else if( phdr.p_type==PT_DYNAMIC )
+        {
+            dynamic = (const ElfW(Dyn)*)start;
+        }
+    }
+
+    if( !contains || !dynamic )
+    {
+        return 0;
+    }
+    search->found = true;
+
+    // The loader relocates these addresses in place on most architectures, but not all
+    auto address = [&]( ElfW(Addr) value ) { return value < info->dlpi_addr ? value + info->dlpi_addr : value; };
+
+    const ElfW(Sym) * symbols = NULL;
+    const char * strings = NULL;
+    const ElfW(Rela) * jmprel = NULL;
+    const ElfW(Rela) * rela = NULL;
+    size_t jmprel_size = 0;
+    size_t rela_size = 0;
+    for( const ElfW(Dyn) * d=dynamic ; d->d_tag!=DT_NULL ; ++d )
+    {
+        switch( d->d_tag )
+        {
+        case DT_SYMTAB: symbols = (const ElfW(Sym)*)address( d->d_un.d_ptr ); break;
+        case DT_STRTAB: strings = (const char*)address( d->d_un.d_ptr ); break;
+        case DT_JMPREL: jmprel = (const ElfW(Rela)*)address( d->d_un.d_ptr ); break;
+        case DT_PLTRELSZ: jmprel_size = d->d_un.d_val; break;
+        case DT_RELA: rela = (const ElfW(Rela)*)address( d->d_un.d_ptr ); break;
+        case DT_RELASZ: rela_size = d->d_un.d_val; break;
+        }
+    }
+
+    if( symbols && strings )
+    {
+        if( jmprel )
+        {
+            find_got_entries_in_relocations( info->dlpi_addr, jmprel, jmprel_size, symbols, strings );
+        }
+        if( rela )
+        {
+            find_got_entries_in_relocations( info->dlpi_addr, rela, rela_size, symbols, strings );
+        }
+    }
+
+    // Patched here, while the program headers are available
+    for( GotEntry & entry : got_entries )
+    {
+        if( entry.address )
+        {
+            entry.previous = *entry.address;
+            patch_got_entry( info->dlpi_addr, info->dlpi_phdr, info->dlpi_phnum, entry.address, entry.hook );
+        }
+    }
+
+    return 1;
+}
+
+static int restore_got_entries( struct dl_phdr_info * info, size_t, void * data )
+{
+    GotSearch * search = (GotSearch*)data;
+
+    for( int i=0 ; i<info->dlpi_phnum ; ++i )
+    {
+        const ElfW(Phdr) & phdr = info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+        if( phdr.p_type==PT_LOAD && search->address >= start && search->address < start + phdr.p_memsz )
+        {
+            for( GotEntry & entry : got_entries )
+            {
+                if( entry.address )
+                {
+                    patch_got_entry( info->dlpi_addr, info->dlpi_phdr, info->dlpi_phnum, entry.address, entry.previous );
+                    entry.address = NULL;
+                }
+            }
+            search->found = true;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+//-----
+
+static PyObject * build_histogram( const GilHistogram & histogram )
+{
+    PyObject * buckets = PyList_New(0);
+    for( size_t i=0 ; buckets && i<GIL_HISTOGRAM_BUCKETS ; ++i )
+    {
+        if( histogram.buckets[i] )
+        {
+            // Upper bound of the bucket in seconds, and the count
+            PyObject * item = Py_BuildValue( "(dK)", (double)( 1ULL << i ) * 1e-6, (unsigned long long)histogram.buckets[i] );
+            if( !item || PyList_Append( buckets, item )!=0 )
+            {
+                Py_XDECREF(item);
+                Py_DECREF(buckets);
+                return NULL;
+            }
+            Py_DECREF(item);
+        }
+    }
+    if( !buckets )
+    {
+        return NULL;
+    }
+
+    return Py_BuildValue( "{s:K,s:d,s:d,s:N}",
+        "count", (unsigned long long)histogram.count,
+        "total", histogram.total_ns * 1e-9,
+        "max", histogram.max_ns * 1e-9,
+        "histogram", buckets );
+}
+
+static PyObject * build_hold_event( const GilHoldEvent & event )
+{
+    PyObject * native_stack = PyList_New( event.num_frames );
+    char ** symbols = backtrace_symbols( const_cast<void**>(event.frames), event.num_frames );
+    for( uint32_t i=0 ; native_stack && i<event.num_frames ; ++i )
+    {
+        PyList_SET_ITEM( native_stack, i, symbols ? PyUnicode_DecodeUTF8( symbols[i], strlen(symbols[i]), "replace" ) : PyUnicode_FromFormat( "%p", event.frames[i] ) );
+    }
+    free( symbols );
+
+    // Outermost first, same as traceback module
+    PyObject * python_stack = PyList_New( event.num_python_frames );
+    for( uint32_t i=0 ; python_stack && i<event.num_python_frames ; ++i )
+    {
+        const PythonFrameInfo & info = event.python_frames[ event.num_python_frames - 1 - i ];
+        PyList_SET_ITEM( python_stack, i, Py_BuildValue( "(sis)", info.filename, info.line, info.name ) );
+    }
+
+    if( !native_stack || !python_stack || PyErr_Occurred() )
+    {
+        Py_XDECREF(native_stack);
+        Py_XDECREF(python_stack);
+        return NULL;
+    }
+
+    return Py_BuildValue( "{s:k,s:i,s:d,s:N,s:N}",
+        "ident", event.ident,
+        "tid", (int)event.tid,
+        "duration", event.duration_ns * 1e-9,
+        "native_stack", native_stack,
+        "python_stack", python_stack );
+}
+
+static int compare_hold_events( const void * a, const void * b )
+{
+    uint64_t duration_a = ((const GilHoldEvent*)a)->duration_ns;
+    uint64_t duration_b = ((const GilHoldEvent*)b)->duration_ns;
+    return duration_a > duration_b ? -1 : duration_a < duration_b ? 1 : 0;
+}
+
+// Called with the GIL held, so that no other thread records at the same time
+static PyObject * build_gil_profile()
+{
+    PyObject * threads = PyDict_New();
+    size_t num_threads = gil_profiler.num_threads.load( std::memory_order_acquire );
+    for( size_t i=0 ; threads && i<num_threads ; ++i )
+    {
+        const GilThread & thread = gil_profiler.threads[i];
+        PyObject * key = PyLong_FromUnsignedLong( thread.ident );
+        PyObject * value = Py_BuildValue( "{s:i,s:N,s:N}",
+            "tid", (int)thread.tid,
+            "wait", build_histogram( thread.wait ),
+            "hold", build_histogram( thread.hold ) );
+        if( !key || !value || PyDict_SetItem( threads, key, value )!=0 )
+        {
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            Py_DECREF(threads);
+            return NULL;
+        }
+        Py_DECREF(key);
+        Py_DECREF(value);
+    }
+    if( !threads )
+    {
+        return NULL;
+    }
+
+    qsort( gil_profiler.hold_events, gil_profiler.num_hold_events, sizeof(GilHoldEvent), compare_hold_events );
+
+    PyObject * long_holds = PyList_New( gil_profiler.num_hold_events );
+    for( size_t i=0 ; long_holds && i<gil_profiler.num_hold_events ; ++i )
+    {
+        PyObject * event = build_hold_event( gil_profiler.hold_events[i] );
+        if( !event )
+        {
+            Py_DECREF(long_holds);
+            Py_DECREF(threads);
+            return NULL;
+        }
+        PyList_SET_ITEM( long_holds, i, event );
+    }
+    if( !long_holds )
+    {
+        Py_DECREF(threads);
+        return NULL;
+    }
+
+    return Py_BuildValue( "{s:N,s:N,s:K}",
+        "threads", threads,
+        "long_holds", long_holds,
+        "lost_threads", (unsigned long long)gil_profiler.num_lost_threads );
+}
+
+//-----
+
+PyObject * _start_gil_profiling( PyObject * self, PyObject * args, PyObject * kwds )
+{
+    double long_hold = 0.01;
+
+    static const char * kwlist[] = {
+        "long_hold",
+        NULL
+    };
+
+    if( ! PyArg_ParseTupleAndKeywords( args, kwds, "|d", const_cast<char**>(kwlist), &long_hold ) )
+    {
+        return NULL;
+    }
+
+    if( long_hold < 0 )
+    {
+        PyErr_SetString( PyExc_ValueError, "long_hold must not be negative" );
+        return NULL;
+    }
+
+    if( gil_profiler.active.load() )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "GIL profiling is already started" );
+        return NULL;
+    }
+
+    if( !gil_profiler.gil )
+    {
+        gil_profiler.gil = find_gil_state();
+        if( !gil_profiler.gil )
+        {
+            PyErr_SetString( PyExc_RuntimeError, "GIL state not found (only Python 3.7 is supported)" );
+            return NULL;
+        }
+    }
+
+    init_python_stack();
+
+    // backtrace() loads libgcc at the first call
+    void * frames[1];
+    backtrace( frames, 1 );
+
+    gil_profiler.cond_signal = (int(*)(pthread_cond_t*))dlsym( RTLD_DEFAULT, "pthread_cond_signal" );
+    gil_profiler.cond_timedwait = (int(*)(pthread_cond_t*,pthread_mutex_t*,const struct timespec*))dlsym( RTLD_DEFAULT, "pthread_cond_timedwait" );
+    if( !gil_profiler.cond_signal || !gil_profiler.cond_timedwait )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "pthread functions not found" );
+        return NULL;
+    }
+
+    // No thread records until active is set, and the calling thread holds the GIL
+    gil_profiler.session++;
+    gil_profiler.num_threads.store(0);
+    gil_profiler.num_lost_threads = 0;
+    gil_profiler.num_hold_events = 0;
+    gil_profiler.long_hold_ns = (uint64_t)( long_hold * 1e9 );
+
+    GotSearch search = { (uintptr_t)PyEval_SaveThread, false };
+    dl_iterate_phdr( find_got_entries, &search );
+    if( !got_entries[0].address || !got_entries[1].address )
+    {
+        dl_iterate_phdr( restore_got_entries, &search );
+        PyErr_SetString( PyExc_RuntimeError, "failed to hook GIL functions of the interpreter" );
+        return NULL;
+    }
+
+    gil_profiler.active.store(true);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyObject * _get_gil_profile( PyObject * self, PyObject * args )
+{
+    if( ! PyArg_ParseTuple(args, "" ) )
+    {
+        return NULL;
+    }
+
+    return build_gil_profile();
+}
+
+PyObject * _stop_gil_profiling( PyObject * self, PyObject * args )
+{
+    if( ! PyArg_ParseTuple(args, "" ) )
+    {
+        return NULL;
+    }
+
+    if( !gil_profiler.active.load() )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "GIL profiling is not started" );
+        return NULL;
+    }
+
+    // Hooks running in other threads call the original functions, which stay valid
+    gil_profiler.active.store(false);
+    GotSearch search = { (uintptr_t)PyEval_SaveThread, false };
+    dl_iterate_phdr( restore_got_entries, &search );
+
+    return build_gil_profile();
+}
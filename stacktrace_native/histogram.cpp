@@ -0,0 +1,749 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stacktrace_native.h"
+
+// Latency histogram
+//
+// Log-linear buckets as in HdrHistogram : values below 128 have their own buckets, and each power of 2 above
+// is divided into 64 buckets, so the relative error of a bucket is below 1/64 (1.6%). Values up to 2^40
+// (18 minutes in nanoseconds) have their own buckets, and larger values are counted in the last bucket.
+//
+// Each thread records to its own shard of the histogram with plain (relaxed) stores, without locks or atomic
+// read-modify-write instructions. Queries sum the shards. Threads beyond the number of shards, merge() and
+// from_bytes() use the base shard with atomic additions.
+
+//-----
+
+static const int HISTOGRAM_SUB_BUCKET_BITS = 7;
+static const uint64_t HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+static const uint64_t HISTOGRAM_HALF_SUB_BUCKETS = HISTOGRAM_SUB_BUCKETS / 2;
+static const int HISTOGRAM_MAX_VALUE_BITS = 40;
+static const size_t HISTOGRAM_NUM_BUCKETS = ( HISTOGRAM_MAX_VALUE_BITS - HISTOGRAM_SUB_BUCKET_BITS + 2 ) * HISTOGRAM_HALF_SUB_BUCKETS;
+
+static const size_t HISTOGRAM_MAX_THREADS = 64;
+static const size_t HISTOGRAM_MAX_NESTING = 32;
+
+static const char HISTOGRAM_MAGIC[8] = { 'S', 'T', 'N', 'H', 'I', 'S', 'T', '\0' };
+static const uint32_t HISTOGRAM_VERSION = 1;
+
+struct HistogramShard
+{
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> min;
+    std::atomic<uint64_t> max;
+    std::atomic<uint64_t> buckets[HISTOGRAM_NUM_BUCKETS];
+};
+
+struct HistogramObject
+{
+    PyObject_HEAD
+    HistogramShard * base;
+    std::atomic<HistogramShard*> shards[HISTOGRAM_MAX_THREADS];
+};
+
+// Sum of all shards
+struct HistogramSnapshot
+{
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_NUM_BUCKETS];
+};
+
+// Serialized form : header, followed by (bucket index, count) pairs of non-empty buckets. Little-endian.
+struct HistogramHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t sub_bucket_bits;
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint32_t num_entries;
+    uint32_t reserved;
+};
+
+struct HistogramEntry
+{
+    uint64_t index;
+    uint64_t count;
+};
+
+// Shard index of the calling thread, shared by all histograms. Indices are returned by the key destructor when
+// the thread exits, and a later thread takes over the shards of the index as their single writer.
+static_assert( HISTOGRAM_MAX_THREADS==64, "histogram thread indices are a 64-bit mask" );
+static std::atomic<uint64_t> histogram_threads_in_use(0);
+static pthread_key_t histogram_thread_key;
+static __thread int32_t histogram_thread = -1;
+
+// Start times of the "with histogram:" blocks of the calling thread, innermost last. Kept per thread rather than
+// in the shards, as threads beyond HISTOGRAM_MAX_THREADS share a shard.
+static __thread uint64_t histogram_start_ns[HISTOGRAM_MAX_NESTING];
+static __thread uint32_t histogram_depth = 0;
+
+//-----
+
+static inline size_t get_bucket_index( uint64_t value )
+{
+    if( value < HISTOGRAM_SUB_BUCKETS )
+    {
+        return (size_t)value;
+    }
+    if( value >= ( 1ULL << HISTOGRAM_MAX_VALUE_BITS ) )
+    {
+        return HISTOGRAM_NUM_BUCKETS - 1;
+    }
+
+    int shift = 63 - __builtin_clzll(value) - ( HISTOGRAM_SUB_BUCKET_BITS - 1 );
+    return shift * HISTOGRAM_HALF_SUB_BUCKETS + ( value >> shift );
+}
+
+static inline uint64_t get_bucket_low( size_t index )
+{
+    if( index < HISTOGRAM_SUB_BUCKETS )
+    {
+        return index;
+    }
+
+    int shift = (int)( index / HISTOGRAM_HALF_SUB_BUCKETS ) - 1;
+    return ( index - shift * HISTOGRAM_HALF_SUB_BUCKETS ) << shift;
+}
+
+static inline uint64_t get_bucket_high( size_t index )
+{
+    if( index < HISTOGRAM_SUB_BUCKETS )
+    {
+        return index;
+    }
+
+    int shift = (int)( index / HISTOGRAM_HALF_SUB_BUCKETS ) - 1;
+    return get_bucket_low(index) + ( 1ULL << shift ) - 1;
+}
+
+static HistogramShard * allocate_shard()
+{
+    HistogramShard * shard = (HistogramShard*)calloc( 1, sizeof(HistogramShard) );
+    if( shard )
+    {
+        shard->min.store( UINT64_MAX, std::memory_order_relaxed );
+    }
+    return shard;
+}
+
+// Single writer : load and store instead of atomic read-modify-write
+static inline void add_owned( std::atomic<uint64_t> & a, uint64_t value )
+{
+    a.store( a.load( std::memory_order_relaxed ) + value, std::memory_order_relaxed );
+}
+
+static inline void update_min_shared( std::atomic<uint64_t> & a, uint64_t value )
+{
+    uint64_t current = a.load( std::memory_order_relaxed );
+    while( value < current && !a.compare_exchange_weak( current, value, std::memory_order_relaxed ) )
+    {
+    }
+}
+
+static inline void update_max_shared( std::atomic<uint64_t> & a, uint64_t value )
+{
+    uint64_t current = a.load( std::memory_order_relaxed );
+    while( value > current && !a.compare_exchange_weak( current, value, std::memory_order_relaxed ) )
+    {
+    }
+}
+
+// Shard of the calling thread, or NULL to use the base shard
+static void release_histogram_thread( void * value )
+{
+    uint64_t index = (uintptr_t)value - 1;
+    histogram_threads_in_use.fetch_and( ~( 1ULL << index ), std::memory_order_release );
+    histogram_thread = -1;
+}
+
+// Returns false when all indices are in use. Tried again at the next call then.
+static bool acquire_histogram_thread()
+{
+    uint64_t in_use = histogram_threads_in_use.load( std::memory_order_relaxed );
+    while( ~in_use )
+    {
+        int index = __builtin_ctzll( ~in_use );
+        if( histogram_threads_in_use.compare_exchange_weak( in_use, in_use | ( 1ULL << index ), std::memory_order_acquire ) )
+        {
+            histogram_thread = index;
+            pthread_setspecific( histogram_thread_key, (void*)(uintptr_t)( index + 1 ) );
+            return true;
+        }
+    }
+    return false;
+}
+
+static HistogramShard * get_own_shard( HistogramObject * self )
+{
+    if( histogram_thread < 0 && !acquire_histogram_thread() )
+    {
+        return NULL;
+    }
+
+    std::atomic<HistogramShard*> & slot = self->shards[histogram_thread];
+    HistogramShard * shard = slot.load( std::memory_order_relaxed );
+    if( !shard )
+    {
+        shard = allocate_shard();
+        slot.store( shard, std::memory_order_release );
+    }
+    return shard;
+}
+
+static void record_value( HistogramObject * self, uint64_t value )
+{
+    size_t index = get_bucket_index(value);
+
+    HistogramShard * shard = get_own_shard(self);
+    if( shard )
+    {
+        add_owned( shard->buckets[index], 1 );
+        add_owned( shard->total, value );
+        if( value < shard->min.load( std::memory_order_relaxed ) )
+        {
+            shard->min.store( value, std::memory_order_relaxed );
+        }
+        if( value > shard->max.load( std::memory_order_relaxed ) )
+        {
+            shard->max.store( value, std::memory_order_relaxed );
+        }
+        // Count last, so that readers don't see a count without its bucket
+        shard->count.store( shard->count.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+        return;
+    }
+
+    shard = self->base;
+    shard->buckets[index].fetch_add( 1, std::memory_order_relaxed );
+    shard->total.fetch_add( value, std::memory_order_relaxed );
+    update_min_shared( shard->min, value );
+    update_max_shared( shard->max, value );
+    shard->count.fetch_add( 1, std::memory_order_release );
+}
+
+static void add_to_snapshot( HistogramSnapshot & snapshot, const HistogramShard & shard )
+{
+    if( shard.count.load( std::memory_order_acquire )==0 )
+    {
+        return;
+    }
+
+    // Buckets are summed for the count, so that percentiles are consistent with concurrent recording
+    for( size_t i=0 ; i<HISTOGRAM_NUM_BUCKETS ; ++i )
+    {
+        uint64_t n = shard.buckets[i].load( std::memory_order_relaxed );
+        snapshot.buckets[i] += n;
+        snapshot.count += n;
+    }
+    snapshot.total += shard.total.load( std::memory_order_relaxed );
+
+    uint64_t min = shard.min.load( std::memory_order_relaxed );
+    uint64_t max = shard.max.load( std::memory_order_relaxed );
+    snapshot.min = min < snapshot.min ? min : snapshot.min;
+    snapshot.max = max > snapshot.max ? max : snapshot.max;
+}
+
+// Returned snapshot has to be freed with free()
+static HistogramSnapshot * take_snapshot( HistogramObject * self )
+{
+    HistogramSnapshot * snapshot = (HistogramSnapshot*)calloc( 1, sizeof(HistogramSnapshot) );
+    if( !snapshot )
+    {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    snapshot->min = UINT64_MAX;
+
+    add_to_snapshot( *snapshot, *self->base );
+    for( size_t i=0 ; i<HISTOGRAM_MAX_THREADS ; ++i )
+    {
+        const HistogramShard * shard = self->shards[i].load( std::memory_order_acquire );
+        if( shard )
+        {
+            add_to_snapshot( *snapshot, *shard );
+        }
+    }
+
+    if( snapshot->count==0 )
+    {
+        snapshot->min = 0;
+    }
+    return snapshot;
+}
+
+// Highest value equivalent to the value at the percentile, limited to the recorded range
+static uint64_t get_percentile( const HistogramSnapshot & snapshot, double percentile )
+{
+    if( snapshot.count==0 )
+    {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)( percentile / 100.0 * snapshot.count + 0.5 );
+    if( target < 1 )
+    {
+        target = 1;
+    }
+
+    uint64_t accumulated = 0;
+    for( size_t i=0 ; i<HISTOGRAM_NUM_BUCKETS ; ++i )
+    {
+        accumulated += snapshot.buckets[i];
+        if( accumulated >= target )
+        {
+            uint64_t value = get_bucket_high(i);
+            value = value < snapshot.max ? value : snapshot.max;
+            return value > snapshot.min ? value : snapshot.min;
+        }
+    }
+
+    return snapshot.max;
+}
+
+static void add_to_base( HistogramObject * self, const HistogramSnapshot & snapshot )
+{
+    HistogramShard & base = *self->base;
+    for( size_t i=0 ; i<HISTOGRAM_NUM_BUCKETS ; ++i )
+    {
+        if( snapshot.buckets[i] )
+        {
+            base.buckets[i].fetch_add( snapshot.buckets[i], std::memory_order_relaxed );
+        }
+    }
+    base.total.fetch_add( snapshot.total, std::memory_order_relaxed );
+    if( snapshot.count )
+    {
+        update_min_shared( base.min, snapshot.min );
+        update_max_shared( base.max, snapshot.max );
+    }
+    base.count.fetch_add( snapshot.count, std::memory_order_release );
+}
+
+//-----
+
+// Other fields are set in init_histogram_types()
+static PyTypeObject Histogram_Type =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    MODULE_NAME ".Histogram",   // tp_name
+    sizeof(HistogramObject),    // tp_basicsize
+};
+
+static PyObject * histogram_new( PyTypeObject * type, PyObject * args, PyObject * kwds )
+{
+    HistogramObject * self = (HistogramObject*)type->tp_alloc( type, 0 );
+    if( !self )
+    {
+        return NULL;
+    }
+
+    self->base = allocate_shard();
+    if( !self->base )
+    {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    return (PyObject*)self;
+}
+
+static void histogram_dealloc( PyObject * obj )
+{
+    HistogramObject * self = (HistogramObject*)obj;
+    free( self->base );
+    for( size_t i=0 ; i<HISTOGRAM_MAX_THREADS ; ++i )
+    {
+        free( self->shards[i].load() );
+    }
+    Py_TYPE(obj)->tp_free(obj);
+}
+
+static PyObject * histogram_record( PyObject * self, PyObject * arg )
+{
+    uint64_t value = PyLong_AsUnsignedLongLong(arg);
+    if( value==(uint64_t)-1 && PyErr_Occurred() )
+    {
+        return NULL;
+    }
+
+    record_value( (HistogramObject*)self, value );
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static inline uint64_t get_time_ns()
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// "with histogram:" records the elapsed time in nanoseconds. Blocks can be nested, with the same or other
+// histograms. Blocks deeper than HISTOGRAM_MAX_NESTING are not recorded.
+static PyObject * histogram_enter( PyObject * obj, PyObject * args )
+{
+    if( histogram_depth < HISTOGRAM_MAX_NESTING )
+    {
+        histogram_start_ns[histogram_depth] = get_time_ns();
+    }
+    histogram_depth++;
+
+    Py_INCREF(obj);
+    return obj;
+}
+
+static PyObject * histogram_exit( PyObject * obj, PyObject * args )
+{
+    if( histogram_depth==0 )
+    {
+        Py_RETURN_FALSE;
+    }
+
+    histogram_depth--;
+    if( histogram_depth < HISTOGRAM_MAX_NESTING )
+    {
+        record_value( (HistogramObject*)obj, get_time_ns() - histogram_start_ns[histogram_depth] );
+    }
+
+    Py_RETURN_FALSE;
+}
+
+static PyObject * histogram_percentile( PyObject * self, PyObject * arg )
+{
+    double percentile = PyFloat_AsDouble(arg);
+    if( percentile==-1.0 && PyErr_Occurred() )
+    {
+        return NULL;
+    }
+    if( percentile < 0 || percentile > 100 )
+    {
+        PyErr_SetString( PyExc_ValueError, "percentile must be 0-100" );
+        return NULL;
+    }
+
+    HistogramSnapshot * snapshot = take_snapshot( (HistogramObject*)self );
+    if( !snapshot )
+    {
+        return NULL;
+    }
+    uint64_t value = get_percentile( *snapshot, percentile );
+    free( snapshot );
+
+    return PyLong_FromUnsignedLongLong(value);
+}
+
+// Multiple percentiles from the same snapshot
+static PyObject * histogram_percentiles( PyObject * self, PyObject * arg )
+{
+    PyObject * sequence = PySequence_Fast( arg, "percentiles must be a sequence" );
+    if( !sequence )
+    {
+        return NULL;
+    }
+
+    HistogramSnapshot * snapshot = take_snapshot( (HistogramObject*)self );
+    if( !snapshot )
+    {
+        Py_DECREF(sequence);
+        return NULL;
+    }
+
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(sequence);
+    PyObject * result = PyList_New(n);
+    for( Py_ssize_t i=0 ; result && i<n ; ++i )
+    {
+        double percentile = PyFloat_AsDouble( PySequence_Fast_GET_ITEM( sequence, i ) );
+        if( ( percentile==-1.0 && PyErr_Occurred() ) || percentile < 0 || percentile > 100 )
+        {
+            if( !PyErr_Occurred() )
+            {
+                PyErr_SetString( PyExc_ValueError, "percentile must be 0-100" );
+            }
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM( result, i, PyLong_FromUnsignedLongLong( get_percentile( *snapshot, percentile ) ) );
+    }
+
+    free( snapshot );
+    Py_DECREF(sequence);
+    return result;
+}
+
+static PyObject * histogram_buckets( PyObject * self, PyObject * args )
+{
+    HistogramSnapshot * snapshot = take_snapshot( (HistogramObject*)self );
+    if( !snapshot )
+    {
+        return NULL;
+    }
+
+    PyObject * result = PyList_New(0);
+    for( size_t i=0 ; result && i<HISTOGRAM_NUM_BUCKETS ; ++i )
+    {
+        if( snapshot->buckets[i] )
+        {
+            PyObject * item = Py_BuildValue( "(KKK)", (unsigned long long)get_bucket_low(i), (unsigned long long)get_bucket_high(i), (unsigned long long)snapshot->buckets[i] );
+            if( !item || PyList_Append( result, item )!=0 )
+            {
+                Py_XDECREF(item);
+                Py_CLEAR(result);
+                break;
+            }
+            Py_DECREF(item);
+        }
+    }
+
+    free( snapshot );
+    return result;
+}
+
+static PyObject * histogram_merge( PyObject * self, PyObject * arg )
+{
+    if( !PyObject_TypeCheck( arg, &Histogram_Type ) )
+    {
+        PyErr_SetString( PyExc_TypeError, "argument must be Histogram" );
+        return NULL;
+    }
+
+    HistogramSnapshot * snapshot = take_snapshot( (HistogramObject*)arg );
+    if( !snapshot )
+    {
+        return NULL;
+    }
+    add_to_base( (HistogramObject*)self, *snapshot );
+    free( snapshot );
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+// Values recorded at the same time may be lost
+static PyObject * histogram_reset( PyObject * obj, PyObject * args )
+{
+    HistogramObject * self = (HistogramObject*)obj;
+
+    auto clear = []( HistogramShard * shard )
+    {
+        shard->count.store( 0, std::memory_order_relaxed );
+        shard->total.store( 0, std::memory_order_relaxed );
+        shard->min.store( UINT64_MAX, std::memory_order_relaxed );
+        shard->max.store( 0, std::memory_order_relaxed );
+        for( size_t i=0 ; i<HISTOGRAM_NUM_BUCKETS ; ++i )
+        {
+            shard->buckets[i].store( 0, std::memory_order_relaxed );
+        }
+    };
+
+    clear( self->base );
+    for( size_t i=0 ; i<HISTOGRAM_MAX_THREADS ; ++i )
+    {
+        HistogramShard * shard = self->shards[i].load( std::memory_order_acquire );
+        if( shard )
+        {
+            clear( shard );
+        }
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject * histogram_to_bytes( PyObject * self, PyObject * args )
+{
+    HistogramSnapshot * snapshot = take_snapshot( (HistogramObject*)self );
+    if( !snapshot )
+    {
+        return NULL;
+    }
+
+    uint32_t num_entries = 0;
+    for( size_t i=0 ; i<HISTOGRAM_NUM_BUCKETS ; ++i )
+    {
+        num_entries += snapshot->buckets[i] ? 1 : 0;
+    }
+
+    PyObject * result = PyBytes_FromStringAndSize( NULL, sizeof(HistogramHeader) + num_entries * sizeof(HistogramEntry) );
+    if( result )
+    {
+        char * p = PyBytes_AS_STRING(result);
+
+        HistogramHeader header;
+        memset( &header, 0, sizeof(header) );
+        memcpy( header.magic, HISTOGRAM_MAGIC, sizeof(header.magic) );
+        header.version = HISTOGRAM_VERSION;
+        header.sub_bucket_bits = HISTOGRAM_SUB_BUCKET_BITS;
+        header.count = snapshot->count;
+        header.total = snapshot->total;
+        header.min = snapshot->min;
+        header.max = snapshot->max;
+        header.num_entries = num_entries;
+        memcpy( p, &header, sizeof(header) );
+        p += sizeof(header);
+
+        for( size_t i=0 ; i<HISTOGRAM_NUM_BUCKETS ; ++i )
+        {
+            if( snapshot->buckets[i] )
+            {
+                HistogramEntry entry = { i, snapshot->buckets[i] };
+                memcpy( p, &entry, sizeof(entry) );
+                p += sizeof(entry);
+            }
+        }
+    }
+
+    free( snapshot );
+    return result;
+}
+
+static PyObject * histogram_from_bytes( PyObject * type, PyObject * arg )
+{
+    Py_buffer buffer;
+    if( PyObject_GetBuffer( arg, &buffer, PyBUF_SIMPLE )!=0 )
+    {
+        return NULL;
+    }
+
+    const char * p = (const char*)buffer.buf;
+    size_t size = buffer.len;
+
+    HistogramHeader header;
+    bool valid = size >= sizeof(header);
+    if( valid )
+    {
+        memcpy( &header, p, sizeof(header) );
+        valid = memcmp( header.magic, HISTOGRAM_MAGIC, sizeof(header.magic) )==0
+            && header.version==HISTOGRAM_VERSION
+            && header.sub_bucket_bits==HISTOGRAM_SUB_BUCKET_BITS
+            && size==sizeof(header) + header.num_entries * sizeof(HistogramEntry);
+    }
+
+    HistogramSnapshot * snapshot = valid ? (HistogramSnapshot*)calloc( 1, sizeof(HistogramSnapshot) ) : NULL;
+    if( snapshot )
+    {
+        snapshot->total = header.total;
+        snapshot->min = header.min;
+        snapshot->max = header.max;
+        for( uint32_t i=0 ; i<header.num_entries ; ++i )
+        {
+            HistogramEntry entry;
+            memcpy( &entry, p + sizeof(header) + i * sizeof(entry), sizeof(entry) );
+            if( entry.index >= HISTOGRAM_NUM_BUCKETS )
+            {
+                valid = false;
+                break;
+            }
+            snapshot->buckets[entry.index] += entry.count;
+            snapshot->count += entry.count;
+        }
+    }
+    PyBuffer_Release(&buffer);
+
+    if( !valid )
+    {
+        free( snapshot );
+        PyErr_SetString( PyExc_ValueError, "invalid serialized histogram" );
+        return NULL;
+    }
+    if( !snapshot )
+    {
+        return PyErr_NoMemory();
+    }
+
+    PyObject * result = PyObject_CallObject( type, NULL );
+    if( result )
+    {
+        add_to_base( (HistogramObject*)result, *snapshot );
+    }
+    free( snapshot );
+    return result;
+}
+
+// Statistics without percentiles are read from the snapshot too, so that they are consistent with each other
+static PyObject * histogram_get_stat( PyObject * self, void * closure )
+{
+    HistogramSnapshot * snapshot = take_snapshot( (HistogramObject*)self );
+    if( !snapshot )
+    {
+        return NULL;
+    }
+
+    PyObject * result = NULL;
+    switch( (intptr_t)closure )
+    {
+    case 0: result = PyLong_FromUnsignedLongLong( snapshot->count ); break;
+    case 1: result = PyLong_FromUnsignedLongLong( snapshot->total ); break;
+    case 2: result = PyLong_FromUnsignedLongLong( snapshot->min ); break;
+    case 3: result = PyLong_FromUnsignedLongLong( snapshot->max ); break;
+    case 4: result = PyFloat_FromDouble( snapshot->count ? (double)snapshot->total / snapshot->count : 0.0 ); break;
+    }
+
+    free( snapshot );
+    return result;
+}
+
+static PyMethodDef histogram_methods[] =
+{
+    { "record", histogram_record, METH_O, "Record a value (e.g. latency in nanoseconds)." },
+    { "percentile", histogram_percentile, METH_O, "Value at the percentile (0-100)." },
+    { "percentiles", histogram_percentiles, METH_O, "Values at the percentiles, from the same snapshot." },
+    { "buckets", histogram_buckets, METH_NOARGS, "Non-empty buckets as list of (lowest value, highest value, count)." },
+    { "merge", histogram_merge, METH_O, "Add values of another histogram." },
+    { "reset", histogram_reset, METH_NOARGS, "Remove all values." },
+    { "to_bytes", histogram_to_bytes, METH_NOARGS, "Serialize to bytes." },
+    { "from_bytes", histogram_from_bytes, METH_O | METH_CLASS, "Create histogram from bytes returned by to_bytes()." },
+    { "__enter__", histogram_enter, METH_NOARGS, NULL },
+    { "__exit__", histogram_exit, METH_VARARGS, NULL },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef histogram_getset[] =
+{
+    { const_cast<char*>("count"), histogram_get_stat, NULL, const_cast<char*>("Number of recorded values."), (void*)0 },
+    { const_cast<char*>("total"), histogram_get_stat, NULL, const_cast<char*>("Sum of recorded values."), (void*)1 },
+    { const_cast<char*>("min"), histogram_get_stat, NULL, const_cast<char*>("Smallest recorded value."), (void*)2 },
+    { const_cast<char*>("max"), histogram_get_stat, NULL, const_cast<char*>("Largest recorded value."), (void*)3 },
+    { const_cast<char*>("mean"), histogram_get_stat, NULL, const_cast<char*>("Mean of recorded values."), (void*)4 },
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+bool init_histogram_types( PyObject * module )
+{
+    if( pthread_key_create( &histogram_thread_key, release_histogram_thread )!=0 )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "pthread_key_create failed" );
+        return false;
+    }
+
+    Histogram_Type.tp_flags = Py_TPFLAGS_DEFAULT;
+    Histogram_Type.tp_doc = "Log-bucketed latency histogram with per-thread recording.";
+    Histogram_Type.tp_methods = histogram_methods;
+    Histogram_Type.tp_getset = histogram_getset;
+    Histogram_Type.tp_new = histogram_new;
+    Histogram_Type.tp_dealloc = histogram_dealloc;
+
+    if( PyType_Ready(&Histogram_Type) < 0 )
+    {
+        return false;
+    }
+
+    Py_INCREF(&Histogram_Type);
+    if( PyModule_AddObject( module, "Histogram", (PyObject*)&Histogram_Type ) < 0 )
+    {
+        Py_DECREF(&Histogram_Type);
+        return false;
+    }
+
+    return true;
+}
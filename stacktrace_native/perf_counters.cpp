@@ -0,0 +1,461 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "stacktrace_native.h"
+
+// Performance counters
+//
+// perf_event_open() counters of the calling thread, in two groups : hardware events (cycles, instructions,
+// cache misses...) and software events (task clock, context switches, page faults). Events in a group are
+// read at once with a single read(), so that they cover the same period.
+//
+// Counters keep running while the object exists, and the context manager reads them at the beginning and
+// the end, so a region costs two read() calls per group. When the PMU doesn't multiplex all events of a
+// group, values are scaled by the enabled / running time, as perf stat does.
+//
+// Hardware events are not available in most VMs, and each unavailable event is skipped. When
+// perf_event_open() isn't permitted at all (e.g. seccomp in containers), the task clock, context switches
+// and page faults are read from getrusage() and the thread CPU clock instead.
+
+//-----
+
+static const size_t PERF_MAX_GROUP_EVENTS = 8;
+
+struct PerfEventDef
+{
+    const char * name;
+    uint32_t type;
+    uint64_t config;
+};
+
+static const PerfEventDef perf_hardware_events[] =
+{
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache_references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static const PerfEventDef perf_software_events[] =
+{
+    { "task_clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "cpu_migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+    { "page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+struct PerfGroup
+{
+    size_t num_events;
+    int fds[PERF_MAX_GROUP_EVENTS]; // fds[0] is the group leader
+    const PerfEventDef * events[PERF_MAX_GROUP_EVENTS];
+
+    // Values at the beginning of the region
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t values[PERF_MAX_GROUP_EVENTS];
+};
+
+// Layout of read() with PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING
+struct PerfGroupReadFormat
+{
+    uint64_t nr;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t values[PERF_MAX_GROUP_EVENTS];
+};
+
+// Fallback when no software event could be opened
+struct PerfRusageValues
+{
+    uint64_t task_clock;
+    uint64_t context_switches;
+    uint64_t page_faults;
+};
+
+struct PerfCountersObject
+{
+    PyObject_HEAD
+    pid_t tid;
+    PerfGroup hardware;
+    PerfGroup software;
+    bool use_rusage;
+    PerfRusageValues rusage_start;
+
+    // Dict returned by __enter__, filled by __exit__
+    PyObject * result;
+};
+
+//-----
+
+static int perf_event_open( struct perf_event_attr * attr, int group_fd )
+{
+    return (int)syscall( SYS_perf_event_open, attr, 0 /* calling thread */, -1 /* any cpu */, group_fd, PERF_FLAG_FD_CLOEXEC );
+}
+
+static int open_event( const PerfEventDef & def, int group_fd )
+{
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof(attr) );
+    attr.size = sizeof(attr);
+    attr.type = def.type;
+    attr.config = def.config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_hv = 1;
+
+    // The leader starts disabled, and the whole group is enabled when it is complete (see open_group())
+    attr.disabled = ( group_fd < 0 );
+
+    int fd = perf_event_open( &attr, group_fd );
+
+    // perf_event_paranoid >= 2 allows only user space counting for unprivileged processes
+    if( fd < 0 && ( errno==EACCES || errno==EPERM ) )
+    {
+        attr.exclude_kernel = 1;
+        fd = perf_event_open( &attr, group_fd );
+    }
+
+    return fd;
+}
+
+static void close_group( PerfGroup & group )
+{
+    // Siblings first, then the leader
+    for( size_t i=group.num_events ; i>0 ; --i )
+    {
+        close( group.fds[i-1] );
+    }
+    group.num_events = 0;
+}
+
+// Unavailable events are skipped. Returns false if no event could be opened.
+static bool open_group( PerfGroup & group, const PerfEventDef * defs, size_t num_defs )
+{
+    group.num_events = 0;
+
+    for( size_t i=0 ; i<num_defs && group.num_events<PERF_MAX_GROUP_EVENTS ; ++i )
+    {
+        int fd = open_event( defs[i], group.num_events ? group.fds[0] : -1 );
+        if( fd < 0 )
+        {
+            continue;
+        }
+
+        group.fds[group.num_events] = fd;
+        group.events[group.num_events] = &defs[i];
+        group.num_events++;
+    }
+
+    if( group.num_events==0 )
+    {
+        return false;
+    }
+
+    // Software events of a group created enabled don't count until the thread is scheduled in again,
+    // which loses the page faults of the first measured region. Enabling it explicitly starts counting now.
+    if( ioctl( group.fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP )!=0 )
+    {
+        close_group(group);
+        return false;
+    }
+
+    return true;
+}
+
+static bool read_group( const PerfGroup & group, PerfGroupReadFormat & data )
+{
+    if( group.num_events==0 )
+    {
+        data.nr = data.time_enabled = data.time_running = 0;
+        return true;
+    }
+
+    ssize_t n = read( group.fds[0], &data, sizeof(data) );
+    return n >= (ssize_t)( sizeof(uint64_t) * 3 ) && data.nr==group.num_events;
+}
+
+static bool add_group_deltas( const PerfGroup & group, const PerfGroupReadFormat & data, PyObject * result )
+{
+    uint64_t enabled = data.time_enabled - group.time_enabled;
+    uint64_t running = data.time_running - group.time_running;
+
+    for( size_t i=0 ; i<group.num_events ; ++i )
+    {
+        uint64_t delta = data.values[i] - group.values[i];
+
+        // Scaled when the PMU had to multiplex the group, 0 if it was never scheduled
+        if( running < enabled )
+        {
+            delta = running ? (uint64_t)( (double)delta * enabled / running ) : 0;
+        }
+
+        PyObject * value = PyLong_FromUnsignedLongLong(delta);
+        if( !value || PyDict_SetItemString( result, group.events[i]->name, value )!=0 )
+        {
+            Py_XDECREF(value);
+            return false;
+        }
+        Py_DECREF(value);
+    }
+
+    return true;
+}
+
+static void read_rusage( PerfRusageValues & values )
+{
+    struct timespec cpu_time;
+    clock_gettime( CLOCK_THREAD_CPUTIME_ID, &cpu_time );
+    values.task_clock = (uint64_t)cpu_time.tv_sec * 1000000000ULL + cpu_time.tv_nsec;
+
+    struct rusage usage;
+    getrusage( RUSAGE_THREAD, &usage );
+    values.context_switches = usage.ru_nvcsw + usage.ru_nivcsw;
+    values.page_faults = usage.ru_minflt + usage.ru_majflt;
+}
+
+//-----
+
+static int perf_counters_init( PyObject * obj, PyObject * args, PyObject * kwds )
+{
+    PerfCountersObject * self = (PerfCountersObject*)obj;
+
+    int hardware = 1;
+
+    static const char * kwlist[] = {
+        "hardware",
+        NULL
+    };
+
+    if( ! PyArg_ParseTupleAndKeywords( args, kwds, "|p", const_cast<char**>(kwlist), &hardware ) )
+    {
+        return -1;
+    }
+
+    if( self->tid )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "perf_counters is already initialized" );
+        return -1;
+    }
+
+    self->tid = get_tid();
+
+    if( hardware )
+    {
+        open_group( self->hardware, perf_hardware_events, sizeof(perf_hardware_events)/sizeof(perf_hardware_events[0]) );
+    }
+
+    self->use_rusage = !open_group( self->software, perf_software_events, sizeof(perf_software_events)/sizeof(perf_software_events[0]) );
+
+    return 0;
+}
+
+static void perf_counters_dealloc( PyObject * obj )
+{
+    PerfCountersObject * self = (PerfCountersObject*)obj;
+    close_group( self->hardware );
+    close_group( self->software );
+    Py_XDECREF( self->result );
+    Py_TYPE(obj)->tp_free(obj);
+}
+
+static PyObject * perf_counters_enter( PyObject * obj, PyObject * args )
+{
+    PerfCountersObject * self = (PerfCountersObject*)obj;
+
+    if( self->tid!=get_tid() )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "perf_counters counts the thread which created it" );
+        return NULL;
+    }
+
+    if( self->result )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "perf_counters can't be nested" );
+        return NULL;
+    }
+
+    self->result = PyDict_New();
+    if( !self->result )
+    {
+        return NULL;
+    }
+
+    PerfGroup * groups[] = { &self->hardware, &self->software };
+    for( PerfGroup * group : groups )
+    {
+        PerfGroupReadFormat data;
+        if( !read_group( *group, data ) )
+        {
+            Py_CLEAR( self->result );
+            return PyErr_SetFromErrno( PyExc_OSError );
+        }
+
+        group->time_enabled = data.time_enabled;
+        group->time_running = data.time_running;
+        memcpy( group->values, data.values, sizeof(uint64_t) * group->num_events );
+    }
+
+    if( self->use_rusage )
+    {
+        read_rusage( self->rusage_start );
+    }
+
+    Py_INCREF( self->result );
+    return self->result;
+}
+
+static PyObject * perf_counters_exit( PyObject * obj, PyObject * args )
+{
+    PerfCountersObject * self = (PerfCountersObject*)obj;
+
+    if( !self->result )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "perf_counters is not entered" );
+        return NULL;
+    }
+
+    // Counters are read before anything else, to exclude the cost of building the result
+    PerfGroupReadFormat hardware_data;
+    PerfGroupReadFormat software_data;
+    PerfRusageValues rusage_end;
+    bool succeeded = read_group( self->hardware, hardware_data ) && read_group( self->software, software_data );
+    if( self->use_rusage )
+    {
+        read_rusage( rusage_end );
+    }
+
+    PyObject * result = self->result;
+    self->result = NULL;
+
+    if( !succeeded )
+    {
+        Py_DECREF(result);
+        return PyErr_SetFromErrno( PyExc_OSError );
+    }
+
+    succeeded = add_group_deltas( self->hardware, hardware_data, result ) && add_group_deltas( self->software, software_data, result );
+
+    if( succeeded && self->use_rusage )
+    {
+        const PerfRusageValues & start = self->rusage_start;
+        PyObject * values[] = {
+            PyLong_FromUnsignedLongLong( rusage_end.task_clock - start.task_clock ),
+            PyLong_FromUnsignedLongLong( rusage_end.context_switches - start.context_switches ),
+            PyLong_FromUnsignedLongLong( rusage_end.page_faults - start.page_faults ),
+        };
+        const char * names[] = { "task_clock", "context_switches", "page_faults" };
+
+        for( size_t i=0 ; i<3 ; ++i )
+        {
+            if( succeeded && ( !values[i] || PyDict_SetItemString( result, names[i], values[i] )!=0 ) )
+            {
+                succeeded = false;
+            }
+            Py_XDECREF( values[i] );
+        }
+    }
+
+    Py_DECREF(result);
+
+    if( !succeeded )
+    {
+        return NULL;
+    }
+
+    Py_RETURN_FALSE;
+}
+
+static PyObject * perf_counters_get_events( PyObject * obj, void * closure )
+{
+    PerfCountersObject * self = (PerfCountersObject*)obj;
+
+    PyObject * events = PyList_New(0);
+    const PerfGroup * groups[] = { &self->hardware, &self->software };
+    for( const PerfGroup * group : groups )
+    {
+        for( size_t i=0 ; events && i<group->num_events ; ++i )
+        {
+            PyObject * name = PyUnicode_FromString( group->events[i]->name );
+            if( !name || PyList_Append( events, name )!=0 )
+            {
+                Py_CLEAR(events);
+            }
+            Py_XDECREF(name);
+        }
+    }
+
+    if( events && self->use_rusage )
+    {
+        const char * names[] = { "task_clock", "context_switches", "page_faults" };
+        for( const char * s : names )
+        {
+            PyObject * name = PyUnicode_FromString(s);
+            if( !name || PyList_Append( events, name )!=0 )
+            {
+                Py_CLEAR(events);
+                Py_XDECREF(name);
+                break;
+            }
+            Py_DECREF(name);
+        }
+    }
+
+    return events;
+}
+
+static PyMethodDef perf_counters_methods[] =
+{
+    { "__enter__", perf_counters_enter, METH_NOARGS, NULL },
+    { "__exit__", perf_counters_exit, METH_VARARGS, NULL },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef perf_counters_getset[] =
+{
+    { const_cast<char*>("events"), perf_counters_get_events, NULL, const_cast<char*>("Names of available events."), NULL },
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject PerfCounters_Type =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    MODULE_NAME ".perf_counters",   // tp_name
+    sizeof(PerfCountersObject),     // tp_basicsize
+};
+
+bool init_perf_counters_types( PyObject * module )
+{
+    PerfCounters_Type.tp_flags = Py_TPFLAGS_DEFAULT;
+    PerfCounters_Type.tp_doc = "Context manager counting performance events of the calling thread.";
+    PerfCounters_Type.tp_methods = perf_counters_methods;
+    PerfCounters_Type.tp_getset = perf_counters_getset;
+    PerfCounters_Type.tp_init = perf_counters_init;
+    PerfCounters_Type.tp_new = PyType_GenericNew;
+    PerfCounters_Type.tp_dealloc = perf_counters_dealloc;
+
+    if( PyType_Ready(&PerfCounters_Type) < 0 )
+    {
+        return false;
+    }
+
+    Py_INCREF(&PerfCounters_Type);
+    if( PyModule_AddObject( module, "perf_counters", (PyObject*)&PerfCounters_Type ) < 0 )
+    {
+        Py_DECREF(&PerfCounters_Type);
+        return false;
+    }
+
+    return true;
+}
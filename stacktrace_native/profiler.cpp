@@ -0,0 +1,817 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+
+#include "stacktrace_native.h"
+
+// Sampling CPU profiler
+//
+// Each thread gets a timer on its own CPU-time clock, which sends SIGPROF to that thread (SIGEV_THREAD_ID),
+// so samples are distributed by the CPU time of each thread. A process-wide CPU timer (setitimer(ITIMER_PROF))
+// would deliver most signals to the main thread on older kernels.
+//
+// The signal handler writes native frames and Python frames to a ring buffer of the thread. A background
+// thread creates timers for new threads, and moves samples from ring buffers to a table of unique stacks.
+// stop_profiling() symbolizes the stacks and writes them in folded format ("frame;frame;frame count").
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+//-----
+
+static const size_t PROFILE_RING_WORDS = 64 * 1024; // power of 2
+static const int PROFILE_SCAN_INTERVAL_MS = 20;
+
+// Largest sample : header, native frames, and 2 words per Python frame
+static const size_t PROFILE_MAX_SAMPLE_WORDS = 1 + CAPTURE_MAX_FRAMES + CAPTURE_MAX_PYTHON_FRAMES * 2;
+
+struct ProfileThread
+{
+    pid_t tid; // 0 if the slot is free
+    uint64_t start_time; // to tell a new thread which reuses the tid of an exited thread
+    timer_t timer;
+    bool seen;
+
+    // Single producer (the thread itself, in the signal handler), single consumer (aggregation thread)
+    uint64_t * ring;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+};
+
+// Unique stack, in the hash table
+struct ProfileStack
+{
+    uint64_t hash;
+    size_t offset; // in ProfilerState::words
+    size_t num_words;
+    uint64_t count;
+};
+
+struct ProfilerState
+{
+    ProfileThread * threads;
+    size_t max_threads;
+    long interval_ns;
+
+    std::atomic<bool> active;
+    std::atomic<int> handlers_running;
+    std::atomic<bool> stop_requested;
+    pthread_t aggregation_thread;
+    pid_t aggregation_tid;
+    struct sigaction previous_action;
+
+    // Touched only by the aggregation thread while profiling
+    ProfileStack * stacks;
+    size_t stacks_capacity; // power of 2
+    size_t num_stacks;
+    uint64_t * words;
+    size_t words_size;
+    size_t words_capacity;
+    uint64_t num_samples;
+    uint64_t num_lost; // samples which couldn't be added to the table (out of memory)
+};
+
+static ProfilerState profiler;
+
+//-----
+
+static inline void write_ring( ProfileThread & thread, uint64_t pos, uint64_t value )
+{
+    thread.ring[ pos & (PROFILE_RING_WORDS-1) ] = value;
+}
+
+static inline uint64_t read_ring( const ProfileThread & thread, uint64_t pos )
+{
+    return thread.ring[ pos & (PROFILE_RING_WORDS-1) ];
+}
+
+// Sample layout : header (num_frames | num_python_frames << 16), native frames, and (code, lasti << 32 | line) for each Python frame
+static void write_sample( ProfileThread & thread, const ucontext_t * context )
+{
+    void * frames[CAPTURE_MAX_FRAMES];
+    size_t num_frames = capture_native_stack( frames, CAPTURE_MAX_FRAMES, context );
+
+    // The thread state is read with safe_read(), as the thread can be exiting. The frame chain of the interrupted
+    // thread itself is consistent after that, so frames are read directly.
+    PythonFrameCapture python_frames[CAPTURE_MAX_PYTHON_FRAMES];
+    size_t num_python_frames = read_python_stack( python_frames, CAPTURE_MAX_PYTHON_FRAMES, false );
+
+    size_t num_words = 1 + num_frames + num_python_frames * 2;
+
+    uint64_t head = thread.head.load( std::memory_order_relaxed );
+    uint64_t tail = thread.tail.load( std::memory_order_acquire );
+    if( head - tail + num_words > PROFILE_RING_WORDS )
+    {
+        thread.dropped.fetch_add( 1, std::memory_order_relaxed );
+        return;
+    }
+
+    write_ring( thread, head++, num_frames | ( num_python_frames << 16 ) );
+    for( size_t i=0 ; i<num_frames ; ++i )
+    {
+        write_ring( thread, head++, (uintptr_t)frames[i] );
+    }
+    for( size_t i=0 ; i<num_python_frames ; ++i )
+    {
+        write_ring( thread, head++, python_frames[i].code );
+        write_ring( thread, head++, ( (uint64_t)(uint32_t)python_frames[i].lasti << 32 ) | (uint32_t)python_frames[i].line );
+    }
+
+    thread.head.store( head, std::memory_order_release );
+}
+
+static void profile_signal_handler( int sig, siginfo_t * info, void * context )
+{
+    int saved_errno = errno;
+
+    // stop_profiling() waits for handlers_running to be 0 after clearing active
+    profiler.handlers_running.fetch_add(1);
+    if( profiler.active.load() && info->si_code==SI_TIMER )
+    {
+        size_t index = (size_t)info->si_value.sival_int;
+        if( index < profiler.max_threads && profiler.threads[index].tid==get_tid() )
+        {
+            write_sample( profiler.threads[index], (const ucontext_t*)context );
+        }
+    }
+    profiler.handlers_running.fetch_sub(1);
+
+    errno = saved_errno;
+}
+
+//-----
+
+static uint64_t hash_words( const uint64_t * words, size_t num_words )
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for( size_t i=0 ; i<num_words ; ++i )
+    {
+        hash = ( hash ^ words[i] ) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool grow_stack_table()
+{
+    size_t capacity = profiler.stacks_capacity ? profiler.stacks_capacity * 2 : 4096;
+    ProfileStack * stacks = (ProfileStack*)calloc( capacity, sizeof(ProfileStack) );
+    if( !stacks )
+    {
+        return false;
+    }
+
+    for( size_t i=0 ; i<profiler.stacks_capacity ; ++i )
+    {
+        const ProfileStack & stack = profiler.stacks[i];
+        if( stack.count )
+        {
+            size_t j = stack.hash & (capacity-1);
+            while( stacks[j].count )
+            {
+                j = ( j + 1 ) & (capacity-1);
+            }
+            stacks[j] = stack;
+        }
+    }
+
+    free( profiler.stacks );
+    profiler.stacks = stacks;
+    profiler.stacks_capacity = capacity;
+    return true;
+}
+
+static void add_stack( const uint64_t * words, size_t num_words )
+{
+    if( ( profiler.num_stacks + 1 ) * 2 > profiler.stacks_capacity && !grow_stack_table() )
+    {
+        profiler.num_lost++;
+        return;
+    }
+
+    uint64_t hash = hash_words( words, num_words );
+    size_t i = hash & (profiler.stacks_capacity-1);
+    for( ; profiler.stacks[i].count ; i = ( i + 1 ) & (profiler.stacks_capacity-1) )
+    {
+        ProfileStack & stack = profiler.stacks[i];
+        if( stack.hash==hash && stack.num_words==num_words && memcmp( profiler.words + stack.offset, words, num_words * sizeof(uint64_t) )==0 )
+        {
+            stack.count++;
+            return;
+        }
+    }
+
+    if( profiler.words_size + num_words > profiler.words_capacity )
+    {
+        size_t capacity = profiler.words_capacity ? profiler.words_capacity * 2 : 64 * 1024;
+        while( profiler.words_size + num_words > capacity )
+        {
+            capacity *= 2;
+        }
+        uint64_t * new_words = (uint64_t*)realloc( profiler.words, capacity * sizeof(uint64_t) );
+        if( !new_words )
+        {
+            profiler.num_lost++;
+            return;
+        }
+        profiler.words = new_words;
+        profiler.words_capacity = capacity;
+    }
+
+    memcpy( profiler.words + profiler.words_size, words, num_words * sizeof(uint64_t) );
+
+    ProfileStack & stack = profiler.stacks[i];
+    stack.hash = hash;
+    stack.offset = profiler.words_size;
+    stack.num_words = num_words;
+    stack.count = 1;
+
+    profiler.words_size += num_words;
+    profiler.num_stacks++;
+}
+
+static void drain_ring( ProfileThread & thread )
+{
+    uint64_t words[PROFILE_MAX_SAMPLE_WORDS];
+
+    uint64_t head = thread.head.load( std::memory_order_acquire );
+    uint64_t tail = thread.tail.load( std::memory_order_relaxed );
+    while( tail < head )
+    {
+        uint64_t header = read_ring( thread, tail );
+        size_t num_words = 1 + ( header & 0xffff ) + ( header >> 16 ) * 2;
+        for( size_t i=0 ; i<num_words ; ++i )
+        {
+            words[i] = read_ring( thread, tail + i );
+        }
+        tail += num_words;
+
+        add_stack( words, num_words );
+        profiler.num_samples++;
+    }
+
+    thread.tail.store( tail, std::memory_order_release );
+}
+
+//-----
+
+// CPU-time clock of a thread in this process (MAKE_THREAD_CPUCLOCK(tid, CPUCLOCK_SCHED) in the kernel)
+static clockid_t get_thread_cpu_clock( pid_t tid )
+{
+    return (clockid_t)( ( ~(unsigned int)tid << 3 ) | 6 );
+}
+
+// Start time of a thread in clock ticks since boot (field 22 of /proc/self/task/<tid>/stat), or 0 if it has exited
+static uint64_t read_thread_start_time( pid_t tid )
+{
+    char path[64];
+    snprintf( path, sizeof(path), "/proc/self/task/%d/stat", (int)tid );
+
+    int fd = open( path, O_RDONLY );
+    if( fd < 0 )
+    {
+        return 0;
+    }
+
+    char buf[1024];
+    ssize_t len = read( fd, buf, sizeof(buf)-1 );
+    close(fd);
+    if( len <= 0 )
+    {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    // The thread name (field 2) can contain spaces and parentheses, so fields are counted from the last ')'
+    const char * s = strrchr( buf, ')' );
+    if( !s )
+    {
+        return 0;
+    }
+    for( int field=2 ; field<22 && *s ; ++s )
+    {
+        if( *s==' ' )
+        {
+            ++field;
+        }
+    }
+
+    uint64_t start_time = 0;
+    for( ; *s>='0' && *s<='9' ; ++s )
+    {
+        start_time = start_time * 10 + ( *s - '0' );
+    }
+    return start_time;
+}
+
+static bool start_thread_timer( ProfileThread & thread, size_t index )
+{
+    struct sigevent event;
+    memset( &event, 0, sizeof(event) );
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_value.sival_int = (int)index;
+    event.sigev_notify_thread_id = thread.tid;
+
+    if( timer_create( get_thread_cpu_clock(thread.tid), &event, &thread.timer )!=0 )
+    {
+        return false;
+    }
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = profiler.interval_ns / 1000000000;
+    spec.it_interval.tv_nsec = profiler.interval_ns % 1000000000;
+    spec.it_value = spec.it_interval;
+    if( timer_settime( thread.timer, 0, &spec, NULL )!=0 )
+    {
+        timer_delete( thread.timer );
+        return false;
+    }
+
+    return true;
+}
+
+static void release_thread( ProfileThread & thread )
+{
+    timer_delete( thread.timer );
+    drain_ring( thread );
+    thread.tid = 0;
+}
+
+// Start timers for new threads, and release slots of exited threads
+static void scan_threads()
+{
+    for( size_t i=0 ; i<profiler.max_threads ; ++i )
+    {
+        profiler.threads[i].seen = false;
+    }
+
+    for_each_thread( [&]( pid_t tid )
+    {
+        if( tid==profiler.aggregation_tid )
+        {
+            return;
+        }
+
+        uint64_t start_time = read_thread_start_time(tid);
+        if( start_time==0 )
+        {
+            return;
+        }
+
+        size_t free_index = profiler.max_threads;
+        for( size_t i=0 ; i<profiler.max_threads ; ++i )
+        {
+            if( profiler.threads[i].tid==tid )
+            {
+                // The timer of an exited thread never fires again. When its tid is reused by a new thread,
+                // the old slot is released below as not seen, and the new thread gets a slot and timer of its own.
+                if( profiler.threads[i].start_time==start_time )
+                {
+                    profiler.threads[i].seen = true;
+                    return;
+                }
+                continue;
+            }
+            if( profiler.threads[i].tid==0 && free_index==profiler.max_threads )
+            {
+                free_index = i;
+            }
+        }
+
+        if( free_index < profiler.max_threads )
+        {
+            ProfileThread & thread = profiler.threads[free_index];
+            thread.tid = tid;
+            thread.start_time = start_time;
+            thread.seen = true;
+            if( !start_thread_timer( thread, free_index ) )
+            {
+                thread.tid = 0;
+            }
+        }
+    });
+
+    for( size_t i=0 ; i<profiler.max_threads ; ++i )
+    {
+        if( profiler.threads[i].tid && !profiler.threads[i].seen )
+        {
+            release_thread( profiler.threads[i] );
+        }
+    }
+}
+
+static void * aggregation_thread_main( void * )
+{
+    profiler.aggregation_tid = get_tid();
+
+    while( !profiler.stop_requested.load() )
+    {
+        scan_threads();
+
+        for( size_t i=0 ; i<profiler.max_threads ; ++i )
+        {
+            if( profiler.threads[i].tid )
+            {
+                drain_ring( profiler.threads[i] );
+            }
+        }
+
+        struct timespec wait = { 0, PROFILE_SCAN_INTERVAL_MS * 1000000L };
+        nanosleep( &wait, NULL );
+    }
+
+    return NULL;
+}
+
+//-----
+
+// Output of one stack in folded format, from the root frame to the leaf frame
+struct FoldedLine
+{
+    char * text;
+    uint64_t count;
+};
+
+static void append_text( char * buf, size_t buf_size, size_t & len, const char * s )
+{
+    while( *s && len < buf_size - 1 )
+    {
+        char c = *s++;
+        // ';' separates frames, and the count follows the last space
+        buf[len++] = ( c==';' || c=='\n' ) ? '_' : c;
+    }
+    buf[len] = '\0';
+}
+
+static void append_native_frame( char * buf, size_t buf_size, size_t & len, uintptr_t pc, bool return_address )
+{
+    char name[512];
+
+    // Return addresses can be after the end of the function (calls to noreturn functions)
+    Dl_info info;
+    if( dladdr( (void*)( return_address ? pc - 1 : pc ), &info ) && info.dli_fname )
+    {
+        if( info.dli_sname )
+        {
+            snprintf( name, sizeof(name), "%s", info.dli_sname );
+        }
+        else
+        {
+            const char * basename = strrchr( info.dli_fname, '/' );
+            snprintf( name, sizeof(name), "%s+0x%lx", basename ? basename + 1 : info.dli_fname, (unsigned long)( pc - (uintptr_t)info.dli_fbase ) );
+        }
+    }
+    else
+    {
+        snprintf( name, sizeof(name), "0x%lx", (unsigned long)pc );
+    }
+
+    append_text( buf, buf_size, len, name );
+}
+
+static void append_python_frame( char * buf, size_t buf_size, size_t & len, const PythonFrameCapture & frame )
+{
+    static PythonFrameInfo info;
+    read_python_frame_info( frame, info );
+
+    char name[512];
+    snprintf( name, sizeof(name), "%s (%s:%d)", info.name, info.filename, info.line );
+    append_text( buf, buf_size, len, name );
+}
+
+static char * format_folded_stack( const uint64_t * words, bool native )
+{
+    size_t num_frames = words[0] & 0xffff;
+    size_t num_python_frames = words[0] >> 16;
+
+    void * frames[CAPTURE_MAX_FRAMES] = {};
+    for( size_t i=0 ; i<num_frames ; ++i )
+    {
+        frames[i] = (void*)(uintptr_t)words[ 1 + i ];
+    }
+
+    PythonFrameCapture python_frames[CAPTURE_MAX_PYTHON_FRAMES];
+    for( size_t i=0 ; i<num_python_frames ; ++i )
+    {
+        const uint64_t * p = words + 1 + num_frames + i * 2;
+        python_frames[i].code = p[0];
+        python_frames[i].lasti = (int32_t)( p[1] >> 32 );
+        python_frames[i].line = (int32_t)(uint32_t)p[1];
+    }
+
+    uint32_t native_indices[CAPTURE_MAX_PYTHON_FRAMES];
+    match_python_frames( frames, num_frames, num_python_frames, native_indices );
+
+    static char buf[16 * 1024];
+    size_t len = 0;
+    buf[0] = '\0';
+
+    auto separator = [&]()
+    {
+        if( len > 0 && len < sizeof(buf) - 1 )
+        {
+            buf[len++] = ';';
+            buf[len] = '\0';
+        }
+    };
+
+    // Python frames beyond the native stack, outermost first
+    size_t python_end = num_python_frames;
+    while( python_end > 0 && native_indices[python_end-1]==NO_NATIVE_FRAME )
+    {
+        --python_end;
+        separator();
+        append_python_frame( buf, sizeof(buf), len, python_frames[python_end] );
+    }
+
+    // Native frames from the root. The eval loop frame is replaced with the Python frame it runs.
+    for( size_t i=num_frames ; i>0 ; --i )
+    {
+        size_t index = i - 1;
+        if( python_end > 0 && native_indices[python_end-1]==index )
+        {
+            while( python_end > 0 && native_indices[python_end-1]==index )
+            {
+                --python_end;
+                separator();
+                append_python_frame( buf, sizeof(buf), len, python_frames[python_end] );
+            }
+        }
+        else if( native )
+        {
+            separator();
+            append_native_frame( buf, sizeof(buf), len, (uintptr_t)frames[index], index > 0 );
+        }
+    }
+
+    if( len==0 )
+    {
+        append_text( buf, sizeof(buf), len, native ? "(unknown)" : "(native)" );
+    }
+
+    return strdup(buf);
+}
+
+static int compare_folded_lines( const void * a, const void * b )
+{
+    return strcmp( ((const FoldedLine*)a)->text, ((const FoldedLine*)b)->text );
+}
+
+// Stacks with different addresses can have the same text (e.g. different bytecode in the same line). Merged after sorting.
+static bool write_folded_stacks( const char * filename, bool native, size_t & num_lines )
+{
+    FILE * fd = fopen( filename, "w" );
+    if( !fd )
+    {
+        return false;
+    }
+
+    FoldedLine * lines = (FoldedLine*)calloc( profiler.num_stacks + 1, sizeof(FoldedLine) );
+    size_t n = 0;
+    for( size_t i=0 ; lines && i<profiler.stacks_capacity ; ++i )
+    {
+        const ProfileStack & stack = profiler.stacks[i];
+        if( stack.count )
+        {
+            lines[n].text = format_folded_stack( profiler.words + stack.offset, native );
+            lines[n].count = stack.count;
+            if( lines[n].text )
+            {
+                n++;
+            }
+        }
+    }
+
+    if( lines )
+    {
+        qsort( lines, n, sizeof(FoldedLine), compare_folded_lines );
+    }
+
+    num_lines = 0;
+    for( size_t i=0 ; i<n ; )
+    {
+        size_t j = i + 1;
+        uint64_t count = lines[i].count;
+        for( ; j<n && strcmp( lines[i].text, lines[j].text )==0 ; ++j )
+        {
+            count += lines[j].count;
+        }
+        fprintf( fd, "%s %llu\n", lines[i].text, (unsigned long long)count );
+        num_lines++;
+
+        for( ; i<j ; ++i )
+        {
+            free( lines[i].text );
+        }
+    }
+
+    free( lines );
+    bool succeeded = ( fflush(fd)==0 );
+    fclose(fd);
+    return succeeded;
+}
+
+static void free_profiler_buffers()
+{
+    free( profiler.stacks );
+    free( profiler.words );
+    profiler.stacks = NULL;
+    profiler.stacks_capacity = 0;
+    profiler.num_stacks = 0;
+    profiler.words = NULL;
+    profiler.words_size = 0;
+    profiler.words_capacity = 0;
+
+    if( profiler.threads )
+    {
+        for( size_t i=0 ; i<profiler.max_threads ; ++i )
+        {
+            munmap( profiler.threads[i].ring, PROFILE_RING_WORDS * sizeof(uint64_t) );
+        }
+        free( profiler.threads );
+        profiler.threads = NULL;
+    }
+}
+
+//-----
+
+PyObject * _start_profiling( PyObject * self, PyObject * args, PyObject * kwds )
+{
+    int rate = 100;
+    int max_threads = 64;
+
+    static const char * kwlist[] = {
+        "rate",
+        "max_threads",
+        NULL
+    };
+
+    if( ! PyArg_ParseTupleAndKeywords( args, kwds, "|ii", const_cast<char**>(kwlist), &rate, &max_threads ) )
+    {
+        return NULL;
+    }
+
+    if( rate<=0 || rate>10000 || max_threads<=0 )
+    {
+        PyErr_SetString( PyExc_ValueError, "rate must be 1-10000, and max_threads must be positive" );
+        return NULL;
+    }
+
+    if( profiler.threads )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "profiling is already started" );
+        return NULL;
+    }
+
+    init_python_stack();
+
+    // backtrace() loads libgcc at the first call, which allocates memory
+    void * frames[1];
+    backtrace( frames, 1 );
+
+    profiler.threads = (ProfileThread*)calloc( max_threads, sizeof(ProfileThread) );
+    if( !profiler.threads )
+    {
+        return PyErr_NoMemory();
+    }
+    profiler.max_threads = max_threads;
+
+    // Pages are allocated when samples are written
+    for( int i=0 ; i<max_threads ; ++i )
+    {
+        void * p = mmap( NULL, PROFILE_RING_WORDS * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+        profiler.threads[i].ring = (uint64_t*)p;
+        if( p==MAP_FAILED )
+        {
+            profiler.max_threads = i;
+            free_profiler_buffers();
+            return PyErr_NoMemory();
+        }
+    }
+
+    profiler.interval_ns = 1000000000L / rate;
+    profiler.num_samples = 0;
+    profiler.num_lost = 0;
+    profiler.aggregation_tid = 0;
+    profiler.stop_requested.store(false);
+
+    struct sigaction action;
+    memset( &action, 0, sizeof(action) );
+    action.sa_sigaction = profile_signal_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset( &action.sa_mask );
+    struct sigaction previous;
+    if( sigaction( SIGPROF, &action, &previous )!=0 )
+    {
+        free_profiler_buffers();
+        return PyErr_SetFromErrno( PyExc_OSError );
+    }
+
+    // Still installed from the previous profiling
+    if( !( (previous.sa_flags & SA_SIGINFO) && previous.sa_sigaction==profile_signal_handler ) )
+    {
+        profiler.previous_action = previous;
+    }
+
+    profiler.active.store(true);
+
+    int result = pthread_create( &profiler.aggregation_thread, NULL, aggregation_thread_main, NULL );
+    if( result!=0 )
+    {
+        profiler.active.store(false);
+        free_profiler_buffers();
+        errno = result;
+        return PyErr_SetFromErrno( PyExc_OSError );
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyObject * _stop_profiling( PyObject * self, PyObject * args, PyObject * kwds )
+{
+    const char * filename;
+    int native = 1;
+
+    static const char * kwlist[] = {
+        "filename",
+        "native",
+        NULL
+    };
+
+    if( ! PyArg_ParseTupleAndKeywords( args, kwds, "s|p", const_cast<char**>(kwlist), &filename, &native ) )
+    {
+        return NULL;
+    }
+
+    if( !profiler.threads )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "profiling is not started" );
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+
+    profiler.stop_requested.store(true);
+    pthread_join( profiler.aggregation_thread, NULL );
+
+    // Signals already queued are ignored, and running handlers finish writing
+    profiler.active.store(false);
+    for( size_t i=0 ; i<profiler.max_threads ; ++i )
+    {
+        if( profiler.threads[i].tid )
+        {
+            timer_delete( profiler.threads[i].timer );
+        }
+    }
+    while( profiler.handlers_running.load()!=0 )
+    {
+        sched_yield();
+    }
+
+    // A signal can still be pending after timer_delete(). The default action of SIGPROF terminates the process,
+    // so the handler (which ignores signals while not profiling) is kept unless there was another handler.
+    if( (profiler.previous_action.sa_flags & SA_SIGINFO) || ( profiler.previous_action.sa_handler!=SIG_DFL && profiler.previous_action.sa_handler!=NULL ) )
+    {
+        sigaction( SIGPROF, &profiler.previous_action, NULL );
+    }
+
+    Py_END_ALLOW_THREADS
+
+    uint64_t dropped = 0;
+    for( size_t i=0 ; i<profiler.max_threads ; ++i )
+    {
+        drain_ring( profiler.threads[i] );
+        dropped += profiler.threads[i].dropped.load();
+    }
+
+    size_t num_lines = 0;
+    bool succeeded = write_folded_stacks( filename, native, num_lines );
+
+    uint64_t num_samples = profiler.num_samples;
+    dropped += profiler.num_lost;
+    free_profiler_buffers();
+
+    if( !succeeded )
+    {
+        return PyErr_SetFromErrnoWithFilename( PyExc_OSError, filename );
+    }
+
+    return Py_BuildValue( "{s:K,s:K,s:n}", "samples", (unsigned long long)num_samples, "dropped", (unsigned long long)dropped, "stacks", (Py_ssize_t)num_lines );
+}
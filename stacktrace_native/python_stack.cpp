@@ -0,0 +1,280 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <link.h>
+
+#include "stacktrace_native.h"
+
+#include "frameobject.h"
+
+//-----
+
+// Limits for walking lists in memory which may be broken (e.g. cycles)
+static const int MAX_THREAD_STATES = 1024;
+
+static PyInterpreterState * python_interp = NULL;
+
+// Address range of the eval loop, to find native frames running Python frames
+static uintptr_t eval_frame_start = 0;
+static uintptr_t eval_frame_end = 0;
+
+//-----
+
+template< typename T >
+static bool read_value( T & value, const void * p )
+{
+    return p && safe_read( &value, p, sizeof(T) )==sizeof(T);
+}
+
+static bool has_type( const void * obj, PyTypeObject * type )
+{
+    PyObject header;
+    return read_value( header, obj ) && header.ob_type==type;
+}
+
+static void copy_str( char * dst, size_t dst_size, const char * src )
+{
+    size_t len = strlen(src);
+    if( len >= dst_size )
+    {
+        len = dst_size - 1;
+    }
+    memcpy( dst, src, len );
+    dst[len] = '\0';
+}
+
+// Unicode object to UTF-8 (or '?' for non-ASCII characters without cached UTF-8)
+static void read_unicode( const void * obj, char * buf, size_t buf_size )
+{
+    copy_str( buf, buf_size, "???" );
+
+    PyASCIIObject ascii;
+    if( !has_type( obj, &PyUnicode_Type ) || !read_value( ascii, obj ) || !ascii.state.compact )
+    {
+        return;
+    }
+
+    if( ascii.state.ascii )
+    {
+        size_t len = (size_t)ascii.length < buf_size - 1 ? (size_t)ascii.length : buf_size - 1;
+        buf[ safe_read( buf, (const PyASCIIObject*)obj + 1, len ) ] = '\0';
+        return;
+    }
+
+    PyCompactUnicodeObject compact;
+    if( !read_value( compact, obj ) )
+    {
+        return;
+    }
+
+    if( compact.utf8 )
+    {
+        size_t len = (size_t)compact.utf8_length < buf_size - 1 ? (size_t)compact.utf8_length : buf_size - 1;
+        buf[ safe_read( buf, compact.utf8, len ) ] = '\0';
+        return;
+    }
+
+    const uint8_t * data = (const uint8_t*)( (const PyCompactUnicodeObject*)obj + 1 );
+    size_t kind = ascii.state.kind;
+    size_t len = 0;
+    for( size_t i=0 ; i<(size_t)ascii.length && len < buf_size - 1 ; ++i )
+    {
+        uint32_t c = 0;
+        if( safe_read( &c, data + i * kind, kind )!=kind )
+        {
+            break;
+        }
+        buf[len++] = c < 0x80 ? (char)c : '?';
+    }
+    buf[len] = '\0';
+}
+
+// Same as PyCode_Addr2Line(), reading co_lnotab with safe_read()
+static int addr_to_line( const PyCodeObject & code, int lasti )
+{
+    int line = code.co_firstlineno;
+
+    PyVarObject lnotab;
+    if( !has_type( code.co_lnotab, &PyBytes_Type ) || !read_value( lnotab, code.co_lnotab ) )
+    {
+        return line;
+    }
+
+    const uint8_t * p = (const uint8_t*)( (const char*)code.co_lnotab + offsetof(PyBytesObject, ob_sval) );
+    size_t size = (size_t)lnotab.ob_size & ~(size_t)1;
+    int addr = 0;
+
+    uint8_t chunk[256];
+    for( size_t pos=0 ; pos<size ; pos+=sizeof(chunk) )
+    {
+        size_t chunk_size = size - pos < sizeof(chunk) ? size - pos : sizeof(chunk);
+        if( safe_read( chunk, p + pos, chunk_size )!=chunk_size )
+        {
+            return line;
+        }
+
+        for( size_t i=0 ; i<chunk_size ; i+=2 )
+        {
+            addr += chunk[i];
+            if( addr > lasti )
+            {
+                return line;
+            }
+            line += (int8_t)chunk[i+1];
+        }
+    }
+
+    return line;
+}
+
+//-----
+
+void init_python_stack()
+{
+    python_interp = PyThreadState_Get()->interp;
+
+    Dl_info info;
+    const ElfW(Sym) * symbol = NULL;
+    if( dladdr1( (void*)_PyEval_EvalFrameDefault, &info, (void**)&symbol, RTLD_DL_SYMENT ) && symbol && symbol->st_size )
+    {
+        eval_frame_start = (uintptr_t)_PyEval_EvalFrameDefault;
+        eval_frame_end = eval_frame_start + symbol->st_size;
+    }
+}
+
+// Reads of the interpreter state. Guarded reads go through safe_read().
+template< typename T >
+static bool read_state( T & value, const void * p, size_t size, bool guarded )
+{
+    if( !p )
+    {
+        return false;
+    }
+    if( guarded )
+    {
+        return safe_read( &value, p, size )==size;
+    }
+    memcpy( &value, p, size );
+    return true;
+}
+
+// Copies the thread state of the calling thread into tstate
+static bool find_own_thread_state( PyThreadState & tstate, bool guarded )
+{
+    // Thread-specific value of the GIL state API, for threads created by Python.
+    // Always read with safe_read(), as an exiting thread frees its thread state before clearing the value.
+    unsigned long self = (unsigned long)pthread_self();
+    const PyThreadState * p = PyGILState_GetThisThreadState();
+    if( read_value( tstate, p ) && tstate.thread_id==self )
+    {
+        return true;
+    }
+
+    // Threads created by Python always have the thread-specific value, so only native threads get here.
+    // Searching the list costs a system call per thread, which is too slow for sampling.
+    if( !guarded )
+    {
+        return false;
+    }
+
+    // Other threads can add or remove thread states while reading the list
+    PyInterpreterState interp;
+    if( !read_value( interp, python_interp ) )
+    {
+        return false;
+    }
+
+    p = interp.tstate_head;
+    for( int i=0 ; i<MAX_THREAD_STATES && read_value( tstate, p ) ; ++i )
+    {
+        if( tstate.thread_id==self )
+        {
+            return true;
+        }
+        p = tstate.next;
+    }
+
+    return false;
+}
+
+size_t read_python_stack( PythonFrameCapture * frames, size_t max_frames, bool guarded )
+{
+    PyThreadState tstate;
+    if( !python_interp || !find_own_thread_state( tstate, guarded ) )
+    {
+        return 0;
+    }
+
+    // Stops at a cycle of f_back in a corrupted chain (Brent's algorithm, comparing with a frame saved at powers of 2)
+    size_t num_frames = 0;
+    const PyFrameObject * f = tstate.frame;
+    const PyFrameObject * checkpoint = NULL;
+    while( f && num_frames < max_frames && f!=checkpoint )
+    {
+        if( ( num_frames & (num_frames-1) )==0 )
+        {
+            checkpoint = f;
+        }
+
+        PyFrameObject frame;
+        if( !read_state( frame, f, offsetof(PyFrameObject, f_iblock), guarded ) || Py_TYPE(&frame)!=&PyFrame_Type )
+        {
+            break;
+        }
+
+        PythonFrameCapture & captured = frames[ num_frames++ ];
+        captured.code = (uintptr_t)frame.f_code;
+        captured.lasti = frame.f_lasti;
+        captured.line = frame.f_trace ? frame.f_lineno : -1;
+
+        f = frame.f_back;
+    }
+
+    return num_frames;
+}
+
+void read_python_frame_info( const PythonFrameCapture & frame, PythonFrameInfo & info )
+{
+    copy_str( info.filename, sizeof(info.filename), "???" );
+    copy_str( info.name, sizeof(info.name), "???" );
+    info.line = frame.line;
+
+    PyCodeObject code;
+    if( !has_type( (const void*)frame.code, &PyCode_Type ) || !read_value( code, (const void*)frame.code ) )
+    {
+        return;
+    }
+
+    read_unicode( code.co_filename, info.filename, sizeof(info.filename) );
+    read_unicode( code.co_name, info.name, sizeof(info.name) );
+
+    if( info.line < 0 )
+    {
+        info.line = addr_to_line( code, frame.lasti );
+    }
+}
+
+void match_python_frames( void * const * frames, size_t num_frames, size_t num_python_frames, uint32_t * native_indices )
+{
+    size_t python_index = 0;
+    for( size_t i=0 ; i<num_frames && python_index<num_python_frames ; ++i )
+    {
+        // Return addresses are inside the caller, after the call instruction
+        uintptr_t pc = (uintptr_t)frames[i];
+        if( pc > eval_frame_start && pc <= eval_frame_end )
+        {
+            native_indices[python_index++] = (uint32_t)i;
+        }
+    }
+
+    while( python_index < num_python_frames )
+    {
+        native_indices[python_index++] = NO_NATIVE_FRAME;
+    }
+}
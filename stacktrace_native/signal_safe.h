@@ -0,0 +1,160 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+// Async-signal-safe output
+//
+// Formats text (or binary data) into a fixed buffer on the stack and writes it with write(2).
+// Doesn't use malloc, locks or stdio, so it can be used in signal handlers, including
+// crashes inside malloc or while other threads hold stdio locks.
+
+struct SignalSafeWriter
+{
+    SignalSafeWriter( int _fd )
+        :
+        fd(_fd),
+        len(0)
+    {
+    }
+
+    ~SignalSafeWriter()
+    {
+        flush();
+    }
+
+    void flush()
+    {
+        size_t pos = 0;
+        while( pos < len )
+        {
+            ssize_t written = write( fd, buf + pos, len - pos );
+            if( written <= 0 )
+            {
+                break;
+            }
+            pos += written;
+        }
+        len = 0;
+    }
+
+    SignalSafeWriter & ch( char c )
+    {
+        if( len == sizeof(buf) )
+        {
+            flush();
+        }
+        buf[len++] = c;
+        return *this;
+    }
+
+    SignalSafeWriter & data( const void * p, size_t size )
+    {
+        const char * bytes = (const char*)p;
+        if( size > sizeof(buf) - len )
+        {
+            flush();
+        }
+
+        if( size >= sizeof(buf) )
+        {
+            while( size > 0 )
+            {
+                ssize_t written = write( fd, bytes, size );
+                if( written <= 0 )
+                {
+                    break;
+                }
+                bytes += written;
+                size -= written;
+            }
+            return *this;
+        }
+
+        memcpy( buf + len, bytes, size );
+        len += size;
+        return *this;
+    }
+
+    SignalSafeWriter & str( const char * s )
+    {
+        while( s && *s )
+        {
+            ch( *s++ );
+        }
+        return *this;
+    }
+
+    // At most max_len characters, for strings in memory which may not be terminated
+    SignalSafeWriter & str( const char * s, size_t max_len )
+    {
+        for( size_t i=0 ; s && i<max_len && s[i] ; ++i )
+        {
+            ch( s[i] );
+        }
+        return *this;
+    }
+
+    SignalSafeWriter & udec( uint64_t value )
+    {
+        char digits[20];
+        int n = 0;
+        do
+        {
+            digits[n++] = '0' + (char)( value % 10 );
+            value /= 10;
+        } while( value );
+
+        while( n > 0 )
+        {
+            ch( digits[--n] );
+        }
+        return *this;
+    }
+
+    SignalSafeWriter & dec( int64_t value )
+    {
+        if( value < 0 )
+        {
+            ch('-');
+            return udec( (uint64_t)0 - (uint64_t)value );
+        }
+        return udec( (uint64_t)value );
+    }
+
+    // "0x" prefixed, zero padded to min_digits
+    SignalSafeWriter & hex( uint64_t value, int min_digits=1 )
+    {
+        static const char hex_chars[] = "0123456789abcdef";
+
+        char digits[16];
+        int n = 0;
+        do
+        {
+            digits[n++] = hex_chars[ value & 0xf ];
+            value >>= 4;
+        } while( value );
+
+        while( n < min_digits && n < 16 )
+        {
+            digits[n++] = '0';
+        }
+
+        str("0x");
+        while( n > 0 )
+        {
+            ch( digits[--n] );
+        }
+        return *this;
+    }
+
+    SignalSafeWriter & ptr( const void * p )
+    {
+        return hex( (uintptr_t)p, 16 );
+    }
+
+    int fd;
+    size_t len;
+    char buf[512];
+};
@@ -1,12 +1,37 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <signal.h>
+#include <unistd.h>
+#include <ucontext.h>
 #include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <atomic>
 
 #include "Python.h"
 
+#include "stacktrace_native.h"
+#include "signal_safe.h"
+
 //-----
 
-#define MODULE_NAME "stacktrace_native"
+static const size_t ALTERNATE_STACK_SIZE = 64 * 1024; // backtrace() and the report run on this stack after a stack overflow
+static const int MAX_BACKTRACE_FRAMES = 64;
+
+// Threads are captured in the crash handler to print their stacks. Stack memory is only copied for crash dump files.
+static const size_t CAPTURE_MAX_THREADS = 256;
+static const int CAPTURE_TIMEOUT_MS = 200;
+
+//-----
+
+// Actions installed before install_signal_handler(), to chain to
+static struct sigaction previous_actions[NSIG];
+
+// Thread reporting a crash. Another thread crashing at the same time waits for the process to terminate,
+// and a crash inside the handler itself terminates the process immediately.
+static std::atomic<pid_t> crashing_tid(0);
 
 //-----
 
@@ -15,19 +40,268 @@ static PyObject * _hello( PyObject * self, PyObject * args )
     return PyUnicode_FromString( "Hello World!" );
 }
 
-static void _signal_handler(int sig)
+static const char * get_signal_name( int sig )
 {
-    void *array[30];
-    size_t size;
+    switch( sig )
+    {
+    case SIGSEGV: return "SIGSEGV";
+    case SIGBUS: return "SIGBUS";
+    case SIGFPE: return "SIGFPE";
+    case SIGILL: return "SIGILL";
+    case SIGABRT: return "SIGABRT";
+    case SIGTRAP: return "SIGTRAP";
+    case SIGSYS: return "SIGSYS";
+    case SIGHUP: return "SIGHUP";
+    case SIGINT: return "SIGINT";
+    case SIGQUIT: return "SIGQUIT";
+    case SIGTERM: return "SIGTERM";
+    case SIGUSR1: return "SIGUSR1";
+    case SIGUSR2: return "SIGUSR2";
+    case SIGPIPE: return "SIGPIPE";
+    }
+    return "unknown signal";
+}
 
-    // get void*'s for all entries on the stack
-    size = backtrace( array, sizeof(array)/sizeof(array[0]) ) ;
+static const char * get_signal_code_description( int sig, int code )
+{
+    switch( code )
+    {
+    case SI_USER: return "SI_USER (sent by kill)";
+    case SI_TKILL: return "SI_TKILL (sent by tgkill)";
+    case SI_QUEUE: return "SI_QUEUE (sent by sigqueue)";
+    case SI_KERNEL: return "SI_KERNEL (sent by kernel)";
+    }
 
-    // print out all the frames to stderr
-    fprintf(stderr, "Error : " MODULE_NAME " caught signal %d:\n", sig );
-    backtrace_symbols_fd(array, size, STDERR_FILENO);
-    
-    exit(1);
+    switch( sig )
+    {
+    case SIGSEGV:
+        switch( code )
+        {
+        case SEGV_MAPERR: return "SEGV_MAPERR (address not mapped)";
+        case SEGV_ACCERR: return "SEGV_ACCERR (invalid permissions for mapped object)";
+        }
+        break;
+
+    case SIGBUS:
+        switch( code )
+        {
+        case BUS_ADRALN: return "BUS_ADRALN (invalid address alignment)";
+        case BUS_ADRERR: return "BUS_ADRERR (nonexistent physical address)";
+        case BUS_OBJERR: return "BUS_OBJERR (object specific hardware error)";
+        }
+        break;
+
+    case SIGFPE:
+        switch( code )
+        {
+        case FPE_INTDIV: return "FPE_INTDIV (integer divide by zero)";
+        case FPE_INTOVF: return "FPE_INTOVF (integer overflow)";
+        case FPE_FLTDIV: return "FPE_FLTDIV (floating point divide by zero)";
+        case FPE_FLTOVF: return "FPE_FLTOVF (floating point overflow)";
+        case FPE_FLTUND: return "FPE_FLTUND (floating point underflow)";
+        case FPE_FLTRES: return "FPE_FLTRES (floating point inexact result)";
+        case FPE_FLTINV: return "FPE_FLTINV (floating point invalid operation)";
+        case FPE_FLTSUB: return "FPE_FLTSUB (subscript out of range)";
+        }
+        break;
+
+    case SIGILL:
+        switch( code )
+        {
+        case ILL_ILLOPC: return "ILL_ILLOPC (illegal opcode)";
+        case ILL_ILLOPN: return "ILL_ILLOPN (illegal operand)";
+        case ILL_ILLADR: return "ILL_ILLADR (illegal addressing mode)";
+        case ILL_ILLTRP: return "ILL_ILLTRP (illegal trap)";
+        case ILL_PRVOPC: return "ILL_PRVOPC (privileged opcode)";
+        case ILL_PRVREG: return "ILL_PRVREG (privileged register)";
+        case ILL_COPROC: return "ILL_COPROC (coprocessor error)";
+        case ILL_BADSTK: return "ILL_BADSTK (internal stack error)";
+        }
+        break;
+    }
+
+    return "";
+}
+
+static bool is_fault_signal( int sig )
+{
+    return sig==SIGSEGV || sig==SIGBUS || sig==SIGFPE || sig==SIGILL || sig==SIGTRAP;
+}
+
+static void write_registers( SignalSafeWriter & out, const ucontext_t * uc )
+{
+#if defined(__aarch64__)
+    const mcontext_t & mc = uc->uc_mcontext;
+
+    out.str("  pc ").hex(mc.pc,16).str("  sp ").hex(mc.sp,16).str("  pstate ").hex(mc.pstate,16).ch('\n');
+    for( int i=0 ; i<31 ; ++i )
+    {
+        out.str("  x").udec(i).str( i<10 ? "  " : " " ).hex(mc.regs[i],16);
+        if( i%4==3 || i==30 )
+        {
+            out.ch('\n');
+        }
+    }
+#elif defined(__x86_64__)
+    static const struct { const char * name; int index; } registers[] = {
+        { "rip", REG_RIP }, { "rsp", REG_RSP }, { "rbp", REG_RBP }, { "efl", REG_EFL },
+        { "rax", REG_RAX }, { "rbx", REG_RBX }, { "rcx", REG_RCX }, { "rdx", REG_RDX },
+        { "rsi", REG_RSI }, { "rdi", REG_RDI }, { "r8 ", REG_R8 },  { "r9 ", REG_R9 },
+        { "r10", REG_R10 }, { "r11", REG_R11 }, { "r12", REG_R12 }, { "r13", REG_R13 },
+        { "r14", REG_R14 }, { "r15", REG_R15 }, { "err", REG_ERR }, { "trp", REG_TRAPNO },
+    };
+
+    const greg_t * gregs = uc->uc_mcontext.gregs;
+    for( size_t i=0 ; i<sizeof(registers)/sizeof(registers[0]) ; ++i )
+    {
+        out.str("  ").str(registers[i].name).ch(' ').hex( (uint64_t)gregs[registers[i].index], 16 );
+        if( i%4==3 )
+        {
+            out.ch('\n');
+        }
+    }
+#else
+    (void)uc;
+    out.str("  (registers not supported on this platform)\n");
+#endif
+}
+
+// Terminate the process by the signal, with the default action (e.g. core dump)
+static void reraise_with_default_action( int sig )
+{
+    struct sigaction action;
+    memset( &action, 0, sizeof(action) );
+    action.sa_handler = SIG_DFL;
+    sigemptyset( &action.sa_mask );
+    sigaction( sig, &action, NULL );
+
+    sigset_t mask;
+    sigemptyset( &mask );
+    sigaddset( &mask, sig );
+    sigprocmask( SIG_UNBLOCK, &mask, NULL );
+
+    syscall( SYS_tgkill, getpid(), syscall(SYS_gettid), sig );
+
+    // Signals ignored by default don't terminate the process
+    _exit( 128 + sig );
+}
+
+// Only async-signal-safe functions are used here. backtrace() is safe once libgcc is loaded (see _install_signal_handler).
+static void _signal_handler( int sig, siginfo_t * info, void * context )
+{
+    pid_t tid = syscall(SYS_gettid);
+
+    pid_t expected = 0;
+    if( !crashing_tid.compare_exchange_strong( expected, tid ) )
+    {
+        if( expected==tid )
+        {
+            reraise_with_default_action(sig);
+        }
+
+        while(true)
+        {
+            sleep(1);
+        }
+    }
+
+    {
+        SignalSafeWriter out(STDERR_FILENO);
+
+        out.str( "Error : " MODULE_NAME " caught signal " ).dec(sig).str(" (").str( get_signal_name(sig) ).str("):\n");
+        out.str( "  thread " ).dec(tid).str(", code ").dec(info->si_code).ch(' ').str( get_signal_code_description( sig, info->si_code ) ).ch('\n');
+
+        if( info->si_code<=0 )
+        {
+            out.str( "  sent by pid " ).dec(info->si_pid).str(", uid ").dec(info->si_uid).ch('\n');
+        }
+        else if( is_fault_signal(sig) )
+        {
+            out.str( "  fault address " ).ptr(info->si_addr).ch('\n');
+        }
+
+        if( context )
+        {
+            out.str( "  registers:\n" );
+            write_registers( out, (const ucontext_t*)context );
+        }
+    }
+
+    size_t num_threads = capture_all_threads( (const ucontext_t*)context, CAPTURE_TIMEOUT_MS, true );
+    if( num_threads > 0 )
+    {
+        thread_capture.threads[0].flags |= CaptureFlags_Crashed;
+        for( size_t i=0 ; i<num_threads ; ++i )
+        {
+            write_thread_stack( STDERR_FILENO, thread_capture.threads[i] );
+        }
+    }
+    else
+    {
+        // Capture buffers are not allocated
+        SignalSafeWriter(STDERR_FILENO).str( "  stack:\n" );
+
+        void * frames[MAX_BACKTRACE_FRAMES];
+        int num_frames = backtrace( frames, MAX_BACKTRACE_FRAMES );
+        backtrace_symbols_fd( frames, num_frames, STDERR_FILENO );
+    }
+
+    if( is_crash_dump_enabled() )
+    {
+        const char * filename = write_crash_dump( sig, info, num_threads );
+
+        SignalSafeWriter out(STDERR_FILENO);
+        if( filename )
+        {
+            out.str( "  crash dump written to " ).str(filename).ch('\n');
+        }
+        else
+        {
+            out.str( "  failed to write crash dump\n" );
+        }
+    }
+
+    release_thread_capture();
+
+    const struct sigaction & previous = previous_actions[sig];
+    if( previous.sa_flags & SA_SIGINFO )
+    {
+        previous.sa_sigaction( sig, info, context );
+    }
+    else if( previous.sa_handler!=SIG_DFL && previous.sa_handler!=SIG_IGN )
+    {
+        previous.sa_handler(sig);
+    }
+
+    reraise_with_default_action(sig);
+}
+
+// Each thread needs its own alternate stack. Returns false if it couldn't be allocated.
+static bool install_alternate_stack()
+{
+    stack_t current;
+    if( sigaltstack( NULL, &current )==0 && !( current.ss_flags & SS_DISABLE ) )
+    {
+        return true;
+    }
+
+    void * p = mmap( NULL, ALTERNATE_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( p==MAP_FAILED )
+    {
+        return false;
+    }
+
+    stack_t stack;
+    stack.ss_sp = p;
+    stack.ss_size = ALTERNATE_STACK_SIZE;
+    stack.ss_flags = 0;
+    if( sigaltstack( &stack, NULL )!=0 )
+    {
+        munmap( p, ALTERNATE_STACK_SIZE );
+        return false;
+    }
+
+    return true;
 }
 
 static PyObject * _install_signal_handler(PyObject* self, PyObject* args, PyObject * kwds)
@@ -44,8 +318,56 @@ static PyObject * _install_signal_handler(PyObject* self, PyObject* args, PyObje
         return NULL;
     }
 
-    signal( signalnum, _signal_handler);
-    
+    if( signalnum<1 || signalnum>=NSIG )
+    {
+        PyErr_SetString( PyExc_ValueError, "signal number out of range" );
+        return NULL;
+    }
+
+    // backtrace() loads libgcc at the first call, which allocates memory. Do it here, not in the handler.
+    void * frames[1];
+    backtrace( frames, 1 );
+
+    install_alternate_stack();
+
+    init_python_stack();
+    init_thread_capture( CAPTURE_MAX_THREADS, 0 );
+
+    struct sigaction action;
+    memset( &action, 0, sizeof(action) );
+    action.sa_sigaction = _signal_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset( &action.sa_mask );
+
+    // Some signals (e.g. SIGKILL) can't be caught
+    struct sigaction previous;
+    if( sigaction( signalnum, &action, &previous )!=0 )
+    {
+        Py_RETURN_FALSE;
+    }
+
+    // Installing twice must not chain to itself
+    if( !( (previous.sa_flags & SA_SIGINFO) && previous.sa_sigaction==_signal_handler ) )
+    {
+        previous_actions[signalnum] = previous;
+    }
+
+    Py_RETURN_TRUE;
+}
+
+static PyObject * _install_alternate_stack( PyObject * self, PyObject * args )
+{
+    if( ! PyArg_ParseTuple(args, "" ) )
+    {
+        return NULL;
+    }
+
+    if( !install_alternate_stack() )
+    {
+        PyErr_SetString( PyExc_OSError, "failed to allocate alternate signal stack" );
+        return NULL;
+    }
+
     Py_INCREF(Py_None);
     return Py_None;
 }
@@ -122,7 +444,26 @@ static PyObject * _crash4( PyObject * self, PyObject * args )
 static PyMethodDef stacktrace_native_funcs[] =
 {
     { "hello", _hello, METH_VARARGS, "Return 'hello' string." },
-    { "install_signal_handler", (PyCFunction)_install_signal_handler, METH_VARARGS|METH_KEYWORDS, "Install signal handler to print stack trace." },
+    { "install_signal_handler", (PyCFunction)_install_signal_handler, METH_VARARGS|METH_KEYWORDS, "Install signal handler to print stack trace. Returns False if the signal can't be caught." },
+    { "install_alternate_stack", _install_alternate_stack, METH_VARARGS, "Allocate alternate signal stack for the calling thread, to report stack overflows." },
+    { "enable_crash_dump", (PyCFunction)_enable_crash_dump, METH_VARARGS|METH_KEYWORDS, "Write crash dump files with all threads and loaded modules to the directory, when the signal handler catches a signal." },
+    { "start_profiling", (PyCFunction)_start_profiling, METH_VARARGS|METH_KEYWORDS, "Start sampling CPU profiler for all threads, at the rate (samples per CPU second per thread)." },
+    { "stop_profiling", (PyCFunction)_stop_profiling, METH_VARARGS|METH_KEYWORDS, "Stop CPU profiler and write sampled stacks to the file in folded format. Returns statistics as dict." },
+    { "start_watchdog", (PyCFunction)_start_watchdog, METH_VARARGS|METH_KEYWORDS, "Start watchdog thread which logs stacks of registered threads missing their heartbeat, to the file or stderr." },
+    { "stop_watchdog", _stop_watchdog, METH_VARARGS, "Stop watchdog thread. Returns the number of stalls reported." },
+    { "watchdog_register", (PyCFunction)_watchdog_register, METH_VARARGS|METH_KEYWORDS, "Register the calling thread to watchdog with the timeout in seconds. Returns id for heartbeat()." },
+    { "watchdog_unregister", _watchdog_unregister, METH_O, "Unregister the thread from watchdog." },
+    { "heartbeat", _heartbeat, METH_O, "Tell watchdog the registered thread is making progress." },
+    { "dump_all_threads", (PyCFunction)_dump_all_threads, METH_VARARGS|METH_KEYWORDS, "Write native and Python stacks of all threads to the file or stderr. Returns the number of threads." },
+    { "install_dump_signal", (PyCFunction)_install_dump_signal, METH_VARARGS|METH_KEYWORDS, "Dump all threads to the file or stderr when the process receives the signal (default SIGUSR1)." },
+    { "start_gil_profiling", (PyCFunction)_start_gil_profiling, METH_VARARGS|METH_KEYWORDS, "Start measuring GIL wait and hold time per thread. Holds longer than long_hold seconds are recorded with stacks." },
+    { "get_gil_profile", _get_gil_profile, METH_VARARGS, "Return GIL wait and hold histograms per thread, and long hold events, as dict." },
+    { "stop_gil_profiling", _stop_gil_profiling, METH_VARARGS, "Stop GIL profiling and return the result, same as get_gil_profile()." },
+    { "start_tracing", (PyCFunction)_start_tracing, METH_VARARGS|METH_KEYWORDS, "Start recording trace events, written to the file in Chrome trace format (JSON)." },
+    { "stop_tracing", _stop_tracing, METH_VARARGS, "Stop recording trace events and finish the file. Returns statistics as dict." },
+    { "trace_name", _trace_name, METH_O, "Intern trace event name, and return its id for trace_begin()." },
+    { "trace_begin", _trace_begin, METH_O, "Record the beginning of a trace event with the name (str or id from trace_name())." },
+    { "trace_end", _trace_end, METH_NOARGS, "Record the end of the innermost trace event of the calling thread." },
     { "crash1", _crash1, METH_VARARGS, "Null pointer access." },
     { "crash2", _crash2, METH_VARARGS, "Stack overflow." },
     { "crash3", _crash3, METH_VARARGS, "Invalid function pointer." },
@@ -148,6 +489,12 @@ extern "C" PyMODINIT_FUNC PyInit_stacktrace_native(void)
 
     m = PyModule_Create(&stacktrace_native_module);
     if(m == NULL) return NULL;
+
+    if( !init_trace_types(m) || !init_histogram_types(m) || !init_perf_counters_types(m) )
+    {
+        Py_DECREF(m);
+        return NULL;
+    }
     
     return m;
 }
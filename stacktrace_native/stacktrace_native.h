@@ -0,0 +1,267 @@
+#pragma once
+
+#include <stdint.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+
+#include "Python.h"
+
+//-----
+
+#define MODULE_NAME "stacktrace_native"
+
+// Architecture codes in crash dump files
+enum CaptureArch
+{
+    CaptureArch_Unknown = 0,
+    CaptureArch_X86_64 = 1,
+    CaptureArch_AArch64 = 2,
+};
+
+//-----
+
+// Thread capture (thread_capture.cpp)
+//
+// Registers, native stack and a copy of the stack memory of every thread in the process, collected by
+// sending a real-time signal to each thread. Buffers are allocated by init_thread_capture() in advance,
+// and capturing doesn't allocate memory, so that it can be used from the crash handler.
+
+static const size_t CAPTURE_MAX_REGS = 40;
+static const size_t CAPTURE_MAX_FRAMES = 64;
+static const size_t CAPTURE_MAX_PYTHON_FRAMES = 64;
+
+enum CaptureState
+{
+    CaptureState_Idle = 0,
+    CaptureState_Requested = 1,
+    CaptureState_Filling = 2,
+    CaptureState_Done = 3,
+};
+
+enum CaptureFlags
+{
+    CaptureFlags_Captured = 1, // registers and stack are valid
+    CaptureFlags_Crashed = 2,  // the thread which received the crash signal
+};
+
+// Python frame, captured by the thread itself. Names are resolved later with read_python_frame_info().
+struct PythonFrameCapture
+{
+    uintptr_t code; // PyCodeObject
+    int32_t lasti;
+    int32_t line; // -1 if it has to be calculated from lasti
+};
+
+struct ThreadCapture
+{
+    std::atomic<int> state;
+    pid_t tid;
+    uint32_t flags;
+    char name[16];
+    uint32_t num_regs;
+    uint64_t regs[CAPTURE_MAX_REGS];
+    uint32_t num_frames;
+    void * frames[CAPTURE_MAX_FRAMES];
+    uint32_t num_python_frames;
+    PythonFrameCapture python_frames[CAPTURE_MAX_PYTHON_FRAMES]; // innermost first
+    uintptr_t stack_start;
+    size_t stack_size;
+    uint8_t * stack; // points to preallocated buffer of capture_stack_size bytes
+};
+
+struct ThreadCaptureBuffers
+{
+    ThreadCapture * threads;
+    size_t max_threads;
+    size_t stack_size;
+    int signal;
+};
+
+extern ThreadCaptureBuffers thread_capture;
+
+bool init_thread_capture( size_t max_threads, size_t stack_size );
+
+// Returned by capture functions when another capture didn't finish in time. Nothing is captured then,
+// and release_thread_capture() must not be called.
+static const size_t CAPTURE_BUSY = (size_t)-1;
+
+// Capture all threads. The calling thread is captured from context when it is not NULL (in a signal handler).
+// Waits at most timeout_ms for other threads to respond. Returns the number of threads in thread_capture.threads.
+// Captures are serialized, and the result is valid until release_thread_capture(). With take_over (crash handler),
+// a capture in progress is overwritten after a short wait, instead of returning CAPTURE_BUSY.
+size_t capture_all_threads( const ucontext_t * context, int timeout_ms, bool take_over );
+
+// Capture the given threads only (not the calling thread), in the same way as capture_all_threads() without take_over
+size_t capture_threads( const pid_t * tids, size_t num_tids, int timeout_ms );
+
+void release_thread_capture();
+
+// Print a captured thread in the format of the crash handler. Python frames are printed after
+// the native frames of the eval loop running them.
+void write_thread_stack( int fd, const ThreadCapture & capture );
+
+// backtrace() from a signal handler, starting at the interrupted instruction of context
+size_t capture_native_stack( void ** frames, size_t max_frames, const ucontext_t * context );
+
+// Thread ids from /proc/self/task, without opendir() which allocates memory
+template< typename F >
+inline void for_each_thread( F func )
+{
+    struct linux_dirent64
+    {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    int fd = open( "/proc/self/task", O_RDONLY | O_DIRECTORY );
+    if( fd < 0 )
+    {
+        return;
+    }
+
+    char buf[4096];
+    while( true )
+    {
+        long n = syscall( SYS_getdents64, fd, buf, sizeof(buf) );
+        if( n <= 0 )
+        {
+            break;
+        }
+
+        for( long pos=0 ; pos<n ; )
+        {
+            const linux_dirent64 * entry = (const linux_dirent64*)( buf + pos );
+            pos += entry->d_reclen;
+
+            pid_t tid = 0;
+            const char * s = entry->d_name;
+            if( *s < '0' || *s > '9' )
+            {
+                continue;
+            }
+            for( ; *s>='0' && *s<='9' ; ++s )
+            {
+                tid = tid * 10 + ( *s - '0' );
+            }
+            func(tid);
+        }
+    }
+
+    close(fd);
+}
+
+// Copy memory which may not be readable. Returns the number of bytes copied from the start of src.
+size_t safe_read( void * dst, const void * src, size_t size );
+
+CaptureArch get_capture_arch();
+size_t get_context_registers( const ucontext_t * uc, uint64_t * regs );
+uintptr_t get_context_sp( const ucontext_t * uc );
+uintptr_t get_context_pc( const ucontext_t * uc );
+
+pid_t get_tid();
+
+//-----
+
+// Python stack (python_stack.cpp)
+//
+// Python frames are read from the interpreter state directly, without the GIL and without calling Python APIs,
+// so that they can be read from signal handlers. All reads go through safe_read(), and objects are type-checked,
+// as the state of other threads can be inconsistent.
+
+struct PythonFrameInfo
+{
+    char filename[256];
+    char name[128];
+    int line;
+};
+
+// Must be called with the GIL held, before capturing threads
+void init_python_stack();
+
+// Python frames of the calling thread (innermost first). Can be called from signal handlers.
+// Without guarded, frames are read directly, which is faster but only safe while the interpreter state is intact.
+// The thread state itself is always read with safe_read().
+size_t read_python_stack( PythonFrameCapture * frames, size_t max_frames, bool guarded );
+
+void read_python_frame_info( const PythonFrameCapture & frame, PythonFrameInfo & info );
+
+// For each Python frame, index of the native frame of the eval loop running it, or NO_NATIVE_FRAME.
+// Python frames are printed after these native frames.
+static const uint32_t NO_NATIVE_FRAME = 0xffffffff;
+void match_python_frames( void * const * frames, size_t num_frames, size_t num_python_frames, uint32_t * native_indices );
+
+//-----
+
+// Crash dump files (crash_dump.cpp)
+
+bool is_crash_dump_enabled();
+
+// Called from the crash handler, after capture_all_threads(). Returns the dump filename, or NULL.
+const char * write_crash_dump( int sig, const siginfo_t * info, size_t num_threads );
+
+PyObject * _enable_crash_dump( PyObject * self, PyObject * args, PyObject * kwds );
+
+//-----
+
+// Sampling CPU profiler (profiler.cpp)
+
+PyObject * _start_profiling( PyObject * self, PyObject * args, PyObject * kwds );
+PyObject * _stop_profiling( PyObject * self, PyObject * args, PyObject * kwds );
+
+//-----
+
+// Hang and stall watchdog (watchdog.cpp)
+
+PyObject * _start_watchdog( PyObject * self, PyObject * args, PyObject * kwds );
+PyObject * _stop_watchdog( PyObject * self, PyObject * args );
+PyObject * _watchdog_register( PyObject * self, PyObject * args, PyObject * kwds );
+PyObject * _watchdog_unregister( PyObject * self, PyObject * arg );
+PyObject * _heartbeat( PyObject * self, PyObject * arg );
+
+//-----
+
+// On-demand thread dump (thread_dump.cpp)
+
+PyObject * _dump_all_threads( PyObject * self, PyObject * args, PyObject * kwds );
+PyObject * _install_dump_signal( PyObject * self, PyObject * args, PyObject * kwds );
+
+//-----
+
+// GIL contention profiler (gil_profiler.cpp)
+
+PyObject * _start_gil_profiling( PyObject * self, PyObject * args, PyObject * kwds );
+PyObject * _get_gil_profile( PyObject * self, PyObject * args );
+PyObject * _stop_gil_profiling( PyObject * self, PyObject * args );
+
+//-----
+
+// Scoped trace events (trace.cpp)
+
+bool init_trace_types( PyObject * module );
+
+PyObject * _start_tracing( PyObject * self, PyObject * args, PyObject * kwds );
+PyObject * _stop_tracing( PyObject * self, PyObject * args );
+PyObject * _trace_name( PyObject * self, PyObject * arg );
+PyObject * _trace_begin( PyObject * self, PyObject * arg );
+PyObject * _trace_end( PyObject * self, PyObject * args );
+
+//-----
+
+// Latency histogram (histogram.cpp)
+
+bool init_histogram_types( PyObject * module );
+
+//-----
+
+// Performance counters (perf_counters.cpp)
+
+bool init_perf_counters_types( PyObject * module );
@@ -0,0 +1,298 @@
+import os
+import sys
+import argparse
+import struct
+import bisect
+import subprocess
+
+# ---
+
+argparser = argparse.ArgumentParser( description='symbolize crash dump file written by stacktrace_native' )
+argparser.add_argument('dumpfile', action='store', help='crash dump filename (stacktrace_native.{pid}.{time}.dmp)')
+argparser.add_argument('--symbols-dir', dest="symbols_dir", action='store', default="./symbols", help='directory with copies of *.so and executable files from the device, in the same directory structure (default: ./symbols)')
+argparser.add_argument('--addr2line', action='store', default=None, help='addr2line program to resolve file names and line numbers (e.g. aarch64-linux-gnu-addr2line)')
+argparser.add_argument('--scan-stack', dest="scan_stack", action='store_true', help='also list values in stack memory which point to executable code, for threads whose backtrace is incomplete')
+argparser.add_argument('--registers', action='store_true', help='print registers of all threads, not only the crashed thread')
+args = argparser.parse_args()
+
+# ---
+
+ARCH_NAMES = { 1 : "x86_64", 2 : "aarch64" }
+
+X86_64_REGISTER_NAMES = [
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+    "rdi", "rsi", "rbp", "rbx", "rdx", "rax", "rcx", "rsp",
+    "rip", "efl", "csgsfs", "err", "trapno", "oldmask", "cr2",
+]
+
+AARCH64_REGISTER_NAMES = [ f"x{i}" for i in range(31) ] + [ "sp", "pc", "pstate" ]
+
+SIGNAL_NAMES = { 4 : "SIGILL", 5 : "SIGTRAP", 6 : "SIGABRT", 7 : "SIGBUS", 8 : "SIGFPE", 11 : "SIGSEGV", 15 : "SIGTERM" }
+
+RECORD_SIGNAL = 1
+RECORD_THREAD = 2
+RECORD_MODULE = 3
+RECORD_PYTHON_STACK = 4
+RECORD_END = 0xffffffff
+
+
+class Module:
+
+    def __init__( self, start, end, load_bias, build_id, path ):
+        self.start = start
+        self.end = end
+        self.load_bias = load_bias
+        self.build_id = build_id
+        self.path = path
+        self.symbols = None
+        self.local_filename = None
+
+
+class Thread:
+
+    def __init__( self, tid, flags, name, regs, frames, stack_start, stack ):
+        self.tid = tid
+        self.flags = flags
+        self.name = name
+        self.regs = regs
+        self.frames = frames
+        self.stack_start = stack_start
+        self.stack = stack
+        self.python_frames = []
+
+
+class CrashDump:
+
+    def __init__( self, filename ):
+
+        with open(filename,"rb") as fd:
+            data = fd.read()
+
+        magic, version, self.arch, timestamp, self.pid, self.crashed_tid = struct.unpack_from( "<8sIIQii", data, 0 )
+        if magic != b"STNDUMP\0":
+            print( f"Error : {filename} is not a crash dump file" )
+            sys.exit(1)
+        if version != 1:
+            print( f"Error : unsupported crash dump version {version}" )
+            sys.exit(1)
+
+        self.timestamp = timestamp / 1e9
+        self.signal = None
+        self.threads = []
+        self.modules = []
+
+        pos = 32
+        while pos + 8 <= len(data):
+            record_type, size = struct.unpack_from( "<II", data, pos )
+            pos += 8
+            payload = data[pos:pos+size]
+            pos += size
+
+            if record_type == RECORD_SIGNAL:
+                self.signal = struct.unpack_from( "<iiQi", payload, 0 )
+            elif record_type == RECORD_THREAD:
+                self.threads.append( self.parse_thread(payload) )
+            elif record_type == RECORD_MODULE:
+                self.modules.append( self.parse_module(payload) )
+            elif record_type == RECORD_PYTHON_STACK:
+                self.parse_python_stack(payload)
+            elif record_type == RECORD_END:
+                break
+
+        self.modules.sort( key = lambda module : module.start )
+        self.module_starts = [ module.start for module in self.modules ]
+
+    def parse_thread( self, payload ):
+        tid, flags, name, num_regs, num_frames, stack_start, stack_size = struct.unpack_from( "<iI16sIIQQ", payload, 0 )
+        pos = 48
+        regs = struct.unpack_from( f"<{num_regs}Q", payload, pos )
+        pos += num_regs * 8
+        frames = struct.unpack_from( f"<{num_frames}Q", payload, pos )
+        pos += num_frames * 8
+        stack = payload[pos:pos+stack_size]
+        return Thread( tid, flags, name.rstrip(b"\0").decode("utf-8","replace"), regs, frames, stack_start, stack )
+
+    def parse_module( self, payload ):
+        start, end, load_bias, build_id_size, path_size = struct.unpack_from( "<QQQII", payload, 0 )
+        pos = 32
+        build_id = payload[pos:pos+build_id_size].hex()
+        pos += build_id_size
+        path = payload[pos:pos+path_size].decode("utf-8","replace")
+        return Module( start, end, load_bias, build_id, path )
+
+    def parse_python_stack( self, payload ):
+        tid, num_frames = struct.unpack_from( "<iI", payload, 0 )
+        pos = 8
+        frames = []
+        for i in range(num_frames):
+            native_index, line, filename_size, name_size = struct.unpack_from( "<IiII", payload, pos )
+            pos += 16
+            filename = payload[pos:pos+filename_size].decode("utf-8","replace")
+            pos += filename_size
+            name = payload[pos:pos+name_size].decode("utf-8","replace")
+            pos += name_size
+            frames.append( ( native_index, line, filename, name ) )
+
+        for thread in self.threads:
+            if thread.tid == tid:
+                thread.python_frames = frames
+
+    def find_module( self, addr ):
+        i = bisect.bisect_right( self.module_starts, addr ) - 1
+        if i >= 0 and addr < self.modules[i].end:
+            return self.modules[i]
+        return None
+
+    def register_names( self ):
+        if self.arch == 2:
+            return AARCH64_REGISTER_NAMES
+        return X86_64_REGISTER_NAMES
+
+
+# ---
+
+def read_build_id( filename ):
+
+    result = subprocess.run( [ "readelf", "-n", filename ], capture_output=True )
+    for line in result.stdout.decode("utf-8","replace").splitlines():
+        line = line.strip()
+        if line.startswith("Build ID:"):
+            return line.split(":",1)[1].strip()
+    return None
+
+
+def find_local_file( module ):
+
+    # Copied files under symbols directory have priority over files in this environment
+    local_symbol_filename = os.path.join( args.symbols_dir, module.path.lstrip("/") )
+    for filename in [ local_symbol_filename, module.path ]:
+        if not os.path.exists(filename):
+            continue
+
+        build_id = read_build_id(filename)
+        if module.build_id and build_id and build_id != module.build_id:
+            print( f"Warning : build-id of {filename} doesn't match ({build_id} != {module.build_id})" )
+            continue
+
+        return filename
+
+    return None
+
+
+def load_symbol_table( filename ):
+
+    symbols = []
+
+    result = subprocess.run( [ "readelf", "-s", "-W", filename ], capture_output=True )
+    for line in result.stdout.decode("utf-8","replace").splitlines():
+        fields = line.split()
+        if len(fields) < 8 or fields[3] != "FUNC":
+            continue
+        try:
+            addr = int( fields[1], 16 )
+            size = int( fields[2], 0 )
+        except ValueError:
+            continue
+        if addr == 0:
+            continue
+        name = fields[7].split("@")[0]
+        symbols.append( ( addr, addr + max(size,1), name ) )
+
+    symbols.sort()
+    return symbols
+
+
+def symbolize( dump, addr ):
+
+    module = dump.find_module(addr)
+    if module is None:
+        return "??"
+
+    offset = addr - module.load_bias
+    location = f"{module.path}+{offset:#x}"
+
+    if module.symbols is None:
+        module.local_filename = find_local_file(module)
+        module.symbols = load_symbol_table(module.local_filename) if module.local_filename else []
+
+    starts = [ symbol[0] for symbol in module.symbols ]
+    i = bisect.bisect_right( starts, offset ) - 1
+    if i >= 0 and offset < module.symbols[i][1]:
+        location += f" ({module.symbols[i][2]}+{offset - module.symbols[i][0]:#x})"
+
+    if args.addr2line and module.local_filename:
+        result = subprocess.run( [ args.addr2line, "-e", module.local_filename, f"{offset:#x}" ], capture_output=True )
+        source = result.stdout.decode("utf-8","replace").strip()
+        if source and not source.startswith("??"):
+            location += f" at {source}"
+
+    return location
+
+
+def print_registers( dump, thread ):
+
+    names = dump.register_names()
+    for i in range( 0, len(thread.regs), 4 ):
+        print( "    " + "  ".join( f"{names[j] if j < len(names) else j:>6} {thread.regs[j]:#018x}" for j in range( i, min(i+4, len(thread.regs)) ) ) )
+
+
+def print_stack_scan( dump, thread ):
+
+    print( "  stack scan:" )
+    for pos in range( 0, len(thread.stack) - 7, 8 ):
+        value = struct.unpack_from( "<Q", thread.stack, pos )[0]
+        if dump.find_module(value):
+            print( f"    [sp{pos:+#x}] {value:#018x} {symbolize( dump, value )}" )
+
+
+def main():
+
+    dump = CrashDump( args.dumpfile )
+
+    print( f"Process {dump.pid} ({ARCH_NAMES.get(dump.arch,'unknown arch')})" )
+    if dump.signal:
+        signo, code, addr, sender_pid = dump.signal[:4]
+        print( f"Signal {signo} ({SIGNAL_NAMES.get(signo,'unknown')}), code {code}, address {addr:#x}" + ( f", sent by pid {sender_pid}" if code <= 0 else "" ) )
+    print( f"{len(dump.threads)} threads, {len(dump.modules)} modules" )
+    print()
+
+    for thread in dump.threads:
+        crashed = " (crashed)" if thread.flags & 2 else ""
+        print( f"Thread {thread.tid} [{thread.name}]{crashed}" )
+
+        if not thread.flags & 1:
+            print( "  not captured (thread didn't respond)" )
+            print()
+            continue
+
+        if thread.flags & 2 or args.registers:
+            print( "  registers:" )
+            print_registers( dump, thread )
+
+        # Python frames are printed after the native frame of the eval loop running them
+        python_frames = list(thread.python_frames)
+
+        def print_python_frames( native_index ):
+            while python_frames and ( native_index is None or python_frames[0][0] == native_index ):
+                _, line, filename, name = python_frames.pop(0)
+                print( f'           File "{filename}", line {line}, in {name}' )
+
+        print( "  stack:" )
+        for i, frame in enumerate(thread.frames):
+            # Return addresses point after the call instruction
+            addr = frame - 1 if i > 0 else frame
+            print( f"    #{i:<3} {frame:#018x} {symbolize( dump, addr )}" )
+            print_python_frames(i)
+        print_python_frames(None)
+
+        if args.scan_stack:
+            print_stack_scan( dump, thread )
+
+        print()
+
+    print( "Modules:" )
+    for module in dump.modules:
+        print( f"  {module.start:#018x}-{module.end:#018x} {module.build_id or '(no build-id)':40} {module.path}" )
+
+
+main()
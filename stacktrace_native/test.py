@@ -1,7 +1,11 @@
 import sys
 import os
+import json
+import tempfile
 import time
 import signal
+import threading
+import subprocess
 
 
 # In order to import stacktrace_native, add a library path to sys.path.
@@ -42,5 +46,313 @@ def test_native_signal_handler( launcher ):
     #stacktrace_native.crash4() # integer zero div
 
 
+def test_crash_dump( launcher ):
+
+    # Crash in a child process, and symbolize its dump file
+    dump_dir = tempfile.mkdtemp()
+    crash_script = """
+import sys, signal, threading
+sys.path.insert( 0, %r )
+import stacktrace_native
+stacktrace_native.install_signal_handler(signal.SIGSEGV)
+stacktrace_native.enable_crash_dump( %r, stack_size=4096 )
+stop = threading.Event()
+for i in range(4):
+    threading.Thread( target=stop.wait ).start()
+def crash_in_python():
+    stacktrace_native.crash1()
+crash_in_python()
+""" % ( native_module_location, dump_dir )
+
+    result = subprocess.run( [ sys.executable, "-c", crash_script ], capture_output=True, text=True )
+    assert result.returncode == -signal.SIGSEGV, ( result.returncode, result.stderr[-2000:] )
+
+    dump_files = os.listdir(dump_dir)
+    assert len(dump_files) == 1 and dump_files[0].endswith(".dmp"), dump_files
+    assert dump_files[0] in result.stderr
+
+    symbolizer = os.path.join( os.path.dirname(os.path.abspath(__file__)), "symbolize_crash_dump.py" )
+    result = subprocess.run( [ sys.executable, symbolizer, os.path.join( dump_dir, dump_files[0] ) ], capture_output=True, text=True )
+    assert result.returncode == 0, result.stderr
+
+    output = result.stdout
+    assert "Signal 11 (SIGSEGV)" in output, output
+    assert "5 threads" in output, output
+    assert output.count("(crashed)") == 1, output
+    assert "not captured" not in output, output
+    assert "in crash_in_python" in output, output
+    assert "stacktrace_native.so" in output, output
+
+
+def test_histogram( launcher ):
+
+    h = stacktrace_native.Histogram()
+    for i in range(1,1001):
+        h.record( i * 1000 )
+
+    assert h.count == 1000
+    assert h.min == 1000 and h.max == 1000000
+
+    # Buckets have 7 bits of precision
+    for p, expected in [ (50, 500000), (99, 990000) ]:
+        assert abs( h.percentile(p) - expected ) <= expected / 64, ( p, h.percentile(p) )
+
+    h2 = stacktrace_native.Histogram.from_bytes( h.to_bytes() )
+    assert h2.count == h.count
+    assert h2.percentiles([0,50,99,100]) == h.percentiles([0,50,99,100])
+
+    h2.merge(h)
+    assert h2.count == 2000
+
+    # More short-lived threads than per-thread shards
+    def record():
+        for i in range(100):
+            h.record(1000)
+
+    for i in range(100):
+        t = threading.Thread( target=record )
+        t.start()
+        t.join()
+
+    assert h.count == 11000
+
+    # Nested context managers in more concurrent threads than per-thread shards
+    outer = stacktrace_native.Histogram()
+    inner = stacktrace_native.Histogram()
+    barrier = threading.Barrier(100)
+
+    def measure():
+        barrier.wait()
+        with outer:
+            with inner:
+                time.sleep(0.01)
+            time.sleep(0.04)
+
+    threads = [ threading.Thread( target=measure ) for i in range(100) ]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    assert outer.count == 100 and inner.count == 100
+    assert outer.min >= 50000000, outer.min
+    assert inner.min >= 10000000, inner.min
+
+
+def test_trace_events( launcher ):
+
+    filename = os.path.join( tempfile.mkdtemp(), "trace.json" )
+
+    # Ends without an open scope are ignored
+    stacktrace_native.trace_begin("before start")
+    stacktrace_native.start_tracing( filename, buffer_size=1024 )
+    stacktrace_native.trace_end()
+    stacktrace_native.trace_end()
+
+    # Small buffers overflow, and scopes are dropped as a whole
+    outer = stacktrace_native.trace("outer")
+    inner = stacktrace_native.trace("inner")
+    def work():
+        for i in range(20000):
+            with outer:
+                with inner:
+                    pass
+                stacktrace_native.trace_begin("inner2")
+                stacktrace_native.trace_end()
+
+    threads = [ threading.Thread( target=work ) for i in range(4) ]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    result = stacktrace_native.stop_tracing()
+    assert result["events"] > 0 and result["dropped"] > 0, result
+
+    with open(filename) as fd:
+        events = json.load(fd)
+
+    depth = {}
+    for event in events:
+        if event["ph"]=="B":
+            depth[event["tid"]] = depth.get(event["tid"],0) + 1
+        elif event["ph"]=="E":
+            depth[event["tid"]] = depth.get(event["tid"],0) - 1
+            assert depth[event["tid"]] >= 0
+    assert all( d==0 for d in depth.values() ), depth
+
+
+def test_perf_counters( launcher ):
+
+    # Hardware events are not available in most VMs, and are then missing from the result.
+    # task_clock, context_switches and page_faults are always counted, with getrusage() as the fallback.
+    counters = stacktrace_native.perf_counters()
+    software = [ "task_clock", "context_switches", "page_faults" ]
+    assert all( name in counters.events for name in software ), counters.events
+
+    with counters as result:
+        buf = b"x" * ( 16 * 1024 * 1024 )
+        sum( i*i for i in range(100000) )
+
+    assert sorted(result.keys()) == sorted(counters.events), result
+    assert result["task_clock"] > 0 and result["page_faults"] > 0, result
+
+
+def test_dump_all_threads( launcher ):
+
+    filename = os.path.join( tempfile.mkdtemp(), "threads.txt" )
+
+    stop = threading.Event()
+    threads = [ threading.Thread( target=stop.wait ) for i in range(8) ]
+    for t in threads:
+        t.start()
+
+    tids = os.listdir("/proc/self/task")
+    num_threads = stacktrace_native.dump_all_threads(filename)
+
+    stop.set()
+    for t in threads:
+        t.join()
+
+    assert num_threads == len(tids), ( num_threads, tids )
+
+    with open(filename) as fd:
+        dump = fd.read()
+    for tid in tids:
+        assert ( "thread %s " % tid ) in dump, tid
+    assert "test_dump_all_threads" in dump
+
+
+def test_watchdog_slot_reuse( launcher ):
+
+    filename = os.path.join( tempfile.mkdtemp(), "watchdog.log" )
+    stacktrace_native.start_watchdog( filename, interval=0.02 )
+
+    # A registration right after unregistering a stalled one reuses its slot, and starts without a stall
+    watchdog_id = stacktrace_native.watchdog_register( 0.1, name="first" )
+    time.sleep(0.3)
+    stacktrace_native.watchdog_unregister(watchdog_id)
+    watchdog_id = stacktrace_native.watchdog_register( 0.1, name="second" )
+    time.sleep(0.3)
+    stacktrace_native.watchdog_unregister(watchdog_id)
+
+    assert stacktrace_native.stop_watchdog() == 2
+
+    with open(filename) as fd:
+        log = fd.read()
+    assert "(first) missed heartbeat" in log
+    assert "(second) resumed heartbeat" not in log
+    assert "(second) missed heartbeat" in log
+
+
+def test_profiler_thread_churn( launcher ):
+
+    # Short lived threads one after another, more than max_threads in total. Each runs a function of its own name.
+    num_rounds = 12
+    functions = []
+    for i in range(num_rounds):
+        namespace = { "time" : time }
+        exec( "def busy_round_%d():\n    end = time.monotonic() + 0.1\n    while time.monotonic() < end: pass\n" % i, namespace )
+        functions.append( namespace[ "busy_round_%d" % i ] )
+
+    stacktrace_native.start_profiling( rate=200, max_threads=4 )
+    for func in functions:
+        t = threading.Thread( target=func )
+        t.start()
+        t.join()
+
+    filename = os.path.join( tempfile.mkdtemp(), "profile.folded" )
+    result = stacktrace_native.stop_profiling( filename, native=False )
+    assert result["samples"] > 0, result
+
+    with open(filename) as fd:
+        profile = fd.read()
+    missing = [ i for i in range(num_rounds) if ( "busy_round_%d " % i ) not in profile ]
+    assert not missing, ( missing, result )
+
+
+def test_gil_profiling( launcher ):
+
+    stacktrace_native.start_gil_profiling( long_hold=0.05 )
+
+    # sum() over a range doesn't release the GIL, so the main thread waits for it while running Python code
+    def hold_gil():
+        for i in range(3):
+            sum( range(5000000) )
+            time.sleep(0.01)
+
+    t = threading.Thread( target=hold_gil )
+    t.start()
+    while t.is_alive():
+        sum( i for i in range(1000) )
+    t.join()
+
+    assert threading.get_ident() in stacktrace_native.get_gil_profile()["threads"]
+    result = stacktrace_native.stop_gil_profiling()
+
+    holder = result["threads"][t.ident]
+    main = result["threads"][threading.get_ident()]
+    assert holder["hold"]["max"] >= 0.05, holder
+    assert main["wait"]["max"] >= 0.05, main
+    for thread in [ holder, main ]:
+        for kind in [ "wait", "hold" ]:
+            assert sum( count for bound, count in thread[kind]["histogram"] ) == thread[kind]["count"], thread
+
+    long_holds = [ hold for hold in result["long_holds"] if hold["ident"]==t.ident ]
+    assert len(long_holds) >= 3, result["long_holds"]
+    assert all( hold["tid"]==holder["tid"] and hold["duration"] >= 0.05 for hold in long_holds ), long_holds
+    assert any( function=="hold_gil" for filename, line, function in long_holds[0]["python_stack"] ), long_holds[0]
+
+
+def test_watchdog( launcher ):
+
+    filename = os.path.join( tempfile.mkdtemp(), "watchdog.log" )
+    stacktrace_native.start_watchdog( filename, interval=0.05 )
+
+    def healthy():
+        watchdog_id = stacktrace_native.watchdog_register( 0.2, name="healthy" )
+        for i in range(40):
+            stacktrace_native.heartbeat(watchdog_id)
+            time.sleep(0.02)
+        stacktrace_native.watchdog_unregister(watchdog_id)
+
+    def stalled_in_sleep():
+        watchdog_id = stacktrace_native.watchdog_register( 0.2, name="stalled" )
+        time.sleep(0.6)
+        stacktrace_native.heartbeat(watchdog_id)
+        time.sleep(0.2) # for the monitor thread to see the heartbeat
+        stacktrace_native.watchdog_unregister(watchdog_id)
+
+    threads = [ threading.Thread( target=healthy ), threading.Thread( target=stalled_in_sleep ) ]
+    for t in threads:
+        t.start()
+
+    # Thread dumps while the watchdog captures don't take over its capture
+    for i in range(5):
+        stacktrace_native.dump_all_threads( os.path.join( os.path.dirname(filename), "threads.txt" ) )
+        time.sleep(0.1)
+
+    for t in threads:
+        t.join()
+
+    assert stacktrace_native.stop_watchdog() == 1
+
+    with open(filename) as fd:
+        log = fd.read()
+    assert "(stalled) missed heartbeat" in log
+    assert "stalled_in_sleep" in log
+    assert "(stalled) resumed heartbeat" in log
+    assert "(healthy)" not in log
+
+
+test_crash_dump(None)
+test_histogram(None)
+test_trace_events(None)
+test_perf_counters(None)
+test_dump_all_threads(None)
+test_gil_profiling(None)
+test_watchdog(None)
+test_watchdog_slot_reuse(None)
+test_profiler_thread_churn(None)
 test_native_signal_handler(None)
 
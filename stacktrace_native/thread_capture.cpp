@@ -0,0 +1,606 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#include "stacktrace_native.h"
+#include "signal_safe.h"
+
+//-----
+
+// Bytes below the stack pointer which can be in use by leaf functions (x86_64 red zone)
+static const size_t STACK_RED_ZONE = 128;
+
+// Wait for a capture in progress, before giving up (or taking over, in the crash handler)
+static const int CAPTURE_LOCK_WAIT_MS = 1000;
+static const int CAPTURE_TAKE_OVER_MS = 100;
+
+ThreadCaptureBuffers thread_capture;
+
+// Fallback of process_vm_readv(), for kernels or seccomp profiles which don't allow it
+static int safe_read_pipe[2] = { -1, -1 };
+static std::atomic<bool> process_vm_readv_available(true);
+
+// Thread id of the capture in progress, 0 if none. Only one capture at a time.
+static std::atomic<pid_t> capture_owner(0);
+static std::atomic<int> capture_waiters(0);
+
+//-----
+
+pid_t get_tid()
+{
+    return syscall(SYS_gettid);
+}
+
+CaptureArch get_capture_arch()
+{
+#if defined(__aarch64__)
+    return CaptureArch_AArch64;
+#elif defined(__x86_64__)
+    return CaptureArch_X86_64;
+#else
+    return CaptureArch_Unknown;
+#endif
+}
+
+// x86_64 : gregs in REG_* order. aarch64 : x0-x30, sp, pc, pstate.
+size_t get_context_registers( const ucontext_t * uc, uint64_t * regs )
+{
+#if defined(__aarch64__)
+    for( int i=0 ; i<31 ; ++i )
+    {
+        regs[i] = uc->uc_mcontext.regs[i];
+    }
+    regs[31] = uc->uc_mcontext.sp;
+    regs[32] = uc->uc_mcontext.pc;
+    regs[33] = uc->uc_mcontext.pstate;
+    return 34;
+#elif defined(__x86_64__)
+    for( int i=0 ; i<NGREG ; ++i )
+    {
+        regs[i] = (uint64_t)uc->uc_mcontext.gregs[i];
+    }
+    return NGREG;
+#else
+    (void)uc;
+    (void)regs;
+    return 0;
+#endif
+}
+
+uintptr_t get_context_sp( const ucontext_t * uc )
+{
+#if defined(__aarch64__)
+    return uc->uc_mcontext.sp;
+#elif defined(__x86_64__)
+    return uc->uc_mcontext.gregs[REG_RSP];
+#else
+    (void)uc;
+    return 0;
+#endif
+}
+
+uintptr_t get_context_pc( const ucontext_t * uc )
+{
+#if defined(__aarch64__)
+    return uc->uc_mcontext.pc;
+#elif defined(__x86_64__)
+    return uc->uc_mcontext.gregs[REG_RIP];
+#else
+    (void)uc;
+    return 0;
+#endif
+}
+
+//-----
+
+static size_t safe_read_with_pipe( void * dst, const void * src, size_t size )
+{
+    // write() fails with EFAULT instead of crashing when the source is not readable
+    size_t total = 0;
+    while( total < size )
+    {
+        size_t chunk = size - total;
+        if( chunk > 4096 )
+        {
+            chunk = 4096; // pipe capacity is at least one page
+        }
+
+        ssize_t written = write( safe_read_pipe[1], (const char*)src + total, chunk );
+        if( written <= 0 )
+        {
+            break;
+        }
+
+        ssize_t n = read( safe_read_pipe[0], (char*)dst + total, written );
+        if( n != written )
+        {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+size_t safe_read( void * dst, const void * src, size_t size )
+{
+    if( process_vm_readv_available.load(std::memory_order_relaxed) )
+    {
+        // One iovec per page, as partial transfers stop at an unreadable iovec
+        static const size_t MAX_IOVECS = 64;
+
+        size_t total = 0;
+        while( total < size )
+        {
+            struct iovec local[MAX_IOVECS];
+            struct iovec remote[MAX_IOVECS];
+            size_t count = 0;
+            size_t batch = 0;
+
+            while( count < MAX_IOVECS && total + batch < size )
+            {
+                uintptr_t addr = (uintptr_t)src + total + batch;
+                size_t chunk = 4096 - ( addr & 4095 );
+                if( chunk > size - total - batch )
+                {
+                    chunk = size - total - batch;
+                }
+                local[count].iov_base = (char*)dst + total + batch;
+                local[count].iov_len = chunk;
+                remote[count].iov_base = (void*)addr;
+                remote[count].iov_len = chunk;
+                count ++;
+                batch += chunk;
+            }
+
+            ssize_t n = syscall( SYS_process_vm_readv, getpid(), local, count, remote, count, 0 );
+            if( n < 0 )
+            {
+                if( errno==ENOSYS || errno==EPERM )
+                {
+                    process_vm_readv_available.store( false, std::memory_order_relaxed );
+                    return total + safe_read_with_pipe( (char*)dst + total, (const char*)src + total, size - total );
+                }
+                break;
+            }
+
+            total += n;
+            if( (size_t)n < batch )
+            {
+                break;
+            }
+        }
+        return total;
+    }
+
+    if( safe_read_pipe[1] < 0 )
+    {
+        return 0;
+    }
+    return safe_read_with_pipe( dst, src, size );
+}
+
+//-----
+
+static void read_thread_name( pid_t tid, char * name, size_t size )
+{
+    // "/proc/self/task/<tid>/comm", formatted without snprintf
+    char path[64] = "/proc/self/task/";
+    size_t len = strlen(path);
+
+    char digits[16];
+    int n = 0;
+    do
+    {
+        digits[n++] = '0' + tid % 10;
+        tid /= 10;
+    } while( tid > 0 );
+    while( n > 0 )
+    {
+        path[len++] = digits[--n];
+    }
+    strcpy( path + len, "/comm" );
+
+    memset( name, 0, size );
+
+    int fd = open( path, O_RDONLY );
+    if( fd < 0 )
+    {
+        return;
+    }
+
+    ssize_t result = read( fd, name, size-1 );
+    close(fd);
+
+    for( ssize_t i=0 ; i<result ; ++i )
+    {
+        if( name[i]=='\n' )
+        {
+            name[i] = '\0';
+        }
+    }
+}
+
+size_t capture_native_stack( void ** frames, size_t max_frames, const ucontext_t * context )
+{
+    size_t num_frames = backtrace( frames, (int)max_frames );
+
+    // Drop the frames of the signal handler, so that the stack starts at the interrupted instruction
+    uintptr_t pc = get_context_pc(context);
+    for( size_t i=0 ; i<num_frames ; ++i )
+    {
+        if( (uintptr_t)frames[i]==pc )
+        {
+            memmove( frames, frames + i, ( num_frames - i ) * sizeof(frames[0]) );
+            return num_frames - i;
+        }
+    }
+
+    return num_frames;
+}
+
+static void fill_capture( ThreadCapture & capture, const ucontext_t * context )
+{
+    capture.num_regs = get_context_registers( context, capture.regs );
+    capture.num_frames = capture_native_stack( capture.frames, CAPTURE_MAX_FRAMES, context );
+
+    uintptr_t sp = get_context_sp(context);
+    capture.stack_start = sp > STACK_RED_ZONE ? sp - STACK_RED_ZONE : sp;
+    capture.stack_size = safe_read( capture.stack, (const void*)capture.stack_start, thread_capture.stack_size );
+
+    capture.num_python_frames = read_python_stack( capture.python_frames, CAPTURE_MAX_PYTHON_FRAMES, true );
+
+    capture.flags |= CaptureFlags_Captured;
+}
+
+static void capture_signal_handler( int sig, siginfo_t * info, void * context )
+{
+    int saved_errno = errno;
+
+    // Ignore the signal if it wasn't sent by capture_all_threads()
+    if( info->si_code==SI_QUEUE && info->si_pid==getpid() )
+    {
+        size_t index = (size_t)info->si_value.sival_int;
+        if( index < thread_capture.max_threads )
+        {
+            ThreadCapture & capture = thread_capture.threads[index];
+            int expected = CaptureState_Requested;
+            if( capture.tid==get_tid() && capture.state.compare_exchange_strong( expected, CaptureState_Filling, std::memory_order_acquire ) )
+            {
+                fill_capture( capture, (const ucontext_t*)context );
+                capture.state.store( CaptureState_Done, std::memory_order_release );
+            }
+        }
+    }
+
+    errno = saved_errno;
+}
+
+// Can be called again with larger sizes (e.g. enable_crash_dump() after install_signal_handler())
+bool init_thread_capture( size_t max_threads, size_t stack_size )
+{
+    if( thread_capture.threads )
+    {
+        if( max_threads<=thread_capture.max_threads && stack_size<=thread_capture.stack_size )
+        {
+            return true;
+        }
+        max_threads = max_threads > thread_capture.max_threads ? max_threads : thread_capture.max_threads;
+        stack_size = stack_size > thread_capture.stack_size ? stack_size : thread_capture.stack_size;
+    }
+
+    size_t threads_size = ( max_threads * sizeof(ThreadCapture) + 4095 ) & ~(size_t)4095;
+    void * p = mmap( NULL, threads_size + max_threads * stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+    if( p==MAP_FAILED )
+    {
+        return false;
+    }
+
+    ThreadCapture * threads = (ThreadCapture*)p;
+    for( size_t i=0 ; i<max_threads ; ++i )
+    {
+        threads[i].stack = (uint8_t*)p + threads_size + i * stack_size;
+    }
+
+    if( safe_read_pipe[0] < 0 && pipe2( safe_read_pipe, O_CLOEXEC | O_NONBLOCK )!=0 )
+    {
+        safe_read_pipe[0] = safe_read_pipe[1] = -1;
+    }
+
+    // backtrace() loads libgcc at the first call, which allocates memory
+    void * frames[1];
+    backtrace( frames, 1 );
+
+    thread_capture.signal = SIGRTMIN + 4;
+
+    struct sigaction action;
+    memset( &action, 0, sizeof(action) );
+    action.sa_sigaction = capture_signal_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+    sigemptyset( &action.sa_mask );
+    if( sigaction( thread_capture.signal, &action, NULL )!=0 )
+    {
+        munmap( p, threads_size + max_threads * stack_size );
+        return false;
+    }
+
+    // Previous buffers are not freed, as a late capture signal may still be writing to them
+    pid_t self = get_tid();
+    pid_t expected = 0;
+    while( !capture_owner.compare_exchange_weak( expected, self ) )
+    {
+        expected = 0;
+        sched_yield();
+    }
+    thread_capture.threads = threads;
+    thread_capture.max_threads = max_threads;
+    thread_capture.stack_size = stack_size;
+    capture_owner.store(0);
+    return true;
+}
+
+//-----
+
+// Waits for another capture to finish. Returns false if it doesn't finish in time, unless take_over.
+// The crash handler takes over the buffers instead of giving up (e.g. crash while dumping, or crash of the
+// capturing thread itself), and the previous owner's release_thread_capture() has no effect then.
+static bool lock_thread_capture( bool take_over )
+{
+    pid_t self = get_tid();
+
+    // Without waiters, the lock is free or held briefly
+    pid_t expected = 0;
+    if( ( take_over || capture_waiters.load()==0 ) && capture_owner.compare_exchange_strong( expected, self ) )
+    {
+        return true;
+    }
+
+    if( take_over && expected==self )
+    {
+        capture_owner.store( self );
+        return true;
+    }
+
+    // Otherwise wait in line with other waiters, so that repeated dumps don't keep the watchdog waiting
+    capture_waiters.fetch_add(1);
+    int wait_ms = take_over ? CAPTURE_TAKE_OVER_MS : CAPTURE_LOCK_WAIT_MS;
+    bool locked = false;
+    for( int i=0 ; i<wait_ms && !locked ; ++i )
+    {
+        struct timespec wait = { 0, 1000000 };
+        nanosleep( &wait, NULL );
+
+        expected = 0;
+        locked = capture_owner.compare_exchange_strong( expected, self );
+    }
+    capture_waiters.fetch_sub(1);
+
+    if( !locked && take_over )
+    {
+        capture_owner.store( self );
+        locked = true;
+    }
+    return locked;
+}
+
+static void add_thread( size_t & num_threads, pid_t tid )
+{
+    if( num_threads >= thread_capture.max_threads )
+    {
+        return;
+    }
+
+    ThreadCapture & capture = thread_capture.threads[num_threads++];
+    capture.state.store( CaptureState_Idle, std::memory_order_relaxed );
+    capture.tid = tid;
+    capture.flags = 0;
+    capture.num_regs = 0;
+    capture.num_frames = 0;
+    capture.num_python_frames = 0;
+    capture.stack_start = 0;
+    capture.stack_size = 0;
+    read_thread_name( tid, capture.name, sizeof(capture.name) );
+}
+
+// Signal all threads first, so that they respond in parallel
+static void request_captures( size_t first, size_t num_threads )
+{
+    pid_t pid = getpid();
+
+    for( size_t i=first ; i<num_threads ; ++i )
+    {
+        ThreadCapture & capture = thread_capture.threads[i];
+        capture.state.store( CaptureState_Requested, std::memory_order_release );
+
+        siginfo_t info;
+        memset( &info, 0, sizeof(info) );
+        info.si_signo = thread_capture.signal;
+        info.si_code = SI_QUEUE;
+        info.si_pid = pid;
+        info.si_uid = getuid();
+        info.si_value.sival_int = (int)i;
+        if( syscall( SYS_rt_tgsigqueueinfo, pid, capture.tid, thread_capture.signal, &info )!=0 )
+        {
+            capture.state.store( CaptureState_Idle, std::memory_order_relaxed );
+        }
+    }
+}
+
+static void wait_for_captures( size_t first, size_t num_threads, int timeout_ms )
+{
+    // Threads blocking the signal or stuck in the kernel don't respond
+    struct timespec start;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    while( true )
+    {
+        bool pending = false;
+        for( size_t i=first ; i<num_threads ; ++i )
+        {
+            int state = thread_capture.threads[i].state.load(std::memory_order_acquire);
+            if( state==CaptureState_Requested || state==CaptureState_Filling )
+            {
+                pending = true;
+                break;
+            }
+        }
+        if( !pending )
+        {
+            break;
+        }
+
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        if( ( now.tv_sec - start.tv_sec ) * 1000 + ( now.tv_nsec - start.tv_nsec ) / 1000000 >= timeout_ms )
+        {
+            break;
+        }
+
+        struct timespec wait = { 0, 100000 };
+        nanosleep( &wait, NULL );
+    }
+
+    // Late responses must not write to the buffers while they are being read.
+    // A thread already filling its buffer finishes soon, as it doesn't block, unless it crashed while
+    // filling (e.g. broken stack). Such a thread is left in Filling state, and treated as not captured.
+    for( size_t i=first ; i<num_threads ; ++i )
+    {
+        std::atomic<int> & state = thread_capture.threads[i].state;
+        int expected = CaptureState_Requested;
+        for( int retry=0 ; !state.compare_exchange_strong( expected, CaptureState_Idle ) && expected==CaptureState_Filling && retry<1000 ; ++retry )
+        {
+            expected = CaptureState_Requested;
+            struct timespec wait = { 0, 100000 };
+            nanosleep( &wait, NULL );
+        }
+    }
+}
+
+size_t capture_all_threads( const ucontext_t * context, int timeout_ms, bool take_over )
+{
+    if( !thread_capture.threads )
+    {
+        return 0;
+    }
+
+    if( !lock_thread_capture(take_over) )
+    {
+        return CAPTURE_BUSY;
+    }
+
+    // The calling thread is always the first one
+    pid_t self = get_tid();
+    size_t num_threads = 0;
+    add_thread( num_threads, self );
+    for_each_thread( [&]( pid_t tid )
+    {
+        if( tid!=self )
+        {
+            add_thread( num_threads, tid );
+        }
+    });
+
+    request_captures( 1, num_threads );
+
+    ThreadCapture & own = thread_capture.threads[0];
+    if( context )
+    {
+        fill_capture( own, context );
+    }
+    else
+    {
+        ucontext_t current;
+        getcontext( &current );
+        fill_capture( own, &current );
+    }
+    own.state.store( CaptureState_Done, std::memory_order_relaxed );
+
+    wait_for_captures( 1, num_threads, timeout_ms );
+    return num_threads;
+}
+
+size_t capture_threads( const pid_t * tids, size_t num_tids, int timeout_ms )
+{
+    if( !thread_capture.threads )
+    {
+        return 0;
+    }
+
+    if( !lock_thread_capture(false) )
+    {
+        return CAPTURE_BUSY;
+    }
+
+    size_t num_threads = 0;
+    for( size_t i=0 ; i<num_tids ; ++i )
+    {
+        add_thread( num_threads, tids[i] );
+    }
+
+    request_captures( 0, num_threads );
+    wait_for_captures( 0, num_threads, timeout_ms );
+    return num_threads;
+}
+
+void release_thread_capture()
+{
+    // No effect if the crash handler took over
+    pid_t self = get_tid();
+    capture_owner.compare_exchange_strong( self, 0 );
+}
+
+//-----
+
+static uint32_t python_native_indices[CAPTURE_MAX_PYTHON_FRAMES];
+static PythonFrameInfo python_frame_info;
+
+static void write_python_frame( SignalSafeWriter & out, const PythonFrameCapture & frame )
+{
+    read_python_frame_info( frame, python_frame_info );
+    out.str("    File \"").str(python_frame_info.filename).str("\", line ").dec(python_frame_info.line).str(", in ").str(python_frame_info.name).ch('\n');
+}
+
+void write_thread_stack( int fd, const ThreadCapture & capture )
+{
+    SignalSafeWriter out(fd);
+
+    out.str("  thread ").dec(capture.tid).str(" [").str( capture.name, sizeof(capture.name) ).ch(']');
+    if( capture.flags & CaptureFlags_Crashed )
+    {
+        out.str(" (crashed)");
+    }
+    out.str(":\n");
+
+    if( capture.state.load(std::memory_order_acquire)!=CaptureState_Done )
+    {
+        out.str("    (not captured, the thread didn't respond)\n");
+        return;
+    }
+
+    match_python_frames( capture.frames, capture.num_frames, capture.num_python_frames, python_native_indices );
+
+    uint32_t python_index = 0;
+    for( uint32_t i=0 ; i<capture.num_frames ; ++i )
+    {
+        out.flush();
+        backtrace_symbols_fd( const_cast<void**>( &capture.frames[i] ), 1, fd );
+
+        while( python_index<capture.num_python_frames && python_native_indices[python_index]==i )
+        {
+            write_python_frame( out, capture.python_frames[python_index++] );
+        }
+    }
+
+    // Frames beyond the native backtrace, or when the eval loop couldn't be located
+    while( python_index<capture.num_python_frames )
+    {
+        write_python_frame( out, capture.python_frames[python_index++] );
+    }
+}
@@ -0,0 +1,255 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "stacktrace_native.h"
+#include "signal_safe.h"
+
+// On-demand thread dump
+//
+// Stacks of all threads in the running process, captured with the same signal as the crash handler.
+// Each thread writes its own native and Python frames to its preallocated slot, so threads are interrupted
+// only for the time of a backtrace, and all threads are captured in parallel.
+//
+// dump_all_threads() captures from the calling thread. With install_dump_signal(), the signal handler only
+// writes to a pipe, and a dumper thread captures and writes the file outside of the signal handler.
+
+//-----
+
+static const size_t DUMP_MAX_THREADS = 256;
+static const int DUMP_CAPTURE_TIMEOUT_MS = 200;
+
+struct ThreadDumpState
+{
+    int signal;
+    char filename[512]; // empty for stderr
+    int wakeup_pipe[2];
+    pthread_t dumper_thread;
+};
+
+static ThreadDumpState thread_dump = { 0, "", { -1, -1 }, 0 };
+
+//-----
+
+// Threads from the first index are written, to skip the dumper thread itself. Returns 0 if the file couldn't be opened,
+// or CAPTURE_BUSY if another capture (e.g. by the watchdog) didn't finish in time.
+static size_t write_thread_dump( const char * filename, size_t first )
+{
+    int fd = STDERR_FILENO;
+    if( filename && filename[0] )
+    {
+        fd = open( filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+        if( fd < 0 )
+        {
+            return 0;
+        }
+    }
+
+    struct timespec start;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    size_t num_captured = capture_all_threads( NULL, DUMP_CAPTURE_TIMEOUT_MS, false );
+    if( num_captured==CAPTURE_BUSY )
+    {
+        SignalSafeWriter(fd).str( "Warning : " MODULE_NAME " thread dump skipped, another thread capture is in progress\n" );
+        if( fd!=STDERR_FILENO )
+        {
+            close(fd);
+        }
+        return CAPTURE_BUSY;
+    }
+
+    size_t num_threads = num_captured > first ? num_captured - first : 0;
+
+    struct timespec end;
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    int64_t capture_us = ( end.tv_sec - start.tv_sec ) * 1000000 + ( end.tv_nsec - start.tv_nsec ) / 1000;
+
+    char time_str[32];
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r( &now, &local );
+    strftime( time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &local );
+
+    SignalSafeWriter(fd).str( "Info : " MODULE_NAME " thread dump at " ).str(time_str).str(", pid ").dec(getpid())
+        .str(", ").dec(num_threads).str(" threads, captured in ").dec(capture_us).str(" us:\n");
+
+    for( size_t i=first ; i<num_captured ; ++i )
+    {
+        write_thread_stack( fd, thread_capture.threads[i] );
+    }
+    release_thread_capture();
+
+    if( fd!=STDERR_FILENO )
+    {
+        close(fd);
+    }
+    return num_threads;
+}
+
+static void dump_signal_handler( int sig, siginfo_t * info, void * context )
+{
+    int saved_errno = errno;
+
+    // Signals while a dump is running are merged, as the pipe is non-blocking
+    char c = 0;
+    ssize_t written = write( thread_dump.wakeup_pipe[1], &c, 1 );
+    (void)written;
+
+    errno = saved_errno;
+}
+
+static void * dumper_thread_main( void * )
+{
+    pthread_setname_np( pthread_self(), "stn_dumper" );
+
+    while( true )
+    {
+        char buf[64];
+        ssize_t n = read( thread_dump.wakeup_pipe[0], buf, sizeof(buf) );
+        if( n < 0 && errno==EINTR )
+        {
+            continue;
+        }
+        if( n <= 0 )
+        {
+            break;
+        }
+
+        // The dumper thread is always the first captured thread, and is not written
+        write_thread_dump( thread_dump.filename, 1 );
+    }
+
+    return NULL;
+}
+
+//-----
+
+static bool init_thread_dump()
+{
+    init_python_stack();
+    return init_thread_capture( DUMP_MAX_THREADS, 0 );
+}
+
+PyObject * _dump_all_threads( PyObject * self, PyObject * args, PyObject * kwds )
+{
+    const char * filename = NULL;
+
+    static const char * kwlist[] = {
+        "filename",
+        NULL
+    };
+
+    if( ! PyArg_ParseTupleAndKeywords( args, kwds, "|z", const_cast<char**>(kwlist), &filename ) )
+    {
+        return NULL;
+    }
+
+    if( !init_thread_dump() )
+    {
+        return PyErr_NoMemory();
+    }
+
+    // The GIL is released, so that threads waiting for it aren't blocked for the capture timeout. Each thread reads
+    // its own frames in the capture signal handler, and names are read with safe_read(), so frames can change meanwhile.
+    size_t num_threads;
+    Py_BEGIN_ALLOW_THREADS
+    num_threads = write_thread_dump( filename, 0 );
+    Py_END_ALLOW_THREADS
+    if( num_threads==CAPTURE_BUSY )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "another thread capture is in progress" );
+        return NULL;
+    }
+    if( num_threads==0 )
+    {
+        return PyErr_SetFromErrnoWithFilename( PyExc_OSError, filename );
+    }
+
+    return PyLong_FromSize_t(num_threads);
+}
+
+PyObject * _install_dump_signal( PyObject * self, PyObject * args, PyObject * kwds )
+{
+    const char * filename = NULL;
+    int signalnum = SIGUSR1;
+
+    static const char * kwlist[] = {
+        "filename",
+        "signalnum",
+        NULL
+    };
+
+    if( ! PyArg_ParseTupleAndKeywords( args, kwds, "|zi", const_cast<char**>(kwlist), &filename, &signalnum ) )
+    {
+        return NULL;
+    }
+
+    if( signalnum<1 || signalnum>=NSIG )
+    {
+        PyErr_SetString( PyExc_ValueError, "signal number out of range" );
+        return NULL;
+    }
+
+    if( filename && strlen(filename) >= sizeof(thread_dump.filename) )
+    {
+        PyErr_SetString( PyExc_ValueError, "filename is too long" );
+        return NULL;
+    }
+
+    if( thread_dump.signal )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "dump signal is already installed" );
+        return NULL;
+    }
+
+    if( !init_thread_dump() )
+    {
+        return PyErr_NoMemory();
+    }
+
+    snprintf( thread_dump.filename, sizeof(thread_dump.filename), "%s", filename ? filename : "" );
+
+    if( pipe2( thread_dump.wakeup_pipe, O_CLOEXEC )!=0 )
+    {
+        return PyErr_SetFromErrno( PyExc_OSError );
+    }
+    fcntl( thread_dump.wakeup_pipe[1], F_SETFL, O_NONBLOCK );
+
+    struct sigaction action;
+    memset( &action, 0, sizeof(action) );
+    action.sa_sigaction = dump_signal_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset( &action.sa_mask );
+
+    // Some signals (e.g. SIGKILL) can't be caught
+    if( sigaction( signalnum, &action, NULL )!=0 )
+    {
+        close( thread_dump.wakeup_pipe[0] );
+        close( thread_dump.wakeup_pipe[1] );
+        Py_RETURN_FALSE;
+    }
+
+    // Signals before the dumper thread starts are kept in the pipe
+    int result = pthread_create( &thread_dump.dumper_thread, NULL, dumper_thread_main, NULL );
+    if( result!=0 )
+    {
+        errno = result;
+        return PyErr_SetFromErrno( PyExc_OSError );
+    }
+
+    // The dumper thread keeps running, and the signal can't be installed again
+    thread_dump.signal = signalnum;
+
+    Py_RETURN_TRUE;
+}
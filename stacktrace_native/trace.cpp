@@ -0,0 +1,630 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "stacktrace_native.h"
+
+// Scoped trace events
+//
+// trace_begin() / trace_end() (or the trace context manager) write timestamped events to a ring buffer of the
+// calling thread. Event names are interned to ids once, so an event is only a timestamp and two integers.
+// A background writer thread moves events from ring buffers to a file in Chrome trace format (JSON), which
+// can be opened with chrome://tracing or https://ui.perfetto.dev/.
+//
+// Events are written by Python threads with the GIL held, but the ring buffers don't rely on it. Each ring buffer
+// has a single producer (the thread) and a single consumer (the writer thread, or stop_tracing() at the end).
+
+//-----
+
+static const size_t TRACE_MAX_THREADS = 256;
+static const size_t TRACE_MAX_NAMES = 4096;
+static const size_t TRACE_MAX_NAME_SIZE = 64;
+static const int TRACE_WRITE_INTERVAL_MS = 50;
+
+enum TracePhase
+{
+    TracePhase_Begin = 'B',
+    TracePhase_End = 'E',
+};
+
+struct TraceEvent
+{
+    uint64_t time_ns;
+    uint32_t name;
+    uint32_t phase;
+};
+
+struct TraceThread
+{
+    pid_t tid;
+    char name[TRACE_MAX_NAME_SIZE]; // Python thread name
+    bool name_written;
+
+    // Single producer (the thread itself), single consumer (writer thread)
+    TraceEvent * ring;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+
+    // Touched only by the thread itself. Scopes inside a dropped Begin are dropped as a whole with their Ends,
+    // so that the events in the file stay nested.
+    uint32_t depth; // open scopes with the Begin in the ring
+    uint32_t dropped_depth; // open scopes from the outermost dropped Begin
+};
+
+struct TracerState
+{
+    std::atomic<bool> active;
+    uint32_t session;
+    size_t ring_size; // events, power of 2
+    uint64_t start_ns;
+    pid_t pid;
+
+    // Slots are added by threads with the GIL held, and read by the writer thread
+    TraceThread threads[TRACE_MAX_THREADS];
+    std::atomic<size_t> num_threads;
+    uint64_t num_lost_threads;
+
+    pthread_t writer_thread;
+    std::atomic<bool> stop_requested;
+
+    // Touched only by the writer thread while tracing
+    FILE * file;
+    bool first_event;
+    uint64_t num_events;
+};
+
+// Interned names, kept across tracing sessions. Added with the GIL held, read by the writer thread.
+struct TraceNames
+{
+    char names[TRACE_MAX_NAMES][TRACE_MAX_NAME_SIZE];
+    std::atomic<size_t> count;
+    PyObject * ids; // dict of name -> id
+};
+
+static TracerState tracer;
+static TraceNames trace_names;
+
+// Slot of the calling thread, valid while trace_thread_session matches
+static __thread TraceThread * trace_thread = NULL;
+static __thread uint32_t trace_thread_session = 0;
+
+//-----
+
+static inline uint64_t get_time_ns()
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// threading.current_thread().name, or empty
+static void get_python_thread_name( char * name, size_t size )
+{
+    name[0] = '\0';
+
+    PyObject * threading = PyImport_ImportModule( "threading" );
+    PyObject * thread = threading ? PyObject_CallMethod( threading, "current_thread", NULL ) : NULL;
+    PyObject * thread_name = thread ? PyObject_GetAttrString( thread, "name" ) : NULL;
+    const char * s = ( thread_name && PyUnicode_Check(thread_name) ) ? PyUnicode_AsUTF8(thread_name) : NULL;
+    if( s )
+    {
+        snprintf( name, size, "%s", s );
+    }
+    PyErr_Clear();
+
+    Py_XDECREF(thread_name);
+    Py_XDECREF(thread);
+    Py_XDECREF(threading);
+}
+
+// Called with the GIL held
+static TraceThread * get_trace_thread()
+{
+    if( trace_thread_session==tracer.session )
+    {
+        return trace_thread;
+    }
+
+    // Calling Python code can release the GIL, so this is done before taking a slot
+    char name[TRACE_MAX_NAME_SIZE];
+    get_python_thread_name( name, sizeof(name) );
+
+    TraceThread * thread = NULL;
+    size_t index = tracer.num_threads.load( std::memory_order_relaxed );
+    if( index < TRACE_MAX_THREADS )
+    {
+        thread = &tracer.threads[index];
+        void * p = mmap( NULL, tracer.ring_size * sizeof(TraceEvent), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+        if( p==MAP_FAILED )
+        {
+            thread = NULL;
+        }
+        else
+        {
+            thread->tid = get_tid();
+            memcpy( thread->name, name, sizeof(name) );
+            thread->name_written = false;
+            thread->ring = (TraceEvent*)p;
+            thread->head.store(0);
+            thread->tail.store(0);
+            thread->dropped.store(0);
+            thread->depth = 0;
+            thread->dropped_depth = 0;
+            tracer.num_threads.store( index + 1, std::memory_order_release );
+        }
+    }
+
+    if( !thread )
+    {
+        tracer.num_lost_threads++;
+    }
+
+    trace_thread = thread;
+    trace_thread_session = tracer.session;
+    return thread;
+}
+
+static inline void record_event( uint32_t name, uint32_t phase )
+{
+    if( !tracer.active.load( std::memory_order_relaxed ) )
+    {
+        return;
+    }
+
+    TraceThread * thread = get_trace_thread();
+    if( !thread )
+    {
+        return;
+    }
+
+    if( thread->dropped_depth > 0 )
+    {
+        thread->dropped_depth += ( phase==TracePhase_Begin ) ? 1 : -1;
+        thread->dropped.fetch_add( 1, std::memory_order_relaxed );
+        return;
+    }
+
+    // An End without an open scope (e.g. begun before start_tracing()) is ignored
+    if( phase==TracePhase_End && thread->depth==0 )
+    {
+        return;
+    }
+
+    // A Begin also reserves room for its End and the Ends of open scopes, so that an End is never dropped
+    uint64_t head = thread->head.load( std::memory_order_relaxed );
+    uint64_t tail = thread->tail.load( std::memory_order_acquire );
+    if( phase==TracePhase_Begin && head - tail + thread->depth + 2 > tracer.ring_size )
+    {
+        thread->dropped_depth = 1;
+        thread->dropped.fetch_add( 1, std::memory_order_relaxed );
+        return;
+    }
+    thread->depth += ( phase==TracePhase_Begin ) ? 1 : -1;
+
+    TraceEvent & event = thread->ring[ head & ( tracer.ring_size - 1 ) ];
+    event.time_ns = get_time_ns();
+    event.name = name;
+    event.phase = phase;
+
+    thread->head.store( head + 1, std::memory_order_release );
+}
+
+//-----
+
+static void write_json_string( FILE * file, const char * s )
+{
+    fputc( '"', file );
+    for( ; *s ; ++s )
+    {
+        unsigned char c = (unsigned char)*s;
+        if( c=='"' || c=='\\' )
+        {
+            fputc( '\\', file );
+            fputc( c, file );
+        }
+        else if( c < 0x20 )
+        {
+            fprintf( file, "\\u%04x", c );
+        }
+        else
+        {
+            fputc( c, file );
+        }
+    }
+    fputc( '"', file );
+}
+
+static void begin_json_event()
+{
+    fputs( tracer.first_event ? "\n" : ",\n", tracer.file );
+    tracer.first_event = false;
+}
+
+static void drain_ring( TraceThread & thread )
+{
+    uint64_t head = thread.head.load( std::memory_order_acquire );
+    uint64_t tail = thread.tail.load( std::memory_order_relaxed );
+    if( tail==head )
+    {
+        return;
+    }
+
+    // Metadata event, to show the Python thread name in the viewer
+    if( !thread.name_written && thread.name[0] )
+    {
+        begin_json_event();
+        fprintf( tracer.file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", (int)tracer.pid, (int)thread.tid );
+        write_json_string( tracer.file, thread.name );
+        fputs( "}}", tracer.file );
+        thread.name_written = true;
+    }
+
+    size_t num_names = trace_names.count.load( std::memory_order_acquire );
+    for( ; tail<head ; ++tail )
+    {
+        const TraceEvent & event = thread.ring[ tail & ( tracer.ring_size - 1 ) ];
+
+        // Timestamps are in microseconds from start_tracing()
+        uint64_t time_ns = event.time_ns - tracer.start_ns;
+        begin_json_event();
+        fprintf( tracer.file, "{\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d", (char)event.phase,
+            (unsigned long long)( time_ns / 1000 ), (unsigned int)( time_ns % 1000 ), (int)tracer.pid, (int)thread.tid );
+        if( event.phase==TracePhase_Begin && event.name < num_names )
+        {
+            fputs( ",\"name\":", tracer.file );
+            write_json_string( tracer.file, trace_names.names[event.name] );
+        }
+        fputc( '}', tracer.file );
+        tracer.num_events++;
+    }
+
+    thread.tail.store( tail, std::memory_order_release );
+}
+
+static void drain_all_rings()
+{
+    size_t num_threads = tracer.num_threads.load( std::memory_order_acquire );
+    for( size_t i=0 ; i<num_threads ; ++i )
+    {
+        drain_ring( tracer.threads[i] );
+    }
+    fflush( tracer.file );
+}
+
+static void * writer_thread_main( void * )
+{
+    pthread_setname_np( pthread_self(), "stn_trace" );
+
+    while( !tracer.stop_requested.load() )
+    {
+        drain_all_rings();
+
+        struct timespec wait = { 0, TRACE_WRITE_INTERVAL_MS * 1000000L };
+        nanosleep( &wait, NULL );
+    }
+
+    return NULL;
+}
+
+static void free_trace_buffers()
+{
+    size_t num_threads = tracer.num_threads.load();
+    for( size_t i=0 ; i<num_threads ; ++i )
+    {
+        munmap( tracer.threads[i].ring, tracer.ring_size * sizeof(TraceEvent) );
+        tracer.threads[i].ring = NULL;
+    }
+    tracer.num_threads.store(0);
+}
+
+//-----
+
+// Name (str, interned at the first use) or id from trace_name(). Called with the GIL held.
+static bool get_name_id( PyObject * arg, uint32_t & id )
+{
+    if( PyLong_Check(arg) )
+    {
+        size_t value = PyLong_AsSize_t(arg);
+        if( value==(size_t)-1 && PyErr_Occurred() )
+        {
+            return false;
+        }
+        if( value >= trace_names.count.load( std::memory_order_relaxed ) )
+        {
+            PyErr_SetString( PyExc_ValueError, "invalid trace name id" );
+            return false;
+        }
+        id = (uint32_t)value;
+        return true;
+    }
+
+    if( !PyUnicode_Check(arg) )
+    {
+        PyErr_SetString( PyExc_TypeError, "trace name must be str or id from trace_name()" );
+        return false;
+    }
+
+    if( !trace_names.ids )
+    {
+        trace_names.ids = PyDict_New();
+        if( !trace_names.ids )
+        {
+            return false;
+        }
+    }
+
+    PyObject * existing = PyDict_GetItem( trace_names.ids, arg );
+    if( existing )
+    {
+        id = (uint32_t)PyLong_AsSize_t(existing);
+        return true;
+    }
+
+    const char * s = PyUnicode_AsUTF8(arg);
+    if( !s )
+    {
+        return false;
+    }
+
+    size_t count = trace_names.count.load( std::memory_order_relaxed );
+    if( count >= TRACE_MAX_NAMES )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "too many trace names" );
+        return false;
+    }
+
+    PyObject * value = PyLong_FromSize_t(count);
+    if( !value || PyDict_SetItem( trace_names.ids, arg, value )!=0 )
+    {
+        Py_XDECREF(value);
+        return false;
+    }
+    Py_DECREF(value);
+
+    snprintf( trace_names.names[count], TRACE_MAX_NAME_SIZE, "%s", s );
+    trace_names.count.store( count + 1, std::memory_order_release );
+
+    id = (uint32_t)count;
+    return true;
+}
+
+PyObject * _trace_name( PyObject * self, PyObject * arg )
+{
+    uint32_t id;
+    if( !get_name_id( arg, id ) )
+    {
+        return NULL;
+    }
+
+    return PyLong_FromUnsignedLong(id);
+}
+
+PyObject * _trace_begin( PyObject * self, PyObject * arg )
+{
+    uint32_t id;
+    if( !get_name_id( arg, id ) )
+    {
+        return NULL;
+    }
+
+    record_event( id, TracePhase_Begin );
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyObject * _trace_end( PyObject * self, PyObject * args )
+{
+    record_event( 0, TracePhase_End );
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+//-----
+
+// Context manager. Objects can be created for each "with" statement, or created once and reused.
+
+struct TraceScopeObject
+{
+    PyObject_HEAD
+    uint32_t name;
+};
+
+static int trace_scope_init( PyObject * self, PyObject * args, PyObject * kwds )
+{
+    PyObject * name;
+
+    static const char * kwlist[] = {
+        "name",
+        NULL
+    };
+
+    if( ! PyArg_ParseTupleAndKeywords( args, kwds, "O", const_cast<char**>(kwlist), &name ) )
+    {
+        return -1;
+    }
+
+    return get_name_id( name, ((TraceScopeObject*)self)->name ) ? 0 : -1;
+}
+
+static PyObject * trace_scope_enter( PyObject * self, PyObject * args )
+{
+    record_event( ((TraceScopeObject*)self)->name, TracePhase_Begin );
+
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject * trace_scope_exit( PyObject * self, PyObject * args )
+{
+    record_event( ((TraceScopeObject*)self)->name, TracePhase_End );
+
+    Py_RETURN_FALSE;
+}
+
+static PyMethodDef trace_scope_methods[] =
+{
+    { "__enter__", trace_scope_enter, METH_NOARGS, NULL },
+    { "__exit__", trace_scope_exit, METH_VARARGS, NULL },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject TraceScope_Type =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    MODULE_NAME ".trace",       // tp_name
+    sizeof(TraceScopeObject),   // tp_basicsize
+};
+
+bool init_trace_types( PyObject * module )
+{
+    TraceScope_Type.tp_flags = Py_TPFLAGS_DEFAULT;
+    TraceScope_Type.tp_doc = "Context manager recording trace_begin(name) and trace_end().";
+    TraceScope_Type.tp_methods = trace_scope_methods;
+    TraceScope_Type.tp_init = trace_scope_init;
+    TraceScope_Type.tp_new = PyType_GenericNew;
+
+    if( PyType_Ready(&TraceScope_Type) < 0 )
+    {
+        return false;
+    }
+
+    Py_INCREF(&TraceScope_Type);
+    if( PyModule_AddObject( module, "trace", (PyObject*)&TraceScope_Type ) < 0 )
+    {
+        Py_DECREF(&TraceScope_Type);
+        return false;
+    }
+
+    return true;
+}
+
+//-----
+
+PyObject * _start_tracing( PyObject * self, PyObject * args, PyObject * kwds )
+{
+    const char * filename;
+    int buffer_size = 65536;
+
+    static const char * kwlist[] = {
+        "filename",
+        "buffer_size",
+        NULL
+    };
+
+    if( ! PyArg_ParseTupleAndKeywords( args, kwds, "s|i", const_cast<char**>(kwlist), &filename, &buffer_size ) )
+    {
+        return NULL;
+    }
+
+    if( buffer_size < 1024 || buffer_size > 64 * 1024 * 1024 )
+    {
+        PyErr_SetString( PyExc_ValueError, "buffer_size must be 1024-67108864 events" );
+        return NULL;
+    }
+
+    if( tracer.file )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "tracing is already started" );
+        return NULL;
+    }
+
+    FILE * file = fopen( filename, "w" );
+    if( !file )
+    {
+        return PyErr_SetFromErrnoWithFilename( PyExc_OSError, filename );
+    }
+
+    // Ring buffers are indexed with a mask
+    size_t ring_size = 1024;
+    while( ring_size < (size_t)buffer_size )
+    {
+        ring_size *= 2;
+    }
+
+    // Slots of the previous session are discarded by threads when they see a new session
+    tracer.session++;
+    tracer.ring_size = ring_size;
+    tracer.start_ns = get_time_ns();
+    tracer.pid = getpid();
+    tracer.num_threads.store(0);
+    tracer.num_lost_threads = 0;
+    tracer.file = file;
+    tracer.first_event = true;
+    tracer.num_events = 0;
+    tracer.stop_requested.store(false);
+
+    fputs( "[", file );
+
+    int result = pthread_create( &tracer.writer_thread, NULL, writer_thread_main, NULL );
+    if( result!=0 )
+    {
+        fclose( file );
+        tracer.file = NULL;
+        errno = result;
+        return PyErr_SetFromErrno( PyExc_OSError );
+    }
+
+    tracer.active.store(true);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyObject * _stop_tracing( PyObject * self, PyObject * args )
+{
+    if( ! PyArg_ParseTuple(args, "" ) )
+    {
+        return NULL;
+    }
+
+    if( !tracer.file )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "tracing is not started" );
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    tracer.stop_requested.store(true);
+    pthread_join( tracer.writer_thread, NULL );
+    Py_END_ALLOW_THREADS
+
+    // Events are recorded with the GIL held, so no thread is writing to the rings after this
+    tracer.active.store(false);
+    drain_all_rings();
+
+    uint64_t dropped = 0;
+    size_t num_threads = tracer.num_threads.load();
+    for( size_t i=0 ; i<num_threads ; ++i )
+    {
+        dropped += tracer.threads[i].dropped.load();
+    }
+
+    fputs( "\n]\n", tracer.file );
+    bool succeeded = ( fflush(tracer.file)==0 && !ferror(tracer.file) );
+    fclose( tracer.file );
+    tracer.file = NULL;
+    free_trace_buffers();
+
+    if( !succeeded )
+    {
+        PyErr_SetString( PyExc_OSError, "failed to write trace file" );
+        return NULL;
+    }
+
+    return Py_BuildValue( "{s:K,s:K,s:K}",
+        "events", (unsigned long long)tracer.num_events,
+        "dropped", (unsigned long long)dropped,
+        "lost_threads", (unsigned long long)tracer.num_lost_threads );
+}
@@ -0,0 +1,430 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "stacktrace_native.h"
+#include "signal_safe.h"
+
+// Hang and stall watchdog
+//
+// Registered threads call heartbeat() periodically (e.g. every frame), which only stores the current time
+// to the slot of the thread. A monitor thread checks the slots, and when a thread missed its deadline,
+// captures its native and Python stacks with the same signal as the crash handler, and logs them.
+// The process keeps running, and recovery of the thread is logged when heartbeats resume.
+
+//-----
+
+static const size_t WATCHDOG_MAX_THREADS = 64;
+static const int WATCHDOG_CAPTURE_TIMEOUT_MS = 200;
+
+struct WatchdogThread
+{
+    // Written by heartbeat() of the thread, read by the monitor thread
+    std::atomic<int64_t> last_heartbeat_ms;
+
+    // Set last by watchdog_register(), after the other fields
+    std::atomic<bool> active;
+    std::atomic<uint32_t> generation; // incremented by each watchdog_register() of the slot
+    pid_t tid;
+    int64_t timeout_ms;
+    char name[64];
+
+    // Touched only by the monitor thread. Reset when the slot is registered again.
+    uint32_t monitored_generation;
+    bool stalled;
+    int64_t stalled_heartbeat_ms;
+};
+
+struct WatchdogState
+{
+    WatchdogThread threads[WATCHDOG_MAX_THREADS];
+
+    bool running;
+    std::atomic<bool> stop_requested;
+    pthread_t monitor_thread;
+    int64_t interval_ms;
+    int fd;
+    uint64_t num_stalls;
+};
+
+static WatchdogState watchdog;
+
+//-----
+
+// Coarse clock is read without a system call, and its resolution (a few ms) is enough for deadlines
+static inline int64_t get_time_ms()
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &now );
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Scheduler state (e.g. 'S' sleeping, 'D' uninterruptible) and kernel function the thread is waiting in.
+// These are still available when the thread doesn't respond to the capture signal.
+static void read_thread_state( pid_t tid, char & state, char * wchan, size_t wchan_size )
+{
+    state = '?';
+    wchan[0] = '\0';
+
+    char path[64];
+    char buf[512];
+
+    snprintf( path, sizeof(path), "/proc/self/task/%d/stat", (int)tid );
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+    if( fd >= 0 )
+    {
+        ssize_t n = read( fd, buf, sizeof(buf)-1 );
+        close(fd);
+        if( n > 0 )
+        {
+            // The thread name can contain spaces and parentheses, the state follows the last ')'
+            buf[n] = '\0';
+            const char * p = strrchr( buf, ')' );
+            if( p && p[1]==' ' && p[2] )
+            {
+                state = p[2];
+            }
+        }
+    }
+
+    snprintf( path, sizeof(path), "/proc/self/task/%d/wchan", (int)tid );
+    fd = open( path, O_RDONLY | O_CLOEXEC );
+    if( fd >= 0 )
+    {
+        ssize_t n = read( fd, wchan, wchan_size-1 );
+        close(fd);
+        wchan[ n > 0 ? n : 0 ] = '\0';
+    }
+}
+
+// Without capture, not_captured is printed instead of the stack
+static void write_stall_report( const WatchdogThread & thread, int64_t now_ms, const ThreadCapture * capture, const char * not_captured )
+{
+    char state;
+    char wchan[64];
+    read_thread_state( thread.tid, state, wchan, sizeof(wchan) );
+
+    {
+        SignalSafeWriter out(watchdog.fd);
+
+        out.str( "Warning : " MODULE_NAME " watchdog : thread " ).dec(thread.tid);
+        if( thread.name[0] )
+        {
+            out.str(" (").str(thread.name).ch(')');
+        }
+        out.str(" missed heartbeat for ").dec( now_ms - thread.last_heartbeat_ms.load(std::memory_order_relaxed) );
+        out.str(" ms (timeout ").dec(thread.timeout_ms).str(" ms):\n");
+
+        out.str("  state ").ch(state);
+        if( wchan[0] && strcmp( wchan, "0" )!=0 )
+        {
+            out.str(", waiting in ").str(wchan);
+        }
+        out.ch('\n');
+    }
+
+    if( capture )
+    {
+        write_thread_stack( watchdog.fd, *capture );
+    }
+    else
+    {
+        SignalSafeWriter(watchdog.fd).str( "    (not captured, " ).str(not_captured).str( ")\n" );
+    }
+}
+
+static void check_threads()
+{
+    int64_t now_ms = get_time_ms();
+
+    size_t stalled_indices[WATCHDOG_MAX_THREADS];
+    pid_t stalled_tids[WATCHDOG_MAX_THREADS];
+    size_t num_stalled = 0;
+
+    for( size_t i=0 ; i<WATCHDOG_MAX_THREADS ; ++i )
+    {
+        WatchdogThread & thread = watchdog.threads[i];
+        if( !thread.active.load(std::memory_order_acquire) )
+        {
+            thread.stalled = false;
+            continue;
+        }
+
+        // The slot can be unregistered and registered again between checks. State of the previous registration
+        // must not leak into the new one.
+        uint32_t generation = thread.generation.load(std::memory_order_acquire);
+        if( generation!=thread.monitored_generation )
+        {
+            thread.monitored_generation = generation;
+            thread.stalled = false;
+            thread.stalled_heartbeat_ms = 0;
+        }
+
+        int64_t last_heartbeat_ms = thread.last_heartbeat_ms.load(std::memory_order_relaxed);
+
+        // Each stall is reported once, until heartbeats resume
+        if( thread.stalled )
+        {
+            if( last_heartbeat_ms!=thread.stalled_heartbeat_ms )
+            {
+                thread.stalled = false;
+
+                SignalSafeWriter out(watchdog.fd);
+                out.str( "Info : " MODULE_NAME " watchdog : thread " ).dec(thread.tid);
+                if( thread.name[0] )
+                {
+                    out.str(" (").str(thread.name).ch(')');
+                }
+                out.str(" resumed heartbeat after ").dec( last_heartbeat_ms - thread.stalled_heartbeat_ms ).str(" ms\n");
+            }
+            continue;
+        }
+
+        if( now_ms - last_heartbeat_ms > thread.timeout_ms )
+        {
+            thread.stalled = true;
+            thread.stalled_heartbeat_ms = last_heartbeat_ms;
+            stalled_indices[num_stalled] = i;
+            stalled_tids[num_stalled] = thread.tid;
+            num_stalled++;
+        }
+    }
+
+    if( num_stalled==0 )
+    {
+        return;
+    }
+
+    watchdog.num_stalls += num_stalled;
+
+    // Stalled threads are captured at once, so that threads blocking each other are reported together.
+    // Captures are in the same order as the thread ids.
+    // When another capture (e.g. a thread dump) is in progress, stalls are reported without stacks
+    size_t num_captured = capture_threads( stalled_tids, num_stalled, WATCHDOG_CAPTURE_TIMEOUT_MS );
+    bool busy = ( num_captured==CAPTURE_BUSY );
+    for( size_t i=0 ; i<num_stalled ; ++i )
+    {
+        const ThreadCapture * capture = !busy && i < num_captured ? &thread_capture.threads[i] : NULL;
+        write_stall_report( watchdog.threads[ stalled_indices[i] ], now_ms, capture, busy ? "another thread capture is in progress" : "no capture buffer" );
+    }
+    if( !busy )
+    {
+        release_thread_capture();
+    }
+}
+
+static void * monitor_thread_main( void * )
+{
+    pthread_setname_np( pthread_self(), "stn_watchdog" );
+
+    while( !watchdog.stop_requested.load() )
+    {
+        struct timespec wait = { (time_t)( watchdog.interval_ms / 1000 ), (long)( watchdog.interval_ms % 1000 ) * 1000000L };
+        nanosleep( &wait, NULL );
+
+        check_threads();
+    }
+
+    return NULL;
+}
+
+//-----
+
+PyObject * _start_watchdog( PyObject * self, PyObject * args, PyObject * kwds )
+{
+    const char * filename = NULL;
+    double interval = 0.1;
+
+    static const char * kwlist[] = {
+        "filename",
+        "interval",
+        NULL
+    };
+
+    if( ! PyArg_ParseTupleAndKeywords( args, kwds, "|zd", const_cast<char**>(kwlist), &filename, &interval ) )
+    {
+        return NULL;
+    }
+
+    if( interval < 0.001 || interval > 60.0 )
+    {
+        PyErr_SetString( PyExc_ValueError, "interval must be 0.001-60 seconds" );
+        return NULL;
+    }
+
+    if( watchdog.running )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "watchdog is already started" );
+        return NULL;
+    }
+
+    int fd = STDERR_FILENO;
+    if( filename )
+    {
+        fd = open( filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+        if( fd < 0 )
+        {
+            return PyErr_SetFromErrnoWithFilename( PyExc_OSError, filename );
+        }
+    }
+
+    // Capture buffers are shared with the crash handler, and only grow
+    init_python_stack();
+    if( !init_thread_capture( WATCHDOG_MAX_THREADS, 0 ) )
+    {
+        if( fd!=STDERR_FILENO )
+        {
+            close(fd);
+        }
+        return PyErr_NoMemory();
+    }
+
+    watchdog.fd = fd;
+    watchdog.interval_ms = (int64_t)( interval * 1000 );
+    watchdog.num_stalls = 0;
+    watchdog.stop_requested.store(false);
+
+    int result = pthread_create( &watchdog.monitor_thread, NULL, monitor_thread_main, NULL );
+    if( result!=0 )
+    {
+        if( fd!=STDERR_FILENO )
+        {
+            close(fd);
+        }
+        errno = result;
+        return PyErr_SetFromErrno( PyExc_OSError );
+    }
+
+    watchdog.running = true;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyObject * _stop_watchdog( PyObject * self, PyObject * args )
+{
+    if( ! PyArg_ParseTuple(args, "" ) )
+    {
+        return NULL;
+    }
+
+    if( !watchdog.running )
+    {
+        PyErr_SetString( PyExc_RuntimeError, "watchdog is not started" );
+        return NULL;
+    }
+
+    // The monitor thread may be waiting for the capture of a thread which waits for the GIL
+    Py_BEGIN_ALLOW_THREADS
+    watchdog.stop_requested.store(true);
+    pthread_join( watchdog.monitor_thread, NULL );
+    Py_END_ALLOW_THREADS
+
+    if( watchdog.fd!=STDERR_FILENO )
+    {
+        close( watchdog.fd );
+    }
+    watchdog.running = false;
+
+    return PyLong_FromUnsignedLongLong( watchdog.num_stalls );
+}
+
+PyObject * _watchdog_register( PyObject * self, PyObject * args, PyObject * kwds )
+{
+    double timeout;
+    const char * name = NULL;
+
+    static const char * kwlist[] = {
+        "timeout",
+        "name",
+        NULL
+    };
+
+    if( ! PyArg_ParseTupleAndKeywords( args, kwds, "d|z", const_cast<char**>(kwlist), &timeout, &name ) )
+    {
+        return NULL;
+    }
+
+    if( timeout < 0.001 )
+    {
+        PyErr_SetString( PyExc_ValueError, "timeout must be positive" );
+        return NULL;
+    }
+
+    // Slots are only added and removed with the GIL held
+    for( size_t i=0 ; i<WATCHDOG_MAX_THREADS ; ++i )
+    {
+        WatchdogThread & thread = watchdog.threads[i];
+        if( thread.active.load() )
+        {
+            continue;
+        }
+
+        thread.tid = get_tid();
+        thread.timeout_ms = (int64_t)( timeout * 1000 );
+        snprintf( thread.name, sizeof(thread.name), "%s", name ? name : "" );
+        thread.last_heartbeat_ms.store( get_time_ms(), std::memory_order_relaxed );
+        thread.generation.fetch_add( 1, std::memory_order_release );
+        thread.active.store( true, std::memory_order_release );
+
+        return PyLong_FromSize_t(i);
+    }
+
+    PyErr_SetString( PyExc_RuntimeError, "too many threads registered to watchdog" );
+    return NULL;
+}
+
+static WatchdogThread * get_watchdog_thread( PyObject * arg )
+{
+    size_t index = PyLong_AsSize_t(arg);
+    if( index==(size_t)-1 && PyErr_Occurred() )
+    {
+        return NULL;
+    }
+
+    if( index >= WATCHDOG_MAX_THREADS || !watchdog.threads[index].active.load(std::memory_order_relaxed) )
+    {
+        PyErr_SetString( PyExc_ValueError, "invalid watchdog id" );
+        return NULL;
+    }
+
+    return &watchdog.threads[index];
+}
+
+PyObject * _watchdog_unregister( PyObject * self, PyObject * arg )
+{
+    WatchdogThread * thread = get_watchdog_thread(arg);
+    if( !thread )
+    {
+        return NULL;
+    }
+
+    thread->active.store( false, std::memory_order_release );
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+// Called every frame, so it takes the id as the only argument (METH_O), and only stores the time
+PyObject * _heartbeat( PyObject * self, PyObject * arg )
+{
+    WatchdogThread * thread = get_watchdog_thread(arg);
+    if( !thread )
+    {
+        return NULL;
+    }
+
+    thread->last_heartbeat_ms.store( get_time_ms(), std::memory_order_relaxed );
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}